@@ -15,11 +15,15 @@
 #ifndef BLUETOOTH__LE_CLIENT_HPP_
 #define BLUETOOTH__LE_CLIENT_HPP_
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <stdint.h>
 
@@ -32,13 +36,39 @@ extern "C" {
 }
 
 #include "bluetooth/l2_cap_socket.hpp"
+#include "bluetooth/notification_ring.hpp"
+#include "util/flight_recorder.hpp"
+#include "util/metrics.hpp"
 
 namespace bluetooth {
 
 class LEClient
 {
 public:
-  LEClient(const std::string & device_address, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW, uint16_t mtu = 0);
+  // Who runs the mainloop that drives the client: its own input thread,
+  // or the caller, with run_once() from the thread that uses the client.
+  // With Caller, the calls that wait for a response run the loop until it
+  // comes, and nothing happens between the caller's calls
+  enum class Dispatch { Thread, Caller };
+
+  LEClient(
+    const std::string & device_address, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW,
+    uint16_t mtu = 0, Dispatch dispatch = Dispatch::Thread);
+
+  // Run over an already connected ATT bearer, such as one end of a
+  // socketpair standing in for the device. The client closes fd
+  explicit LEClient(int fd, uint16_t mtu = 0, Dispatch dispatch = Dispatch::Thread);
+
+  // Wait up to timeout ms (-1 for ever) for the ATT bearer, or any other
+  // fd added to the mainloop, and dispatch what is ready. Returns the
+  // number of events, or -errno (-EINTR when a signal came in)
+  static int run_once(int timeout_ms);
+  Dispatch get_dispatch() const { return dispatch_; }
+
+  // Wait until everything queued has gone out and every request has been
+  // answered, running the loop meanwhile with Dispatch::Caller; false if
+  // that takes longer than timeout
+  bool flush(std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
 
   // GattClient
   static void ready_cb(bool success, uint8_t att_ecode, void * user_data);
@@ -49,10 +79,22 @@ public:
 
   ~LEClient();
 
+  // Look up handles in the discovered database by UUID; 0 if there is no
+  // such characteristic (or no CCC descriptor for value_handle)
+  uint16_t find_characteristic(const std::string & uuid);
+  uint16_t find_characteristic(const bt_uuid_t & uuid);
+  uint16_t find_ccc(uint16_t value_handle);
+
   int get_security();
   void set_security(int level);	// BT_SECURITY_SDP, LOW, MEDIUM, HIGH
 
-  void read_long_value(uint16_t handle, uint16_t value);
+  // Read a value of any length with Read Blob requests, blocking until the
+  // last blob arrives. The second form reads straight into buf, truncating
+  // the value to size bytes, and returns its length
+  std::vector<uint8_t> read_long_value(uint16_t handle, uint16_t offset = 0);
+  size_t read_long_value(uint16_t handle, uint16_t offset, uint8_t * buf, size_t size);
+  static void read_long_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
+  static void read_long_into_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
 
   void read_multiple(uint16_t * handles, uint8_t num_handles);
   static void read_multiple_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
@@ -60,6 +102,14 @@ public:
   void read_value(uint16_t handle);
   static void read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
 
+  // Read a value without waiting and push the response into ring, tagged
+  // with handle, for its consumer to take along with the notifications. A
+  // read that fails, or is dropped with the connection, is pushed empty so
+  // that every read comes back. False if the request couldn't be sent
+  bool read_value(uint16_t handle, const std::shared_ptr<NotificationRing> & ring);
+  static void read_ring_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
+  static void read_ring_destroy_cb(void * user_data);
+
   void register_notify(uint16_t value_handle);
   static void notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data);
   static void register_notify_cb(uint16_t att_ecode, void * user_data);
@@ -69,16 +119,37 @@ public:
 
   void unregister_notify(unsigned int id);
 
+  // Deliver notifications for value_handle into a ring that another thread
+  // drains with NotificationRing::consume(). Payloads longer than slot_size
+  // are truncated
+  std::shared_ptr<NotificationRing> subscribe(uint16_t value_handle, size_t num_slots = 256, size_t slot_size = 64);
+  void unsubscribe(const std::shared_ptr<NotificationRing> & ring);
+  static void ring_notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data);
+  static void ring_destroy_cb(void * user_data);
+  static void find_ccc_cb(struct gatt_db_attribute * attr, void * user_data);
+
+  // Record notifications, indications and read responses. The recorder
+  // must outlive the client or be cleared first
+  void set_recorder(jeronibot::util::FlightRecorder * recorder);
+  static void record_notify_cb(uint8_t opcode, const void * pdu, uint16_t length, void * user_data);
+
   void write_execute(unsigned int session_id, bool execute);
 
   void write_long_value(bool reliable_writes, uint16_t handle, uint16_t offset, uint8_t * value, int length);
   static void write_long_cb(bool success, bool reliable_error, uint8_t att_ecode, void * user_data);
 
   void write_prepare(unsigned int id, uint16_t handle, uint16_t offset, uint8_t * value, unsigned int length);
-  void write_value(uint16_t handle, uint8_t * value, int length, bool without_response = false, bool signed_write = false);
+  // False if the write couldn't be queued or, with a response, failed
+  bool write_value(uint16_t handle, const uint8_t * value, int length, bool without_response = false, bool signed_write = false);
   static void write_cb(bool success, uint8_t att_ecode, void * user_data);
 
+  // Counts PDUs by opcode, request round trips and notification spacing
+  // into the default metrics registry
+  static void metrics_cb(int metric, uint8_t opcode, uint64_t value, void * user_data);
+
 protected:
+  std::string device_address_;
+
   // Bluetooth socket
   int fd_{-1};                       
   struct bt_att * att_{nullptr};
@@ -88,9 +159,33 @@ protected:
   struct gatt_db * db_{nullptr};
   struct bt_gatt_client * gatt_{nullptr};
   unsigned int reliable_session_id_{0};
+  std::atomic<jeronibot::util::FlightRecorder *> recorder_{nullptr};
+
+  // Per-connection metrics, labeled with the device. The opcode ones are
+  // created on first use, on the input thread
+  jeronibot::util::MetricLabels metric_labels_;
+  jeronibot::util::Counter * pdus_sent_[256]{};
+  jeronibot::util::Counter * pdus_received_[256]{};
+  jeronibot::util::Histogram * request_rtt_[256]{};
+  jeronibot::util::Histogram * notify_interval_{nullptr};
+  jeronibot::util::Counter * disconnects_{nullptr};
+  uint64_t last_notify_ns_{0};
+  unsigned int metrics_collector_{0};
+  void init_metrics();
+
+  void init(uint16_t mtu);
   void process_input();
+
+  // What the destructor does; also run when the constructor throws, which
+  // leaves no destructor to run
+  void shutdown();
+  Dispatch dispatch_{Dispatch::Thread};
   std::unique_ptr<std::thread> input_thread_;
 
+  // The result of a request, once the loop has delivered it
+  template<typename T>
+  T wait(std::future<T> & future);
+
   std::mutex mutex_;
   std::condition_variable cv_;
   bool ready_{false};
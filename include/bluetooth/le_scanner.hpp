@@ -0,0 +1,145 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__LE_SCANNER_HPP_
+#define BLUETOOTH__LE_SCANNER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "bluetooth.h"
+#include "uuid.h"
+}
+
+namespace bluetooth {
+
+// A device seen by the scanner, as copied out of the device table
+struct LEDevice
+{
+  bdaddr_t address;
+  uint8_t address_type;                   // LE_PUBLIC_ADDRESS or LE_RANDOM_ADDRESS
+  float rssi;                             // EWMA of the reported RSSI, in dBm
+  int8_t last_rssi;
+  uint32_t num_reports;
+  bool matched;                           // advertised a service UUID or company ID of interest
+  std::chrono::steady_clock::time_point last_seen;
+
+  std::string get_address_string() const;
+};
+
+// Runs an LE scan on a raw HCI socket and folds the advertising reports
+// into a fixed-size table keyed by device address. The table is written
+// only by the scanner's thread and can be read from any thread without
+// locking; each slot is guarded by a sequence counter and readers retry
+// if they race with an update
+class LEScanner
+{
+public:
+  struct Config
+  {
+    int dev_id{-1};                       // HCI device, -1 for the first available
+    bool active{true};                    // request scan responses (names, more UUIDs)
+    uint16_t interval{0x0010};            // in units of 0.625 ms
+    uint16_t window{0x0010};              // in units of 0.625 ms
+    float rssi_alpha{0.25f};              // weight of a new RSSI sample in the EWMA
+    size_t capacity{256};                 // table slots, rounded up to a power of two
+
+    // Advertisements carrying any of these mark a device as matched
+    std::vector<std::string> service_uuids;
+    std::vector<uint16_t> company_ids;
+  };
+
+  explicit LEScanner(const Config & config);
+  LEScanner();
+
+  // Fold the HCI events read from an already open socket, such as one end
+  // of a socketpair standing in for the controller. Scanning is neither
+  // configured nor started; the scanner closes dd
+  LEScanner(int dd, const Config & config);
+
+  ~LEScanner();
+
+  // Copy out one device; false if it hasn't been seen
+  bool find(const bdaddr_t & address, LEDevice & device) const;
+
+  // Copy out every device seen within max_age
+  std::vector<LEDevice> get_devices(std::chrono::milliseconds max_age = std::chrono::seconds(10)) const;
+
+  // The matched device with the strongest RSSI seen within max_age
+  bool get_best_match(LEDevice & device, std::chrono::milliseconds max_age = std::chrono::seconds(10)) const;
+
+  uint64_t get_num_reports() const { return num_reports_.load(std::memory_order_relaxed); }
+
+  // Advertising data helpers, exposed for reuse and testing
+  static bool has_service_uuid(const uint8_t * data, size_t length, const uint8_t * uuid_le, size_t uuid_length);
+  static bool has_company_id(const uint8_t * data, size_t length, uint16_t company_id);
+
+protected:
+  using clock = std::chrono::steady_clock;
+
+  struct Slot
+  {
+    std::atomic<uint32_t> seq{0};         // odd while the writer is updating the slot
+    std::atomic<uint64_t> key{0};         // address | type << 48 | 1 << 56, 0 if free
+    std::atomic<float> rssi{0.0f};
+    std::atomic<int8_t> last_rssi{0};
+    std::atomic<uint32_t> num_reports{0};
+    std::atomic<bool> matched{false};
+    std::atomic<int64_t> last_seen{0};    // clock ticks
+  };
+
+  struct MatchUuid
+  {
+    uint8_t bytes[16];                    // little endian, as advertised
+    size_t length;
+  };
+
+  void init_table();
+
+  static uint64_t to_key(const bdaddr_t & address, uint8_t address_type);
+  bool read_slot(const Slot & slot, LEDevice & device) const;
+
+  void process_event(const uint8_t * buf, size_t length);
+  void update(const bdaddr_t & address, uint8_t address_type, int8_t rssi, const uint8_t * data, size_t length);
+  bool is_match(const uint8_t * data, size_t length) const;
+
+  void input_thread_func();
+
+  Config config_;
+  std::vector<MatchUuid> match_uuids_;
+
+  int dd_{-1};
+  bool scanning_{false};                  // the scan was set up here and is undone on exit
+  std::vector<uint8_t> saved_filter_;
+
+  // Linear probing, limited to max_probe_ slots past an address's home slot
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_{0};
+  size_t max_probe_{16};
+  std::atomic<uint64_t> num_reports_{0};
+
+  std::atomic<bool> should_exit_{false};
+  std::unique_ptr<std::thread> input_thread_;
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__LE_SCANNER_HPP_
@@ -0,0 +1,110 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__NOTIFICATION_RING_HPP_
+#define BLUETOOTH__NOTIFICATION_RING_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+namespace bluetooth {
+
+// One received Handle Value Notification/Indication, stored in place in a
+// ring slot; the payload follows the header in the same slot
+struct Notification
+{
+  std::chrono::steady_clock::time_point timestamp;
+  uint16_t value_handle;
+  uint16_t length;                       // bytes stored, at most the slot size
+  bool truncated;                        // the PDU was longer than the slot
+
+  const uint8_t * data() const { return reinterpret_cast<const uint8_t *>(this + 1); }
+  uint8_t * data() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
+
+// Single-producer/single-consumer ring of preallocated notification slots.
+// The event loop thread pushes, one consumer thread reads entries in place
+// and releases them in batches. Neither side locks or allocates; when the
+// ring is full new notifications are dropped and counted
+class NotificationRing
+{
+public:
+  NotificationRing(size_t num_slots, size_t slot_size);
+
+  NotificationRing(const NotificationRing &) = delete;
+  NotificationRing & operator=(const NotificationRing &) = delete;
+
+  // Producer side
+  bool push(uint16_t value_handle, const uint8_t * value, uint16_t length);
+
+  // Consumer side: calls f(const Notification &) for up to max_count
+  // entries, then frees their slots. Returns the number consumed
+  template<typename F>
+  size_t consume(F && f, size_t max_count = std::numeric_limits<size_t>::max())
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t count = std::min(head - tail, max_count);
+
+    for (size_t i = 0; i < count; i++) {
+      f(*slot(tail + i));
+    }
+
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t size() const;
+  size_t get_capacity() const { return mask_ + 1; }
+  size_t get_slot_size() const { return slot_size_; }
+
+  uint64_t get_num_dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  uint64_t get_num_truncated() const { return truncated_.load(std::memory_order_relaxed); }
+
+  // Set by LEClient::subscribe()
+  unsigned int get_subscription_id() const { return subscription_id_; }
+  void set_subscription_id(unsigned int id) { subscription_id_ = id; }
+
+protected:
+  Notification * slot(size_t index) const
+  {
+    return reinterpret_cast<Notification *>(&buffer_[(index & mask_) * stride_]);
+  }
+
+  size_t mask_;
+  size_t slot_size_;
+  size_t stride_;
+  std::unique_ptr<uint8_t[]> storage_;
+  uint8_t * buffer_;
+
+  unsigned int subscription_id_{0};
+
+  // Each index is written by one side only; keep them on separate cache
+  // lines, along with the producer's stale copy of the consumer index
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
+  alignas(64) std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> truncated_{0};
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__NOTIFICATION_RING_HPP_
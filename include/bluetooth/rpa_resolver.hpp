@@ -0,0 +1,103 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__RPA_RESOLVER_HPP_
+#define BLUETOOTH__RPA_RESOLVER_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "aes.h"
+#include "bluetooth.h"
+}
+
+namespace bluetooth {
+
+// Resolves batches of resolvable private addresses (RPAs) against a set of
+// identity resolving keys (IRKs). Each IRK's AES key schedule is expanded
+// once, and ah() is evaluated for all pending addresses per key in one
+// multi-block AES call. Resolved addresses are cached until they expire
+class RpaResolver
+{
+public:
+  // Devices rotate their RPA every 15 minutes by default
+  explicit RpaResolver(std::chrono::milliseconds cache_ttl = std::chrono::minutes(15));
+
+  // The IRK is LSB first, as exchanged during pairing
+  void add_irk(const bdaddr_t & identity, const uint8_t irk[16]);
+  void clear_irks();
+  size_t get_num_irks() const { return keys_.size(); }
+
+  // Resolves count addresses; identities[i] is set to the identity address
+  // or to nullptr if rpas[i] is not an RPA or matches no IRK. The pointers
+  // stay valid until the IRK set changes. Returns the number resolved
+  size_t resolve(const bdaddr_t * rpas, size_t count, const bdaddr_t ** identities);
+  bool resolve(const bdaddr_t & rpa, bdaddr_t & identity);
+
+  void expire_cache();
+  void clear_cache() { cache_.clear(); }
+
+  static bool is_rpa(const bdaddr_t & addr);
+
+  struct Stats
+  {
+    uint64_t addresses{0};        // addresses passed to resolve()
+    uint64_t resolved{0};         // addresses matched to an identity
+    uint64_t cache_hits{0};       // resolved without running AES
+    uint64_t ah_evaluations{0};   // AES blocks encrypted
+    std::chrono::nanoseconds busy_time{0};
+
+    double resolutions_per_second() const;
+    double ah_per_second() const;
+  };
+
+  const Stats & get_stats() const { return stats_; }
+  void reset_stats() { stats_ = Stats(); }
+
+protected:
+  using clock = std::chrono::steady_clock;
+
+  struct Key
+  {
+    bdaddr_t identity;
+    struct bt_aes128 aes;
+  };
+
+  struct CacheEntry
+  {
+    size_t key_index;
+    clock::time_point expires;
+  };
+
+  static uint64_t to_key(const bdaddr_t & addr);
+
+  std::chrono::milliseconds cache_ttl_;
+  std::vector<Key> keys_;
+  std::unordered_map<uint64_t, CacheEntry> cache_;
+
+  // Scratch buffers, reused between calls
+  std::vector<uint8_t> plaintext_;
+  std::vector<uint8_t> ciphertext_;
+  std::vector<size_t> pending_;
+
+  Stats stats_;
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__RPA_RESOLVER_HPP_
@@ -0,0 +1,88 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__DRIVE_SCHEDULER_HPP_
+#define MINIPRO__DRIVE_SCHEDULER_HPP_
+
+#include <chrono>
+#include <cstdint>
+
+namespace jeronibot::minipro
+{
+
+// Decides when a drive setpoint has to go out: right away when it moves
+// by more than epsilon (or to or from a stop), otherwise only once the
+// keepalive interval has passed since the last packet. The keepalive has
+// to be shorter than the vehicle's remote control timeout
+class DriveScheduler
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct Config
+  {
+    int16_t epsilon{256};                       // per axis, in drive units
+    std::chrono::milliseconds keepalive{100};
+  };
+
+  explicit DriveScheduler(const Config & config);
+  DriveScheduler();
+
+  // Returns true if a packet with this setpoint should be sent now; the
+  // caller is expected to send it
+  bool update(int16_t throttle, int16_t steering, clock::time_point now = clock::now());
+
+  // Forget the last sent setpoint so that the next update() sends
+  void reset() { have_sent_ = false; }
+
+  const Config & get_config() const { return config_; }
+  void set_config(const Config & config) { config_ = config; }
+
+  struct Stats
+  {
+    uint64_t updates{0};                        // calls to update()
+    uint64_t packets{0};                        // updates that sent
+    uint64_t keepalives{0};                     // sent only because of the keepalive
+    std::chrono::nanoseconds max_latency{0};    // from a setpoint change to the packet carrying it
+    std::chrono::nanoseconds total_latency{0};
+    uint64_t num_latencies{0};
+    clock::time_point start{clock::now()};
+
+    double packets_per_second(clock::time_point now = clock::now()) const;
+    std::chrono::nanoseconds mean_latency() const;
+  };
+
+  const Stats & get_stats() const { return stats_; }
+  void reset_stats() { stats_ = Stats(); }
+
+protected:
+  void sent(int16_t throttle, int16_t steering, clock::time_point now);
+
+  Config config_;
+
+  bool have_sent_{false};
+  int16_t sent_throttle_{0};
+  int16_t sent_steering_{0};
+  clock::time_point sent_time_;
+
+  // When the setpoint first differed from what was last sent
+  bool change_pending_{false};
+  clock::time_point change_time_;
+
+  Stats stats_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__DRIVE_SCHEDULER_HPP_
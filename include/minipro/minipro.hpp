@@ -15,12 +15,21 @@
 #ifndef MINIPRO__MINIPRO_HPP_
 #define MINIPRO__MINIPRO_HPP_
 
+#include <array>
+#include <chrono>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "bluetooth/le_client.hpp"
-#include "minipro/packet.hpp"
+#include "bluetooth/le_scanner.hpp"
+#include "bluetooth/notification_ring.hpp"
+#include "minipro/drive_scheduler.hpp"
+#include "minipro/protocol.hpp"
+#include "minipro/query_scheduler.hpp"
+#include "util/metrics.hpp"
 #include "util/units.hpp"
 
 namespace jeronibot::minipro
@@ -29,29 +38,117 @@ namespace jeronibot::minipro
 class MiniPro : public bluetooth::LEClient
 {
 public:
-  explicit MiniPro(const std::string & bt_address);
+  explicit MiniPro(const std::string & bt_address, Dispatch dispatch = Dispatch::Thread);
+  explicit MiniPro(int fd, Dispatch dispatch = Dispatch::Thread);  // see LEClient(int fd)
   MiniPro() = delete;
 
+  // Scanner settings that mark MiniPROs in the device table
+  static bluetooth::LEScanner::Config get_scan_config();
+
+  // The values last answered to query(); 0 until then
   units::velocity::miles_per_hour_t get_current_speed();
   units::current::ampere_t get_battery_level();
   units::voltage::volt_t get_voltage();
   units::temperature::fahrenheit_t get_vehicle_temperature();
+  units::length::meter_t get_odometer();
+
+  // Ask for a value the vehicle answers GetSetValue for every period, e.g.
+  // query<protocol::Voltage>(1s); the answers are taken by receive_packet()
+  template<typename V>
+  void query(std::chrono::nanoseconds period)
+  {
+    query_scheduler_.add(V::parameter, period);
+    query_requests_.push_back(protocol::get_value_request<V>);
+  }
+
+  template<typename V>
+  typename std::tuple_element_t<0, typename V::Values> get_value() const
+  {
+    return static_cast<std::tuple_element_t<0, typename V::Values>>(values_[V::parameter]);
+  }
+
+  QueryScheduler & get_query_scheduler() { return query_scheduler_; }
 
+  struct TelemetryConfig
+  {
+    size_t num_slots{64};                        // notifications held between receive_packet() calls
+    size_t slot_size{32};
+    std::chrono::milliseconds poll_period{0};    // 0 to never poll
+    std::vector<uint16_t> poll_handles;          // values the vehicle doesn't push
+  };
+
+  void set_telemetry_config(const TelemetryConfig & config);
+  const TelemetryConfig & get_telemetry_config() const { return telemetry_config_; }
+
+  // Subscribe to the telemetry the vehicle pushes on TX; the GATT client
+  // writes the CCC descriptor
   void enable_notifications();
   void disable_notifications();
 
   void enter_remote_control_mode();
   void drive(int16_t throttle, int16_t steering);
+
+  // Call at the control loop rate; sends a drive packet only when the
+  // scheduler says so. Returns true if a packet was sent
+  bool update_drive(
+    int16_t throttle, int16_t steering,
+    DriveScheduler::clock::time_point now = DriveScheduler::clock::now());
+  DriveScheduler & get_drive_scheduler() { return drive_scheduler_; }
   void exit_remote_control_mode();
 
+  // Take the telemetry pushed since the last call, including the answers
+  // to queries and polls, send the queries that are due and, when the poll
+  // period is up, read the values that aren't pushed. A handle is read again
+  // only once its last read came back. Doesn't wait for anything; returns
+  // true if new telemetry was taken
   bool receive_packet();
 
+  uint64_t get_num_telemetry() const { return num_telemetry_; }
+  const std::vector<uint8_t> & get_last_telemetry() const { return last_telemetry_; }
+
+  // The last value read from one of the poll handles, decoded into the
+  // getters above too when it is a packet; empty until then. A failed read
+  // keeps the previous value
+  const std::vector<uint8_t> & get_polled_value(uint16_t handle) const;
+  uint64_t get_num_polled() const { return num_polled_; }
+
 protected:
-  void send_packet(packet::Packet & packet);
-  void write_config_value(uint16_t value);
+  void find_handles();
+  bool send_packet(const uint8_t * bytes, size_t length);
+  void decode(const bluetooth::Notification & n);
+  void poll(std::chrono::steady_clock::time_point now);
+
+  template<size_t N>
+  bool send_packet(const std::array<uint8_t, N> & bytes) { return send_packet(bytes.data(), N); }
+
+  // Looked up by UUID once the client is ready; these are the handles the
+  // MiniPRO firmware has been seen to use (TX notifies through its CCC at
+  // 0x000c), kept in case the lookup fails
+  uint16_t notify_handle_{0x000b};
+  uint16_t tx_service_handle_{0x00e};
+
+  TelemetryConfig telemetry_config_;
+  std::shared_ptr<bluetooth::NotificationRing> telemetry_;
+  uint64_t num_telemetry_{0};
+  std::vector<uint8_t> last_telemetry_;
+  std::chrono::steady_clock::time_point last_poll_;
+
+  // One slot per poll handle, as each has at most one read outstanding
+  std::shared_ptr<bluetooth::NotificationRing> polled_;
+  std::vector<bool> poll_pending_;                       // by poll handle index
+  std::vector<std::vector<uint8_t>> polled_values_;      // by poll handle index
+  uint64_t num_polled_{0};
+
+  QueryScheduler query_scheduler_;
+  std::vector<protocol::GetValueBytes> query_requests_;  // by query index
+  std::array<int64_t, 256> values_{};                    // by parameter
+
+  DriveScheduler drive_scheduler_;
 
-  const uint16_t config_service_handle_{0x000c};
-  const uint16_t tx_service_handle_{0x00e};
+  util::Counter * drive_updates_{nullptr};
+  util::Counter * drive_coalesced_{nullptr};
+  util::Counter * drive_dropped_{nullptr};
+  util::Histogram * query_rtt_{nullptr};
 };
 
 }  // namespace jeronibot::minipro
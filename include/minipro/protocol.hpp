@@ -0,0 +1,317 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__PROTOCOL_HPP_
+#define MINIPRO__PROTOCOL_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// The MiniPRO serial protocol, declared as a table of messages. Each
+// message is a type from which the compiler generates the encoder and
+// decoder; fixed commands are encoded once, at compile time. A packet is
+//
+//   0x55 0xaa | length | type | operation | parameter | payload | checksum
+//
+// where length counts the payload and the checksum, multi-byte values are
+// little-endian and the checksum is the complement of the 16-bit sum of
+// the bytes from length to the end of the payload
+
+namespace jeronibot::minipro::protocol
+{
+
+enum class Type : uint8_t { Command = 0x0a, Notification = 0x0d };
+enum class Operation : uint8_t { GetSetValue = 0x01, ControlDriveBase = 0x03 };
+
+constexpr size_t header_size = 6;
+constexpr size_t checksum_size = 2;
+
+// What a received packet is looked up by
+constexpr uint32_t make_key(Type type, Operation operation, uint8_t parameter)
+{
+  return static_cast<uint32_t>(type) << 16 | static_cast<uint32_t>(operation) << 8 | parameter;
+}
+
+namespace detail
+{
+
+template<typename T, size_t N>
+constexpr void put(std::array<uint8_t, N> & bytes, size_t offset, T value)
+{
+  auto v = static_cast<std::make_unsigned_t<T>>(value);
+  for (size_t i = 0; i < sizeof(T); i++) {
+    bytes[offset + i] = static_cast<uint8_t>(v >> (8 * i));
+  }
+}
+
+template<typename T>
+constexpr T take(const uint8_t * p, size_t & offset)
+{
+  std::make_unsigned_t<T> v = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    v |= static_cast<std::make_unsigned_t<T>>(static_cast<std::make_unsigned_t<T>>(p[offset + i]) << (8 * i));
+  }
+  offset += sizeof(T);
+  return static_cast<T>(v);
+}
+
+constexpr uint16_t checksum(const uint8_t * p, size_t length)
+{
+  uint16_t sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    sum += p[i];
+  }
+  return sum ^ 0xffff;
+}
+
+}  // namespace detail
+
+// A received packet whose framing and checksum hold
+struct Frame
+{
+  uint32_t key;
+  const uint8_t * payload;
+  size_t payload_size;
+};
+
+constexpr bool parse(const uint8_t * data, size_t length, Frame & frame)
+{
+  if (length < header_size + checksum_size || data[0] != 0x55 || data[1] != 0xaa ||
+    data[2] + header_size != length)
+  {
+    return false;
+  }
+
+  size_t sum_end = length - checksum_size;
+  uint16_t checksum = data[sum_end] | data[sum_end + 1] << 8;
+  if (detail::checksum(data + 2, sum_end - 2) != checksum) {
+    return false;
+  }
+
+  frame.key = make_key(static_cast<Type>(data[3]), static_cast<Operation>(data[4]), data[5]);
+  frame.payload = data + header_size;
+  frame.payload_size = length - header_size - checksum_size;
+  return true;
+}
+
+// One line of the table: where the message goes and its payload fields,
+// which are integers
+template<Type T, Operation O, uint8_t P, typename ... Fields>
+struct Message
+{
+  static_assert((std::is_integral_v<Fields>&& ...), "Message: Payload fields must be integers");
+
+  static constexpr Type type = T;
+  static constexpr Operation operation = O;
+  static constexpr uint8_t parameter = P;
+  static constexpr uint32_t key = make_key(T, O, P);
+
+  static constexpr size_t payload_size = (size_t{0} + ... + sizeof(Fields));
+  static constexpr size_t size = header_size + payload_size + checksum_size;
+  static_assert(payload_size + checksum_size <= 0xff, "Message: Payload too long");
+
+  using Bytes = std::array<uint8_t, size>;
+  using Values = std::tuple<Fields...>;
+
+  static constexpr Bytes encode(Fields ... values)
+  {
+    Bytes bytes{0x55, 0xaa, payload_size + checksum_size, static_cast<uint8_t>(T), static_cast<uint8_t>(O), P};
+
+    [[maybe_unused]] size_t offset = header_size;
+    ((detail::put(bytes, offset, values), offset += sizeof(Fields)), ...);
+
+    detail::put(bytes, header_size + payload_size, detail::checksum(bytes.data() + 2, header_size + payload_size - 2));
+
+    return bytes;
+  }
+
+  // From payload_size bytes of payload
+  static constexpr Values decode(const uint8_t * payload)
+  {
+    [[maybe_unused]] size_t offset = 0;
+    return Values{detail::take<Fields>(payload, offset)...};
+  }
+};
+
+namespace detail
+{
+
+// A slot for each key in a table of 1 << bits slots
+constexpr size_t hash_slot(uint32_t key, uint32_t multiplier, unsigned int bits)
+{
+  return static_cast<uint32_t>(key * multiplier) >> (32 - bits);
+}
+
+constexpr unsigned int hash_bits(size_t num_keys)
+{
+  // At most half full, so a multiplier turns up quickly
+  unsigned int bits = 1;
+  while ((size_t{1} << bits) < 2 * num_keys) {
+    bits++;
+  }
+  return bits;
+}
+
+// The first odd multiplier that sends every key to its own slot; 0 if two
+// keys are the same or there is none
+template<size_t N>
+constexpr uint32_t find_multiplier(const std::array<uint32_t, N> & keys, unsigned int bits)
+{
+  for (size_t i = 0; i < N; i++) {
+    for (size_t j = i + 1; j < N; j++) {
+      if (keys[i] == keys[j]) {
+        return 0;
+      }
+    }
+  }
+
+  for (uint32_t candidate = 0x9e3779b1; candidate < 0x9e3779b1 + 2 * 4096; candidate += 2) {
+    bool unique = true;
+    for (size_t i = 0; i < N && unique; i++) {
+      for (size_t j = i + 1; j < N && unique; j++) {
+        unique = hash_slot(keys[i], candidate, bits) != hash_slot(keys[j], candidate, bits);
+      }
+    }
+    if (unique) {
+      return candidate;
+    }
+  }
+  return 0;
+}
+
+template<size_t NumSlots>
+struct HashTable
+{
+  std::array<uint32_t, NumSlots> keys;   // ~0 where empty, which no key is
+  std::array<uint8_t, NumSlots> index;
+};
+
+template<size_t NumSlots, size_t N>
+constexpr HashTable<NumSlots> make_hash_table(
+  const std::array<uint32_t, N> & keys, uint32_t multiplier, unsigned int bits)
+{
+  HashTable<NumSlots> table{};
+  for (size_t slot = 0; slot < NumSlots; slot++) {
+    table.keys[slot] = ~uint32_t{0};
+  }
+  for (size_t i = 0; i < N; i++) {
+    table.keys[hash_slot(keys[i], multiplier, bits)] = keys[i];
+    table.index[hash_slot(keys[i], multiplier, bits)] = static_cast<uint8_t>(i);
+  }
+  return table;
+}
+
+}  // namespace detail
+
+// The messages one side receives, dispatched through a perfect hash of
+// their keys that is found at compile time
+template<typename ... Messages>
+class Schema
+{
+public:
+  static_assert(sizeof...(Messages) > 0 && sizeof...(Messages) < 128, "Schema: 1 to 127 messages");
+
+  static constexpr size_t num_messages = sizeof...(Messages);
+
+  // Decode a packet and call visitor(Message{}, Message::Values) for it.
+  // False if it's malformed or not in the schema
+  template<typename Visitor>
+  static bool dispatch(const uint8_t * data, size_t length, Visitor && visitor)
+  {
+    Frame frame{};
+    if (!parse(data, length, frame)) {
+      return false;
+    }
+
+    size_t slot = detail::hash_slot(frame.key, multiplier_, bits_);
+    if (table_.keys[slot] != frame.key) {
+      return false;
+    }
+
+    return visit(table_.index[slot], frame, visitor, std::index_sequence_for<Messages...>{});
+  }
+
+  // Whether a key is in the schema
+  static constexpr bool contains(uint32_t key)
+  {
+    return table_.keys[detail::hash_slot(key, multiplier_, bits_)] == key;
+  }
+
+protected:
+  static constexpr std::array<uint32_t, num_messages> keys_{Messages::key ...};
+  static constexpr unsigned int bits_ = detail::hash_bits(num_messages);
+  static constexpr uint32_t multiplier_ = detail::find_multiplier(keys_, bits_);
+  static_assert(multiplier_ != 0, "Schema: Messages must have different keys");
+
+  static constexpr auto table_ = detail::make_hash_table<size_t{1} << bits_>(keys_, multiplier_, bits_);
+
+  template<typename M, typename Visitor>
+  static bool visit_one(const Frame & frame, Visitor & visitor)
+  {
+    if (frame.payload_size != M::payload_size) {
+      return false;
+    }
+    visitor(M{}, M::decode(frame.payload));
+    return true;
+  }
+
+  template<typename Visitor, size_t ... I>
+  static bool visit(size_t index, const Frame & frame, Visitor & visitor, std::index_sequence<I...>)
+  {
+    return ((index == I && visit_one<Messages>(frame, visitor)) || ...);
+  }
+};
+
+//
+// The MiniPRO's messages. A new parameter is a line here, and one in
+// Incoming if the vehicle sends it
+//
+
+using RemoteControl = Message<Type::Command, Operation::ControlDriveBase, 0x7a, uint16_t>;  // 1 to enter, 0 to exit
+using Drive = Message<Type::Command, Operation::ControlDriveBase, 0x7b, int16_t, int16_t>;  // throttle, steering
+
+// GetSetValue reads a parameter: the request gives the number of bytes
+// to read and the vehicle notifies them back under the same parameter.
+// The parameter numbers are the Ninebot serial protocol's
+template<uint8_t P>
+using GetValue = Message<Type::Command, Operation::GetSetValue, P, uint8_t>;
+using GetValueBytes = GetValue<0>::Bytes;  // the same for every parameter
+
+template<uint8_t P, typename T>
+using Value = Message<Type::Notification, Operation::GetSetValue, P, T>;
+
+using BatteryLevel = Value<0x22, uint16_t>;  // percent
+using Speed = Value<0x26, int16_t>;          // 0.01 km/h
+using Odometer = Value<0x29, uint32_t>;      // m
+using Temperature = Value<0x3e, int16_t>;    // 0.1 degC
+using Voltage = Value<0x47, uint16_t>;       // 0.01 V
+
+using Incoming = Schema<BatteryLevel, Speed, Odometer, Temperature, Voltage>;
+
+// Fixed commands, encoded at compile time
+inline constexpr RemoteControl::Bytes enter_remote_control_mode = RemoteControl::encode(1);
+inline constexpr RemoteControl::Bytes exit_remote_control_mode = RemoteControl::encode(0);
+inline constexpr Drive::Bytes stop = Drive::encode(0, 0);
+
+template<typename V>
+inline constexpr typename GetValue<V::parameter>::Bytes get_value_request =
+  GetValue<V::parameter>::encode(V::payload_size);
+
+}  // namespace jeronibot::minipro::protocol
+
+#endif  // MINIPRO__PROTOCOL_HPP_
@@ -0,0 +1,112 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__QUERY_SCHEDULER_HPP_
+#define MINIPRO__QUERY_SCHEDULER_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace jeronibot::minipro
+{
+
+// Decides when to send GetSetValue queries: each parameter at its own
+// period, with up to max_in_flight of them outstanding at once so that
+// the link, not the round trip, bounds the rate. A query is done when a
+// value with its parameter comes back, or after the timeout. Only one
+// query per parameter is outstanding, since answers are matched by
+// parameter
+class QueryScheduler
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct Config
+  {
+    size_t max_in_flight{4};
+    std::chrono::milliseconds timeout{500};
+  };
+
+  explicit QueryScheduler(const Config & config);
+  QueryScheduler();
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  // Query a parameter every period, starting at the next call to next().
+  // Returns its index
+  size_t add(uint8_t parameter, std::chrono::nanoseconds period);
+  size_t get_num_queries() const { return queries_.size(); }
+  uint8_t get_parameter(size_t index) const { return queries_[index].parameter; }
+
+  // The index of a query to send now, the most overdue first, or npos if
+  // none is due or too many are in flight. The caller is expected to send
+  // it, and to call failed() if it couldn't
+  size_t next(clock::time_point now = clock::now());
+  void failed(size_t index);
+
+  // A value came back; returns false if no query for it was in flight
+  bool answered(uint8_t parameter, clock::time_point now = clock::now());
+
+  size_t get_num_in_flight() const { return num_in_flight_; }
+
+  const Config & get_config() const { return config_; }
+  void set_config(const Config & config) { config_ = config; }
+
+  struct Stats
+  {
+    uint64_t requests{0};
+    uint64_t responses{0};
+    uint64_t timeouts{0};
+    uint64_t unsolicited{0};                     // values no query was waiting for
+    std::chrono::nanoseconds max_rtt{0};
+    std::chrono::nanoseconds total_rtt{0};
+
+    std::chrono::nanoseconds mean_rtt() const;
+  };
+
+  const Stats & get_stats() const { return stats_; }
+  void reset_stats() { stats_ = Stats(); }
+
+  // The round trip of the last answer, for the caller's metrics
+  std::chrono::nanoseconds get_last_rtt() const { return last_rtt_; }
+
+protected:
+  void expire(clock::time_point now);
+
+  struct Query
+  {
+    Query(uint8_t parameter, std::chrono::nanoseconds period)
+    : parameter(parameter), period(period) {}
+
+    uint8_t parameter;
+    std::chrono::nanoseconds period;
+    bool started{false};
+    clock::time_point due;
+    bool in_flight{false};
+    clock::time_point sent;
+  };
+
+  Config config_;
+  std::vector<Query> queries_;
+  size_t num_in_flight_{0};
+  std::chrono::nanoseconds last_rtt_{0};
+
+  Stats stats_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__QUERY_SCHEDULER_HPP_
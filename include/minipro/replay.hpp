@@ -0,0 +1,85 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__REPLAY_HPP_
+#define MINIPRO__REPLAY_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "minipro/drive_scheduler.hpp"
+#include "minipro/teleop.hpp"
+#include "util/flight_recorder.hpp"
+
+namespace jeronibot::minipro
+{
+
+// Runs a recorded teleop session back through the stack. A MiniPro is
+// connected over a socketpair to a fake device that serves the Nordic UART
+// service, answers reads with the recorded read responses in order and
+// pushes the recorded notifications as telemetry; the recorded joystick snapshots are fed
+// to a Joystick through a pipe. Teleop drives the MiniPro as TeleopLoop
+// does, but on a virtual clock that starts at the first record: the loop
+// wakes up for the next record, the update Teleop says is due or the
+// telemetry tick, whichever comes first, so the drive packets it produces
+// depend only on the recording. They are compared byte for byte with the
+// recorded ones.
+//
+// As fast as possible, the replay doubles as a throughput benchmark of the
+// client, the ATT transport and the joystick input path
+class Replay
+{
+public:
+  struct Config
+  {
+    bool real_time{false};  // at the recorded timing, else as fast as possible
+    // How often receive_packet() runs
+    std::chrono::nanoseconds tick{std::chrono::milliseconds(33)};
+    Teleop::Config teleop;  // run without the sender thread
+    DriveScheduler::Config scheduler;
+  };
+
+  struct Result
+  {
+    uint64_t records{0};
+    uint64_t notifications{0};
+    uint64_t telemetry{0};  // notifications MiniPro took in
+    uint64_t read_responses{0};
+    uint64_t joystick_events{0};
+    uint64_t ticks{0};     // calls to receive_packet()
+    uint64_t updates{0};   // drive updates Teleop made
+    uint64_t expected_packets{0};
+    uint64_t sent_packets{0};
+    int64_t first_mismatch{-1};  // index of the first packet that differs
+    std::chrono::nanoseconds elapsed{0};
+
+    bool ok() const { return first_mismatch < 0 && sent_packets == expected_packets; }
+  };
+
+  explicit Replay(const std::string & path);
+  Replay(const std::string & path, const Config & config);
+  Replay() = delete;
+
+  Result run();
+
+protected:
+  Config config_;
+  std::unique_ptr<util::FlightLog> log_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__REPLAY_HPP_
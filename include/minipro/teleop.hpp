@@ -0,0 +1,127 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__TELEOP_HPP_
+#define MINIPRO__TELEOP_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "util/joystick.hpp"
+
+namespace jeronibot::minipro
+{
+
+class MiniPro;
+
+struct DriveSetpoint
+{
+  int16_t throttle{0};
+  int16_t steering{0};
+};
+
+struct StickMapping
+{
+  int deadzone{8000};          // per axis, in joystick units
+  double expo{0.0};            // 0 is linear, 1 cubic: finer control near the center
+  double throttle_scale{1.0};
+  double steering_scale{0.1};  // less aggressive on turns
+};
+
+// Map a thumbstick to a drive setpoint: forward and right are positive,
+// small deflections around the center are zero so that the MiniPRO is
+// stable when the stick is released, and steering is made less aggressive
+DriveSetpoint teleop_setpoint(const util::AxisState & stick, const StickMapping & mapping);
+DriveSetpoint teleop_setpoint(const util::AxisState & stick);
+
+// Drives from a joystick as its events arrive rather than on an app tick:
+// the joystick's input thread maps each move of the stick to a setpoint
+// and a sender thread passes it on right away, or as soon as min_interval
+// has passed since the last update. With the stick still, the sender
+// updates every idle_period so that the drive scheduler can send its
+// keepalives. Create it once in remote control mode, and destroy it
+// before leaving
+class Teleop
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  // Given each setpoint and when; returns true if a packet went out, like
+  // MiniPro::update_drive()
+  using DriveFunc = std::function<bool(int16_t throttle, int16_t steering, clock::time_point now)>;
+
+  struct Config
+  {
+    StickMapping mapping;
+    uint8_t axis{0};                                // the stick that drives
+    std::chrono::milliseconds min_interval{20};
+    std::chrono::milliseconds idle_period{50};      // shorter than the keepalive
+    bool sender_thread{true};                       // false to call update() from an event loop
+  };
+
+  Teleop(util::Joystick & joystick, MiniPro & minipro, const Config & config);
+  Teleop(util::Joystick & joystick, DriveFunc drive, const Config & config);
+  Teleop() = delete;
+  ~Teleop();
+
+  Teleop(const Teleop &) = delete;
+  Teleop & operator=(const Teleop &) = delete;
+
+  // Without the sender thread: make the update that is due, if any, and
+  // return when the next one is. Call on the thread the joystick's
+  // callbacks run on, at the latest when it says
+  clock::time_point update(clock::time_point now = clock::now());
+
+  // What the stick does, for other sources of setpoints; any thread.
+  // since is when the input that led to it happened
+  void set_setpoint(const DriveSetpoint & setpoint, clock::time_point since = clock::now());
+
+  struct Stats
+  {
+    uint64_t events{0};                         // setpoints given
+    uint64_t updates{0};                        // calls to the drive function
+    uint64_t packets{0};                        // updates that sent
+    std::chrono::nanoseconds max_latency{0};    // from the input to the update carrying it
+  };
+
+  Stats get_stats();
+
+protected:
+  void sender_thread_func();
+  clock::time_point next_update() const;
+  void send(std::unique_lock<std::mutex> & lock, clock::time_point now);
+
+  util::Joystick & joystick_;
+  DriveFunc drive_;
+  Config config_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  DriveSetpoint setpoint_;
+  bool pending_{false};
+  clock::time_point pending_since_;
+  clock::time_point last_update_;
+  bool should_exit_{false};
+  Stats stats_;
+
+  std::thread sender_thread_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__TELEOP_HPP_
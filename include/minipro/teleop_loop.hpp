@@ -0,0 +1,87 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__TELEOP_LOOP_HPP_
+#define MINIPRO__TELEOP_LOOP_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "minipro/minipro.hpp"
+#include "minipro/teleop.hpp"
+#include "util/joystick.hpp"
+
+namespace jeronibot::minipro
+{
+
+// Runs teleop on the calling thread alone, instead of on the joystick's
+// input thread, the client's mainloop thread, Teleop's sender thread and
+// an app loop. The joystick, the ATT bearer and a timerfd are on the one
+// epoll mainloop, so a stick move is read, mapped and written to the link
+// without a handoff. The timer wakes the loop when the next teleop update
+// or telemetry tick is due, and not otherwise.
+//
+// The MiniPro has to be created with Dispatch::Caller, the joystick's
+// input thread stopped and the Teleop created without its sender thread
+class TeleopLoop
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct Config
+  {
+    std::chrono::milliseconds tick{33};  // how often receive_packet() takes the telemetry
+  };
+
+  TeleopLoop(MiniPro & minipro, util::Joystick & joystick, Teleop & teleop, const Config & config);
+  TeleopLoop() = delete;
+  ~TeleopLoop();
+
+  TeleopLoop(const TeleopLoop &) = delete;
+  TeleopLoop & operator=(const TeleopLoop &) = delete;
+
+  // Until should_exit is set; a signal, or at the latest the next tick,
+  // gets it looked at. The calling thread takes the ThreadRole::Control
+  // profile
+  void run(const std::atomic<bool> & should_exit);
+
+  struct Stats
+  {
+    uint64_t wakeups{0};     // returns from epoll_wait
+    uint64_t joystick{0};    // times the joystick was readable
+    uint64_t timer{0};       // times the timer expired
+    uint64_t ticks{0};       // calls to receive_packet()
+  };
+
+  const Stats & get_stats() const { return stats_; }
+
+protected:
+  static void joystick_cb(int fd, uint32_t events, void * user_data);
+  static void timer_cb(int fd, uint32_t events, void * user_data);
+  void arm(clock::time_point when);
+
+  MiniPro & minipro_;
+  util::Joystick & joystick_;
+  Teleop & teleop_;
+  Config config_;
+
+  int timer_fd_{-1};
+  clock::time_point armed_;
+  Stats stats_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__TELEOP_LOOP_HPP_
@@ -0,0 +1,114 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__EVDEV_JOYSTICK_HPP_
+#define UTIL__EVDEV_JOYSTICK_HPP_
+
+#include <linux/input.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "util/joystick.hpp"
+
+namespace jeronibot::util
+{
+
+// A joystick on the evdev interface (/dev/input/event*) instead of the
+// legacy js one. Events are applied a frame at a time, up to each
+// SYN_REPORT, so both coordinates of a stick change together, and their
+// times are the kernel's, in microseconds on the monotonic clock. Axes
+// are paired and numbered the way the js interface numbers a gamepad's
+// (left stick, right stick, triggers, hat), from the absolute axes the
+// device reports at open, and scaled to -32767..32767
+class EvdevJoystick : public Joystick
+{
+public:
+  explicit EvdevJoystick(const std::string & device_name);
+
+  // An absolute axis the device has, as EVIOCGABS reports it
+  struct AbsAxis
+  {
+    uint16_t code;
+    int32_t minimum;
+    int32_t maximum;
+  };
+
+  // Read input_event records from an already open source, such as a pipe
+  // standing in for the device, that has these axes and keys. Event times
+  // are taken to be on the monotonic clock. The joystick closes fd
+  EvdevJoystick(int fd, const std::vector<AbsAxis> & axes, const std::vector<uint16_t> & keys);
+
+  ~EvdevJoystick() override;
+
+  // From the kernel's timestamp of a frame to it being applied
+  std::chrono::nanoseconds get_last_latency() const
+  {
+    return std::chrono::nanoseconds(last_latency_.load(std::memory_order_relaxed));
+  }
+  std::chrono::nanoseconds get_max_latency() const
+  {
+    return std::chrono::nanoseconds(max_latency_.load(std::memory_order_relaxed));
+  }
+
+  // Times the kernel's buffer overflowed and frames were lost
+  uint64_t get_num_dropped() const { return num_dropped_.load(std::memory_order_relaxed); }
+
+protected:
+  static constexpr size_t max_frame_buttons = 16;
+  static constexpr uint8_t no_button = 0xff;
+
+  static int open_device(const std::string & device_name);
+
+  void build_maps(const std::vector<AbsAxis> & axes, const std::vector<uint16_t> & keys);
+  int16_t scale(uint16_t code, int32_t value) const;
+
+  void read_events() override;
+  void apply_event(const struct input_event & event);
+  void apply_frame();
+  void resync();
+
+  struct AxisMapping
+  {
+    bool used{false};
+    uint8_t axis{0};
+    bool is_y{false};
+    int32_t minimum{0};
+    int32_t maximum{0};
+  };
+
+  std::array<AxisMapping, ABS_CNT> abs_map_{};
+  std::array<uint8_t, KEY_CNT> key_map_{};
+  bool have_device_{false};   // false for a stand-in, which can't be asked for its state
+
+  // The frame being read; input thread only
+  std::array<AxisState, 16> frame_axes_{};
+  uint32_t frame_changed_{0};
+  std::array<std::pair<uint8_t, bool>, max_frame_buttons> frame_buttons_{};
+  size_t num_frame_buttons_{0};
+  bool dropping_{false};
+
+  std::atomic<int64_t> last_latency_{0};
+  std::atomic<int64_t> max_latency_{0};
+  std::atomic<uint64_t> num_dropped_{0};
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__EVDEV_JOYSTICK_HPP_
@@ -0,0 +1,146 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__FLIGHT_RECORDER_HPP_
+#define UTIL__FLIGHT_RECORDER_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jeronibot::util
+{
+
+// One fixed-size record of the flight recorder file
+struct FlightRecord
+{
+  enum Type : uint8_t { Packet = 1, Notification = 2, ReadResponse = 3, Joystick = 4 };
+  enum Flags : uint8_t { Truncated = 0x01 };
+
+  static constexpr size_t max_data = 40;
+
+  std::atomic<uint64_t> seq;  // position + 1 once the record is complete
+  uint64_t timestamp_ns;      // CLOCK_MONOTONIC
+  uint8_t type;
+  uint8_t flags;
+  uint16_t handle;            // ATT handle; 0 when not known
+  uint16_t length;            // length of the original value
+  uint16_t reserved;
+  uint8_t data[max_data];
+};
+
+static_assert(sizeof(FlightRecord) == 64, "FlightRecord must be one cache line");
+
+// Payload of a Joystick record: the button bitmask followed by the x, y
+// pair of the first num_axes axes; the record length is 4 + 4 * num_axes
+struct JoystickSnapshot
+{
+  static constexpr size_t max_axes = 8;
+
+  uint32_t buttons;
+  int16_t axes[max_axes][2];
+};
+
+// The file starts with one page of header followed by a ring of records.
+// commit is the number of records known to be complete: every record
+// below it has been written out, so a reader trusts [commit - capacity,
+// commit) and, past a crash, any later record whose seq is still valid
+struct FlightRecorderHeader
+{
+  static constexpr char magic_value[8] = {'J', 'B', 'F', 'L', 'I', 'G', 'H', 'T'};
+  static const uint32_t version_value = 1;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  int64_t wall_clock_ns;  // CLOCK_REALTIME and CLOCK_MONOTONIC at the same
+  int64_t monotonic_ns;   // instant, to convert record timestamps
+
+  alignas(64) std::atomic<uint64_t> commit;
+};
+
+// Appends records to a memory-mapped ring file. record() is lock-free and
+// may be called from any number of threads; once it returns the record is
+// in the page cache and survives a crash of the process
+class FlightRecorder
+{
+public:
+  explicit FlightRecorder(const std::string & path, size_t num_records = 65536);
+  FlightRecorder() = delete;
+  ~FlightRecorder();
+
+  FlightRecorder(const FlightRecorder &) = delete;
+  FlightRecorder & operator=(const FlightRecorder &) = delete;
+
+  // Values longer than FlightRecord::max_data are truncated
+  void record(FlightRecord::Type type, uint16_t handle, const uint8_t * data, size_t length);
+  void record_joystick(const JoystickSnapshot & snapshot, uint8_t num_axes);
+
+  // Schedule the mapped pages to be written to disk
+  void sync();
+
+  uint64_t get_count() const {return next_.load(std::memory_order_relaxed);}
+  size_t get_capacity() const {return mask_ + 1;}
+
+protected:
+  int fd_{-1};
+  void * map_{nullptr};
+  size_t map_size_{0};
+
+  FlightRecorderHeader * header_{nullptr};
+  FlightRecord * records_{nullptr};
+  size_t mask_{0};
+
+  alignas(64) std::atomic<uint64_t> next_{0};
+};
+
+// Read-only view of a recorder file, live or left behind by a crash. The
+// valid records are those still in the ring, oldest first
+class FlightLog
+{
+public:
+  explicit FlightLog(const std::string & path);
+  FlightLog() = delete;
+  ~FlightLog();
+
+  FlightLog(const FlightLog &) = delete;
+  FlightLog & operator=(const FlightLog &) = delete;
+
+  size_t size() const {return records_.size();}
+  const FlightRecord & operator[](size_t i) const {return *records_[i];}
+
+  const FlightRecorderHeader & header() const {return *header_;}
+
+  // Records that were lost: overwritten by the ring or torn by a crash
+  uint64_t get_lost() const {return lost_;}
+
+  // CLOCK_REALTIME of a record
+  int64_t wall_clock_ns(const FlightRecord & record) const;
+
+protected:
+  int fd_{-1};
+  void * map_{nullptr};
+  size_t map_size_{0};
+
+  const FlightRecorderHeader * header_{nullptr};
+  std::vector<const FlightRecord *> records_;
+  uint64_t lost_{0};
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__FLIGHT_RECORDER_HPP_
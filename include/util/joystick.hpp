@@ -18,13 +18,17 @@
 #include <linux/joystick.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
+#include "util/flight_recorder.hpp"
+
 namespace jeronibot::util
 {
 
@@ -39,7 +43,14 @@ public:
   explicit Joystick(const std::string & device_name);
   Joystick();
 
-  ~Joystick();
+  // Read js_event records from an already open source, such as a pipe
+  // standing in for the device. The joystick closes fd
+  Joystick(int fd, uint8_t num_axes, uint8_t num_buttons);
+
+  virtual ~Joystick();
+
+  Joystick(const Joystick &) = delete;
+  Joystick & operator=(const Joystick &) = delete;
 
   uint8_t get_num_axes() { return num_axes_; };
   uint8_t get_num_buttons() { return num_buttons_; };
@@ -47,18 +58,68 @@ public:
   AxisState get_axis_state(uint8_t axis);
   void set_button_callback(uint8_t button, std::function<void(bool)> callback);
 
+  // Called on the input thread with an axis' new state whenever it moves.
+  // Setting another (or nullptr) waits for a call in progress to return
+  void set_axis_callback(std::function<void(uint8_t axis, AxisState state)> callback);
+
+  // Record a snapshot of the axes and buttons after every event. The
+  // recorder must outlive the joystick or be cleared first
+  void set_recorder(FlightRecorder * recorder);
+
+  // Number of events (for evdev, frames) applied so far
+  uint64_t get_num_events() const { return num_events_.load(std::memory_order_acquire); }
+
+  // When the event being applied happened, on the steady clock; for the
+  // callbacks, which run on the input thread
+  std::chrono::steady_clock::time_point get_event_time() const { return event_time_; }
+
+  // For an event loop of the caller's: stop the input thread, then call
+  // process_input() whenever get_fd() is readable. The callbacks then run
+  // on the caller's thread
+  void stop_input_thread() { stop(); }
+  int get_fd() const { return fd_; }
+  void process_input() { read_events(); }
+
+  // The axis and coordinate an axis event number updates; false if none
+  static bool axis_of_event(uint8_t number, uint8_t * axis, bool * is_y);
+
 protected:
+  // For backends that have to look at the device before the input thread
+  // starts; they call start() themselves, and stop() in their destructor
+  Joystick(int fd, uint8_t num_axes, uint8_t num_buttons, bool start_input);
+
+  // Read whatever is ready on fd_ and apply it, on the input thread
+  virtual void read_events();
+
+  // x and y of an axis are stored together, so a reader never sees half
+  // of an update that set both
+  static uint32_t pack(AxisState state);
+  static AxisState unpack(uint32_t packed);
+  void set_axis(uint8_t axis, AxisState state);
+  void set_button(uint8_t button, bool pressed);
+  void event_applied();
+
   int fd_{-1};
 
   uint8_t num_axes_{0};
   uint8_t num_buttons_{0};
 
-  struct XY { std::atomic<int16_t> x; std::atomic<int16_t> y; };
-  std::map<uint8_t, struct XY> axis_map_;
+  std::map<uint8_t, std::atomic<uint32_t>> axis_map_;
 
   std::map<uint8_t, std::function<void(int)>> button_map_;
 
+  std::mutex axis_callback_mutex_;
+  std::function<void(uint8_t, AxisState)> axis_callback_;
+  uint32_t buttons_{0};  // input thread only
+
+  std::atomic<FlightRecorder *> recorder_{nullptr};
+  void record_snapshot(FlightRecorder * recorder);
+
+  void start();
+  void stop();
   void input_thread_func();
+  std::chrono::steady_clock::time_point event_time_;  // input thread only
+  std::atomic<uint64_t> num_events_{0};
   std::atomic<bool> should_exit_{false};
   std::unique_ptr<std::thread> input_thread_;
 };
@@ -0,0 +1,159 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__LOGGER_HPP_
+#define UTIL__LOGGER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace jeronibot::util
+{
+
+enum class LogLevel : int
+{
+  Error,
+  Warn,
+  Info,
+  Debug,
+  Trace,
+};
+
+enum class LogComponent : uint8_t
+{
+  Bluetooth,
+  MiniPro,
+  Util,
+};
+
+// A fixed-size structured record. Fields that were not set are left out
+// of the formatted line. The event name must be a literal
+struct LogRecord
+{
+  static constexpr size_t max_device = 18;
+  static constexpr size_t max_text = 48;
+  static constexpr size_t max_data = 16;
+
+  std::chrono::system_clock::time_point time;
+  LogLevel level;
+  LogComponent component;
+  const char * event;
+
+  int32_t handle{-1};
+  int16_t opcode{-1};
+  int16_t status{-1};
+  int32_t length{-1};
+  int64_t latency_ns{-1};
+
+  uint8_t data_length{0};
+  char device[max_device]{};
+  char text[max_text]{};
+  uint8_t data[max_data];
+};
+
+// Another producer queue that the formatting thread drains, so that the
+// bt_log records of lib/bluez share its thread, threshold and sink. drain()
+// hands its records to Logger::write() and returns how many there were;
+// set_level() follows the threshold, -1 when logging is disabled
+struct LogSource
+{
+  unsigned int (*drain)();
+  void (*set_level)(int level);
+};
+
+// Records are copied into a bounded lock-free queue by the calling thread
+// and formatted by a background thread, so logging from the Bluetooth event
+// thread never waits on the terminal, a pipe or a file. When the queue is
+// full the record is dropped and counted. Built WITH_LOG4CXX, records go
+// to the "jeronibot.<component>" loggers unless a stream is given
+class Logger
+{
+public:
+  // Start the formatting thread and set the threshold. With no stream the
+  // records go to log4cxx, or to stderr without it. The first record logged
+  // starts the thread with the defaults if start() was never called
+  static bool start(LogLevel level = LogLevel::Info, FILE * stream = nullptr);
+
+  // Disable logging, write out what is queued and stop the thread. Until
+  // the next start(), records are dropped rather than restarting it
+  static void stop();
+
+  static void set_level(LogLevel level);
+
+  static bool enabled(LogLevel level)
+  {
+    return static_cast<int>(level) <= level_.load(std::memory_order_relaxed);
+  }
+
+  // Non-blocking; false if the record was dropped
+  static bool log(const LogRecord & record);
+
+  // Drain source on the formatting thread too, starting the thread as the
+  // first record would. There is room for one source
+  static bool attach(const LogSource & source);
+
+  // Write a line from the attached source; only called from its drain()
+  static void write(
+    LogLevel level, LogComponent component, std::chrono::system_clock::time_point time,
+    const char * text);
+
+  // Records dropped because the queue was full
+  static uint64_t get_dropped();
+
+  // Records, and lines from the attached source, written out so far
+  static uint64_t get_written();
+
+protected:
+  static inline std::atomic<int> level_{static_cast<int>(LogLevel::Info)};
+};
+
+// Builds a record in place and queues it when it goes out of scope, which
+// with LOG_RECORD is at the end of the statement:
+//
+//   LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "notify").handle(h).length(n);
+//
+class LogEntry
+{
+public:
+  LogEntry(LogLevel level, LogComponent component, const char * event);
+  ~LogEntry();
+
+  LogEntry(const LogEntry &) = delete;
+  LogEntry & operator=(const LogEntry &) = delete;
+
+  LogEntry & device(const std::string & address);
+  LogEntry & handle(uint16_t handle);
+  LogEntry & opcode(uint8_t opcode);
+  LogEntry & status(uint8_t status);
+  LogEntry & length(size_t length);
+  LogEntry & latency(std::chrono::nanoseconds latency);
+  LogEntry & latency_since(std::chrono::steady_clock::time_point start);
+  LogEntry & text(const char * text);
+  LogEntry & data(const uint8_t * data, size_t length);
+
+protected:
+  LogRecord record_;
+};
+
+}  // namespace jeronibot::util
+
+// The arguments are only evaluated when the level is enabled
+#define LOG_RECORD(level, component, event) \
+  if (!jeronibot::util::Logger::enabled(level)) {} else \
+    jeronibot::util::LogEntry(level, component, event)
+
+#endif  // UTIL__LOGGER_HPP_
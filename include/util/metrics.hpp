@@ -0,0 +1,174 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__METRICS_HPP_
+#define UTIL__METRICS_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace jeronibot::util
+{
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// Metrics are updated with relaxed atomics from any thread; only creating
+// one and exporting take the registry's lock
+class Counter
+{
+public:
+  void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+protected:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge
+{
+public:
+  void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+protected:
+  std::atomic<int64_t> value_{0};
+};
+
+// Durations counted into fixed buckets, each an upper bound
+class Histogram
+{
+public:
+  static constexpr size_t max_buckets = 16;
+
+  // 100 us to 1 s, roughly 1-2.5-5 per decade
+  static std::vector<std::chrono::nanoseconds> latency_buckets();
+
+  explicit Histogram(const std::vector<std::chrono::nanoseconds> & bounds);
+  Histogram() = delete;
+
+  void observe(std::chrono::nanoseconds value);
+
+  size_t get_num_buckets() const { return num_bounds_; }
+  std::chrono::nanoseconds get_bound(size_t i) const { return std::chrono::nanoseconds(bounds_[i]); }
+
+  // Observations in bucket i alone; bucket num_buckets is the overflow
+  uint64_t get_bucket_count(size_t i) const { return counts_[i].load(std::memory_order_relaxed); }
+  uint64_t get_count() const { return count_.load(std::memory_order_relaxed); }
+  std::chrono::nanoseconds get_sum() const
+  {
+    return std::chrono::nanoseconds(sum_.load(std::memory_order_relaxed));
+  }
+
+protected:
+  size_t num_bounds_{0};
+  int64_t bounds_[max_buckets];
+  std::atomic<uint64_t> counts_[max_buckets + 1]{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<int64_t> sum_{0};
+};
+
+// Named families of labeled metrics, written out in the Prometheus text
+// format. A metric lives as long as the registry, so references to it can
+// be kept and updated without a lookup
+class MetricsRegistry
+{
+public:
+  MetricsRegistry() = default;
+
+  MetricsRegistry(const MetricsRegistry &) = delete;
+  MetricsRegistry & operator=(const MetricsRegistry &) = delete;
+
+  // The registry the library's own metrics go to
+  static MetricsRegistry & get_default();
+
+  // Get, creating it the first time, the metric of a family with these
+  // labels. A name can only be used for one type of metric
+  Counter & counter(const std::string & name, const std::string & help, const MetricLabels & labels = {});
+  Gauge & gauge(const std::string & name, const std::string & help, const MetricLabels & labels = {});
+  Histogram & histogram(
+    const std::string & name, const std::string & help, const MetricLabels & labels = {},
+    const std::vector<std::chrono::nanoseconds> & bounds = Histogram::latency_buckets());
+
+  // Collectors run before each export, to sample values such as queue
+  // depths into gauges. They may take locks the updaters hold
+  unsigned int add_collector(std::function<void()> collector);
+  void remove_collector(unsigned int id);
+
+  void write_prometheus(std::ostream & out);
+
+  // Replace the file at path with the current values; false on error
+  bool write_file(const std::string & path);
+
+protected:
+  enum class Type { Counter, Gauge, Histogram };
+
+  struct Family
+  {
+    Type type;
+    std::string help;
+    std::map<std::string, std::shared_ptr<void>> metrics;  // by formatted labels
+  };
+
+  Family & family(const std::string & name, const std::string & help, Type type);
+  void collect();
+
+  std::mutex mutex_;
+  std::map<std::string, Family> families_;
+
+  std::mutex collectors_mutex_;
+  std::map<unsigned int, std::function<void()>> collectors_;
+  unsigned int next_collector_id_{1};
+};
+
+// Serves the registry on a unix stream socket: each connection gets the
+// current values and is closed, so "socat - UNIX-CONNECT:<path>" or a
+// node exporter textfile script can scrape on demand
+class MetricsExporter
+{
+public:
+  MetricsExporter(MetricsRegistry & registry, const std::string & socket_path);
+  MetricsExporter() = delete;
+  ~MetricsExporter();
+
+  MetricsExporter(const MetricsExporter &) = delete;
+  MetricsExporter & operator=(const MetricsExporter &) = delete;
+
+  uint64_t get_num_scrapes() const { return num_scrapes_.load(std::memory_order_relaxed); }
+
+protected:
+  void serve();
+
+  MetricsRegistry & registry_;
+  std::string socket_path_;
+  int fd_{-1};
+
+  std::atomic<uint64_t> num_scrapes_{0};
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__METRICS_HPP_
@@ -0,0 +1,87 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__REALTIME_HPP_
+#define UTIL__REALTIME_HPP_
+
+#include <sched.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace jeronibot::util
+{
+
+// The threads the library creates, and the app's control loop
+enum class ThreadRole
+{
+  BluetoothInput,    // LEClient's mainloop
+  JoystickInput,     // Joystick's input thread
+  TeleopSender,      // Teleop's sender thread
+  Scanner,           // LEScanner's input thread
+  Logger,            // the log formatting thread
+  MetricsExporter,   // MetricsExporter's socket thread
+  Control,           // TeleopLoop::run(), or the app's own loop calling apply()
+};
+
+struct ThreadProfile
+{
+  int policy{SCHED_OTHER};   // SCHED_FIFO or SCHED_RR for a real-time thread
+  int priority{0};           // 1 to 99 for SCHED_FIFO and SCHED_RR, 0 otherwise
+  std::vector<int> cpus;     // the CPUs the thread may run on; empty for any
+};
+
+// Scheduling for the library's threads. A profile set for a role before
+// its thread starts is applied by the thread itself as it starts, along
+// with the thread's name, so that the threads can be told apart in top and
+// perf; the main thread keeps the process's name. Threads also report how
+// late they get to run, to the default registry:
+//
+//   thread_wakeup_latency_seconds{thread}        past the deadline a timed wait woke up
+//   thread_run_delay_microseconds_total{thread}  runnable but waiting for a CPU (schedstat)
+//   thread_timeslices_total{thread}              times run on a CPU (schedstat)
+//   thread_profile_failures_total{thread}        profiles that couldn't be applied
+//
+// Real-time policies need CAP_SYS_NICE or an RLIMIT_RTPRIO, and locking
+// memory CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK. Without them the
+// threads run as they were; the failure is logged and counted
+class Realtime
+{
+public:
+  static void set_profile(ThreadRole role, const ThreadProfile & profile);
+  static ThreadProfile get_profile(ThreadRole role);
+
+  static const char * get_name(ThreadRole role);
+
+  // Lock the process's memory, now and as it grows, and keep malloc from
+  // giving memory back to the system, so that a control thread doesn't
+  // page fault. Each thread then prefaults stack_prefault bytes of its stack
+  // in apply(), the calling thread right away. False if mlockall failed
+  static bool lock_memory(size_t stack_prefault = 128 * 1024);
+  static bool is_memory_locked();
+
+  // On the thread itself: name it, apply its role's profile and, with
+  // memory locked, prefault its stack. False if the profile couldn't be
+  // applied in full
+  static bool apply(ThreadRole role);
+
+  // Called by a thread woken up from a timed wait for deadline, to record
+  // how late it is. Nothing is recorded on a thread that didn't apply()
+  static void observe_wakeup(std::chrono::steady_clock::time_point deadline);
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__REALTIME_HPP_
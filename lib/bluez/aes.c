@@ -0,0 +1,450 @@
+/**
+ * @file aes.c
+ * @brief userspace AES-128 and AES-CMAC for the bt_crypto layer
+ *
+ * Two implementations are provided: a portable byte-oriented one and one
+ * using the x86 AES-NI instructions, picked at runtime through CPUID. Both
+ * share the same expanded key layout, so a key can be switched between them
+ * without re-expanding it.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <byteswap.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AESNI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "aes.h"
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t rcon[10] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+};
+
+static inline uint8_t xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0x00);
+}
+
+static void expand_key(const uint8_t key[16], uint8_t rk[11][16])
+{
+	uint8_t *w = &rk[0][0];
+	int i;
+
+	memcpy(w, key, 16);
+
+	for (i = 16; i < 176; i += 4) {
+		uint8_t t0 = w[i - 4], t1 = w[i - 3];
+		uint8_t t2 = w[i - 2], t3 = w[i - 1];
+
+		if (i % 16 == 0) {
+			uint8_t tmp = t0;
+
+			t0 = sbox[t1] ^ rcon[i / 16 - 1];
+			t1 = sbox[t2];
+			t2 = sbox[t3];
+			t3 = sbox[tmp];
+		}
+
+		w[i + 0] = w[i - 16] ^ t0;
+		w[i + 1] = w[i - 15] ^ t1;
+		w[i + 2] = w[i - 14] ^ t2;
+		w[i + 3] = w[i - 13] ^ t3;
+	}
+}
+
+static inline void add_round_key(uint8_t s[16], const uint8_t k[16])
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		s[i] ^= k[i];
+}
+
+/* SubBytes and ShiftRows in one pass: row r rotates left by r columns */
+static inline void sub_shift(uint8_t s[16])
+{
+	uint8_t t[16];
+	int c, r;
+
+	for (c = 0; c < 4; c++)
+		for (r = 0; r < 4; r++)
+			t[c * 4 + r] = sbox[s[((c + r) % 4) * 4 + r]];
+
+	memcpy(s, t, 16);
+}
+
+static inline void mix_columns(uint8_t s[16])
+{
+	int c;
+
+	for (c = 0; c < 16; c += 4) {
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+		uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+		s[c + 0] = a0 ^ all ^ xtime(a0 ^ a1);
+		s[c + 1] = a1 ^ all ^ xtime(a1 ^ a2);
+		s[c + 2] = a2 ^ all ^ xtime(a2 ^ a3);
+		s[c + 3] = a3 ^ all ^ xtime(a3 ^ a0);
+	}
+}
+
+static void generic_encrypt(const struct bt_aes128 *aes, const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint8_t s[16];
+	int round;
+
+	memcpy(s, in, 16);
+	add_round_key(s, aes->round_keys[0]);
+
+	for (round = 1; round < 10; round++) {
+		sub_shift(s);
+		mix_columns(s);
+		add_round_key(s, aes->round_keys[round]);
+	}
+
+	sub_shift(s);
+	add_round_key(s, aes->round_keys[10]);
+
+	memcpy(out, s, 16);
+}
+
+static void generic_cbc_mac(const struct bt_aes128 *aes, const uint8_t *msg,
+					size_t num_blocks, uint8_t state[16])
+{
+	while (num_blocks--) {
+		add_round_key(state, msg);
+		generic_encrypt(aes, state, state);
+		msg += 16;
+	}
+}
+
+#ifdef HAVE_AESNI
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+#define AESNI_ROUNDS(b, k) do {					\
+	int __r;						\
+	b = _mm_xor_si128(b, k[0]);				\
+	for (__r = 1; __r < 10; __r++)				\
+		b = _mm_aesenc_si128(b, k[__r]);		\
+	b = _mm_aesenclast_si128(b, k[10]);			\
+} while (0)
+
+AESNI_TARGET static void aesni_load_keys(const struct bt_aes128 *aes,
+								__m128i k[11])
+{
+	int i;
+
+	for (i = 0; i < 11; i++)
+		k[i] = _mm_load_si128((const __m128i *) aes->round_keys[i]);
+}
+
+AESNI_TARGET static void aesni_encrypt_blocks(const struct bt_aes128 *aes,
+						const uint8_t *in, uint8_t *out,
+						size_t num_blocks)
+{
+	__m128i k[11];
+	int r;
+
+	aesni_load_keys(aes, k);
+
+	/* Four independent blocks keep the AES unit pipeline busy */
+	for (; num_blocks >= 4; num_blocks -= 4, in += 64, out += 64) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *) (in + 0));
+		__m128i b1 = _mm_loadu_si128((const __m128i *) (in + 16));
+		__m128i b2 = _mm_loadu_si128((const __m128i *) (in + 32));
+		__m128i b3 = _mm_loadu_si128((const __m128i *) (in + 48));
+
+		b0 = _mm_xor_si128(b0, k[0]);
+		b1 = _mm_xor_si128(b1, k[0]);
+		b2 = _mm_xor_si128(b2, k[0]);
+		b3 = _mm_xor_si128(b3, k[0]);
+
+		for (r = 1; r < 10; r++) {
+			b0 = _mm_aesenc_si128(b0, k[r]);
+			b1 = _mm_aesenc_si128(b1, k[r]);
+			b2 = _mm_aesenc_si128(b2, k[r]);
+			b3 = _mm_aesenc_si128(b3, k[r]);
+		}
+
+		_mm_storeu_si128((__m128i *) (out + 0),
+					_mm_aesenclast_si128(b0, k[10]));
+		_mm_storeu_si128((__m128i *) (out + 16),
+					_mm_aesenclast_si128(b1, k[10]));
+		_mm_storeu_si128((__m128i *) (out + 32),
+					_mm_aesenclast_si128(b2, k[10]));
+		_mm_storeu_si128((__m128i *) (out + 48),
+					_mm_aesenclast_si128(b3, k[10]));
+	}
+
+	for (; num_blocks; num_blocks--, in += 16, out += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *) in);
+
+		AESNI_ROUNDS(b, k);
+		_mm_storeu_si128((__m128i *) out, b);
+	}
+}
+
+AESNI_TARGET static void aesni_cbc_mac(const struct bt_aes128 *aes,
+					const uint8_t *msg, size_t num_blocks,
+					uint8_t state[16])
+{
+	__m128i k[11];
+	__m128i s;
+
+	aesni_load_keys(aes, k);
+
+	s = _mm_loadu_si128((const __m128i *) state);
+
+	for (; num_blocks; num_blocks--, msg += 16) {
+		s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *) msg));
+		AESNI_ROUNDS(s, k);
+	}
+
+	_mm_storeu_si128((__m128i *) state, s);
+}
+
+static bool cpu_has_aesni(void)
+{
+	static int cached = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (cached < 0) {
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			cached = 0;
+		else
+			cached = (ecx & bit_AES) ? 1 : 0;
+	}
+
+	return cached;
+}
+#endif
+
+bool bt_aes_impl_supported(enum bt_aes_impl impl)
+{
+	switch (impl) {
+	case BT_AES_IMPL_GENERIC:
+		return true;
+	case BT_AES_IMPL_AESNI:
+#ifdef HAVE_AESNI
+		return cpu_has_aesni();
+#else
+		return false;
+#endif
+	}
+
+	return false;
+}
+
+/**
+ * expand key for the given implementation
+ *
+ * @param aes	context to fill
+ * @param impl	implementation to use for this key
+ * @param key	128-bit key in AES byte order
+ * @return		false if impl is not available on this machine
+ */
+bool bt_aes128_init(struct bt_aes128 *aes, enum bt_aes_impl impl,
+						const uint8_t key[16])
+{
+	if (!aes || !bt_aes_impl_supported(impl))
+		return false;
+
+	aes->impl = impl;
+	expand_key(key, aes->round_keys);
+
+	return true;
+}
+
+void bt_aes128_encrypt_blocks(const struct bt_aes128 *aes, const uint8_t *in,
+						uint8_t *out, size_t num_blocks)
+{
+#ifdef HAVE_AESNI
+	if (aes->impl == BT_AES_IMPL_AESNI) {
+		aesni_encrypt_blocks(aes, in, out, num_blocks);
+		return;
+	}
+#endif
+
+	for (; num_blocks; num_blocks--, in += 16, out += 16)
+		generic_encrypt(aes, in, out);
+}
+
+void bt_aes128_encrypt(const struct bt_aes128 *aes, const uint8_t in[16],
+							uint8_t out[16])
+{
+	bt_aes128_encrypt_blocks(aes, in, out, 1);
+}
+
+static void cbc_mac(const struct bt_aes128 *aes, const uint8_t *msg,
+					size_t num_blocks, uint8_t state[16])
+{
+#ifdef HAVE_AESNI
+	if (aes->impl == BT_AES_IMPL_AESNI) {
+		aesni_cbc_mac(aes, msg, num_blocks, state);
+		return;
+	}
+#endif
+
+	generic_cbc_mac(aes, msg, num_blocks, state);
+}
+
+/* Multiply by x in GF(2^128), RFC 4493 section 2.3; in and out may alias */
+static void cmac_dbl(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t carry = in[0] & 0x80;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	out[15] = in[15] << 1;
+
+	if (carry)
+		out[15] ^= 0x87;
+}
+
+/**
+ * AES-CMAC as specified by RFC 4493
+ *
+ * @param aes		expanded key
+ * @param msg		message, may be NULL when msg_len is 0
+ * @param msg_len	message length in bytes, no upper limit
+ * @param mac		128-bit tag
+ */
+void bt_aes128_cmac(const struct bt_aes128 *aes, const uint8_t *msg,
+						size_t msg_len, uint8_t mac[16])
+{
+	uint8_t subkey[16], last[16], state[16];
+	size_t num_blocks, rest;
+	bool complete;
+
+	memset(state, 0, sizeof(state));
+
+	/* K1 = dbl(E(K, 0)), K2 = dbl(K1) */
+	bt_aes128_encrypt(aes, state, subkey);
+	cmac_dbl(subkey, subkey);
+
+	num_blocks = (msg_len + 15) / 16;
+	complete = num_blocks && (msg_len % 16 == 0);
+	if (!num_blocks)
+		num_blocks = 1;
+
+	if (!complete)
+		cmac_dbl(subkey, subkey);
+
+	cbc_mac(aes, msg, num_blocks - 1, state);
+
+	rest = msg_len - (num_blocks - 1) * 16;
+	memset(last, 0, sizeof(last));
+	if (rest)
+		memcpy(last, msg + (num_blocks - 1) * 16, rest);
+
+	if (!complete)
+		last[rest] = 0x80;
+
+	add_round_key(last, subkey);
+	add_round_key(state, last);
+
+	bt_aes128_encrypt(aes, state, mac);
+}
+
+/**
+ * reverse the byte order of a buffer (Bluetooth LSB first <-> AES MSB first)
+ *
+ * Works a word at a time from the front of src into the back of dst; src
+ * and dst must not overlap.
+ *
+ * @param src	source buffer
+ * @param dst	destination buffer
+ * @param len	number of bytes
+ */
+void bt_aes_swap_buf(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	size_t i;
+
+#ifdef __SSSE3__
+	const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					8, 9, 10, 11, 12, 13, 14, 15);
+
+	for (; len >= 16; len -= 16, src += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) src);
+
+		_mm_storeu_si128((__m128i *) (dst + len - 16),
+						_mm_shuffle_epi8(v, rev));
+	}
+#endif
+
+	for (; len >= 8; len -= 8, src += 8) {
+		uint64_t v;
+
+		memcpy(&v, src, 8);
+		v = bswap_64(v);
+		memcpy(dst + len - 8, &v, 8);
+	}
+
+	for (i = 0; i < len; i++)
+		dst[len - 1 - i] = src[i];
+}
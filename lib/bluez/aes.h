@@ -0,0 +1,54 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Userspace AES-128 block cipher and AES-CMAC, used by crypto.c in place of
+ * the kernel AF_ALG sockets. All keys and blocks are in AES (FIPS-197) byte
+ * order; the Bluetooth MSB/LSB swapping stays with the callers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum bt_aes_impl {
+	BT_AES_IMPL_GENERIC,
+	BT_AES_IMPL_AESNI,
+};
+
+struct bt_aes128 {
+	uint8_t round_keys[11][16] __attribute__((aligned(16)));
+	enum bt_aes_impl impl;
+};
+
+bool bt_aes_impl_supported(enum bt_aes_impl impl);
+
+bool bt_aes128_init(struct bt_aes128 *aes, enum bt_aes_impl impl,
+						const uint8_t key[16]);
+
+void bt_aes128_encrypt(const struct bt_aes128 *aes, const uint8_t in[16],
+							uint8_t out[16]);
+void bt_aes128_encrypt_blocks(const struct bt_aes128 *aes, const uint8_t *in,
+						uint8_t *out, size_t num_blocks);
+
+void bt_aes128_cmac(const struct bt_aes128 *aes, const uint8_t *msg,
+						size_t msg_len, uint8_t mac[16]);
+
+void bt_aes_swap_buf(const uint8_t *src, uint8_t *dst, size_t len);
@@ -31,17 +31,26 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* recvmmsg() */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "io.h"
 #include "queue.h"
 #include "util.h"
+#include "log.h"
 #include "timeout.h"
 #include "bluetooth.h"
 #include "uuid.h"
@@ -52,6 +61,10 @@
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
 #define ATT_TIMEOUT_INTERVAL		30000  /* 30000 ms */
+#define ATT_RX_BATCH_DEFAULT		16     /* PDUs read per receive call */
+#define ATT_RX_MAX_ROUNDS		4      /* receive calls per wakeup */
+#define ATT_TX_BATCH			16     /* PDUs passed to one send call */
+#define ATT_OP_INLINE_PDU		32     /* PDUs up to this size are kept in the op */
 
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
@@ -90,10 +103,37 @@ struct bt_att {
 	struct queue *disconn_list;
 	/// There's a pending incoming request
 	bool in_req;
-	/// buffer pointer
+	/// receive buffer: rx_batch slots of buf_mtu bytes each
 	uint8_t *buf;
+	/// MTU and batch size the receive buffer was sized for
+	uint16_t buf_mtu;
+	unsigned int buf_batch;
 	/// actual number of bytes for pdu ATT exchange
 	uint16_t mtu;
+	/// maximum number of PDUs read per receive call
+	unsigned int rx_batch;
+	/// receive descriptors, one per buffer slot
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iov;
+	/// true if fd is a socket (non-blocking receive is available)
+	bool io_socket;
+	/// true if the socket keeps message boundaries (recvmmsg/sendmmsg)
+	bool io_mmsg;
+	/// read and write wakeups and the PDUs moved by them
+	struct bt_att_io_stats stats;
+	/// high-water marks of the send queues
+	unsigned int max_req;
+	unsigned int max_write;
+	unsigned int max_ind;
+	/// send ops kept for reuse, linked through next_free
+	struct att_send_op *free_ops;
+	unsigned int num_free_ops;
+	/// number of ops kept, set by bt_att_preallocate()
+	unsigned int max_free_ops;
+	/// metrics callback: PDUs sent and received, response times
+	bt_att_metrics_func_t metrics_callback;
+	bt_att_destroy_func_t metrics_destroy;
+	void *metrics_data;
 	/// IDs for "send" ops
 	unsigned int next_send_id;
 	/// IDs for registered callbacks
@@ -213,9 +253,17 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 	return 0;
 }
 
+struct timeout_data {
+	struct bt_att *att;
+	unsigned int id;
+};
+
 struct att_send_op {
+	struct bt_att *att;
 	unsigned int id;
 	unsigned int timeout_id;
+	/// handed to the timeout of a request or indication
+	struct timeout_data timeout;
 	enum att_op_type type;
 	uint16_t opcode;
 	void *pdu;
@@ -223,8 +271,83 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	/// when bt_att_send() queued it, if metrics were enabled; else 0
+	uint64_t queued_ns;
+	/// next op in att->free_ops
+	struct att_send_op *next_free;
+	/// pdu points here when the PDU fits
+	uint8_t pdu_buf[ATT_OP_INLINE_PDU];
 };
 
+static uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void metric(struct bt_att *att, int type, uint8_t opcode,
+							uint64_t value)
+{
+	if (att->metrics_callback)
+		att->metrics_callback(type, opcode, value, att->metrics_data);
+}
+
+/**
+ * Take a zeroed op, a kept one if there is any.
+ *
+ * @param att		ATT context
+ * @return		the op, or NULL on allocation failure
+ */
+static struct att_send_op *alloc_att_send_op(struct bt_att *att)
+{
+	struct att_send_op *op = att->free_ops;
+
+	if (!op)
+		op = malloc(sizeof(*op));
+	else {
+		att->free_ops = op->next_free;
+		att->num_free_ops--;
+	}
+
+	if (!op)
+		return NULL;
+
+	/* The PDU buffer is written before it is read */
+	memset(op, 0, offsetof(struct att_send_op, pdu_buf));
+	op->att = att;
+
+	return op;
+}
+
+static void free_pdu(struct att_send_op *op)
+{
+	if (op->pdu != op->pdu_buf)
+		free(op->pdu);
+
+	op->pdu = NULL;
+}
+
+/**
+ * Keep an op for reuse while fewer than max_free_ops are kept, or free it.
+ *
+ * @param op		the op, its PDU already freed
+ */
+static void release_att_send_op(struct att_send_op *op)
+{
+	struct bt_att *att = op->att;
+
+	if (att->num_free_ops < att->max_free_ops) {
+		op->next_free = att->free_ops;
+		att->free_ops = op;
+		att->num_free_ops++;
+		return;
+	}
+
+	free(op);
+}
+
 /**
  * @brief destroy att send operation
  * calls the destroy callback with user_data as an argument
@@ -242,8 +365,8 @@ static void destroy_att_send_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->pdu);
-	free(op);
+	free_pdu(op);
+	release_att_send_op(op);
 }
 
 static void cancel_att_send_op(struct att_send_op *op)
@@ -325,7 +448,10 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 		return false;
 
 	op->len = pdu_len;
-	op->pdu = malloc(op->len);
+	if (pdu_len <= sizeof(op->pdu_buf))
+		op->pdu = op->pdu_buf;
+	else
+		op->pdu = malloc(op->len);
 	if (!op->pdu)
 		return false;
 
@@ -347,7 +473,7 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 					"ATT unable to generate signature");
 
 fail:
-	free(op->pdu);
+	free_pdu(op);
 	return false;
 }
 
@@ -382,7 +508,7 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	if (!callback && (op_type == ATT_OP_TYPE_REQ || op_type == ATT_OP_TYPE_IND))
 		return NULL;
 
-	op = new0(struct att_send_op, 1);
+	op = alloc_att_send_op(att);
 	if (!op)
 		return NULL;
 
@@ -393,7 +519,7 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	op->user_data = user_data;
 
 	if (!encode_pdu(att, op, pdu, length)) {
-		free(op);
+		release_att_send_op(op);
 		return NULL;
 	}
 
@@ -430,11 +556,6 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	return NULL;
 }
 
-struct timeout_data {
-	struct bt_att *att;
-	unsigned int id;
-};
-
 static bool timeout_cb(void *user_data)
 {
 	struct timeout_data *timeout = user_data;
@@ -478,37 +599,22 @@ static void write_watch_destroy(void *user_data)
 	att->writer_active = false;
 }
 
-static bool can_write_data(struct io *io, void *user_data)
+/**
+ * Finish an op that has been written to the socket: requests and
+ * indications wait for their response, everything else is done.
+ *
+ * @param att		ATT context
+ * @param op		the op
+ * @param len		number of bytes written
+ */
+static void op_sent(struct bt_att *att, struct att_send_op *op, ssize_t len)
 {
-	struct bt_att *att = user_data;
-	struct att_send_op *op;
-	struct timeout_data *timeout;
-	ssize_t ret;
-	struct iovec iov;
-
-	op = pick_next_send_op(att);
-	if (!op)
-		return false;
-
-	iov.iov_base = op->pdu;
-	iov.iov_len = op->len;
-
-	ret = io_send(io, &iov, 1);
-	if (ret < 0) {
-		util_debug(att->debug_callback, att->debug_data,
-					"write failed: %s", strerror(-ret));
-		if (op->callback)
-			op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
-							op->user_data);
-
-		destroy_att_send_op(op);
-		return true;
-	}
-
 	util_debug(att->debug_callback, att->debug_data,
 					"ATT op 0x%02x", op->opcode);
 
-	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
+	util_hexdump('<', op->pdu, len, att->debug_callback, att->debug_data);
+	bt_log_hexdump(BT_LOG_TRACE, '<', op->pdu, len);
+	metric(att, BT_ATT_METRIC_PDU_SENT, op->opcode, len);
 
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
@@ -531,20 +637,192 @@ static bool can_write_data(struct io *io, void *user_data)
 	case ATT_OP_TYPE_UNKNOWN:
 	default:
 		destroy_att_send_op(op);
-		return true;
+		return;
 	}
 
-	timeout = new0(struct timeout_data, 1);
-	if (!timeout)
-		return true;
-
-	timeout->att = att;
-	timeout->id = op->id;
+	/* Removed before the op is destroyed, so the op can hold the data */
+	op->timeout.att = att;
+	op->timeout.id = op->id;
 	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+							&op->timeout, NULL);
+}
 
-	/* Return true as there may be more operations ready to write. */
-	return true;
+/**
+ * Fail an op that could not be written.
+ *
+ * @param att		ATT context
+ * @param op		the op
+ * @param err		negative errno
+ */
+static void op_failed(struct bt_att *att, struct att_send_op *op, int err)
+{
+	util_debug(att->debug_callback, att->debug_data,
+					"write failed: %s", strerror(-err));
+	if (op->callback)
+		op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0, op->user_data);
+
+	destroy_att_send_op(op);
+}
+
+/**
+ * Put an op that was picked but not sent back at the head of its queue.
+ *
+ * @param att		ATT context
+ * @param op		the op
+ */
+static void requeue_op(struct bt_att *att, struct att_send_op *op)
+{
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+		queue_push_head(att->req_queue, op);
+		break;
+	case ATT_OP_TYPE_IND:
+		queue_push_head(att->ind_queue, op);
+		break;
+	default:
+		queue_push_head(att->write_queue, op);
+		break;
+	}
+}
+
+/**
+ * Pick up to ATT_TX_BATCH ops that can be sent back to back. A request
+ * or indication ends the batch, since the next one may only be picked
+ * once it is pending.
+ *
+ * @param att		ATT context
+ * @param ops		picked ops, in send order
+ * @return		number of ops picked
+ */
+static int pick_send_batch(struct bt_att *att, struct att_send_op **ops)
+{
+	int count = 0;
+
+	while (count < ATT_TX_BATCH) {
+		struct att_send_op *op = pick_next_send_op(att);
+
+		if (!op)
+			break;
+
+		ops[count++] = op;
+
+		if (op->type == ATT_OP_TYPE_REQ || op->type == ATT_OP_TYPE_IND)
+			break;
+	}
+
+	return count;
+}
+
+/**
+ * Send a batch of ops, one PDU each.
+ *
+ * @param att		ATT context
+ * @param ops		ops to send
+ * @param count		number of ops
+ * @param sent		set to the number of bytes written for each op sent
+ * @return		number of ops sent, or a negative errno if none were
+ */
+static int send_batch(struct bt_att *att, struct att_send_op **ops,
+						int count, ssize_t *sent)
+{
+	struct mmsghdr msgs[ATT_TX_BATCH];
+	struct iovec iov[ATT_TX_BATCH];
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = ops[i]->pdu;
+		iov[i].iov_len = ops[i]->len;
+	}
+
+	/* Sockets that keep message boundaries take the batch in one call */
+	if (att->io_mmsg) {
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (i = 0; i < count; i++) {
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		do {
+			ret = sendmmsg(att->fd, msgs, count, MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0 && errno == ENOSYS) {
+			att->io_mmsg = false;
+		} else if (ret < 0) {
+			return -errno;
+		} else {
+			for (i = 0; i < ret; i++)
+				sent[i] = msgs[i].msg_len;
+			return ret;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = io_send(att->io, &iov[i], 1);
+		if (ret < 0)
+			return i ? i : ret;
+
+		sent[i] = ret;
+	}
+
+	return count;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+	struct att_send_op *ops[ATT_TX_BATCH];
+	ssize_t sent[ATT_TX_BATCH];
+	bool more = false;
+	int count, ret, i;
+
+	bt_att_ref(att);
+	att->stats.tx_wakeups++;
+
+	/*
+	 * Keep writing until nothing is ready or the socket is full, so that
+	 * queued commands go out in one wakeup rather than one epoll cycle
+	 * and write handler toggle each.
+	 */
+	while ((count = pick_send_batch(att, ops)) > 0) {
+		ret = send_batch(att, ops, count, sent);
+
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			/* Wait for the next EPOLLOUT with the batch requeued */
+			for (i = count - 1; i >= 0; i--)
+				requeue_op(att, ops[i]);
+
+			more = true;
+			break;
+		}
+
+		if (ret < 0) {
+			op_failed(att, ops[0], ret);
+			for (i = count - 1; i > 0; i--)
+				requeue_op(att, ops[i]);
+			continue;
+		}
+
+		for (i = count - 1; i >= ret; i--)
+			requeue_op(att, ops[i]);
+
+		att->stats.tx_pdus += ret;
+
+		for (i = 0; i < ret; i++)
+			op_sent(att, ops[i], sent[i]);
+
+		/* A short send means the socket is full */
+		if (ret < count) {
+			more = true;
+			break;
+		}
+	}
+
+	bt_att_unref(att);
+
+	/* Returning false drops the write handler until wakeup_writer() */
+	return more;
 }
 
 static void wakeup_writer(struct bt_att *att)
@@ -714,6 +992,11 @@ fail:
 	rsp_opcode = BT_ATT_OP_ERROR_RSP;
 
 done:
+	/* Not stamped if the callback was set while the request was queued */
+	if (att->metrics_callback && op->queued_ns)
+		metric(att, BT_ATT_METRIC_RESPONSE, op->opcode,
+					metrics_now() - op->queued_ns);
+
 	if (op->callback)
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
@@ -860,39 +1143,38 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	bt_att_unref(att);
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+/**
+ * Dispatch one received PDU.
+ *
+ * @param att		ATT context
+ * @param pdu		the PDU, opcode first
+ * @param len		number of bytes in the PDU
+ * @return		false if the bearer was shut down
+ */
+static bool dispatch_pdu(struct bt_att *att, uint8_t *pdu, ssize_t len)
 {
-	struct bt_att *att = user_data;
 	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t bytes_read;
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
-	if (bytes_read < 0)
-		return false;
+	util_hexdump('>', pdu, len, att->debug_callback, att->debug_data);
+	bt_log_hexdump(BT_LOG_TRACE, '>', pdu, len);
 
-	util_hexdump('>', att->buf, bytes_read,
-					att->debug_callback, att->debug_data);
-
-	if (bytes_read < ATT_MIN_PDU_LEN)
+	if (len < ATT_MIN_PDU_LEN)
 		return true;
 
-	pdu = att->buf;
 	opcode = pdu[0];
-
-	bt_att_ref(att);
+	metric(att, BT_ATT_METRIC_PDU_RECEIVED, opcode, len);
 
 	/* Act on the received PDU based on the opcode type */
 	switch (get_op_type(opcode)) {
 	case ATT_OP_TYPE_RSP:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT response received: 0x%02x", opcode);
-		handle_rsp(att, opcode, pdu + 1, bytes_read - 1);
+		handle_rsp(att, opcode, pdu + 1, len - 1);
 		break;
 	case ATT_OP_TYPE_CONF:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT confirmation received: 0x%02x", opcode);
-		handle_conf(att, pdu + 1, bytes_read - 1);
+		handle_conf(att, pdu + 1, len - 1);
 		break;
 	case ATT_OP_TYPE_REQ:
 		/*
@@ -905,7 +1187,6 @@ static bool can_read_data(struct io *io, void *user_data)
 					"Received request while another is "
 					"pending: 0x%02x", opcode);
 			io_shutdown(att->io);
-			bt_att_unref(att);
 
 			return false;
 		}
@@ -923,15 +1204,185 @@ static bool can_read_data(struct io *io, void *user_data)
 		 */
 		util_debug(att->debug_callback, att->debug_data,
 					"ATT PDU received: 0x%02x", opcode);
-		handle_notify(att, opcode, pdu + 1, bytes_read - 1);
+		handle_notify(att, opcode, pdu + 1, len - 1);
 		break;
 	}
 
-	bt_att_unref(att);
+	return true;
+}
+
+/**
+ * (Re)size the receive buffers for the current MTU and batch size.
+ * Only called between batches, as handlers may change the MTU while
+ * PDUs in the buffer are being dispatched.
+ *
+ * @param att		ATT context
+ * @return		false on allocation failure
+ */
+static bool alloc_rx_buffers(struct bt_att *att)
+{
+	uint8_t *buf;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	unsigned int i;
+
+	if (att->buf && att->buf_mtu == att->mtu &&
+					att->buf_batch == att->rx_batch)
+		return true;
+
+	buf = malloc((size_t) att->mtu * att->rx_batch);
+	msgs = new0(struct mmsghdr, att->rx_batch);
+	iov = new0(struct iovec, att->rx_batch);
+
+	if (!buf || !msgs || !iov) {
+		free(buf);
+		free(msgs);
+		free(iov);
+		return false;
+	}
+
+	for (i = 0; i < att->rx_batch; i++) {
+		iov[i].iov_base = buf + (size_t) i * att->mtu;
+		iov[i].iov_len = att->mtu;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	free(att->buf);
+	free(att->rx_msgs);
+	free(att->rx_iov);
+
+	att->buf = buf;
+	att->buf_mtu = att->mtu;
+	att->buf_batch = att->rx_batch;
+	att->rx_msgs = msgs;
+	att->rx_iov = iov;
 
 	return true;
 }
 
+/**
+ * Read up to rx_batch PDUs without blocking.
+ *
+ * @param att		ATT context
+ * @return		number of PDUs read, 0 if none are queued, -1 on error
+ */
+static int receive_batch(struct bt_att *att)
+{
+	unsigned int count = 0;
+	ssize_t len;
+	int ret;
+
+	/* Sockets that keep message boundaries: one system call for all */
+	if (att->io_mmsg) {
+		do {
+			ret = recvmmsg(att->fd, att->rx_msgs, att->buf_batch,
+							MSG_DONTWAIT, NULL);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0 && errno == ENOSYS) {
+			att->io_mmsg = false;
+		} else if (ret < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		} else {
+			return ret;
+		}
+	}
+
+	/* Other sockets: one PDU per call until the queue is empty */
+	while (count < att->buf_batch) {
+		struct iovec *iov = &att->rx_iov[count];
+
+		if (att->io_socket)
+			len = recv(att->fd, iov->iov_base, iov->iov_len,
+								MSG_DONTWAIT);
+		else
+			len = read(att->fd, iov->iov_base, iov->iov_len);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (count || errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		att->rx_msgs[count++].msg_len = len;
+
+		/* Without a non-blocking receive, a second read could block */
+		if (!att->io_socket || len == 0)
+			break;
+	}
+
+	return count;
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+	unsigned int round;
+	int count, i;
+	unsigned int max_rounds;
+	bool ok = true;
+
+	bt_att_ref(att);
+
+	/*
+	 * Drain what has queued up since the last wakeup, so that a burst
+	 * of notifications costs one epoll round trip rather than one each.
+	 * The number of rounds is bounded to keep other sources serviced.
+	 */
+	max_rounds = att->rx_batch > 1 ? ATT_RX_MAX_ROUNDS : 1;
+	att->stats.rx_wakeups++;
+
+	for (round = 0; ok && round < max_rounds; round++) {
+		if (!alloc_rx_buffers(att)) {
+			ok = false;
+			break;
+		}
+
+		count = receive_batch(att);
+		if (count < 0) {
+			/* Fail only if nothing was read; else retry next wakeup */
+			ok = round > 0;
+			break;
+		}
+
+		if (count == 0)
+			break;
+
+		att->stats.rx_pdus += count;
+
+		for (i = 0; i < count && ok; i++)
+			ok = dispatch_pdu(att, att->buf + (size_t) i * att->buf_mtu,
+						att->rx_msgs[i].msg_len);
+
+		if ((unsigned int) count < att->buf_batch)
+			break;
+	}
+
+	bt_att_unref(att);
+
+	return ok;
+}
+
+/**
+ * Find out how the fd can be read in batches.
+ *
+ * @param att		ATT context
+ */
+static void probe_io_socket(struct bt_att *att)
+{
+	int type = 0;
+	socklen_t len = sizeof(type);
+
+	if (getsockopt(att->fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return;
+
+	att->io_socket = true;
+	att->io_mmsg = type == SOCK_SEQPACKET || type == SOCK_DGRAM;
+}
+
 static bool is_io_l2cap_based(int fd)
 {
 	int domain;
@@ -959,6 +1410,9 @@ static bool is_io_l2cap_based(int fd)
 
 static void bt_att_free(struct bt_att *att)
 {
+	/* Ops destroyed from here on are freed */
+	att->max_free_ops = 0;
+
 	if (att->pending_req)
 		destroy_att_send_op(att->pending_req);
 
@@ -980,10 +1434,22 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
+	if (att->metrics_destroy)
+		att->metrics_destroy(att->metrics_data);
+
 	free(att->local_sign);
 	free(att->remote_sign);
 
 	free(att->buf);
+	free(att->rx_msgs);
+	free(att->rx_iov);
+
+	while (att->free_ops) {
+		struct att_send_op *op = att->free_ops;
+
+		att->free_ops = op->next_free;
+		free(op);
+	}
 
 	free(att);
 }
@@ -1002,10 +1468,12 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	att->fd = fd;
 	att->ext_signed = ext_signed;
 	att->mtu = BT_ATT_DEFAULT_LE_MTU;
-	att->buf = malloc(att->mtu);
-	if (!att->buf)
+	att->rx_batch = ATT_RX_BATCH_DEFAULT;
+	if (!alloc_rx_buffers(att))
 		goto fail;
 
+	probe_io_socket(att);
+
 	att->io = io_new(fd);
 	if (!att->io)
 		goto fail;
@@ -1118,22 +1586,151 @@ uint16_t bt_att_get_mtu(struct bt_att *att)
 
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 {
-	void *buf;
-
 	if (!att)
 		return false;
 
 	if (mtu < BT_ATT_DEFAULT_LE_MTU)
 		return false;
 
-	buf = malloc(mtu);
-	if (!buf)
+	/*
+	 * This is usually called from a response handler while the receive
+	 * buffer is in use; it is resized before the next read instead.
+	 */
+	att->mtu = mtu;
+
+	return true;
+}
+
+/**
+ * Set the maximum number of PDUs read from the socket per receive call.
+ * A batch size of 1 reads a single PDU per wakeup.
+ *
+ * @param att		ATT context
+ * @param max_pdus	batch size
+ * @return		true if OK
+ */
+bool bt_att_set_rx_batch(struct bt_att *att, unsigned int max_pdus)
+{
+	if (!att || !max_pdus)
 		return false;
 
-	free(att->buf);
+	/* Reallocated before the next read, never while PDUs are dispatched */
+	att->rx_batch = max_pdus;
 
-	att->mtu = mtu;
-	att->buf = buf;
+	return true;
+}
+
+unsigned int bt_att_get_rx_batch(struct bt_att *att)
+{
+	if (!att)
+		return 0;
+
+	return att->rx_batch;
+}
+
+/**
+ * Allocate send ops and queue entries up front and keep them for reuse,
+ * so that with up to count PDUs queued or pending at a time, and PDUs of
+ * up to ATT_OP_INLINE_PDU bytes, sending doesn't allocate.
+ *
+ * @param att		ATT context
+ * @param count		number of ops to keep
+ * @return		false on allocation failure
+ */
+bool bt_att_preallocate(struct bt_att *att, unsigned int count)
+{
+	if (!att)
+		return false;
+
+	att->max_free_ops = count;
+
+	while (att->num_free_ops < count) {
+		struct att_send_op *op = malloc(sizeof(*op));
+
+		if (!op)
+			return false;
+
+		op->att = att;
+		release_att_send_op(op);
+	}
+
+	while (att->num_free_ops > count) {
+		struct att_send_op *op = att->free_ops;
+
+		att->free_ops = op->next_free;
+		att->num_free_ops--;
+		free(op);
+	}
+
+	return queue_reserve(att->req_queue, count) &&
+			queue_reserve(att->ind_queue, count) &&
+			queue_reserve(att->write_queue, count);
+}
+
+/**
+ * Get the number of read and write wakeups and the PDUs moved by them.
+ *
+ * @param att		ATT context
+ * @param stats		filled in with the counters
+ * @return		true if OK
+ */
+bool bt_att_get_io_stats(struct bt_att *att, struct bt_att_io_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->stats;
+
+	return true;
+}
+
+/**
+ * Get the depths of the request, write and indication queues and their
+ * high-water marks.
+ *
+ * @param att		ATT context
+ * @param stats		filled in with the depths
+ * @return		true if OK
+ */
+bool bt_att_get_queue_stats(struct bt_att *att,
+					struct bt_att_queue_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	stats->req = queue_length(att->req_queue);
+	stats->write = queue_length(att->write_queue);
+	stats->ind = queue_length(att->ind_queue);
+	stats->max_req = att->max_req;
+	stats->max_write = att->max_write;
+	stats->max_ind = att->max_ind;
+	stats->pending = !!att->pending_req + !!att->pending_ind;
+
+	return true;
+}
+
+/**
+ * Report every PDU sent and received, and the time from bt_att_send() to
+ * the response of each request. The callback runs on the loop's thread.
+ *
+ * @param att		ATT context
+ * @param callback	called for each event, NULL to stop
+ * @param user_data	passed to callback
+ * @param destroy	called with user_data when replaced or on unref
+ * @return		true if OK
+ */
+bool bt_att_set_metrics_cb(struct bt_att *att, bt_att_metrics_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy)
+{
+	if (!att)
+		return false;
+
+	if (att->metrics_destroy)
+		att->metrics_destroy(att->metrics_data);
+
+	att->metrics_callback = callback;
+	att->metrics_destroy = destroy;
+	att->metrics_data = user_data;
 
 	return true;
 }
@@ -1238,13 +1835,20 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 
 	op->id = att->next_send_id++;
 
+	if (att->metrics_callback)
+		op->queued_ns = metrics_now();
+
 	/* Add the op to the correct queue based on its type */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
 		result = queue_push_tail(att->req_queue, op);
+		if (queue_length(att->req_queue) > att->max_req)
+			att->max_req = queue_length(att->req_queue);
 		break;
 	case ATT_OP_TYPE_IND:
 		result = queue_push_tail(att->ind_queue, op);
+		if (queue_length(att->ind_queue) > att->max_ind)
+			att->max_ind = queue_length(att->ind_queue);
 		break;
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
@@ -1253,12 +1857,14 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	case ATT_OP_TYPE_CONF:
 	default:
 		result = queue_push_tail(att->write_queue, op);
+		if (queue_length(att->write_queue) > att->max_write)
+			att->max_write = queue_length(att->write_queue);
 		break;
 	}
 
 	if (!result) {
-		free(op->pdu);
-		free(op);
+		free_pdu(op);
+		release_att_send_op(op);
 		return 0;
 	}
 
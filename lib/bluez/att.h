@@ -51,12 +51,50 @@ typedef void (*bt_att_timeout_func_t)(unsigned int id, uint8_t opcode,
 typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
 typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
 
+/* Events passed to bt_att_metrics_func_t, with what value holds */
+#define BT_ATT_METRIC_PDU_SENT		0	/* PDU length */
+#define BT_ATT_METRIC_PDU_RECEIVED	1	/* PDU length */
+#define BT_ATT_METRIC_RESPONSE		2	/* ns since bt_att_send() */
+
+typedef void (*bt_att_metrics_func_t)(int metric, uint8_t opcode,
+					uint64_t value, void *user_data);
+
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
+bool bt_att_set_rx_batch(struct bt_att *att, unsigned int max_pdus);
+unsigned int bt_att_get_rx_batch(struct bt_att *att);
+
+bool bt_att_preallocate(struct bt_att *att, unsigned int count);
+
+struct bt_att_io_stats {
+	uint64_t rx_wakeups;
+	uint64_t rx_pdus;
+	uint64_t tx_wakeups;
+	uint64_t tx_pdus;
+};
+
+bool bt_att_get_io_stats(struct bt_att *att, struct bt_att_io_stats *stats);
+
+struct bt_att_queue_stats {
+	unsigned int req;
+	unsigned int write;
+	unsigned int ind;
+	unsigned int max_req;
+	unsigned int max_write;
+	unsigned int max_ind;
+	unsigned int pending;	/* requests and indications sent, not answered */
+};
+
+bool bt_att_get_queue_stats(struct bt_att *att,
+					struct bt_att_queue_stats *stats);
+
+bool bt_att_set_metrics_cb(struct bt_att *att, bt_att_metrics_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy);
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
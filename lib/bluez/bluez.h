@@ -11,4 +11,5 @@ extern "C" {
 #include "queue.h"
 #include "gatt-db.h"
 #include "gatt-client.h"
+#include "log.h"
 }
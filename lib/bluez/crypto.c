@@ -40,6 +40,7 @@
 #include <sys/socket.h>
 
 #include "util.h"
+#include "aes.h"
 #include "crypto.h"
 
 #ifndef HAVE_LINUX_IF_ALG_H
@@ -89,6 +90,7 @@ struct bt_crypto {
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
+	enum bt_crypto_backend backend;
 };
 
 /**
@@ -155,6 +157,14 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
+/**
+ * create a crypto context
+ *
+ * The userspace AES backend is selected by default, so no AF_ALG sockets are
+ * opened unless BT_CRYPTO_BACKEND_AF_ALG is requested later.
+ *
+ * @return	crypto context or NULL if /dev/urandom cannot be opened
+ */
 struct bt_crypto *bt_crypto_new(void)
 {
 	struct bt_crypto *crypto;
@@ -163,28 +173,110 @@ struct bt_crypto *bt_crypto_new(void)
 	if (!crypto)
 		return NULL;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
-		free(crypto);
-		return NULL;
-	}
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
 
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
+	bt_crypto_set_backend(crypto, BT_CRYPTO_BACKEND_AUTO);
+
+	return bt_crypto_ref(crypto);
+}
+
+static void alg_close(struct bt_crypto *crypto)
+{
+	if (crypto->ecb_aes >= 0)
 		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
+
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
+
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
+}
+
+/**
+ * select where AES-ECB and AES-CMAC are computed
+ *
+ * BT_CRYPTO_BACKEND_AUTO resolves to AES-NI when the CPU supports it and to
+ * the portable implementation otherwise. Selecting AF_ALG opens the kernel
+ * sockets; leaving it closes them.
+ *
+ * @param crypto	crypto context
+ * @param backend	requested backend
+ * @return		false if the backend is not available, the previous
+ *			backend is kept in that case
+ */
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend)
+{
+	if (!crypto)
+		return false;
+
+	switch (backend) {
+	case BT_CRYPTO_BACKEND_AUTO:
+		if (bt_aes_impl_supported(BT_AES_IMPL_AESNI))
+			backend = BT_CRYPTO_BACKEND_AESNI;
+		else
+			backend = BT_CRYPTO_BACKEND_GENERIC;
+		break;
+	case BT_CRYPTO_BACKEND_AESNI:
+		if (!bt_aes_impl_supported(BT_AES_IMPL_AESNI))
+			return false;
+		break;
+	case BT_CRYPTO_BACKEND_GENERIC:
+		break;
+	case BT_CRYPTO_BACKEND_AF_ALG:
+		if (crypto->ecb_aes < 0)
+			crypto->ecb_aes = ecb_aes_setup();
+
+		if (crypto->cmac_aes < 0)
+			crypto->cmac_aes = cmac_aes_setup();
+
+		if (crypto->ecb_aes < 0 || crypto->cmac_aes < 0) {
+			if (crypto->backend != BT_CRYPTO_BACKEND_AF_ALG)
+				alg_close(crypto);
+			return false;
+		}
+
+		crypto->backend = backend;
+		return true;
+	default:
+		return false;
 	}
 
-	return bt_crypto_ref(crypto);
+	alg_close(crypto);
+	crypto->backend = backend;
+
+	return true;
+}
+
+enum bt_crypto_backend bt_crypto_get_backend(struct bt_crypto *crypto)
+{
+	if (!crypto)
+		return BT_CRYPTO_BACKEND_AUTO;
+
+	return crypto->backend;
+}
+
+static bool use_af_alg(struct bt_crypto *crypto)
+{
+	return crypto->backend == BT_CRYPTO_BACKEND_AF_ALG;
+}
+
+static bool aes_setup(struct bt_crypto *crypto, struct bt_aes128 *aes,
+						const uint8_t key_msb[16])
+{
+	enum bt_aes_impl impl = BT_AES_IMPL_GENERIC;
+
+	if (crypto->backend == BT_CRYPTO_BACKEND_AESNI)
+		impl = BT_AES_IMPL_AESNI;
+
+	return bt_aes128_init(aes, impl, key_msb);
 }
 
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
@@ -206,8 +298,7 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+	alg_close(crypto);
 
 	free(crypto);
 }
@@ -277,10 +368,7 @@ static bool alg_encrypt(int fd, const void *inbuf, size_t inlen,
 
 static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 {
-	int i;
-
-	for (i = 0; i < len; i++)
-		dst[len - 1 - i] = src[i];
+	bt_aes_swap_buf(src, dst, len);
 }
 
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
@@ -306,13 +394,23 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
+	/* Swap msg before signing */
+	swap_buf(msg, msg_s, msg_len);
+
+	if (!use_af_alg(crypto)) {
+		struct bt_aes128 aes;
+
+		if (!aes_setup(crypto, &aes, tmp))
+			return false;
+
+		bt_aes128_cmac(&aes, msg_s, msg_len, out);
+		goto done;
+	}
+
 	fd = alg_new(crypto->cmac_aes, tmp, 16);
 	if (fd < 0)
 		return false;
 
-	/* Swap msg before signing */
-	swap_buf(msg, msg_s, msg_len);
-
 	len = send(fd, msg_s, msg_len, 0);
 	if (len < 0) {
 		close(fd);
@@ -327,6 +425,8 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 
 	close(fd);
 
+done:
+
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
 	 * be placed in the signature
@@ -368,24 +468,32 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
-
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
+	if (!use_af_alg(crypto)) {
+		struct bt_aes128 aes;
+
+		if (!aes_setup(crypto, &aes, tmp))
+			return false;
+
+		bt_aes128_encrypt(&aes, in, out);
+	} else {
+		fd = alg_new(crypto->ecb_aes, tmp, 16);
+		if (fd < 0)
+			return false;
+
+		if (!alg_encrypt(fd, in, 16, out, 16)) {
+			close(fd);
+			return false;
+		}
+
 		close(fd);
-		return false;
 	}
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -599,11 +707,24 @@ static bool aes_cmac(struct bt_crypto *crypto, uint8_t key[16], uint8_t *msg,
 		return false;
 
 	swap_buf(key, key_msb, 16);
+	swap_buf(msg, msg_msb, msg_len);
+
+	if (!use_af_alg(crypto)) {
+		struct bt_aes128 aes;
+
+		if (!aes_setup(crypto, &aes, key_msb))
+			return false;
+
+		bt_aes128_cmac(&aes, msg_msb, msg_len, out);
+		swap_buf(out, res, 16);
+
+		return true;
+	}
+
 	fd = alg_new(crypto->cmac_aes, key_msb, 16);
 	if (fd < 0)
 		return false;
 
-	swap_buf(msg, msg_msb, msg_len);
 	len = send(fd, msg_msb, msg_len, 0);
 	if (len < 0) {
 		close(fd);
@@ -26,11 +26,23 @@
 
 struct bt_crypto;
 
+/* Where AES-ECB and AES-CMAC are computed */
+enum bt_crypto_backend {
+	BT_CRYPTO_BACKEND_AUTO,		/* best userspace implementation */
+	BT_CRYPTO_BACKEND_AF_ALG,	/* kernel crypto API sockets */
+	BT_CRYPTO_BACKEND_GENERIC,	/* portable userspace AES */
+	BT_CRYPTO_BACKEND_AESNI,	/* userspace AES using AES-NI */
+};
+
 struct bt_crypto *bt_crypto_new(void);
 
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto);
 void bt_crypto_unref(struct bt_crypto *crypto);
 
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend);
+enum bt_crypto_backend bt_crypto_get_backend(struct bt_crypto *crypto);
+
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					uint8_t *buf, uint8_t num_bytes);
 
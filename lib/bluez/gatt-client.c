@@ -35,6 +35,7 @@
 #include "uuid.h"
 #include "gatt-helpers.h"
 #include "util.h"
+#include "log.h"
 #include "queue.h"
 #include "gatt-db.h"
 #include "gatt-client.h"
@@ -120,6 +121,11 @@ struct bt_gatt_client {
 	 * id to an ATT request id.
 	 */
 	unsigned int next_request_id;
+	struct request *free_requests;
+	/**< Requests kept for reuse, linked through next_free */
+	unsigned int num_free_requests;
+	unsigned int max_free_requests;
+	/**< Number of requests kept, set by bt_gatt_client_preallocate() */
 	struct bt_gatt_request *discovery_req;
 	unsigned int mtu_req_id;
 };
@@ -148,6 +154,8 @@ struct request {
 	/**< reference to the data exchanged during the request */
 	void (*destroy)(void *);
 	/**< function called when data structure need to be released (ref_count reaches 0) */
+	struct request *next_free;
+	/**< next request in client->free_requests */
 };
 
 static struct request *request_ref(struct request *req)
@@ -161,9 +169,16 @@ static struct request *request_create(struct bt_gatt_client *client)
 {
 	struct request *req;
 
-	req = new0(struct request, 1);
-	if (!req)
-		return NULL;
+	if (client->free_requests) {
+		req = client->free_requests;
+		client->free_requests = req->next_free;
+		client->num_free_requests--;
+		memset(req, 0, sizeof(*req));
+	} else {
+		req = new0(struct request, 1);
+		if (!req)
+			return NULL;
+	}
 
 	if (client->next_request_id < 1)
 		client->next_request_id = 1;
@@ -185,8 +200,22 @@ static void request_unref(void *data)
 	if (req->destroy)
 		req->destroy(req->data);
 
-	if (!req->removed)
-		queue_remove(req->client->pending_requests, req);
+	/*
+	 * A removed request may outlive its client; one that isn't is kept
+	 * for reuse if there is room
+	 */
+	if (!req->removed) {
+		struct bt_gatt_client *client = req->client;
+
+		queue_remove(client->pending_requests, req);
+
+		if (client->num_free_requests < client->max_free_requests) {
+			req->next_free = client->free_requests;
+			client->free_requests = req;
+			client->num_free_requests++;
+			return;
+		}
+	}
 
 	free(req);
 }
@@ -1667,12 +1696,9 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 
 	queue_foreach(client->notify_list, notify_handler, &pdu_data);
 
-	if (opcode == BT_ATT_OP_HANDLE_VAL_NOT) {
-		printf("notify_cb: Received Value Notification (BT_ATT_OP_HANDLE_VAL_NOT)\n");
-		util_hexdump('<', pdu, length, (util_debug_func_t) printf, NULL);
-		printf("\n");
-		fflush(stdout);
-	}
+	bt_log(BT_LOG_DEBUG, "notify_cb: opcode 0x%02x, %u bytes", opcode,
+								length);
+	bt_log_hexdump(BT_LOG_DEBUG, '<', pdu, length);
 
 	if (opcode == BT_ATT_OP_HANDLE_VAL_IND)
 		bt_att_send(client->att, BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0,
@@ -1693,6 +1719,9 @@ static void notify_data_cleanup(void *data)
 
 static void bt_gatt_client_free(struct bt_gatt_client *client)
 {
+	/* Requests released from here on are freed */
+	client->max_free_requests = 0;
+
 	bt_gatt_client_cancel_all(client);
 
 	queue_destroy(client->notify_list, notify_data_cleanup);
@@ -1717,6 +1746,13 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
 	queue_destroy(client->pending_requests, request_unref);
 
+	while (client->free_requests) {
+		struct request *req = client->free_requests;
+
+		client->free_requests = req->next_free;
+		free(req);
+	}
+
 	free(client);
 }
 
@@ -1877,6 +1913,47 @@ bool bt_gatt_client_set_debug(struct bt_gatt_client *client,
 	return true;
 }
 
+/**
+ * Allocate requests, the entries that track them and the ATT send ops
+ * behind them up front, and keep them for reuse. With up to count
+ * requests in flight at a time, writes without response and the
+ * confirmations of indications don't allocate.
+ *
+ * @param client	GATT client
+ * @param count		number of requests to keep
+ * @return		false on allocation failure
+ */
+bool bt_gatt_client_preallocate(struct bt_gatt_client *client,
+							unsigned int count)
+{
+	if (!client || !client->att)
+		return false;
+
+	client->max_free_requests = count;
+
+	while (client->num_free_requests < count) {
+		struct request *req = new0(struct request, 1);
+
+		if (!req)
+			return false;
+
+		req->next_free = client->free_requests;
+		client->free_requests = req;
+		client->num_free_requests++;
+	}
+
+	while (client->num_free_requests > count) {
+		struct request *req = client->free_requests;
+
+		client->free_requests = req->next_free;
+		client->num_free_requests--;
+		free(req);
+	}
+
+	return queue_reserve(client->pending_requests, count) &&
+				bt_att_preallocate(client->att, count);
+}
+
 uint16_t bt_gatt_client_get_mtu(struct bt_gatt_client *client)
 {
 	if (!client || !client->att)
@@ -2185,6 +2262,8 @@ struct read_long_op {
 	uint16_t value_handle;
 	uint16_t offset;
 	struct iovec iov;
+	size_t capacity;
+	bool user_buffer;
 	bt_gatt_client_read_callback_t callback;
 	void *user_data;
 	bt_gatt_client_destroy_func_t destroy;
@@ -2197,24 +2276,50 @@ static void destroy_read_long_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->iov.iov_base);
+	if (!op->user_buffer)
+		free(op->iov.iov_base);
+
 	free(op);
 }
 
+/*
+ * The buffer at least doubles whenever it has to grow, so a value read as
+ * n blobs is copied O(n) times in total rather than once per blob. A
+ * caller-supplied buffer never grows; the value is truncated to fit it.
+ */
 static bool append_chunk(struct read_long_op *op, const uint8_t *data,
 								uint16_t len)
 {
-	void *buf;
+	size_t needed;
 
 	/* Truncate if the data would exceed maximum length */
 	if (op->offset + len > BT_ATT_MAX_VALUE_LEN)
 		len = BT_ATT_MAX_VALUE_LEN - op->offset;
 
-	buf = realloc(op->iov.iov_base, op->iov.iov_len + len);
-	if (!buf)
-		return false;
+	needed = op->iov.iov_len + len;
+
+	if (needed > op->capacity && op->user_buffer) {
+		len = op->capacity - op->iov.iov_len;
+		needed = op->capacity;
+	}
+
+	if (needed > op->capacity) {
+		size_t capacity = op->capacity ? op->capacity * 2 : len * 4;
+		void *buf;
+
+		if (capacity > BT_ATT_MAX_VALUE_LEN)
+			capacity = BT_ATT_MAX_VALUE_LEN;
+
+		if (capacity < needed)
+			capacity = needed;
+
+		buf = realloc(op->iov.iov_base, capacity);
+		if (!buf)
+			return false;
 
-	op->iov.iov_base = buf;
+		op->iov.iov_base = buf;
+		op->capacity = capacity;
+	}
 
 	memcpy(op->iov.iov_base + op->iov.iov_len, data, len);
 
@@ -2254,6 +2359,9 @@ static void read_long_cb(uint8_t opcode, const void *pdu,
 	if (op->offset >= BT_ATT_MAX_VALUE_LEN)
 		goto success;
 
+	if (op->user_buffer && op->iov.iov_len == op->capacity)
+		goto success;
+
 	if (length >= bt_att_get_mtu(op->client->att) - 1) {
 		uint8_t pdu[4];
 
@@ -2283,8 +2391,9 @@ done:
 						op->iov.iov_len, op->user_data);
 }
 
-unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
+static unsigned int read_long_value(struct bt_gatt_client *client,
 					uint16_t value_handle, uint16_t offset,
+					uint8_t *buf, size_t size,
 					bt_gatt_client_read_callback_t callback,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy)
@@ -2310,6 +2419,13 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	op->value_handle = value_handle;
 	op->offset = offset;
 	op->callback = callback;
+
+	if (buf) {
+		op->iov.iov_base = buf;
+		op->capacity = size;
+		op->user_buffer = true;
+	}
+
 	op->user_data = user_data;
 	op->destroy = destroy;
 
@@ -2332,6 +2448,31 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	return req->id;
 }
 
+unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	return read_long_value(client, value_handle, offset, NULL, 0,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_gatt_client_read_long_value_into(
+					struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					uint8_t *buf, size_t size,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	if (!buf || !size)
+		return 0;
+
+	return read_long_value(client, value_handle, offset, buf, size,
+					callback, user_data, destroy);
+}
+
 unsigned int bt_gatt_client_write_without_response(
 					struct bt_gatt_client *client,
 					uint16_t value_handle,
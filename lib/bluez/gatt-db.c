@@ -31,6 +31,8 @@
  */
 
 #include <stdbool.h>
+#include <limits.h>
+#include <string.h>
 #include <errno.h>
 
 #include "bluetooth.h"
@@ -47,7 +49,10 @@
 
 #define MAX_CHAR_DECL_VALUE_LEN 19
 #define MAX_INCLUDED_VALUE_LEN 6
+#define ATTRIBUTE_INLINE_VALUE_LEN MAX_CHAR_DECL_VALUE_LEN
 #define ATTRIBUTE_TIMEOUT 5000
+#define UUID_ID_NONE UINT_MAX
+#define UUID_HASH_MIN_SIZE 64
 
 static const bt_uuid_t primary_service_uuid = { .type = BT_UUID16,
 					.value.u16 = GATT_PRIM_SVC_UUID };
@@ -61,7 +66,25 @@ static const bt_uuid_t included_service_uuid = { .type = BT_UUID16,
 struct gatt_db {
 	int ref_count;
 	uint16_t next_handle;
-	struct queue *services;
+
+	/* Sorted by start handle; service handle ranges never overlap */
+	struct gatt_db_service **services;
+	unsigned int num_services;
+	unsigned int max_services;
+
+	/*
+	 * Interned UUIDs: every attribute type and service UUID is converted
+	 * to its 128-bit form once, when it enters the database, and from then
+	 * on is identified by its index in uuids. uuid_hash maps the 128-bit
+	 * form to that index (open addressing, index + 1, 0 for empty), and
+	 * uuid_attrs heads the list of attributes of each type.
+	 */
+	uint128_t *uuids;
+	struct gatt_db_attribute **uuid_attrs;
+	unsigned int num_uuids;
+	unsigned int max_uuids;
+	unsigned int *uuid_hash;
+	unsigned int uuid_hash_size;
 
 	struct queue *notify_list;
 	unsigned int next_notify_id;
@@ -95,6 +118,9 @@ struct gatt_db_attribute {
 	struct gatt_db_service *service;
 	uint16_t handle;
 	bt_uuid_t uuid;
+	unsigned int uuid_id;
+	struct gatt_db_attribute *uuid_next;
+	struct gatt_db_attribute *uuid_prev;
 	uint32_t permissions;
 	uint16_t value_len;
 	uint8_t *value;
@@ -103,11 +129,15 @@ struct gatt_db_attribute {
 	gatt_db_write_t write_func;
 	void *user_data;
 
+	/* Created on the first read or write through read_func or write_func */
 	unsigned int read_id;
 	struct queue *pending_reads;
 
 	unsigned int write_id;
 	struct queue *pending_writes;
+
+	/* value points here when it fits, as every declaration's does */
+	uint8_t inline_value[ATTRIBUTE_INLINE_VALUE_LEN];
 };
 
 struct gatt_db_service {
@@ -115,9 +145,176 @@ struct gatt_db_service {
 	bool active;
 	bool claimed;
 	uint16_t num_handles;
-	struct gatt_db_attribute **attributes;
+	unsigned int uuid_id;
+	/*
+	 * One slot per handle, allocated with the service; a slot not in use
+	 * has a NULL service. Attributes don't move while the service lives.
+	 */
+	struct gatt_db_attribute *attributes;
 };
 
+static unsigned int uuid_hash(const uint128_t *u128)
+{
+	uint64_t hi, lo;
+
+	memcpy(&hi, &u128->data[0], sizeof(hi));
+	memcpy(&lo, &u128->data[8], sizeof(lo));
+
+	hi = (hi ^ (lo * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+
+	return (unsigned int) (hi ^ (hi >> 32));
+}
+
+static unsigned int uuid_find(struct gatt_db *db, const uint128_t *u128,
+							unsigned int *slot)
+{
+	unsigned int mask = db->uuid_hash_size - 1;
+	unsigned int i, entry;
+
+	if (!db->uuid_hash_size)
+		return UUID_ID_NONE;
+
+	for (i = uuid_hash(u128) & mask; (entry = db->uuid_hash[i]);
+							i = (i + 1) & mask) {
+		if (!memcmp(&db->uuids[entry - 1], u128, sizeof(*u128)))
+			return entry - 1;
+	}
+
+	if (slot)
+		*slot = i;
+
+	return UUID_ID_NONE;
+}
+
+static bool uuid_grow(struct gatt_db *db)
+{
+	unsigned int size, i, j, mask;
+	unsigned int *hash;
+
+	if (db->num_uuids == db->max_uuids) {
+		unsigned int max = db->max_uuids ? db->max_uuids * 2 :
+							UUID_HASH_MIN_SIZE / 2;
+		uint128_t *uuids;
+		struct gatt_db_attribute **attrs;
+
+		uuids = realloc(db->uuids, max * sizeof(*uuids));
+		if (!uuids)
+			return false;
+
+		db->uuids = uuids;
+
+		attrs = realloc(db->uuid_attrs, max * sizeof(*attrs));
+		if (!attrs)
+			return false;
+
+		db->uuid_attrs = attrs;
+		db->max_uuids = max;
+	}
+
+	/* Keep the hash at most half full */
+	if ((db->num_uuids + 1) * 2 <= db->uuid_hash_size)
+		return true;
+
+	size = db->uuid_hash_size ? db->uuid_hash_size * 2 :
+							UUID_HASH_MIN_SIZE;
+	hash = new0(unsigned int, size);
+	if (!hash)
+		return false;
+
+	mask = size - 1;
+
+	for (i = 0; i < db->num_uuids; i++) {
+		for (j = uuid_hash(&db->uuids[i]) & mask; hash[j];
+							j = (j + 1) & mask)
+			;
+		hash[j] = i + 1;
+	}
+
+	free(db->uuid_hash);
+	db->uuid_hash = hash;
+	db->uuid_hash_size = size;
+
+	return true;
+}
+
+/*
+ * Return the interned id of uuid, or UUID_ID_NONE if no attribute or
+ * service in the database ever had it
+ */
+static unsigned int uuid_lookup(struct gatt_db *db, const bt_uuid_t *uuid)
+{
+	bt_uuid_t u128;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+
+	return uuid_find(db, &u128.value.u128, NULL);
+}
+
+static unsigned int uuid_intern(struct gatt_db *db, const bt_uuid_t *uuid)
+{
+	bt_uuid_t u128;
+	unsigned int id, slot;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+
+	id = uuid_find(db, &u128.value.u128, NULL);
+	if (id != UUID_ID_NONE)
+		return id;
+
+	if (!uuid_grow(db))
+		return UUID_ID_NONE;
+
+	uuid_find(db, &u128.value.u128, &slot);
+
+	id = db->num_uuids++;
+	db->uuids[id] = u128.value.u128;
+	db->uuid_attrs[id] = NULL;
+	db->uuid_hash[slot] = id + 1;
+
+	return id;
+}
+
+static bool index_attribute(struct gatt_db *db,
+					struct gatt_db_attribute *attribute)
+{
+	struct gatt_db_attribute *head;
+	unsigned int id;
+
+	id = uuid_intern(db, &attribute->uuid);
+	if (id == UUID_ID_NONE)
+		return false;
+
+	head = db->uuid_attrs[id];
+
+	attribute->uuid_id = id;
+	attribute->uuid_prev = NULL;
+	attribute->uuid_next = head;
+	if (head)
+		head->uuid_prev = attribute;
+
+	db->uuid_attrs[id] = attribute;
+
+	return true;
+}
+
+static void unindex_attribute(struct gatt_db_attribute *attribute)
+{
+	struct gatt_db *db = attribute->service->db;
+
+	if (attribute->uuid_id == UUID_ID_NONE)
+		return;
+
+	if (attribute->uuid_prev)
+		attribute->uuid_prev->uuid_next = attribute->uuid_next;
+	else
+		db->uuid_attrs[attribute->uuid_id] = attribute->uuid_next;
+
+	if (attribute->uuid_next)
+		attribute->uuid_next->uuid_prev = attribute->uuid_prev;
+
+	attribute->uuid_id = UUID_ID_NONE;
+}
+
 static void pending_read_result(struct pending_read *p, int err,
 					const uint8_t *data, size_t length)
 {
@@ -153,49 +350,92 @@ static void pending_write_free(void *data)
 	pending_write_result(p, -ECANCELED);
 }
 
+/* The attribute in a service slot, NULL if the slot is not in use */
+static struct gatt_db_attribute *
+service_attribute(const struct gatt_db_service *service, int index)
+{
+	struct gatt_db_attribute *attribute = &service->attributes[index];
+
+	return attribute->service ? attribute : NULL;
+}
+
+static void free_value(struct gatt_db_attribute *attribute)
+{
+	if (attribute->value != attribute->inline_value)
+		free(attribute->value);
+
+	attribute->value = NULL;
+	attribute->value_len = 0;
+}
+
+/*
+ * Grow a value stored in the db to len bytes, keeping its contents and
+ * zeroing the bytes added. It moves out of the attribute once it doesn't fit.
+ */
+static bool grow_value(struct gatt_db_attribute *attribute, size_t len)
+{
+	uint8_t *value;
+
+	if (len <= ATTRIBUTE_INLINE_VALUE_LEN) {
+		value = attribute->inline_value;
+	} else if (attribute->value == attribute->inline_value) {
+		value = malloc(len);
+		if (!value)
+			return false;
+
+		memcpy(value, attribute->inline_value, attribute->value_len);
+	} else {
+		value = realloc(attribute->value, len);
+		if (!value)
+			return false;
+	}
+
+	memset(value + attribute->value_len, 0, len - attribute->value_len);
+
+	attribute->value = value;
+	attribute->value_len = len;
+
+	return true;
+}
+
+/* Empties the attribute's slot */
 static void attribute_destroy(struct gatt_db_attribute *attribute)
 {
 	/* Attribute was not initialized by user */
-	if (!attribute)
+	if (!attribute->service)
 		return;
 
+	unindex_attribute(attribute);
+
 	queue_destroy(attribute->pending_reads, pending_read_free);
 	queue_destroy(attribute->pending_writes, pending_write_free);
 
-	free(attribute->value);
-	free(attribute);
+	free_value(attribute);
+	memset(attribute, 0, sizeof(*attribute));
 }
 
 static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
+							int index,
 							uint16_t handle,
 							const bt_uuid_t *type,
 							const uint8_t *val,
 							uint16_t len)
 {
-	struct gatt_db_attribute *attribute;
-
-	attribute = new0(struct gatt_db_attribute, 1);
-	if (!attribute)
-		return NULL;
+	struct gatt_db_attribute *attribute = &service->attributes[index];
 
 	attribute->service = service;
 	attribute->handle = handle;
 	attribute->uuid = *type;
-	attribute->value_len = len;
+	attribute->uuid_id = UUID_ID_NONE;
 	if (len) {
-		attribute->value = malloc0(len);
-		if (!attribute->value)
+		if (!grow_value(attribute, len))
 			goto failed;
 
 		memcpy(attribute->value, val, len);
 	}
 
-	attribute->pending_reads = queue_new();
-	if (!attribute->pending_reads)
-		goto failed;
-
-	attribute->pending_writes = queue_new();
-	if (!attribute->pending_reads)
+	/* The service declaration is indexed once the service is inserted */
+	if (service->db && !index_attribute(service->db, attribute))
 		goto failed;
 
 	return attribute;
@@ -223,15 +463,8 @@ struct gatt_db *gatt_db_new(void)
 	if (!db)
 		return NULL;
 
-	db->services = queue_new();
-	if (!db->services) {
-		free(db);
-		return NULL;
-	}
-
 	db->notify_list = queue_new();
 	if (!db->notify_list) {
-		queue_destroy(db->services, NULL);
 		free(db);
 		return NULL;
 	}
@@ -284,7 +517,7 @@ static void notify_service_changed(struct gatt_db *db,
 	if (queue_isempty(db->notify_list))
 		return;
 
-	data.attr = service->attributes[0];
+	data.attr = &service->attributes[0];
 	data.added = added;
 
 	gatt_db_ref(db);
@@ -303,12 +536,142 @@ static void gatt_db_service_destroy(void *data)
 		notify_service_changed(service->db, service, false);
 
 	for (i = 0; i < service->num_handles; i++)
-		attribute_destroy(service->attributes[i]);
+		attribute_destroy(&service->attributes[i]);
 
 	free(service->attributes);
 	free(service);
 }
 
+static void gatt_db_service_get_handles(const struct gatt_db_service *service,
+							uint16_t *start_handle,
+							uint16_t *end_handle)
+{
+	if (start_handle)
+		*start_handle = service->attributes[0].handle;
+
+	if (end_handle)
+		*end_handle = service->attributes[0].handle +
+						service->num_handles - 1;
+}
+
+/**
+ * Find the first service that ends at or after a handle.
+ *
+ * @param db		database
+ * @param handle	attribute handle
+ * @return		index into db->services, num_services if none
+ */
+static unsigned int service_lower_bound(struct gatt_db *db, uint16_t handle)
+{
+	unsigned int lo = 0, hi = db->num_services;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		uint16_t end;
+
+		gatt_db_service_get_handles(db->services[mid], NULL, &end);
+
+		if (end < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static struct gatt_db_service *find_service_for_handle(struct gatt_db *db,
+							uint16_t handle)
+{
+	unsigned int i = service_lower_bound(db, handle);
+	uint16_t start;
+
+	if (i == db->num_services)
+		return NULL;
+
+	gatt_db_service_get_handles(db->services[i], &start, NULL);
+
+	return start <= handle ? db->services[i] : NULL;
+}
+
+static bool services_insert(struct gatt_db *db, unsigned int index,
+					struct gatt_db_service *service)
+{
+	if (db->num_services == db->max_services) {
+		unsigned int max = db->max_services ? db->max_services * 2 : 8;
+		struct gatt_db_service **services;
+
+		services = realloc(db->services, max * sizeof(*services));
+		if (!services)
+			return false;
+
+		db->services = services;
+		db->max_services = max;
+	}
+
+	memmove(&db->services[index + 1], &db->services[index],
+			(db->num_services - index) * sizeof(*db->services));
+	db->services[index] = service;
+	db->num_services++;
+
+	return true;
+}
+
+static void services_remove(struct gatt_db *db, unsigned int index,
+							unsigned int count)
+{
+	memmove(&db->services[index], &db->services[index + count],
+		(db->num_services - index - count) * sizeof(*db->services));
+	db->num_services -= count;
+}
+
+/**
+ * Destroy services that have already been taken out of db->services, so
+ * that service_removed callbacks see a consistent database.
+ */
+static void destroy_services(struct gatt_db_service **services,
+							unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		gatt_db_service_destroy(services[i]);
+
+	free(services);
+}
+
+/**
+ * Call func for each service overlapping [start, end], in handle order.
+ * The position is kept as a handle rather than an index, so func may add
+ * or remove services.
+ */
+static void foreach_service_overlapping(struct gatt_db *db, uint16_t start,
+						uint16_t end,
+						queue_foreach_func_t func,
+						void *user_data)
+{
+	uint32_t handle = start;
+
+	while (handle <= end) {
+		struct gatt_db_service *service;
+		unsigned int i = service_lower_bound(db, handle);
+		uint16_t svc_start, svc_end;
+
+		if (i == db->num_services)
+			break;
+
+		service = db->services[i];
+		gatt_db_service_get_handles(service, &svc_start, &svc_end);
+
+		if (svc_start > end)
+			break;
+
+		func(service, user_data);
+
+		handle = (uint32_t) svc_end + 1;
+	}
+}
+
 static void gatt_db_destroy(struct gatt_db *db)
 {
 	if (!db)
@@ -321,7 +684,11 @@ static void gatt_db_destroy(struct gatt_db *db)
 	queue_destroy(db->notify_list, notify_destroy);
 	db->notify_list = NULL;
 
-	queue_destroy(db->services, gatt_db_service_destroy);
+	destroy_services(db->services, db->num_services);
+
+	free(db->uuids);
+	free(db->uuid_attrs);
+	free(db->uuid_hash);
 	free(db);
 }
 
@@ -341,7 +708,7 @@ bool gatt_db_isempty(struct gatt_db *db)
 	if (!db)
 		return true;
 
-	return queue_isempty(db->services);
+	return db->num_services == 0;
 }
 
 static int uuid_to_le(const bt_uuid_t *uuid, uint8_t *dst)
@@ -398,12 +765,14 @@ static struct gatt_db_service *gatt_db_service_create(const bt_uuid_t *uuid,
 	if (!service)
 		return NULL;
 
-	service->attributes = new0(struct gatt_db_attribute *, num_handles);
+	service->attributes = new0(struct gatt_db_attribute, num_handles);
 	if (!service->attributes) {
 		free(service);
 		return NULL;
 	}
 
+	service->uuid_id = UUID_ID_NONE;
+
 	if (primary)
 		type = &primary_service_uuid;
 	else
@@ -411,9 +780,7 @@ static struct gatt_db_service *gatt_db_service_create(const bt_uuid_t *uuid,
 
 	len = uuid_to_le(uuid, value);
 
-	service->attributes[0] = new_attribute(service, handle, type, value,
-									len);
-	if (!service->attributes[0]) {
+	if (!new_attribute(service, 0, handle, type, value, len)) {
 		gatt_db_service_destroy(service);
 		return NULL;
 	}
@@ -426,13 +793,16 @@ bool gatt_db_remove_service(struct gatt_db *db,
 					struct gatt_db_attribute *attrib)
 {
 	struct gatt_db_service *service;
+	unsigned int i;
 
 	if (!db || !attrib)
 		return false;
 
 	service = attrib->service;
 
-	queue_remove(db->services, service);
+	i = service_lower_bound(db, service->attributes[0].handle);
+	if (i < db->num_services && db->services[i] == service)
+		services_remove(db, i, 1);
 
 	gatt_db_service_destroy(service);
 
@@ -441,91 +811,84 @@ bool gatt_db_remove_service(struct gatt_db *db,
 
 bool gatt_db_clear(struct gatt_db *db)
 {
+	struct gatt_db_service **services;
+	unsigned int count;
+
 	if (!db)
 		return false;
 
-	queue_remove_all(db->services, NULL, NULL, gatt_db_service_destroy);
+	services = db->services;
+	count = db->num_services;
+
+	db->services = NULL;
+	db->num_services = 0;
+	db->max_services = 0;
+
+	destroy_services(services, count);
 
 	db->next_handle = 0;
 
 	return true;
 }
 
-static void gatt_db_service_get_handles(const struct gatt_db_service *service,
-							uint16_t *start_handle,
-							uint16_t *end_handle)
+bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
+							uint16_t end_handle)
 {
-	if (start_handle)
-		*start_handle = service->attributes[0]->handle;
-
-	if (end_handle)
-		*end_handle = service->attributes[0]->handle +
-						service->num_handles - 1;
-}
+	struct gatt_db_service **removed;
+	unsigned int first, last;
 
-struct clear_range {
-	uint16_t start, end;
-};
-
-static bool match_range(const void *a, const void *b)
-{
-	const struct gatt_db_service *service = a;
-	const struct clear_range *range = b;
-	uint16_t svc_start, svc_end;
+	if (!db || start_handle > end_handle)
+		return false;
 
-	gatt_db_service_get_handles(service, &svc_start, &svc_end);
+	/* Overlapping services are contiguous in the sorted array */
+	first = service_lower_bound(db, start_handle);
+	for (last = first; last < db->num_services; last++) {
+		uint16_t svc_start;
 
-	return svc_start <= range->end && svc_end >= range->start;
-}
+		gatt_db_service_get_handles(db->services[last], &svc_start,
+									NULL);
+		if (svc_start > end_handle)
+			break;
+	}
 
-bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
-							uint16_t end_handle)
-{
-	struct clear_range range;
+	if (last == first)
+		return true;
 
-	if (!db || start_handle > end_handle)
+	removed = malloc((last - first) * sizeof(*removed));
+	if (!removed)
 		return false;
 
-	range.start = start_handle;
-	range.end = end_handle;
+	memcpy(removed, &db->services[first], (last - first) * sizeof(*removed));
+	services_remove(db, first, last - first);
 
-	queue_remove_all(db->services, match_range, &range,
-						gatt_db_service_destroy);
+	destroy_services(removed, last - first);
 
 	return true;
 }
 
+/**
+ * Find where a service covering [start, end] goes.
+ *
+ * @param db		database
+ * @param start		first handle
+ * @param end		last handle
+ * @param index		set to the insertion index into db->services
+ * @return		an existing service overlapping the range, or NULL
+ */
 static struct gatt_db_service *find_insert_loc(struct gatt_db *db,
 						uint16_t start, uint16_t end,
-						struct gatt_db_service **after)
+						unsigned int *index)
 {
-	const struct queue_entry *services_entry;
-	struct gatt_db_service *service;
-	uint16_t cur_start, cur_end;
-
-	*after = NULL;
+	uint16_t cur_start;
 
-	services_entry = queue_get_entries(db->services);
+	*index = service_lower_bound(db, start);
 
-	while (services_entry) {
-		service = services_entry->data;
-
-		gatt_db_service_get_handles(service, &cur_start, &cur_end);
-
-		if (start >= cur_start && start <= cur_end)
-			return service;
-
-		if (end >= cur_start && end <= cur_end)
-			return service;
+	if (*index == db->num_services)
+		return NULL;
 
-		if (end < cur_start)
-			return NULL;
+	gatt_db_service_get_handles(db->services[*index], &cur_start, NULL);
 
-		*after = service;
-		services_entry = services_entry->next;
-	}
-
-	return NULL;
+	return cur_start <= end ? db->services[*index] : NULL;
 }
 
 struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
@@ -534,9 +897,8 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 							bool primary,
 							uint16_t num_handles)
 {
-	struct gatt_db_service *service, *after;
-
-	after = NULL;
+	struct gatt_db_service *service;
+	unsigned int index;
 
 	if (!db || handle < 1)
 		return NULL;
@@ -544,7 +906,7 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 	if (num_handles < 1 || (handle + num_handles - 1) > UINT16_MAX)
 		return NULL;
 
-	service = find_insert_loc(db, handle, handle + num_handles - 1, &after);
+	service = find_insert_loc(db, handle, handle + num_handles - 1, &index);
 	if (service) {
 		const bt_uuid_t *type;
 		bt_uuid_t value;
@@ -554,15 +916,15 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 		else
 			type = &secondary_service_uuid;
 
-		gatt_db_attribute_get_service_uuid(service->attributes[0],
+		gatt_db_attribute_get_service_uuid(&service->attributes[0],
 									&value);
 
 		/* Check if service match */
-		if (!bt_uuid_cmp(&service->attributes[0]->uuid, type) &&
+		if (!bt_uuid_cmp(&service->attributes[0].uuid, type) &&
 				!bt_uuid_cmp(&value, uuid) &&
 				service->num_handles == num_handles &&
-				service->attributes[0]->handle == handle)
-			return service->attributes[0];
+				service->attributes[0].handle == handle)
+			return &service->attributes[0];
 
 		return NULL;
 	}
@@ -572,21 +934,25 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 	if (!service)
 		return NULL;
 
-	if (after) {
-		if (!queue_push_after(db->services, after, service))
-			goto fail;
-	} else if (!queue_push_head(db->services, service)) {
+	service->db = db;
+
+	service->uuid_id = uuid_intern(db, uuid);
+	if (service->uuid_id == UUID_ID_NONE)
 		goto fail;
-	}
 
-	service->db = db;
-	service->attributes[0]->handle = handle;
+	if (!index_attribute(db, &service->attributes[0]))
+		goto fail;
+
+	if (!services_insert(db, index, service))
+		goto fail;
+
+	service->attributes[0].handle = handle;
 	service->num_handles = num_handles;
 
 	/* Fast-forward next_handle if the new service was added to the end */
 	db->next_handle = MAX(handle + num_handles, db->next_handle);
 
-	return service->attributes[0];
+	return &service->attributes[0];
 
 fail:
 	gatt_db_service_destroy(service);
@@ -659,7 +1025,7 @@ static uint16_t get_attribute_index(struct gatt_db_service *service,
 
 	/* Here we look for first free attribute index with given offset */
 	while (i < (service->num_handles - end_offset) &&
-						service->attributes[i])
+						service_attribute(service, i))
 		i++;
 
 	return i == (service->num_handles - end_offset) ? 0 : i;
@@ -668,7 +1034,7 @@ static uint16_t get_attribute_index(struct gatt_db_service *service,
 static uint16_t get_handle_at_index(struct gatt_db_service *service,
 								int index)
 {
-	return service->attributes[index]->handle;
+	return service->attributes[index].handle;
 }
 
 static struct gatt_db_attribute *
@@ -679,10 +1045,10 @@ attribute_update(struct gatt_db_service *service, int index)
 	/* We call this function with index > 0, because index 0 is reserved
 	 * for service declaration, and is set in add_service()
 	 */
-	previous_handle = service->attributes[index - 1]->handle;
-	service->attributes[index]->handle = previous_handle + 1;
+	previous_handle = service->attributes[index - 1].handle;
+	service->attributes[index].handle = previous_handle + 1;
 
-	return service->attributes[index];
+	return &service->attributes[index];
 }
 
 static void set_attribute_data(struct gatt_db_attribute *attribute,
@@ -712,7 +1078,7 @@ service_insert_characteristic(struct gatt_db_service *service,
 	int i;
 
 	/* Check if handle is in within service range */
-	if (handle && handle <= service->attributes[0]->handle)
+	if (handle && handle <= service->attributes[0].handle)
 		return NULL;
 
 	/*
@@ -742,24 +1108,21 @@ service_insert_characteristic(struct gatt_db_service *service,
 	len += sizeof(uint16_t);
 	len += uuid_to_le(uuid, &value[3]);
 
-	service->attributes[i] = new_attribute(service, handle - 1,
-							&characteristic_uuid,
-							value, len);
-	if (!service->attributes[i])
+	if (!new_attribute(service, i, handle - 1, &characteristic_uuid,
+								value, len))
 		return NULL;
 
 	i++;
 
-	service->attributes[i] = new_attribute(service, handle, uuid, NULL, 0);
-	if (!service->attributes[i]) {
-		free(service->attributes[i - 1]);
+	if (!new_attribute(service, i, handle, uuid, NULL, 0)) {
+		attribute_destroy(&service->attributes[i - 1]);
 		return NULL;
 	}
 
-	set_attribute_data(service->attributes[i], read_func, write_func,
+	set_attribute_data(&service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
-	return service->attributes[i];
+	return &service->attributes[i];
 }
 
 struct gatt_db_attribute *
@@ -815,20 +1178,19 @@ service_insert_descriptor(struct gatt_db_service *service,
 		return NULL;
 
 	/* Check if handle is in within service range */
-	if (handle && handle <= service->attributes[0]->handle)
+	if (handle && handle <= service->attributes[0].handle)
 		return NULL;
 
 	if (!handle)
 		handle = get_handle_at_index(service, i - 1) + 1;
 
-	service->attributes[i] = new_attribute(service, handle, uuid, NULL, 0);
-	if (!service->attributes[i])
+	if (!new_attribute(service, i, handle, uuid, NULL, 0))
 		return NULL;
 
-	set_attribute_data(service->attributes[i], read_func, write_func,
+	set_attribute_data(&service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
-	return service->attributes[i];
+	return &service->attributes[i];
 }
 
 struct gatt_db_attribute *
@@ -880,8 +1242,8 @@ gatt_db_service_add_included(struct gatt_db_attribute *attrib,
 	included = include->service;
 
 	/* Adjust include to point to the first attribute */
-	if (include != included->attributes[0])
-		include = included->attributes[0];
+	if (include != &included->attributes[0])
+		include = &included->attributes[0];
 
 	included_handle = include->handle;
 
@@ -903,10 +1265,8 @@ gatt_db_service_add_included(struct gatt_db_attribute *attrib,
 	if (!index)
 		return NULL;
 
-	service->attributes[index] = new_attribute(service, 0,
-							&included_service_uuid,
-							value, len);
-	if (!service->attributes[index])
+	if (!new_attribute(service, index, 0, &included_service_uuid,
+								value, len))
 		return NULL;
 
 	/* The Attribute Permissions shall be read only and not require
@@ -914,7 +1274,7 @@ gatt_db_service_add_included(struct gatt_db_attribute *attrib,
 	 *
 	 * TODO handle permissions
 	 */
-	set_attribute_data(service->attributes[index], NULL, NULL, 0, NULL);
+	set_attribute_data(&service->attributes[index], NULL, NULL, 0, NULL);
 
 	return attribute_update(service, index);
 }
@@ -970,46 +1330,47 @@ void gatt_db_read_by_group_type(struct gatt_db *db, uint16_t start_handle,
 							const bt_uuid_t type,
 							struct queue *queue)
 {
-	const struct queue_entry *services_entry;
 	struct gatt_db_service *service;
 	uint16_t grp_start, grp_end, uuid_size;
+	unsigned int i, type_id;
 
 	uuid_size = 0;
 
-	services_entry = queue_get_entries(db->services);
+	type_id = uuid_lookup(db, &type);
+	if (type_id == UUID_ID_NONE)
+		return;
 
-	while (services_entry) {
-		service = services_entry->data;
+	/* Services are sorted, so start at the first one that can match */
+	for (i = service_lower_bound(db, start_handle);
+					i < db->num_services; i++) {
+		service = db->services[i];
 
-		if (!service->active)
-			goto next_service;
+		grp_start = service->attributes[0].handle;
+		grp_end = grp_start + service->num_handles - 1;
 
-		if (bt_uuid_cmp(&type, &service->attributes[0]->uuid))
-			goto next_service;
+		if (grp_start > end_handle)
+			break;
 
-		grp_start = service->attributes[0]->handle;
-		grp_end = grp_start + service->num_handles - 1;
+		if (!service->active)
+			continue;
 
-		if (grp_end < start_handle || grp_start > end_handle)
-			goto next_service;
+		if (service->attributes[0].uuid_id != type_id)
+			continue;
 
-		if (grp_start < start_handle || grp_start > end_handle)
-			goto next_service;
+		if (grp_end < start_handle || grp_start < start_handle)
+			continue;
 
 		if (!uuid_size)
-			uuid_size = service->attributes[0]->value_len;
-		else if (uuid_size != service->attributes[0]->value_len)
+			uuid_size = service->attributes[0].value_len;
+		else if (uuid_size != service->attributes[0].value_len)
 			return;
 
-		queue_push_tail(queue, service->attributes[0]);
-
-next_service:
-		services_entry = services_entry->next;
+		queue_push_tail(queue, &service->attributes[0]);
 	}
 }
 
 struct find_by_type_value_data {
-	bt_uuid_t uuid;
+	unsigned int uuid_id;
 	uint16_t start_handle;
 	uint16_t end_handle;
 	gatt_db_attribute_cb_t func;
@@ -1030,7 +1391,7 @@ static void find_by_type(void *data, void *user_data)
 		return;
 
 	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
+		attribute = service_attribute(service, i);
 
 		if (!attribute)
 			continue;
@@ -1039,7 +1400,7 @@ static void find_by_type(void *data, void *user_data)
 				(attribute->handle > search_data->end_handle))
 			continue;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
+		if (attribute->uuid_id != search_data->uuid_id)
 			continue;
 
 		/* TODO: fix for read-callback based attributes */
@@ -1063,13 +1424,17 @@ unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
 
 	memset(&data, 0, sizeof(data));
 
-	data.uuid = *type;
+	data.uuid_id = uuid_lookup(db, type);
+	if (data.uuid_id == UUID_ID_NONE)
+		return 0;
+
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.func = func;
 	data.user_data = user_data;
 
-	queue_foreach(db->services, find_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle, find_by_type,
+									&data);
 
 	return data.num_of_res;
 }
@@ -1085,7 +1450,12 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 {
 	struct find_by_type_value_data data;
 
-	data.uuid = *type;
+	memset(&data, 0, sizeof(data));
+
+	data.uuid_id = uuid_lookup(db, type);
+	if (data.uuid_id == UUID_ID_NONE)
+		return 0;
+
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.func = func;
@@ -1093,14 +1463,15 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 	data.value = value;
 	data.value_len = value_len;
 
-	queue_foreach(db->services, find_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle, find_by_type,
+									&data);
 
 	return data.num_of_res;
 }
 
 struct read_by_type_data {
 	struct queue *queue;
-	bt_uuid_t uuid;
+	unsigned int uuid_id;
 	uint16_t start_handle;
 	uint16_t end_handle;
 };
@@ -1116,7 +1487,7 @@ static void read_by_type(void *data, void *user_data)
 		return;
 
 	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
+		attribute = service_attribute(service, i);
 		if (!attribute)
 			continue;
 
@@ -1126,7 +1497,7 @@ static void read_by_type(void *data, void *user_data)
 		if (attribute->handle > search_data->end_handle)
 			return;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
+		if (attribute->uuid_id != search_data->uuid_id)
 			continue;
 
 		queue_push_tail(search_data->queue, attribute);
@@ -1139,12 +1510,17 @@ void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
 						struct queue *queue)
 {
 	struct read_by_type_data data;
-	data.uuid = type;
+
+	data.uuid_id = uuid_lookup(db, &type);
+	if (data.uuid_id == UUID_ID_NONE)
+		return;
+
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.queue = queue;
 
-	queue_foreach(db->services, read_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle, read_by_type,
+									&data);
 }
 
 
@@ -1165,12 +1541,12 @@ static void find_information(void *data, void *user_data)
 		return;
 
 	/* Check if service is in range */
-	if ((service->attributes[0]->handle + service->num_handles - 1) <
+	if ((service->attributes[0].handle + service->num_handles - 1) <
 						search_data->start_handle)
 		return;
 
 	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
+		attribute = service_attribute(service, i);
 		if (!attribute)
 			continue;
 
@@ -1194,7 +1570,8 @@ void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
 	data.end_handle = end_handle;
 	data.queue = queue;
 
-	queue_foreach(db->services, find_information, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+						find_information, &data);
 }
 
 void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
@@ -1207,7 +1584,7 @@ void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
 
 struct foreach_data {
 	gatt_db_attribute_cb_t func;
-	const bt_uuid_t *uuid;
+	unsigned int uuid_id;
 	void *user_data;
 	uint16_t start, end;
 };
@@ -1217,21 +1594,17 @@ static void foreach_service_in_range(void *data, void *user_data)
 	struct gatt_db_service *service = data;
 	struct foreach_data *foreach_data = user_data;
 	uint16_t svc_start;
-	bt_uuid_t uuid;
 
 	svc_start = get_handle_at_index(service, 0);
 
 	if (svc_start > foreach_data->end || svc_start < foreach_data->start)
 		return;
 
-	if (foreach_data->uuid) {
-		gatt_db_attribute_get_service_uuid(service->attributes[0],
-									&uuid);
-		if (bt_uuid_cmp(&uuid, foreach_data->uuid))
-			return;
-	}
+	if (foreach_data->uuid_id != UUID_ID_NONE &&
+				service->uuid_id != foreach_data->uuid_id)
+		return;
 
-	foreach_data->func(service->attributes[0], foreach_data->user_data);
+	foreach_data->func(&service->attributes[0], foreach_data->user_data);
 }
 
 void gatt_db_foreach_service_in_range(struct gatt_db *db,
@@ -1246,13 +1619,20 @@ void gatt_db_foreach_service_in_range(struct gatt_db *db,
 	if (!db || !func || start_handle > end_handle)
 		return;
 
+	data.uuid_id = UUID_ID_NONE;
+	if (uuid) {
+		data.uuid_id = uuid_lookup(db, uuid);
+		if (data.uuid_id == UUID_ID_NONE)
+			return;
+	}
+
 	data.func = func;
-	data.uuid = uuid;
 	data.user_data = user_data;
 	data.start = start_handle;
 	data.end = end_handle;
 
-	queue_foreach(db->services, foreach_service_in_range, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+					foreach_service_in_range, &data);
 }
 
 void gatt_db_service_foreach(struct gatt_db_attribute *attrib,
@@ -1262,6 +1642,7 @@ void gatt_db_service_foreach(struct gatt_db_attribute *attrib,
 {
 	struct gatt_db_service *service;
 	struct gatt_db_attribute *attr;
+	unsigned int uuid_id = UUID_ID_NONE;
 	uint16_t i;
 
 	if (!attrib || !func)
@@ -1269,12 +1650,18 @@ void gatt_db_service_foreach(struct gatt_db_attribute *attrib,
 
 	service = attrib->service;
 
+	if (uuid) {
+		uuid_id = uuid_lookup(service->db, uuid);
+		if (uuid_id == UUID_ID_NONE)
+			return;
+	}
+
 	for (i = 0; i < service->num_handles; i++) {
-		attr = service->attributes[i];
+		attr = service_attribute(service, i);
 		if (!attr)
 			continue;
 
-		if (uuid && bt_uuid_cmp(uuid, &attr->uuid))
+		if (uuid && attr->uuid_id != uuid_id)
 			continue;
 
 		func(attr, user_data);
@@ -1306,15 +1693,10 @@ void gatt_db_service_foreach_desc(struct gatt_db_attribute *attrib,
 	service = attrib->service;
 
 	/* Start from the attribute following the value handle */
-	for (i = 0; i < service->num_handles; i++) {
-		if (service->attributes[i] == attrib) {
-			i += 2;
-			break;
-		}
-	}
+	i = attrib - service->attributes + 2;
 
 	for (; i < service->num_handles; i++) {
-		attr = service->attributes[i];
+		attr = service_attribute(service, i);
 		if (!attr)
 			continue;
 
@@ -1335,66 +1717,77 @@ void gatt_db_service_foreach_incl(struct gatt_db_attribute *attrib,
 								user_data);
 }
 
-static bool find_service_for_handle(const void *data, const void *user_data)
-{
-	const struct gatt_db_service *service = data;
-	uint16_t handle = PTR_TO_UINT(user_data);
-	uint16_t start, end;
-
-	gatt_db_service_get_handles(service, &start, &end);
-
-	return (start <= handle) && (handle <= end);
-}
-
 struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 							uint16_t handle)
 {
 	struct gatt_db_service *service;
+	struct gatt_db_attribute *attr;
+	uint16_t offset;
 	int i;
 
 	if (!db || !handle)
 		return NULL;
 
-	service = queue_find(db->services, find_service_for_handle,
-							UINT_TO_PTR(handle));
+	service = find_service_for_handle(db, handle);
 	if (!service)
 		return NULL;
 
-	for (i = 0; i < service->num_handles; i++) {
-		if (!service->attributes[i])
-			continue;
+	/* Attributes are normally laid out one per handle */
+	offset = handle - service->attributes[0].handle;
+	attr = service_attribute(service, offset);
+	if (attr && attr->handle == handle)
+		return attr;
 
-		if (service->attributes[i]->handle == handle)
-			return service->attributes[i];
+	for (i = 0; i < service->num_handles; i++) {
+		attr = service_attribute(service, i);
+		if (attr && attr->handle == handle)
+			return attr;
 	}
 
 	return NULL;
 }
 
-static bool find_service_with_uuid(const void *data, const void *user_data)
+struct gatt_db_attribute *gatt_db_get_service_with_uuid(struct gatt_db *db,
+							const bt_uuid_t *uuid)
 {
-	const struct gatt_db_service *service = data;
-	const bt_uuid_t *uuid = user_data;
-	bt_uuid_t svc_uuid;
+	unsigned int i, uuid_id;
+
+	if (!db || !uuid)
+		return NULL;
 
-	gatt_db_attribute_get_service_uuid(service->attributes[0], &svc_uuid);
+	uuid_id = uuid_lookup(db, uuid);
+	if (uuid_id == UUID_ID_NONE)
+		return NULL;
+
+	for (i = 0; i < db->num_services; i++) {
+		struct gatt_db_service *service = db->services[i];
+
+		if (service->uuid_id == uuid_id)
+			return &service->attributes[0];
+	}
 
-	return bt_uuid_cmp(uuid, &svc_uuid) == 0;
+	return NULL;
 }
 
-struct gatt_db_attribute *gatt_db_get_service_with_uuid(struct gatt_db *db,
-							const bt_uuid_t *uuid)
+struct gatt_db_attribute *gatt_db_get_attribute_with_uuid(struct gatt_db *db,
+							const bt_uuid_t *type)
 {
-	struct gatt_db_service *service;
+	struct gatt_db_attribute *attr, *found = NULL;
+	unsigned int uuid_id;
 
-	if (!db || !uuid)
+	if (!db || !type)
 		return NULL;
 
-	service = queue_find(db->services, find_service_with_uuid, uuid);
-	if (!service)
+	uuid_id = uuid_lookup(db, type);
+	if (uuid_id == UUID_ID_NONE)
 		return NULL;
 
-	return service->attributes[0];
+	for (attr = db->uuid_attrs[uuid_id]; attr; attr = attr->uuid_next) {
+		if (!found || attr->handle < found->handle)
+			found = attr;
+	}
+
+	return found;
 }
 
 const bt_uuid_t *gatt_db_attribute_get_type(
@@ -1424,19 +1817,19 @@ bool gatt_db_attribute_get_service_uuid(const struct gatt_db_attribute *attrib,
 
 	service = attrib->service;
 
-	if (service->attributes[0]->value_len == sizeof(uint16_t)) {
+	if (service->attributes[0].value_len == sizeof(uint16_t)) {
 		uint16_t value;
 
-		value = get_le16(service->attributes[0]->value);
+		value = get_le16(service->attributes[0].value);
 		bt_uuid16_create(uuid, value);
 
 		return true;
 	}
 
-	if (service->attributes[0]->value_len == sizeof(uint128_t)) {
+	if (service->attributes[0].value_len == sizeof(uint128_t)) {
 		uint128_t value;
 
-		bswap_128(service->attributes[0]->value, &value);
+		bswap_128(service->attributes[0].value, &value);
 		bt_uuid128_create(uuid, value);
 
 		return true;
@@ -1475,7 +1868,7 @@ bool gatt_db_attribute_get_service_data(const struct gatt_db_attribute *attrib,
 		return false;
 
 	service = attrib->service;
-	decl = service->attributes[0];
+	decl = &service->attributes[0];
 
 	gatt_db_service_get_handles(service, start_handle, end_handle);
 
@@ -1599,6 +1992,12 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 	if (attrib->read_func) {
 		struct pending_read *p;
 
+		if (!attrib->pending_reads) {
+			attrib->pending_reads = queue_new();
+			if (!attrib->pending_reads)
+				return false;
+		}
+
 		p = new0(struct pending_read, 1);
 		if (!p)
 			return false;
@@ -1683,6 +2082,12 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 	if (attrib->write_func) {
 		struct pending_write *p;
 
+		if (!attrib->pending_writes) {
+			attrib->pending_writes = queue_new();
+			if (!attrib->pending_writes)
+				return false;
+		}
+
 		p = new0(struct pending_write, 1);
 		if (!p)
 			return false;
@@ -1708,19 +2113,8 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 	/* For values stored in db allocate on demand */
 	if (!attrib->value || offset >= attrib->value_len ||
 				len > (unsigned) (attrib->value_len - offset)) {
-		void *buf;
-
-		buf = realloc(attrib->value, len + offset);
-		if (!buf)
+		if (!grow_value(attrib, len + offset))
 			return false;
-
-		attrib->value = buf;
-
-		/* Init data in the first allocation */
-		if (!attrib->value_len)
-			memset(attrib->value, 0, offset);
-
-		attrib->value_len = len + offset;
 	}
 
 	memcpy(&attrib->value[offset], value, len);
@@ -1754,12 +2148,7 @@ bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib)
 	if (!attrib)
 		return false;
 
-	if (!attrib->value || !attrib->value_len)
-		return true;
-
-	free(attrib->value);
-	attrib->value = NULL;
-	attrib->value_len = 0;
+	free_value(attrib);
 
 	return true;
 }
@@ -176,6 +176,9 @@ struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 struct gatt_db_attribute *gatt_db_get_service_with_uuid(struct gatt_db *db,
 							const bt_uuid_t *uuid);
 
+struct gatt_db_attribute *gatt_db_get_attribute_with_uuid(struct gatt_db *db,
+							const bt_uuid_t *type);
+
 const bt_uuid_t *gatt_db_attribute_get_type(
 					const struct gatt_db_attribute *attrib);
 
@@ -46,71 +46,69 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
-struct bt_gatt_result {
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * The responses to a discovery, in one buffer that grows as they come in:
+ * each response's data list is stored after a record giving its opcode and
+ * element length. Records start at even offsets.
+ */
+struct result_record {
 	uint8_t opcode;
-	void *pdu;
-	uint16_t pdu_len;
 	uint16_t data_len;
+	uint16_t pdu_len;
+};
+
+#define RESULT_MIN_SIZE 256
 
+struct bt_gatt_result {
 	void *op;  /* Discovery operation data */
 
-	struct bt_gatt_result *next;
+	/* Of the first response, which the result is checked against */
+	uint8_t opcode;
+	uint16_t data_len;
+
+	/* Elements in the responses with the first response's opcode */
+	unsigned int count;
+
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	size_t last;  /* Offset of the last record */
 };
 
-static struct bt_gatt_result *result_create(uint8_t opcode, const void *pdu,
-							uint16_t pdu_len,
-							uint16_t data_len,
-							void *op)
+static struct result_record *result_record(const struct bt_gatt_result *result,
+								size_t offset)
 {
-	struct bt_gatt_result *result;
-
-	result = new0(struct bt_gatt_result, 1);
-	if (!result)
+	if (offset >= result->len)
 		return NULL;
 
-	result->pdu = malloc(pdu_len);
-	if (!result->pdu) {
-		free(result);
-		return NULL;
-	}
+	return (struct result_record *) (result->buf + offset);
+}
 
-	result->opcode = opcode;
-	result->pdu_len = pdu_len;
-	result->data_len = data_len;
-	result->op = op;
+static uint8_t *record_pdu(const struct result_record *record)
+{
+	return (uint8_t *) (record + 1);
+}
 
-	memcpy(result->pdu, pdu, pdu_len);
+static size_t record_next(const struct bt_gatt_result *result, size_t offset)
+{
+	const struct result_record *record = result_record(result, offset);
 
-	return result;
+	return offset + sizeof(*record) + ((record->pdu_len + 1) & ~1);
 }
 
 static void result_destroy(struct bt_gatt_result *result)
 {
-	struct bt_gatt_result *next;
-
-	while (result) {
-		next = result->next;
-
-		free(result->pdu);
-		free(result);
-
-		result = next;
-	}
+	free(result->buf);
+	memset(result, 0, sizeof(*result));
 }
 
 static unsigned int result_element_count(struct bt_gatt_result *result)
 {
-	unsigned int count = 0;
-	struct bt_gatt_result *cur;
-
-	cur = result;
-
-	while (cur) {
-		count += cur->pdu_len / cur->data_len;
-		cur = cur->next;
-	}
-
-	return count;
+	return result->count;
 }
 
 unsigned int bt_gatt_result_service_count(struct bt_gatt_result *result)
@@ -159,9 +157,6 @@ unsigned int bt_gatt_result_descriptor_count(struct bt_gatt_result *result)
 
 unsigned int bt_gatt_result_included_count(struct bt_gatt_result *result)
 {
-	struct bt_gatt_result *cur;
-	unsigned int count = 0;
-
 	if (!result)
 		return 0;
 
@@ -174,15 +169,13 @@ unsigned int bt_gatt_result_included_count(struct bt_gatt_result *result)
 	 * 2 octets - start handle of included service
 	 * 2 octets - end handle of included service
 	 * 2 octets (optionally) - 16 bit Bluetooth UUID
+	 *
+	 * The READ_RSPs with the 128 bit UUIDs aren't counted.
 	 */
 	if (result->data_len != 6 && result->data_len != 8)
 		return 0;
 
-	for (cur = result; cur; cur = cur->next)
-		if (cur->opcode == BT_ATT_OP_READ_BY_TYPE_RSP)
-			count += cur->pdu_len / cur->data_len;
-
-	return count;
+	return result_element_count(result);
 }
 
 bool bt_gatt_iter_init(struct bt_gatt_iter *iter, struct bt_gatt_result *result)
@@ -191,11 +184,32 @@ bool bt_gatt_iter_init(struct bt_gatt_iter *iter, struct bt_gatt_result *result)
 		return false;
 
 	iter->result = result;
+	iter->record = 0;
 	iter->pos = 0;
 
 	return true;
 }
 
+/* The record the iterator is in, NULL past the end */
+static struct result_record *iter_record(struct bt_gatt_iter *iter)
+{
+	if (!iter->result)
+		return NULL;
+
+	return result_record(iter->result, iter->record);
+}
+
+/* Step over the element at pos, to the next record after the last one */
+static void iter_advance(struct bt_gatt_iter *iter,
+					const struct result_record *record)
+{
+	iter->pos += record->data_len;
+	if (iter->pos == record->pdu_len) {
+		iter->record = record_next(iter->result, iter->record);
+		iter->pos = 0;
+	}
+}
+
 static const uint8_t bt_base_uuid[16] = {
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
 	0x80, 0x00, 0x00, 0x80, 0x5F, 0x9B, 0x34, 0xFB
@@ -226,49 +240,81 @@ struct bt_gatt_request {
 	int ref_count;
 	bt_uuid_t uuid;
 	uint16_t service_type;
-	struct bt_gatt_result *result_head;
-	struct bt_gatt_result *result_tail;
+	struct bt_gatt_result result;
 	bt_gatt_request_callback_t callback;
 	void *user_data;
 	bt_gatt_destroy_func_t destroy;
 };
 
-static struct bt_gatt_result *result_append(uint8_t opcode, const void *pdu,
+/*
+ * Store a response's data list. Pointers into the result are valid until the
+ * next response is stored; the last one is at op->result.last.
+ */
+static bool result_append(uint8_t opcode, const void *pdu,
 						uint16_t pdu_len,
 						uint16_t data_len,
 						struct bt_gatt_request *op)
 {
-	struct bt_gatt_result *result;
+	struct bt_gatt_result *result = &op->result;
+	struct result_record *record;
+	size_t needed;
 
-	result = result_create(opcode, pdu, pdu_len, data_len, op);
-	if (!result)
-		return NULL;
+	needed = result->len + sizeof(*record) + ((pdu_len + 1) & ~1);
 
-	if (!op->result_head)
-		op->result_head = op->result_tail = result;
-	else {
-		op->result_tail->next = result;
-		op->result_tail = result;
+	if (needed > result->size) {
+		size_t size = MAX(result->size * 2, RESULT_MIN_SIZE);
+		uint8_t *buf;
+
+		while (size < needed)
+			size *= 2;
+
+		buf = realloc(result->buf, size);
+		if (!buf)
+			return false;
+
+		result->buf = buf;
+		result->size = size;
 	}
 
-	return result;
+	if (!result->len) {
+		result->op = op;
+		result->opcode = opcode;
+		result->data_len = data_len;
+	}
+
+	record = (struct result_record *) (result->buf + result->len);
+	record->opcode = opcode;
+	record->data_len = data_len;
+	record->pdu_len = pdu_len;
+	memcpy(record_pdu(record), pdu, pdu_len);
+
+	if (opcode == result->opcode)
+		result->count += pdu_len / data_len;
+
+	result->last = result->len;
+	result->len = needed;
+
+	return true;
 }
 
 bool bt_gatt_iter_next_included_service(struct bt_gatt_iter *iter,
 				uint16_t *handle, uint16_t *start_handle,
 				uint16_t *end_handle, uint8_t uuid[16])
 {
-	struct bt_gatt_result *read_result;
+	struct result_record *record, *read_record;
 	struct bt_gatt_request *op;
-	const void *pdu_ptr;
+	const uint8_t *pdu_ptr;
+	size_t read_offset;
 	int i = 0;
 
-	if (!iter || !iter->result || !handle || !start_handle || !end_handle
-								|| !uuid)
+	if (!iter || !handle || !start_handle || !end_handle || !uuid)
 		return false;
 
+	record = iter_record(iter);
+	if (!record)
+		return false;
 
-	if (iter->result->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
+	if (record->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
 		return false;
 
 	/* UUID in discovery_op is set in read_by_type and service_discovery */
@@ -276,30 +322,25 @@ bool bt_gatt_iter_next_included_service(struct bt_gatt_iter *iter,
 	if (op->uuid.type != BT_UUID_UNSPEC)
 		return false;
 	/*
-	 * iter->result points to READ_BY_TYPE_RSP with data length containing:
+	 * The record is a READ_BY_TYPE_RSP with data length containing:
 	 * 2 octets - include service handle
 	 * 2 octets - start handle of included service
 	 * 2 octets - end handle of included service
 	 * optional 2  octets - Bluetooth UUID
 	 */
-	if (iter->result->data_len != 8 && iter->result->data_len != 6)
+	if (record->data_len != 8 && record->data_len != 6)
 		return false;
 
-	pdu_ptr = iter->result->pdu + iter->pos;
+	pdu_ptr = record_pdu(record) + iter->pos;
 
 	/* This result contains 16 bit UUID */
-	if (iter->result->data_len == 8) {
+	if (record->data_len == 8) {
 		*handle = get_le16(pdu_ptr);
 		*start_handle = get_le16(pdu_ptr + 2);
 		*end_handle = get_le16(pdu_ptr + 4);
 		convert_uuid_le(pdu_ptr + 6, 2, uuid);
 
-		iter->pos += iter->result->data_len;
-
-		if (iter->pos == iter->result->pdu_len) {
-			iter->result = iter->result->next;
-			iter->pos = 0;
-		}
+		iter_advance(iter, record);
 
 		return true;
 	}
@@ -307,27 +348,29 @@ bool bt_gatt_iter_next_included_service(struct bt_gatt_iter *iter,
 	*handle = get_le16(pdu_ptr);
 	*start_handle = get_le16(pdu_ptr + 2);
 	*end_handle = get_le16(pdu_ptr + 4);
-	read_result = iter->result;
 
 	/*
 	 * Find READ_RSP with include service UUID.
 	 * If number of current data set in READ_BY_TYPE_RSP is n, then we must
-	 * go to n'th PDU next to current item->result
+	 * go to n'th record next to the current one
 	 */
-	for (read_result = read_result->next; read_result; i++) {
-		if (i >= (iter->pos / iter->result->data_len))
+	read_offset = record_next(iter->result, iter->record);
+	read_record = result_record(iter->result, read_offset);
+	for (; read_record; i++) {
+		if (i >= (iter->pos / record->data_len))
 			break;
 
-		read_result = read_result->next;
+		read_offset = record_next(iter->result, read_offset);
+		read_record = result_record(iter->result, read_offset);
 	}
 
-	if (!read_result)
+	if (!read_record)
 		return false;
 
-	convert_uuid_le(read_result->pdu, read_result->data_len, uuid);
-	iter->pos += iter->result->data_len;
-	if (iter->pos == iter->result->pdu_len) {
-		iter->result = read_result->next;
+	convert_uuid_le(record_pdu(read_record), read_record->data_len, uuid);
+	iter->pos += record->data_len;
+	if (iter->pos == record->pdu_len) {
+		iter->record = record_next(iter->result, read_offset);
 		iter->pos = 0;
 	}
 
@@ -338,21 +381,26 @@ bool bt_gatt_iter_next_service(struct bt_gatt_iter *iter,
 				uint16_t *start_handle, uint16_t *end_handle,
 				uint8_t uuid[16])
 {
+	struct result_record *record;
 	struct bt_gatt_request *op;
-	const void *pdu_ptr;
+	const uint8_t *pdu_ptr;
 	bt_uuid_t tmp;
 
-	if (!iter || !iter->result || !start_handle || !end_handle || !uuid)
+	if (!iter || !start_handle || !end_handle || !uuid)
+		return false;
+
+	record = iter_record(iter);
+	if (!record)
 		return false;
 
 	op = iter->result->op;
-	pdu_ptr = iter->result->pdu + iter->pos;
+	pdu_ptr = record_pdu(record) + iter->pos;
 
-	switch (iter->result->opcode) {
+	switch (record->opcode) {
 	case BT_ATT_OP_READ_BY_GRP_TYPE_RSP:
 		*start_handle = get_le16(pdu_ptr);
 		*end_handle = get_le16(pdu_ptr + 2);
-		convert_uuid_le(pdu_ptr + 4, iter->result->data_len - 4, uuid);
+		convert_uuid_le(pdu_ptr + 4, record->data_len - 4, uuid);
 		break;
 	case BT_ATT_OP_FIND_BY_TYPE_VAL_RSP:
 		*start_handle = get_le16(pdu_ptr);
@@ -366,11 +414,7 @@ bool bt_gatt_iter_next_service(struct bt_gatt_iter *iter,
 	}
 
 
-	iter->pos += iter->result->data_len;
-	if (iter->pos == iter->result->pdu_len) {
-		iter->result = iter->result->next;
-		iter->pos = 0;
-	}
+	iter_advance(iter, record);
 
 	return true;
 }
@@ -380,14 +424,19 @@ bool bt_gatt_iter_next_characteristic(struct bt_gatt_iter *iter,
 				uint16_t *value_handle, uint8_t *properties,
 				uint8_t uuid[16])
 {
+	struct result_record *record;
 	struct bt_gatt_request *op;
-	const void *pdu_ptr;
+	const uint8_t *pdu_ptr;
 
-	if (!iter || !iter->result || !start_handle || !end_handle ||
+	if (!iter || !start_handle || !end_handle ||
 					!value_handle || !properties || !uuid)
 		return false;
 
-	if (iter->result->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
+	record = iter_record(iter);
+	if (!record)
+		return false;
+
+	if (record->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
 		return false;
 
 	/* UUID in discovery_op is set in read_by_type and service_discovery */
@@ -401,28 +450,25 @@ bool bt_gatt_iter_next_characteristic(struct bt_gatt_iter *iter,
 	 * 2 octets: Characteristic value handle
 	 * 2 or 16 octets: characteristic UUID
 	 */
-	if (iter->result->data_len != 21 && iter->result->data_len != 7)
+	if (record->data_len != 21 && record->data_len != 7)
 		return false;
 
-	pdu_ptr = iter->result->pdu + iter->pos;
+	pdu_ptr = record_pdu(record) + iter->pos;
 
 	*start_handle = get_le16(pdu_ptr);
-	*properties = ((uint8_t *) pdu_ptr)[2];
+	*properties = pdu_ptr[2];
 	*value_handle = get_le16(pdu_ptr + 3);
-	convert_uuid_le(pdu_ptr + 5, iter->result->data_len - 5, uuid);
+	convert_uuid_le(pdu_ptr + 5, record->data_len - 5, uuid);
 
-	iter->pos += iter->result->data_len;
-	if (iter->pos == iter->result->pdu_len) {
-		iter->result = iter->result->next;
-		iter->pos = 0;
-	}
+	iter_advance(iter, record);
 
-	if (!iter->result) {
+	record = iter_record(iter);
+	if (!record) {
 		*end_handle = op->end_handle;
 		return true;
 	}
 
-	*end_handle = get_le16(iter->result->pdu + iter->pos) - 1;
+	*end_handle = get_le16(record_pdu(record) + iter->pos) - 1;
 
 	return true;
 }
@@ -430,24 +476,25 @@ bool bt_gatt_iter_next_characteristic(struct bt_gatt_iter *iter,
 bool bt_gatt_iter_next_descriptor(struct bt_gatt_iter *iter, uint16_t *handle,
 							uint8_t uuid[16])
 {
-	const void *pdu_ptr;
+	struct result_record *record;
+	const uint8_t *pdu_ptr;
 
-	if (!iter || !iter->result || !handle || !uuid)
+	if (!iter || !handle || !uuid)
 		return false;
 
-	if (iter->result->opcode != BT_ATT_OP_FIND_INFO_RSP)
+	record = iter_record(iter);
+	if (!record)
 		return false;
 
-	pdu_ptr = iter->result->pdu + iter->pos;
+	if (record->opcode != BT_ATT_OP_FIND_INFO_RSP)
+		return false;
+
+	pdu_ptr = record_pdu(record) + iter->pos;
 
 	*handle = get_le16(pdu_ptr);
-	convert_uuid_le(pdu_ptr + 2, iter->result->data_len - 2, uuid);
+	convert_uuid_le(pdu_ptr + 2, record->data_len - 2, uuid);
 
-	iter->pos += iter->result->data_len;
-	if (iter->pos == iter->result->pdu_len) {
-		iter->result = iter->result->next;
-		iter->pos = 0;
-	}
+	iter_advance(iter, record);
 
 	return true;
 }
@@ -456,13 +503,18 @@ bool bt_gatt_iter_next_read_by_type(struct bt_gatt_iter *iter,
 				uint16_t *handle, uint16_t *length,
 				const uint8_t **value)
 {
+	struct result_record *record;
 	struct bt_gatt_request *op;
-	const void *pdu_ptr;
+	const uint8_t *pdu_ptr;
+
+	if (!iter || !handle || !length || !value)
+		return false;
 
-	if (!iter || !iter->result || !handle || !length || !value)
+	record = iter_record(iter);
+	if (!record)
 		return false;
 
-	if (iter->result->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
+	if (record->opcode != BT_ATT_OP_READ_BY_TYPE_RSP)
 		return false;
 
 	/*
@@ -473,17 +525,13 @@ bool bt_gatt_iter_next_read_by_type(struct bt_gatt_iter *iter,
 	if (op->uuid.type == BT_UUID_UNSPEC)
 		return false;
 
-	pdu_ptr = iter->result->pdu + iter->pos;
+	pdu_ptr = record_pdu(record) + iter->pos;
 
 	*handle = get_le16(pdu_ptr);
-	*length = iter->result->data_len - 2;
+	*length = record->data_len - 2;
 	*value = pdu_ptr + 2;
 
-	iter->pos += iter->result->data_len;
-	if (iter->pos == iter->result->pdu_len) {
-		iter->result = iter->result->next;
-		iter->pos = 0;
-	}
+	iter_advance(iter, record);
 
 	return true;
 }
@@ -642,7 +690,7 @@ void bt_gatt_request_unref(struct bt_gatt_request *req)
 	if (req->destroy)
 		req->destroy(req->user_data);
 
-	result_destroy(req->result_head);
+	result_destroy(&req->result);
 
 	free(req);
 }
@@ -670,11 +718,12 @@ static void discovery_op_complete(struct bt_gatt_request *op, bool success,
 								uint8_t ecode)
 {
 	/* Reset success if there is some result to report */
-	if (ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND && op->result_head)
+	if (ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND && op->result.len)
 		success = true;
 
 	if (op->callback)
-		op->callback(success, ecode, success ? op->result_head : NULL,
+		op->callback(success, ecode,
+				success && op->result.len ? &op->result : NULL,
 								op->user_data);
 
 	if (!op->id)
@@ -690,7 +739,6 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 	struct bt_gatt_request *op = user_data;
 	bool success;
 	uint8_t att_ecode = 0;
-	struct bt_gatt_result *cur_result;
 	size_t data_length;
 	size_t list_length;
 	uint16_t last_end;
@@ -725,9 +773,7 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 	/* PDU is correctly formatted. Get the last end handle to process the
 	 * next request and store the PDU.
 	 */
-	cur_result = result_append(opcode, pdu + 1, list_length, data_length,
-									op);
-	if (!cur_result) {
+	if (!result_append(opcode, pdu + 1, list_length, data_length, op)) {
 		success = false;
 		goto done;
 	}
@@ -771,7 +817,8 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 	 */
 	if (last_end == 0xffff && last_end != op->end_handle)
 		put_le16(op->end_handle,
-				cur_result->pdu + length - data_length + 1);
+			record_pdu(result_record(&op->result, op->result.last)) +
+						length - data_length + 1);
 
 	success = true;
 
@@ -957,12 +1004,13 @@ struct bt_gatt_request *bt_gatt_discover_secondary_services(
 
 struct read_incl_data {
 	struct bt_gatt_request *op;
-	struct bt_gatt_result *result;
+	size_t record;  /* The READ_BY_TYPE_RSP's, in op->result */
 	int pos;
 	int ref_count;
 };
 
-static struct read_incl_data *new_read_included(struct bt_gatt_result *res)
+static struct read_incl_data *new_read_included(struct bt_gatt_request *op,
+								size_t record)
 {
 	struct read_incl_data *data;
 
@@ -970,12 +1018,18 @@ static struct read_incl_data *new_read_included(struct bt_gatt_result *res)
 	if (!data)
 		return NULL;
 
-	data->op = bt_gatt_request_ref(res->op);
-	data->result = res;
+	data->op = bt_gatt_request_ref(op);
+	data->record = record;
 
 	return data;
 };
 
+/* Moves when a response is stored */
+static struct result_record *read_included_record(struct read_incl_data *data)
+{
+	return result_record(&data->op->result, data->record);
+}
+
 static struct read_incl_data *read_included_ref(struct read_incl_data *data)
 {
 	__sync_fetch_and_add(&data->ref_count, 1);
@@ -1003,6 +1057,7 @@ static void read_included_cb(uint8_t opcode, const void *pdu,
 {
 	struct read_incl_data *data = user_data;
 	struct bt_gatt_request *op = data->op;
+	struct result_record *record;
 	uint8_t att_ecode = 0;
 	uint8_t read_pdu[2];
 	bool success;
@@ -1032,12 +1087,14 @@ static void read_included_cb(uint8_t opcode, const void *pdu,
 		goto done;
 	}
 
-	if (data->pos == data->result->pdu_len) {
+	record = read_included_record(data);
+
+	if (data->pos == record->pdu_len) {
 		uint16_t last_handle;
 		uint8_t pdu[6];
 
-		last_handle = get_le16(data->result->pdu + data->pos -
-							data->result->data_len);
+		last_handle = get_le16(record_pdu(record) + data->pos -
+							record->data_len);
 		if (last_handle == op->end_handle) {
 			success = true;
 			goto done;
@@ -1059,9 +1116,9 @@ static void read_included_cb(uint8_t opcode, const void *pdu,
 		goto done;
 	}
 
-	memcpy(read_pdu, data->result->pdu + data->pos + 2, sizeof(uint16_t));
+	memcpy(read_pdu, record_pdu(record) + data->pos + 2, sizeof(uint16_t));
 
-	data->pos += data->result->data_len;
+	data->pos += record->data_len;
 
 	if (bt_att_send(op->att, BT_ATT_OP_READ_REQ, read_pdu, sizeof(read_pdu),
 				read_included_cb, read_included_ref(data),
@@ -1078,11 +1135,12 @@ done:
 static void read_included(struct read_incl_data *data)
 {
 	struct bt_gatt_request *op = data->op;
+	struct result_record *record = read_included_record(data);
 	uint8_t pdu[2];
 
-	memcpy(pdu, data->result->pdu + 2, sizeof(uint16_t));
+	memcpy(pdu, record_pdu(record) + 2, sizeof(uint16_t));
 
-	data->pos += data->result->data_len;
+	data->pos += record->data_len;
 
 	if (bt_att_send(op->att, BT_ATT_OP_READ_REQ, pdu, sizeof(pdu),
 							read_included_cb,
@@ -1100,7 +1158,6 @@ static void discover_included_cb(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
 	struct bt_gatt_request *op = user_data;
-	struct bt_gatt_result *cur_result;
 	uint8_t att_ecode = 0;
 	uint16_t last_handle;
 	size_t data_length;
@@ -1134,9 +1191,7 @@ static void discover_included_cb(uint8_t opcode, const void *pdu,
 		goto failed;
 	}
 
-	cur_result = result_append(opcode, pdu + 1, length - 1, data_length,
-									op);
-	if (!cur_result) {
+	if (!result_append(opcode, pdu + 1, length - 1, data_length, op)) {
 		success = false;
 		goto failed;
 	}
@@ -1144,7 +1199,7 @@ static void discover_included_cb(uint8_t opcode, const void *pdu,
 	if (data_length == 6) {
 		struct read_incl_data *data;
 
-		data = new_read_included(cur_result);
+		data = new_read_included(op, op->result.last);
 		if (!data) {
 			success = false;
 			goto failed;
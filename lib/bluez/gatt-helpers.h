@@ -26,12 +26,14 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct bt_gatt_result;
 
 struct bt_gatt_iter {
 	struct bt_gatt_result *result;
+	size_t record;
 	uint16_t pos;
 };
 
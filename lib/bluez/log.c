@@ -0,0 +1,541 @@
+/**
+ * @file log.c
+ * @brief leveled binary logging with a background formatting thread
+ *
+ * Call sites copy a format pointer and the raw argument values (or the
+ * bytes of a hexdump) into a slot of a bounded lock-free queue; a single
+ * thread turns the records into text. Producers never block: when the
+ * queue is full the record is counted as dropped. Instead of starting
+ * that thread, an application can drain the queue from its own logging
+ * thread with bt_log_drain().
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "log.h"
+
+#define LOG_QUEUE_SIZE		1024	/* power of two */
+#define LOG_IDLE_NS		1000000
+
+enum log_arg_type {
+	ARG_INT,
+	ARG_UINT,
+	ARG_LONG,
+	ARG_ULONG,
+	ARG_LLONG,
+	ARG_ULLONG,
+	ARG_SIZE,
+	ARG_STR,
+	ARG_PTR,
+};
+
+struct log_record {
+	uint64_t timestamp;		/* CLOCK_MONOTONIC, ns */
+	const char *format;		/* NULL for a hexdump */
+	uint8_t level;
+	char dir;
+	uint16_t len;			/* hexdump length */
+	uint8_t nargs;
+	uint8_t types[BT_LOG_MAX_ARGS];
+	union {
+		uint64_t args[BT_LOG_MAX_ARGS];
+		uint8_t data[BT_LOG_MAX_DUMP];
+	};
+};
+
+/*
+ * Bounded multi-producer queue: a slot is free for the producer that
+ * claims position pos when its seq equals pos, and holds a record for the
+ * consumer when seq equals pos + 1
+ */
+struct log_slot {
+	size_t seq;
+	struct log_record record;
+};
+
+int bt_log_level = -1;
+
+static struct log_slot queue[LOG_QUEUE_SIZE];
+static size_t queue_tail;
+static size_t queue_head;
+static uint64_t dropped;
+
+static pthread_t thread;
+static bool initialized;
+static bool running;
+static bool stopping;
+static FILE *output;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct log_slot *claim_slot(void)
+{
+	size_t pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+	struct log_slot *slot;
+
+	for (;;) {
+		size_t seq;
+		intptr_t diff;
+
+		slot = &queue[pos & (LOG_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t) seq - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue_tail, &pos,
+						pos + 1, true,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->record.timestamp = now_ns();
+
+	return slot;
+}
+
+static void publish_slot(struct log_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Walk the conversions of format; returns the next one (after the '%')
+ * and its argument type, or NULL at the end. *end is set past the
+ * conversion character.
+ */
+static const char *next_conversion(const char *format, const char **end,
+						enum log_arg_type *type)
+{
+	const char *p;
+	int lmod = 0;
+	bool zmod = false;
+
+	for (p = format; (p = strchr(p, '%')); p += 2) {
+		if (p[1] != '%')
+			break;
+	}
+
+	if (!p)
+		return NULL;
+
+	format = p++;
+
+	p += strspn(p, "-+ #0");
+	p += strspn(p, "0123456789");
+	if (*p == '.') {
+		p++;
+		p += strspn(p, "0123456789");
+	}
+
+	for (; *p == 'h' || *p == 'l' || *p == 'z'; p++) {
+		if (*p == 'l')
+			lmod++;
+		else if (*p == 'z')
+			zmod = true;
+	}
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'c':
+		*type = zmod ? ARG_SIZE : lmod == 0 ? ARG_INT :
+					lmod == 1 ? ARG_LONG : ARG_LLONG;
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		*type = zmod ? ARG_SIZE : lmod == 0 ? ARG_UINT :
+					lmod == 1 ? ARG_ULONG : ARG_ULLONG;
+		break;
+	case 's':
+		*type = ARG_STR;
+		break;
+	case 'p':
+		*type = ARG_PTR;
+		break;
+	default:
+		/* Unsupported conversion: stop taking arguments */
+		return NULL;
+	}
+
+	*end = p + 1;
+
+	return format;
+}
+
+void bt_log_record(int level, const char *format, ...)
+{
+	struct log_slot *slot;
+	struct log_record *rec;
+	enum log_arg_type type;
+	const char *p = format;
+	va_list ap;
+
+	slot = claim_slot();
+	if (!slot)
+		return;
+
+	rec = &slot->record;
+	rec->level = level;
+	rec->format = format;
+	rec->nargs = 0;
+
+	va_start(ap, format);
+
+	while (rec->nargs < BT_LOG_MAX_ARGS &&
+				next_conversion(p, &p, &type)) {
+		uint64_t v;
+
+		switch (type) {
+		case ARG_INT:
+			v = (uint64_t) va_arg(ap, int);
+			break;
+		case ARG_UINT:
+			v = va_arg(ap, unsigned int);
+			break;
+		case ARG_LONG:
+			v = (uint64_t) va_arg(ap, long);
+			break;
+		case ARG_ULONG:
+			v = va_arg(ap, unsigned long);
+			break;
+		case ARG_LLONG:
+			v = (uint64_t) va_arg(ap, long long);
+			break;
+		case ARG_ULLONG:
+			v = va_arg(ap, unsigned long long);
+			break;
+		case ARG_SIZE:
+			v = va_arg(ap, size_t);
+			break;
+		case ARG_STR:
+			v = (uintptr_t) va_arg(ap, const char *);
+			break;
+		case ARG_PTR:
+		default:
+			v = (uintptr_t) va_arg(ap, void *);
+			break;
+		}
+
+		rec->types[rec->nargs] = type;
+		rec->args[rec->nargs++] = v;
+	}
+
+	va_end(ap);
+
+	publish_slot(slot);
+}
+
+void bt_log_record_dump(int level, char dir, const void *buf, size_t len)
+{
+	struct log_slot *slot;
+	struct log_record *rec;
+
+	slot = claim_slot();
+	if (!slot)
+		return;
+
+	if (len > BT_LOG_MAX_DUMP)
+		len = BT_LOG_MAX_DUMP;
+
+	rec = &slot->record;
+	rec->level = level;
+	rec->format = NULL;
+	rec->dir = dir;
+	rec->len = len;
+	memcpy(rec->data, buf, len);
+
+	publish_slot(slot);
+}
+
+/* Format one conversion spec [spec, end) with its recorded argument */
+static int format_arg(char *dst, size_t size, const char *spec,
+				const char *end, enum log_arg_type type,
+				uint64_t v)
+{
+	char fmt[32];
+	size_t len = end - spec;
+
+	if (len >= sizeof(fmt))
+		return 0;
+
+	memcpy(fmt, spec, len);
+	fmt[len] = '\0';
+
+	switch (type) {
+	case ARG_INT:
+		return snprintf(dst, size, fmt, (int) v);
+	case ARG_UINT:
+		return snprintf(dst, size, fmt, (unsigned int) v);
+	case ARG_LONG:
+		return snprintf(dst, size, fmt, (long) v);
+	case ARG_ULONG:
+		return snprintf(dst, size, fmt, (unsigned long) v);
+	case ARG_LLONG:
+		return snprintf(dst, size, fmt, (long long) v);
+	case ARG_ULLONG:
+		return snprintf(dst, size, fmt, (unsigned long long) v);
+	case ARG_SIZE:
+		return snprintf(dst, size, fmt, (size_t) v);
+	case ARG_STR:
+		return snprintf(dst, size, fmt, (const char *) (uintptr_t) v);
+	case ARG_PTR:
+	default:
+		return snprintf(dst, size, fmt, (void *) (uintptr_t) v);
+	}
+}
+
+/* Append src (up to len bytes) to the line, collapsing "%%" */
+static size_t append_text(char *line, size_t pos, size_t size,
+					const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && pos < size - 1; i++) {
+		if (src[i] == '%' && i + 1 < len && src[i + 1] == '%')
+			i++;
+		line[pos++] = src[i];
+	}
+
+	return pos;
+}
+
+struct dump_text {
+	char *buf;
+	size_t size;
+	size_t pos;
+};
+
+static void append_dump_line(const char *str, void *user_data)
+{
+	struct dump_text *text = user_data;
+	int n;
+
+	if (text->pos >= text->size)
+		return;
+
+	n = snprintf(text->buf + text->pos, text->size - text->pos, "\n%s",
+									str);
+	if (n > 0)
+		text->pos += n;
+}
+
+/* Format a record as text; a hexdump spans several lines */
+static void format_record(const struct log_record *rec, char *line,
+								size_t size)
+{
+	size_t pos;
+	const char *p;
+	const char *spec, *end;
+	enum log_arg_type type;
+	unsigned int i;
+
+	if (!rec->format) {
+		struct dump_text text = { line, size, 0 };
+		int n;
+
+		n = snprintf(line, size, "%u bytes", rec->len);
+		text.pos = n > 0 ? n : 0;
+		(util_hexdump)(rec->dir, rec->data, rec->len, append_dump_line,
+									&text);
+		return;
+	}
+
+	pos = 0;
+	p = rec->format;
+
+	for (i = 0; i < rec->nargs; i++) {
+		int n;
+
+		spec = next_conversion(p, &end, &type);
+		if (!spec)
+			break;
+
+		pos = append_text(line, pos, size, p, spec - p);
+
+		n = format_arg(line + pos, size - pos, spec, end,
+							rec->types[i],
+							rec->args[i]);
+		if (n > 0)
+			pos += (size_t) n < size - pos ?
+					(size_t) n : size - pos - 1;
+
+		p = end;
+	}
+
+	pos = append_text(line, pos, size, p, strlen(p));
+	line[pos] = '\0';
+}
+
+static void write_line(int level, uint64_t timestamp, const char *line,
+							void *user_data)
+{
+	static const char levels[] = "EWIDT";
+
+	fprintf(user_data, "[%llu.%06llu] %c %s\n",
+			(unsigned long long) (timestamp / 1000000000ULL),
+			(unsigned long long) (timestamp % 1000000000ULL) / 1000,
+			level >= 0 && (size_t) level < sizeof(levels) - 1 ?
+						levels[level] : '?', line);
+}
+
+/* Hand every published record to func; returns how many there were */
+static unsigned int drain(bt_log_line_func_t func, void *user_data)
+{
+	unsigned int count = 0;
+	char line[1024];
+
+	for (;;) {
+		struct log_slot *slot = &queue[queue_head &
+							(LOG_QUEUE_SIZE - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != queue_head + 1)
+			break;
+
+		format_record(&slot->record, line, sizeof(line));
+		func(slot->record.level, slot->record.timestamp, line,
+								user_data);
+
+		__atomic_store_n(&slot->seq, queue_head + LOG_QUEUE_SIZE,
+							__ATOMIC_RELEASE);
+		queue_head++;
+		count++;
+	}
+
+	return count;
+}
+
+static unsigned int drain_output(void)
+{
+	unsigned int count = drain(write_line, output);
+
+	if (count)
+		fflush(output);
+
+	return count;
+}
+
+static void *log_thread(void *user_data __attribute__((unused)))
+{
+	struct timespec idle = { 0, LOG_IDLE_NS };
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (!drain_output())
+			nanosleep(&idle, NULL);
+	}
+
+	drain_output();
+
+	return NULL;
+}
+
+static void reset_queue(void)
+{
+	size_t i;
+
+	for (i = 0; i < LOG_QUEUE_SIZE; i++)
+		queue[i].seq = i;
+
+	queue_head = 0;
+	queue_tail = 0;
+	initialized = true;
+}
+
+bool bt_log_start(int level, FILE *stream)
+{
+	if (running || !stream)
+		return false;
+
+	reset_queue();
+	output = stream;
+	stopping = false;
+
+	if (pthread_create(&thread, NULL, log_thread, NULL))
+		return false;
+
+	running = true;
+	__atomic_store_n(&bt_log_level, level, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void bt_log_stop(void)
+{
+	if (!running)
+		return;
+
+	__atomic_store_n(&bt_log_level, -1, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+
+	pthread_join(thread, NULL);
+	running = false;
+}
+
+void bt_log_set_level(int level)
+{
+	if (running)
+		return;
+
+	if (!initialized)
+		reset_queue();
+
+	__atomic_store_n(&bt_log_level, level, __ATOMIC_RELEASE);
+}
+
+unsigned int bt_log_drain(bt_log_line_func_t func, void *user_data)
+{
+	/* The thread started by bt_log_start() owns the queue */
+	if (running || !initialized || !func)
+		return 0;
+
+	return drain(func, user_data);
+}
+
+uint64_t bt_log_get_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,103 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Leveled logging for the protocol hot paths. A call site costs one
+ * compare against bt_log_level when its level is disabled at runtime, and
+ * nothing at all when it is above BT_LOG_MAX_LEVEL; arguments are only
+ * evaluated when the record is taken. Records are binary (format pointer
+ * plus raw arguments, or a copy of the dumped bytes) and are formatted by
+ * a background thread started with bt_log_start(), or by the caller's
+ * own logging thread through bt_log_drain().
+ *
+ * The format must outlive the record (a literal) and take at most
+ * BT_LOG_MAX_ARGS arguments. Integer, character and pointer conversions
+ * are copied by value; %s copies the pointer, so only strings that outlive
+ * the record (literals, static tables) may be passed. Floating point and
+ * %n are not supported.
+ */
+
+#ifndef BT_LOG_H
+#define BT_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BT_LOG_ERROR	0
+#define BT_LOG_WARN	1
+#define BT_LOG_INFO	2
+#define BT_LOG_DEBUG	3
+#define BT_LOG_TRACE	4
+
+/* Call sites above this level are compiled out */
+#ifndef BT_LOG_MAX_LEVEL
+#define BT_LOG_MAX_LEVEL BT_LOG_DEBUG
+#endif
+
+#define BT_LOG_MAX_ARGS		6
+#define BT_LOG_MAX_DUMP		96
+
+/* Runtime threshold; -1 until bt_log_start() */
+extern int bt_log_level;
+
+#define bt_log_enabled(level) \
+	((level) <= BT_LOG_MAX_LEVEL && \
+		(level) <= __atomic_load_n(&bt_log_level, __ATOMIC_RELAXED))
+
+#define bt_log(level, ...) \
+do { \
+	if (bt_log_enabled(level)) \
+		bt_log_record((level), __VA_ARGS__); \
+} while (0)
+
+#define bt_log_hexdump(level, dir, buf, len) \
+do { \
+	if (bt_log_enabled(level)) \
+		bt_log_record_dump((level), (dir), (buf), (len)); \
+} while (0)
+
+void bt_log_record(int level, const char *format, ...)
+					__attribute__((format(printf, 2, 3)));
+void bt_log_record_dump(int level, char dir, const void *buf, size_t len);
+
+/* Start the formatting thread writing to stream and enable level */
+bool bt_log_start(int level, FILE *stream);
+
+/* Disable logging, write out what is queued and stop the thread */
+void bt_log_stop(void);
+
+/* Receives one formatted record; timestamp is CLOCK_MONOTONIC in ns and
+ * a hexdump spans several lines */
+typedef void (*bt_log_line_func_t)(int level, uint64_t timestamp,
+					const char *line, void *user_data);
+
+/* Without a thread of our own: set the runtime threshold (-1 disables)
+ * and hand what is queued to func, returning how many records there
+ * were. Both are for a single caller, the thread that drains; they do
+ * nothing while a thread started by bt_log_start() owns the queue */
+void bt_log_set_level(int level);
+unsigned int bt_log_drain(bt_log_line_func_t func, void *user_data);
+
+/* Records dropped because the queue was full */
+uint64_t bt_log_get_dropped(void);
+
+#endif /* BT_LOG_H */
@@ -37,6 +37,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +54,20 @@ static int epoll_fd;
 static int epoll_terminate;
 static int exit_status;
 
+/* Held while events are dispatched; see mainloop_lock() */
+static pthread_mutex_t dispatch_lock;
+static pthread_once_t dispatch_lock_once = PTHREAD_ONCE_INIT;
+
+static void dispatch_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&dispatch_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
 /**
  * @brief mainloop file descriptor event data structure
  */
@@ -110,6 +125,23 @@ void mainloop_init(void)
 	epoll_terminate = 0;
 }
 
+/**
+ * Keep the loop from dispatching events until mainloop_unlock(). The
+ * objects driven by the loop (bt_att, bt_gatt_client, ...) are not thread
+ * safe: another thread must hold the lock while it calls into them. The
+ * lock is recursive, so callbacks run by the loop may take it again
+ */
+void mainloop_lock(void)
+{
+	pthread_once(&dispatch_lock_once, dispatch_lock_init);
+	pthread_mutex_lock(&dispatch_lock);
+}
+
+void mainloop_unlock(void)
+{
+	pthread_mutex_unlock(&dispatch_lock);
+}
+
 /**
  * set epoll_terminate to 1 (mainloop_run exit looping)
  */
@@ -163,6 +195,44 @@ static void signal_callback(int fd, uint32_t events, void *user_data)
 		data->callback(si.ssi_signo, data->user_data);
 }
 
+/**
+ * wait up to timeout ms (-1 for ever) for epoll events and dispatch them,
+ * once; for a caller that runs the loop itself instead of mainloop_run().
+ * Unlike mainloop_run(), doesn't look at epoll_terminate or tear anything
+ * down
+ *
+ * @param timeout	as for epoll_wait()
+ * @return number of events dispatched, <0 on error (-EINTR on a signal)
+ */
+int mainloop_iterate(int timeout)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int n, nfds;
+
+	nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+	if (nfds < 0)
+		return -errno;
+
+	mainloop_lock();
+
+	/*
+	 * Looked up by fd under the lock: another thread, or a callback
+	 * earlier in the batch, may have removed an entry since epoll_wait()
+	 */
+	for (n = 0; n < nfds; n++) {
+		struct mainloop_data *data = mainloop_list[events[n].data.fd];
+
+		if (!data)
+			continue;
+
+		data->callback(data->fd, events[n].events, data->user_data);
+	}
+
+	mainloop_unlock();
+
+	return nfds;
+}
+
 /**
  * main loop wait for epoll events
  * to exit the loop, set epoll_terminate to a <>0 value
@@ -193,23 +263,8 @@ int mainloop_run(void)
 
 	exit_status = EXIT_SUCCESS;
 
-	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
-
-		//nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 100);
-
-		if (nfds < 0)
-			continue;
-
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
-
-			data->callback(data->fd, events[n].events,
-							data->user_data);
-		}
-	}
+	while (!epoll_terminate)
+		mainloop_iterate(100);
 
 	if (signal_data) {
 		mainloop_remove_fd(signal_data->fd);
@@ -274,7 +329,7 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
-	ev.data.ptr = data;
+	ev.data.fd = fd;
 
 	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
 	if (err < 0) {
@@ -289,7 +344,7 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 
 /**
  * trigger an epoll event for an existing mainloop socket (exisiting mainloop_list[fd])
- * epool event "events" = events, "data.ptr" = mainloop_list[fd]
+ * epool event "events" = events, "data.fd" = fd
  *
  * @param fd		socket
  * @param events	EPOLL event like EPOLLIN, EPOLLOUT...
@@ -310,7 +365,7 @@ int mainloop_modify_fd(int fd, uint32_t events)
 
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
-	ev.data.ptr = data;
+	ev.data.fd = fd;
 
 	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
 	if (err < 0)
@@ -42,6 +42,11 @@ struct queue {
 	struct queue_entry *head;
 	struct queue_entry *tail;
 	unsigned int entries;
+	/// released entries kept for reuse, linked through next
+	struct queue_entry *spare;
+	unsigned int spares;
+	/// number of entries kept, set by queue_reserve()
+	unsigned int reserved;
 };
 
 /**
@@ -70,6 +75,13 @@ static void queue_unref(struct queue *queue)
 	if (__sync_sub_and_fetch(&queue->ref_count, 1))
 		return;
 
+	while (queue->spare) {
+		struct queue_entry *entry = queue->spare;
+
+		queue->spare = entry->next;
+		free(entry);
+	}
+
 	free(queue);
 }
 
@@ -126,37 +138,93 @@ static struct queue_entry *queue_entry_ref(struct queue_entry *entry)
 }
 
 /**
- * decrement &entry->ref_count and free entry structure if ref_count == 0
+ * decrement &entry->ref_count and, if ref_count == 0, keep the entry for
+ * reuse while the queue has fewer spares than it reserved, or free it
  *
+ * @param queue	queue the entry was taken from
  * @param entry
  */
-static void queue_entry_unref(struct queue_entry *entry)
+static void queue_entry_unref(struct queue *queue, struct queue_entry *entry)
 {
 	if (__sync_sub_and_fetch(&entry->ref_count, 1))
 		return;
 
+	if (queue->spares < queue->reserved) {
+		entry->next = queue->spare;
+		queue->spare = entry;
+		queue->spares++;
+		return;
+	}
+
 	free(entry);
 }
 
 /**
- * create a new queue, set queue->data to data, increment queue->ref_count
+ * create a new queue entry, taking a spare one if there is any, set
+ * entry->data to data, increment entry->ref_count
  *
+ * @param queue	queue the entry is for
  * @param data
- * @return	new queue pointer
+ * @return	new entry pointer
  */
-static struct queue_entry *queue_entry_new(void *data)
+static struct queue_entry *queue_entry_new(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
-	if (!entry)
-		return NULL;
+	if (queue->spare) {
+		entry = queue->spare;
+		queue->spare = entry->next;
+		queue->spares--;
+		memset(entry, 0, sizeof(*entry));
+	} else {
+		entry = new0(struct queue_entry, 1);
+		if (!entry)
+			return NULL;
+	}
 
 	entry->data = data;
 
 	return queue_entry_ref(entry);
 }
 
+/**
+ * allocate entries up front and keep up to count of them for reuse, so
+ * that a queue that holds at most count entries at a time never allocates
+ * again
+ *
+ * @param queue	queue pointer
+ * @param count	number of entries to keep
+ * @return	false on allocation failure
+ */
+bool queue_reserve(struct queue *queue, unsigned int count)
+{
+	if (!queue)
+		return false;
+
+	queue->reserved = count;
+
+	while (queue->spares < count) {
+		struct queue_entry *entry = new0(struct queue_entry, 1);
+
+		if (!entry)
+			return false;
+
+		entry->next = queue->spare;
+		queue->spare = entry;
+		queue->spares++;
+	}
+
+	while (queue->spares > count) {
+		struct queue_entry *entry = queue->spare;
+
+		queue->spare = entry->next;
+		queue->spares--;
+		free(entry);
+	}
+
+	return true;
+}
+
 /**
  * push a queue entry allocated with data and set it at the tail of queue
  *
@@ -171,7 +239,7 @@ bool queue_push_tail(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 	if (!entry)
 		return false;
 
@@ -202,7 +270,7 @@ bool queue_push_head(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 	if (!entry)
 		return false;
 
@@ -245,7 +313,7 @@ bool queue_push_after(struct queue *queue, void *entry, void *data)
 	if (!qentry)
 		return false;
 
-	new_entry = queue_entry_new(data);
+	new_entry = queue_entry_new(queue, data);
 	if (!new_entry)
 		return false;
 
@@ -283,7 +351,7 @@ void *queue_pop_head(struct queue *queue)
 
 	data = entry->data;
 
-	queue_entry_unref(entry);
+	queue_entry_unref(queue, entry);
 	queue->entries--;
 
 	return data;
@@ -344,7 +412,7 @@ void queue_foreach(struct queue *queue, queue_foreach_func_t function,
 
 		next = entry->next;
 
-		queue_entry_unref(entry);
+		queue_entry_unref(queue, entry);
 
 		entry = next;
 	}
@@ -419,7 +487,7 @@ bool queue_remove(struct queue *queue, void *data)
 		if (!entry->next)
 			queue->tail = prev;
 
-		queue_entry_unref(entry);
+		queue_entry_unref(queue, entry);
 		queue->entries--;
 
 		return true;
@@ -461,7 +529,7 @@ void *queue_remove_if(struct queue *queue, queue_match_func_t function,
 
 			data = entry->data;
 
-			queue_entry_unref(entry);
+			queue_entry_unref(queue, entry);
 			queue->entries--;
 
 			return data;
@@ -522,7 +590,7 @@ unsigned int queue_remove_all(struct queue *queue, queue_match_func_t function,
 			if (destroy)
 				destroy(tmp->data);
 
-			queue_entry_unref(tmp);
+			queue_entry_unref(queue, tmp);
 			count++;
 		}
 	}
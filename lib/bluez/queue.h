@@ -35,6 +35,7 @@ struct queue_entry {
 
 struct queue *queue_new(void);
 void queue_destroy(struct queue *queue, queue_destroy_func_t destroy);
+bool queue_reserve(struct queue *queue, unsigned int count);
 
 bool queue_push_tail(struct queue *queue, void *data);
 bool queue_push_head(struct queue *queue, void *data);
@@ -53,7 +53,7 @@
  * @param user_data	data for the "function"
  * @param format	format string template of str string
  */
-void util_debug(util_debug_func_t function, void *user_data,
+void (util_debug)(util_debug_func_t function, void *user_data,
 						const char *format, ...)
 {
 	char str[78];
@@ -78,7 +78,7 @@ void util_debug(util_debug_func_t function, void *user_data,
  * @param function		function to call with (str,user_data)
  * @param user_data		pointer to pass to function
  */
-void util_hexdump(const char dir, const unsigned char *buf, size_t len,
+void (util_hexdump)(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data)
 {
 	static const char hexdigits[] = "0123456789abcdef";
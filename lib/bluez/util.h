@@ -27,6 +27,8 @@
 #include <byteswap.h>
 #include <string.h>
 
+#include "log.h"
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define le16_to_cpu(val) (val)
 #define le32_to_cpu(val) (val)
@@ -92,6 +94,24 @@ void util_debug(util_debug_func_t function, void *user_data,
 void util_hexdump(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data);
 
+/*
+ * The debug callback is tested inline so that a disabled call site costs a
+ * branch and does not evaluate its arguments. Both compile out entirely
+ * when BT_LOG_MAX_LEVEL is below BT_LOG_DEBUG.
+ */
+#define util_debug(function, user_data, ...) \
+do { \
+	if (BT_LOG_DEBUG <= BT_LOG_MAX_LEVEL && (function)) \
+		(util_debug)((function), (user_data), __VA_ARGS__); \
+} while (0)
+
+#define util_hexdump(dir, buf, len, function, user_data) \
+do { \
+	if (BT_LOG_DEBUG <= BT_LOG_MAX_LEVEL && (function)) \
+		(util_hexdump)((dir), (buf), (len), (function), \
+							(user_data)); \
+} while (0)
+
 unsigned char util_get_dt(const char *parent, const char *name);
 
 uint8_t util_get_uid(unsigned int *bitmap, uint8_t max);
@@ -132,10 +132,32 @@ int bt_uuid128_create(bt_uuid_t *btuuid, uint128_t value)
 	return 0;
 }
 
+static uint32_t bt_uuid_short_value(const bt_uuid_t *uuid)
+{
+	return uuid->type == BT_UUID16 ? uuid->value.u16 : uuid->value.u32;
+}
+
+/*
+ * 16 and 32-bit UUIDs occupy the leading big-endian octets of the base
+ * UUID, so comparing their values orders them exactly as comparing the
+ * 128-bit forms would. Only a short UUID against a 128-bit one needs
+ * the conversion.
+ */
 int bt_uuid_cmp(const bt_uuid_t *uuid1, const bt_uuid_t *uuid2)
 {
 	bt_uuid_t u1, u2;
 
+	if ((uuid1->type == BT_UUID16 || uuid1->type == BT_UUID32) &&
+		(uuid2->type == BT_UUID16 || uuid2->type == BT_UUID32)) {
+		uint32_t v1 = bt_uuid_short_value(uuid1);
+		uint32_t v2 = bt_uuid_short_value(uuid2);
+
+		return v1 < v2 ? -1 : v1 > v2;
+	}
+
+	if (uuid1->type == BT_UUID128 && uuid2->type == BT_UUID128)
+		return bt_uuid128_cmp(uuid1, uuid2);
+
 	bt_uuid_to_uuid128(uuid1, &u1);
 	bt_uuid_to_uuid128(uuid2, &u2);
 
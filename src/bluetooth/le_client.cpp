@@ -23,12 +23,16 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "bluez.h"
 #include "bluetooth/l2_cap_socket.hpp"
 #include "bluetooth/utils.hpp"
 #include "minipro/minipro.hpp"
 #include "util/joystick.hpp"
+#include "util/logger.hpp"
+#include "util/metrics.hpp"
+#include "util/realtime.hpp"
 
 using namespace std::chrono_literals;
 using namespace jeronibot::util;
@@ -36,8 +40,49 @@ using namespace jeronibot::util;
 namespace bluetooth
 {
 
-LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec, uint16_t mtu)
+// Requests and ATT PDUs in flight that need no allocation, enough for the
+// drive and query packets written between two EPOLLOUT wakeups
+static const unsigned int preallocated_sends = 32;
+
+// lib/bluez's bt_log records are formatted on util::Logger's thread, go to
+// its sink and follow its threshold
+static void
+write_bt_log_line(int level, uint64_t timestamp, const char * line, void *)
+{
+  // bt_log stamps records with CLOCK_MONOTONIC, which steady_clock reads
+  auto age = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::nanoseconds(timestamp);
+  Logger::write(
+    static_cast<LogLevel>(level), LogComponent::Bluetooth,
+    std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(age),
+    line);
+}
+
+static unsigned int
+drain_bt_log()
+{
+  return bt_log_drain(write_bt_log_line, nullptr);
+}
+
+static const LogSource bt_log_source{drain_bt_log, bt_log_set_level};
+
+// bt_att and bt_gatt_client are driven by the mainloop on the input thread
+// and are not thread safe; calls into them from the caller's thread hold
+// the mainloop's lock
+class MainloopLock
+{
+public:
+  MainloopLock() { mainloop_lock(); }
+  ~MainloopLock() { mainloop_unlock(); }
+
+  MainloopLock(const MainloopLock &) = delete;
+  MainloopLock & operator=(const MainloopLock &) = delete;
+};
+
+LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec, uint16_t mtu, Dispatch dispatch)
+: dispatch_(dispatch)
 {
+  device_address_ = device_address;
+
   bdaddr_t dst_addr;
   str2ba(device_address.c_str(), &dst_addr);
 
@@ -45,8 +90,6 @@ LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec
   bdaddr_t bdaddr_any = {{0, 0, 0, 0, 0, 0}};
   bacpy(&src_addr, &bdaddr_any);
 
-  mainloop_init();
-
   l2_cap_socket_ = std::make_unique<L2CapSocket>(&src_addr, &dst_addr, dst_type, sec);
 
   fd_ = l2_cap_socket_->get_handle();
@@ -54,22 +97,145 @@ LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec
     throw std::runtime_error("LEClient: Failed to connect to Bluetooth device");
   }
 
+  init(mtu);
+}
+
+LEClient::LEClient(int fd, uint16_t mtu, Dispatch dispatch)
+: dispatch_(dispatch)
+{
+  if (fd < 0) {
+    throw std::runtime_error("LEClient: Invalid ATT bearer");
+  }
+
+  fd_ = fd;
+  init(mtu);
+}
+
+void
+LEClient::init_metrics()
+{
+  MetricsRegistry & registry = MetricsRegistry::get_default();
+
+  metric_labels_ = {{"device", device_address_.empty() ? "fd" : device_address_}};
+
+  Counter & connections = registry.counter("ble_connections_total", "ATT bearers set up", metric_labels_);
+  Counter & reconnects = registry.counter(
+    "ble_reconnects_total", "ATT bearers set up to a device connected to before", metric_labels_);
+  if (connections.get()) {
+    reconnects.inc();
+  }
+  connections.inc();
+
+  disconnects_ = &registry.counter("ble_disconnects_total", "ATT bearers lost", metric_labels_);
+  notify_interval_ = &registry.histogram(
+    "ble_notification_interval_seconds", "Time between notifications or indications", metric_labels_);
+
+  static const char * queue_names[] = {"req", "write", "ind"};
+  Gauge * depths[3];
+  Gauge * max_depths[3];
+  for (int i = 0; i < 3; i++) {
+    MetricLabels labels = metric_labels_;
+    labels.emplace_back("queue", queue_names[i]);
+    depths[i] = &registry.gauge("ble_att_queue_depth", "PDUs waiting in a bt_att send queue", labels);
+    max_depths[i] = &registry.gauge("ble_att_queue_max_depth", "High-water mark of a bt_att send queue", labels);
+  }
+
+  // Sampled when the metrics are exported
+  metrics_collector_ = registry.add_collector([this, depths, max_depths] {
+        struct bt_att_queue_stats stats = {};
+        {
+          MainloopLock lock;
+          if (!att_ || !bt_att_get_queue_stats(att_, &stats)) {
+            return;
+          }
+        }
+
+        depths[0]->set(stats.req);
+        depths[1]->set(stats.write);
+        depths[2]->set(stats.ind);
+        max_depths[0]->set(stats.max_req);
+        max_depths[1]->set(stats.max_write);
+        max_depths[2]->set(stats.max_ind);
+      });
+}
+
+void
+LEClient::metrics_cb(int metric, uint8_t opcode, uint64_t value, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+  MetricsRegistry & registry = MetricsRegistry::get_default();
+
+  auto labels = [This, opcode] {
+      char text[8];
+      snprintf(text, sizeof(text), "0x%02x", opcode);
+      MetricLabels labels = This->metric_labels_;
+      labels.emplace_back("opcode", text);
+      return labels;
+    };
+
+  switch (metric) {
+    case BT_ATT_METRIC_PDU_SENT:
+      if (!This->pdus_sent_[opcode]) {
+        This->pdus_sent_[opcode] = &registry.counter("ble_att_pdus_sent_total", "ATT PDUs sent", labels());
+      }
+      This->pdus_sent_[opcode]->inc();
+      break;
+
+    case BT_ATT_METRIC_PDU_RECEIVED:
+      if (!This->pdus_received_[opcode]) {
+        This->pdus_received_[opcode] = &registry.counter("ble_att_pdus_received_total", "ATT PDUs received", labels());
+      }
+      This->pdus_received_[opcode]->inc();
+
+      if (opcode == BT_ATT_OP_HANDLE_VAL_NOT || opcode == BT_ATT_OP_HANDLE_VAL_IND) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (This->last_notify_ns_) {
+          This->notify_interval_->observe(std::chrono::nanoseconds(now - This->last_notify_ns_));
+        }
+        This->last_notify_ns_ = now;
+      }
+      break;
+
+    case BT_ATT_METRIC_RESPONSE:
+      if (!This->request_rtt_[opcode]) {
+        This->request_rtt_[opcode] = &registry.histogram(
+          "ble_att_request_seconds", "Time from queuing an ATT request to its response", labels());
+      }
+      This->request_rtt_[opcode]->observe(std::chrono::nanoseconds(value));
+      break;
+
+    default:
+      break;
+  }
+}
+
+void
+LEClient::init(uint16_t mtu)
+{
+  mainloop_init();
+  init_metrics();
+  Logger::attach(bt_log_source);
+
   att_ = bt_att_new(fd_, false);
   if (!att_) {
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to initialize ATT transport layer\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "att_init_failed").device(device_address_);
     return;
   }
 
   if (!bt_att_set_close_on_unref(att_, true)) {
     bt_att_unref(att_);
-    fprintf(stderr, "Failed to set up ATT transport layer\n");
+    att_ = nullptr;
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "att_setup_failed").device(device_address_);
     return;
   }
 
-  if (!bt_att_register_disconnect(att_, LEClient::att_disconnect_cb, nullptr, nullptr)) {
+  bt_att_set_metrics_cb(att_, metrics_cb, this, nullptr);
+
+  if (!bt_att_register_disconnect(att_, LEClient::att_disconnect_cb, this, nullptr)) {
     bt_att_unref(att_);
-    fprintf(stderr, "Failed to set ATT disconnect handler\n");
+    att_ = nullptr;
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "att_disconnect_handler_failed").device(device_address_);
     return;
   }
 
@@ -77,49 +243,143 @@ LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec
   db_ = gatt_db_new();
   if (!db_) {
     bt_att_unref(att_);
-    fprintf(stderr, "Failed to create GATT database\n");
+    att_ = nullptr;
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "gatt_db_failed").device(device_address_);
     return;
   }
 
   gatt_ = bt_gatt_client_new(db_, att_, mtu);
   if (!gatt_) {
     gatt_db_unref(db_);
+    db_ = nullptr;
     bt_att_unref(att_);
-    fprintf(stderr, "Failed to create GATT client\n");
+    att_ = nullptr;
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "gatt_client_failed").device(device_address_);
     return;
   }
 
   gatt_db_register(db_, service_added_cb, service_removed_cb, nullptr, nullptr);
 
+  // Writes without response and notifications then don't allocate
+  if (!bt_gatt_client_preallocate(gatt_, preallocated_sends)) {
+    LOG_RECORD(LogLevel::Warn, LogComponent::Bluetooth, "preallocate_failed").device(device_address_);
+  }
+
+  // Alongside the client's own handlers, which see the same PDUs
+  bt_att_register(att_, BT_ATT_OP_HANDLE_VAL_NOT, record_notify_cb, this, nullptr);
+  bt_att_register(att_, BT_ATT_OP_HANDLE_VAL_IND, record_notify_cb, this, nullptr);
+
   bt_gatt_client_set_ready_handler(gatt_, ready_cb, this, nullptr);
   bt_gatt_client_set_service_changed(gatt_, service_changed_cb, this, nullptr);
 
   // bt_gatt_client already holds a reference
   gatt_db_unref(db_);
 
-  input_thread_ = std::make_unique<std::thread>(std::bind(&LEClient::process_input, this));
+  bool ready = false;
+  if (dispatch_ == Dispatch::Thread) {
+    input_thread_ = std::make_unique<std::thread>(std::bind(&LEClient::process_input, this));
 
-  // Wait for client to be ready
-  std::unique_lock<std::mutex> lk(mutex_);
-  if (cv_.wait_for(lk, 5s, [this] {return ready_;})) {
-    printf("LEClient: Ready\n");
+    // Wait for client to be ready
+    std::unique_lock<std::mutex> lk(mutex_);
+    ready = cv_.wait_for(lk, 5s, [this] {return ready_;});
   } else {
+    // Discovery goes on only while the loop runs
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (!ready_ && std::chrono::steady_clock::now() < deadline) {
+      run_once(100);
+    }
+    ready = ready_;
+  }
+
+  if (!ready) {
+    shutdown();
     throw std::runtime_error("LEClient: Did NOT initialize OK");
   }
+
+  LOG_RECORD(LogLevel::Info, LogComponent::Bluetooth, "ready").device(device_address_);
+}
+
+void
+LEClient::shutdown()
+{
+  // First, so that an export doesn't sample the bearer as it goes
+  MetricsRegistry::get_default().remove_collector(metrics_collector_);
+  metrics_collector_ = 0;
+
+  {
+    MainloopLock lock;
+    mainloop_quit();
+    bt_gatt_client_unref(gatt_);
+    bt_att_unref(att_);
+    gatt_ = nullptr;
+    att_ = nullptr;
+  }
+  if (input_thread_) {
+    input_thread_->join();
+    input_thread_.reset();
+  }
 }
 
 LEClient::~LEClient()
 {
-  mainloop_quit();
-  bt_gatt_client_unref(gatt_);
-  bt_att_unref(att_);
-  input_thread_->join();
+  shutdown();
+}
+
+int
+LEClient::run_once(int timeout_ms)
+{
+  return mainloop_iterate(timeout_ms);
+}
+
+bool
+LEClient::flush(std::chrono::milliseconds timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  for (;;) {
+    struct bt_att_queue_stats stats = {};
+    {
+      MainloopLock lock;
+      if (!bt_att_get_queue_stats(att_, &stats)) {
+        return false;
+      }
+    }
+
+    if (!stats.req && !stats.write && !stats.ind && !stats.pending) {
+      return true;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+
+    if (dispatch_ == Dispatch::Caller) {
+      run_once(10);
+    } else {
+      std::this_thread::sleep_for(1ms);
+    }
+  }
+}
+
+template<typename T>
+T
+LEClient::wait(std::future<T> & future)
+{
+  if (dispatch_ == Dispatch::Caller) {
+    while (future.wait_for(0s) != std::future_status::ready) {
+      run_once(100);
+    }
+  }
+
+  return future.get();
 }
 
 void
-LEClient::att_disconnect_cb(int err, void * /*user_data*/)
+LEClient::att_disconnect_cb(int err, void * user_data)
 {
-  printf("Device disconnected: %s\n", strerror(err));
+  LEClient * This = (LEClient *) user_data;
+  This->disconnects_->inc();
+
+  LOG_RECORD(LogLevel::Warn, LogComponent::Bluetooth, "disconnected").text(strerror(err));
   mainloop_quit();
 }
 
@@ -227,7 +487,8 @@ LEClient::ready_cb(bool success, uint8_t att_ecode, void * user_data)
 // TODO: sucess == false on disconnect?
 
   if (!success) {
-    printf("GATT discovery procedures failed - error code: 0x%02x\n", att_ecode);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "discovery_failed")
+    .device(This->device_address_).status(att_ecode);
     return;
   }
 
@@ -245,8 +506,9 @@ LEClient::service_changed_cb(uint16_t start_handle, uint16_t end_handle, void *
 {
   LEClient * This = (LEClient *) user_data;
 
-  printf("Service Changed handled - start: 0x%04x end: 0x%04x\n", start_handle, end_handle);
-  gatt_db_foreach_service_in_range(This->db_, nullptr, print_service, This, start_handle, end_handle);
+  // The range goes out as its first handle and the number of handles in it
+  LOG_RECORD(LogLevel::Info, LogComponent::Bluetooth, "service_changed")
+  .device(This->device_address_).handle(start_handle).length(end_handle - start_handle + 1);
 }
 
 void
@@ -254,61 +516,186 @@ LEClient::read_multiple_cb(
   bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * /*user_data*/)
 {
   if (!success) {
-    printf("\nRead multiple request failed: 0x%02x\n", att_ecode);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_multiple_failed")
+    .opcode(BT_ATT_OP_READ_MULT_REQ).status(att_ecode);
     return;
   }
 
-  printf("\nRead multiple value (%u bytes):", length);
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
-  }
-  printf("\n");
+  LOG_RECORD(LogLevel::Info, LogComponent::Bluetooth, "read_multiple")
+  .opcode(BT_ATT_OP_READ_MULT_REQ).data(value, length);
 }
 
 void
 LEClient::read_multiple(uint16_t * handles, uint8_t num_handles)
 {
+  MainloopLock lock;
   if (!bt_gatt_client_read_multiple(gatt_, handles, num_handles, read_multiple_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read multiple procedure\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_multiple_failed").opcode(BT_ATT_OP_READ_MULT_REQ);
   }
 }
 
 void
-LEClient::read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * /*user_data*/)
+LEClient::read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data)
 {
+  LEClient * This = (LEClient *) user_data;
+
   if (!success) {
-    printf("Read request failed: %s (0x%02x)\n", bluetooth::utils::to_string(att_ecode), att_ecode);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_failed")
+    .opcode(BT_ATT_OP_READ_REQ).status(att_ecode).text(bluetooth::utils::to_string(att_ecode));
     return;
   }
 
-  printf("\nRead value");
-  if (length == 0) {
-    printf(": 0 bytes\n");
+  // The response doesn't carry the handle it was read from
+  if (FlightRecorder * recorder = This->recorder_.load(std::memory_order_acquire)) {
+    recorder->record(FlightRecord::ReadResponse, 0, value, length);
+  }
+
+  LOG_RECORD(LogLevel::Info, LogComponent::Bluetooth, "read").opcode(BT_ATT_OP_READ_REQ).data(value, length);
+}
+
+void
+LEClient::read_value(uint16_t handle)
+{
+  MainloopLock lock;
+  if (!bt_gatt_client_read_value(gatt_, handle, read_cb, this, nullptr)) {
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_failed").handle(handle).opcode(BT_ATT_OP_READ_REQ);
+  }
+}
+
+// Owned by the request; freed by read_ring_destroy_cb()
+struct ReadRingRequest
+{
+  LEClient * client;
+  uint16_t handle;
+  std::shared_ptr<NotificationRing> ring;
+  bool answered;
+};
+
+void
+LEClient::read_ring_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data)
+{
+  auto request = (ReadRingRequest *) user_data;
+  request->answered = true;
+
+  if (!success) {
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_failed")
+    .handle(request->handle).opcode(BT_ATT_OP_READ_REQ).status(att_ecode).text(bluetooth::utils::to_string(att_ecode));
+    request->ring->push(request->handle, nullptr, 0);
     return;
   }
 
-  printf(" (%u bytes): ", length);
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
+  if (FlightRecorder * recorder = request->client->recorder_.load(std::memory_order_acquire)) {
+    recorder->record(FlightRecord::ReadResponse, request->handle, value, length);
   }
 
-  printf("\n");
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "read")
+  .handle(request->handle).opcode(BT_ATT_OP_READ_REQ).data(value, length);
+  request->ring->push(request->handle, value, length);
 }
 
 void
-LEClient::read_value(uint16_t handle)
+LEClient::read_ring_destroy_cb(void * user_data)
 {
-  if (!bt_gatt_client_read_value(gatt_, handle, read_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read value\n");
+  auto request = (ReadRingRequest *) user_data;
+
+  // Cancelled or disconnected before the response came
+  if (!request->answered) {
+    request->ring->push(request->handle, nullptr, 0);
   }
+
+  delete request;
+}
+
+bool
+LEClient::read_value(uint16_t handle, const std::shared_ptr<NotificationRing> & ring)
+{
+  auto request = new ReadRingRequest{this, handle, ring, false};
+
+  MainloopLock lock;
+  if (!bt_gatt_client_read_value(gatt_, handle, read_ring_cb, request, read_ring_destroy_cb)) {
+    // The destroy function isn't called when the request wasn't sent
+    delete request;
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "read_failed").handle(handle).opcode(BT_ATT_OP_READ_REQ);
+    return false;
+  }
+
+  return true;
+}
+
+static std::runtime_error
+read_long_error(uint8_t att_ecode)
+{
+  return std::runtime_error(std::string("LEClient: Read long value failed: ") +
+    bluetooth::utils::to_string(att_ecode));
+}
+
+void
+LEClient::read_long_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data)
+{
+  auto promise = (std::promise<std::vector<uint8_t>> *) user_data;
+
+  if (!success) {
+    promise->set_exception(std::make_exception_ptr(read_long_error(att_ecode)));
+    return;
+  }
+
+  promise->set_value(std::vector<uint8_t>(value, value + length));
 }
 
 void
+LEClient::read_long_into_cb(bool success, uint8_t att_ecode, const uint8_t * /*value*/, uint16_t length, void * user_data)
+{
+  // The value is already in the caller's buffer
+  auto promise = (std::promise<size_t> *) user_data;
+
+  if (!success) {
+    promise->set_exception(std::make_exception_ptr(read_long_error(att_ecode)));
+    return;
+  }
+
+  promise->set_value(length);
+}
+
+std::vector<uint8_t>
 LEClient::read_long_value(uint16_t handle, uint16_t offset)
 {
-  if (!bt_gatt_client_read_long_value(gatt_, handle, offset, read_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read long value\n");
+  std::promise<std::vector<uint8_t>> promise;
+  std::future<std::vector<uint8_t>> future = promise.get_future();
+  auto start = std::chrono::steady_clock::now();
+
+  {
+    MainloopLock lock;
+    if (!bt_gatt_client_read_long_value(gatt_, handle, offset, read_long_cb, (void *) &promise, nullptr)) {
+      throw std::runtime_error("LEClient: Failed to initiate read long value");
+    }
+  }
+
+  std::vector<uint8_t> value = wait(future);
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "read_long")
+  .handle(handle).opcode(BT_ATT_OP_READ_BLOB_REQ).length(value.size()).latency_since(start);
+
+  return value;
+}
+
+size_t
+LEClient::read_long_value(uint16_t handle, uint16_t offset, uint8_t * buf, size_t size)
+{
+  std::promise<size_t> promise;
+  std::future<size_t> future = promise.get_future();
+  auto start = std::chrono::steady_clock::now();
+
+  {
+    MainloopLock lock;
+    if (!bt_gatt_client_read_long_value_into(gatt_, handle, offset, buf, size, read_long_into_cb, (void *) &promise, nullptr)) {
+      throw std::runtime_error("LEClient: Failed to initiate read long value");
+    }
   }
+
+  size_t length = wait(future);
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "read_long")
+  .handle(handle).opcode(BT_ATT_OP_READ_BLOB_REQ).length(length).latency_since(start);
+
+  return length;
 }
 
 void
@@ -318,7 +705,8 @@ LEClient::write_long_cb(bool success, bool reliable_error, uint8_t att_ecode, vo
   if (success) {
     promise->set_value(0);
   } else if (reliable_error) {
-    printf("Reliable write not verified\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "reliable_write_not_verified")
+    .opcode(BT_ATT_OP_EXEC_WRITE_REQ);
   } else {
     promise->set_value(att_ecode);
   }
@@ -328,16 +716,25 @@ void
 LEClient::write_long_value(bool reliable_writes, uint16_t handle, uint16_t offset, uint8_t * value, int length)
 {
   std::promise<int> promise;
-  if (!bt_gatt_client_write_long_value(gatt_, reliable_writes, handle,
-      offset, value, length, write_long_cb, (void *) &promise, nullptr))
+  auto start = std::chrono::steady_clock::now();
   {
-    printf("Failed to initiate bt_gatt_client_write_long_value\n");
+    MainloopLock lock;
+    if (!bt_gatt_client_write_long_value(gatt_, reliable_writes, handle,
+        offset, value, length, write_long_cb, (void *) &promise, nullptr))
+    {
+      LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "write_long_failed")
+      .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ).length(length);
+    }
   }
 
   std::future<int> future = promise.get_future();
-  int rc = future.get();
+  int rc = wait(future);
   if (rc != 0) {
-    printf("bt_gatt_client_write_long_value failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "write_long_failed")
+    .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ).status(rc).text(bluetooth::utils::to_string(rc));
+  } else {
+    LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "write_long")
+    .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ).length(length).latency_since(start);
   }
 }
 
@@ -345,19 +742,26 @@ void
 LEClient::write_prepare(unsigned int id, uint16_t handle, uint16_t offset, uint8_t * value, unsigned int length)
 {
   if (reliable_session_id_ != id) {
-    printf("Session id != Ongoing session id (%u!=%u)\n", id, reliable_session_id_);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "prepare_write_wrong_session")
+    .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ);
     return;
   }
 
-  reliable_session_id_ = bt_gatt_client_prepare_write(gatt_, id, handle, offset, value, length,
-      // write_long_cb, nullptr, nullptr);
-      nullptr, nullptr, nullptr);
+  {
+    MainloopLock lock;
+    reliable_session_id_ = bt_gatt_client_prepare_write(gatt_, id, handle, offset, value, length,
+        // write_long_cb, nullptr, nullptr);
+        nullptr, nullptr, nullptr);
+  }
 
   if (!reliable_session_id_) {
-    printf("Failed to proceed prepare write\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "prepare_write_failed")
+    .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ).length(length);
+    return;
   }
 
-  printf("Prepare write success.\nSession id: %d to be used on next write\n", reliable_session_id_);
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "prepare_write")
+  .handle(handle).opcode(BT_ATT_OP_PREP_WRITE_REQ).length(length);
 }
 
 void
@@ -367,21 +771,46 @@ LEClient::write_cb(bool success, uint8_t att_ecode, void * user_data)
   promise->set_value(success? 0 : att_ecode);
 }
 
+void
+LEClient::set_recorder(FlightRecorder * recorder)
+{
+  recorder_.store(recorder, std::memory_order_release);
+}
+
+void
+LEClient::record_notify_cb(uint8_t /*opcode*/, const void * pdu, uint16_t length, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+  FlightRecorder * recorder = This->recorder_.load(std::memory_order_acquire);
+
+  if (!recorder || length < 2) {
+    return;
+  }
+
+  auto bytes = static_cast<const uint8_t *>(pdu);
+  recorder->record(FlightRecord::Notification, get_le16(bytes), bytes + 2, length - 2);
+}
+
 void
 LEClient::write_execute(unsigned int session_id, bool execute)
 {
   if (execute) {
     std::promise<int> promise;
-    if (!bt_gatt_client_write_execute(gatt_, session_id, write_cb, (void *) &promise, nullptr)) {
-      printf("Failed to proceed write execute\n");
+    {
+      MainloopLock lock;
+      if (!bt_gatt_client_write_execute(gatt_, session_id, write_cb, (void *) &promise, nullptr)) {
+        LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "execute_write_failed").opcode(BT_ATT_OP_EXEC_WRITE_REQ);
+      }
     }
 
     std::future<int> future = promise.get_future();
-    int rc = future.get();
+    int rc = wait(future);
     if (rc != 0) {
-      printf("Write failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
+      LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "execute_write_failed")
+      .opcode(BT_ATT_OP_EXEC_WRITE_REQ).status(rc).text(bluetooth::utils::to_string(rc));
     }
   } else {
+    MainloopLock lock;
     bt_gatt_client_cancel(gatt_, session_id);
   }
 
@@ -393,42 +822,30 @@ LEClient::notify_cb(
   uint16_t value_handle, const uint8_t * value,
   uint16_t length, void * user_data)
 {
-  printf("Handle Value Not/Ind: 0x%04x - ", value_handle);
-
-  if (length == 0) {
-    printf("(0 bytes)\n");
-    return;
-  }
-
-  printf("(%u bytes): ", length);
-
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
-  }
-
-  printf("\n");
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "notify").handle(value_handle).data(value, length);
 }
 
 void
 LEClient::register_notify_cb(uint16_t att_ecode, void * /*user_data*/)
 {
   if (att_ecode) {
-    printf("Failed to register notify handler - error code: 0x%02x\n", att_ecode);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "register_notify_failed").status(att_ecode);
     return;
   }
 
-  printf("Registered notify handler!");
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "register_notify");
 }
 
 // TODO(mjeronimo): return unsigned int?
 void
 LEClient::register_notify(uint16_t value_handle)
 {
+  MainloopLock lock;
   unsigned int id = bt_gatt_client_register_notify(
     gatt_, value_handle, register_notify_cb, notify_cb, nullptr, nullptr);
 
   if (!id) {
-    printf("Failed to register notify handler\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "register_notify_failed").handle(value_handle);
     return;
   }
 }
@@ -436,27 +853,122 @@ LEClient::register_notify(uint16_t value_handle)
 void
 LEClient::unregister_notify(unsigned int id)
 {
+  MainloopLock lock;
   if (!bt_gatt_client_unregister_notify(gatt_, id)) {
-    printf("Failed to unregister notify handler with id: %u\n", id);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "unregister_notify_failed");
+  }
+}
+
+void
+LEClient::ring_notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data)
+{
+  auto ring = (std::shared_ptr<NotificationRing> *) user_data;
+  (*ring)->push(value_handle, value, length);
+}
+
+void
+LEClient::ring_destroy_cb(void * user_data)
+{
+  delete (std::shared_ptr<NotificationRing> *) user_data;
+}
+
+std::shared_ptr<NotificationRing>
+LEClient::subscribe(uint16_t value_handle, size_t num_slots, size_t slot_size)
+{
+  auto ring = std::make_shared<NotificationRing>(num_slots, slot_size);
+
+  // The client holds its own reference until the handler is unregistered
+  auto client_ref = new std::shared_ptr<NotificationRing>(ring);
+
+  MainloopLock lock;
+  unsigned int id = bt_gatt_client_register_notify(
+    gatt_, value_handle, register_notify_cb, ring_notify_cb, client_ref, ring_destroy_cb);
+
+  if (!id) {
+    delete client_ref;
+    throw std::runtime_error("LEClient: Failed to register notify handler");
   }
+
+  ring->set_subscription_id(id);
+  return ring;
+}
+
+void
+LEClient::unsubscribe(const std::shared_ptr<NotificationRing> & ring)
+{
+  unregister_notify(ring->get_subscription_id());
+}
+
+uint16_t
+LEClient::find_characteristic(const std::string & uuid)
+{
+  bt_uuid_t u;
+  if (bt_string_to_uuid(&u, uuid.c_str()) < 0) {
+    throw std::runtime_error("LEClient: Invalid UUID: " + uuid);
+  }
+
+  return find_characteristic(u);
+}
+
+uint16_t
+LEClient::find_characteristic(const bt_uuid_t & uuid)
+{
+  // The value attribute of a characteristic has the characteristic's UUID
+  // as its type, so this is a single hash lookup in the database
+  MainloopLock lock;
+  struct gatt_db_attribute * attr = gatt_db_get_attribute_with_uuid(db_, &uuid);
+  return attr ? gatt_db_attribute_get_handle(attr) : 0;
+}
+
+void
+LEClient::find_ccc_cb(struct gatt_db_attribute * attr, void * user_data)
+{
+  auto handle = (uint16_t *) user_data;
+  bt_uuid_t ccc_uuid;
+  bt_uuid16_create(&ccc_uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+
+  if (!*handle && !bt_uuid_cmp(gatt_db_attribute_get_type(attr), &ccc_uuid)) {
+    *handle = gatt_db_attribute_get_handle(attr);
+  }
+}
+
+uint16_t
+LEClient::find_ccc(uint16_t value_handle)
+{
+  if (!value_handle) {
+    return 0;
+  }
+
+  // The characteristic declaration immediately precedes its value
+  MainloopLock lock;
+  struct gatt_db_attribute * decl = gatt_db_get_attribute(db_, value_handle - 1);
+  uint16_t handle = 0;
+
+  if (decl) {
+    gatt_db_service_foreach_desc(decl, find_ccc_cb, &handle);
+  }
+
+  return handle;
 }
 
 void
 LEClient::set_security(int level)
 {
   if (level < 1 || level > 3) {
-    printf("Invalid level: %d\n", level);
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "invalid_security_level").status(level);
     return;
   }
 
+  MainloopLock lock;
   if (!bt_gatt_client_set_security(gatt_, level)) {
-    printf("Could not set security level\n");
+    LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "set_security_failed").status(level);
   }
 }
 
 int
 LEClient::get_security()
 {
+  MainloopLock lock;
   return bt_gatt_client_get_security(gatt_);
 }
 
@@ -471,33 +983,51 @@ LEClient::local_counter(uint32_t * sign_cnt, void * /*user_data*/)
 void
 LEClient::set_sign_key(uint8_t key[16])
 {
+  MainloopLock lock;
   bt_att_set_local_key(att_, key, local_counter, this);
 }
 
-void
-LEClient::write_value(uint16_t handle, uint8_t * value, int length, bool without_response, bool signed_write)
+bool
+LEClient::write_value(uint16_t handle, const uint8_t * value, int length, bool without_response, bool signed_write)
 {
   if (without_response) {
+    MainloopLock lock;
     if (!bt_gatt_client_write_without_response(gatt_, handle, signed_write, value, length)) {
-      printf("Failed to initiate write-without-response procedure\n");
+      LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "write_failed")
+      .handle(handle).opcode(BT_ATT_OP_WRITE_CMD).length(length);
+      return false;
     }
   } else {
     std::promise<int> promise;
-    if (!bt_gatt_client_write_value(gatt_, handle, value, length, write_cb, (void *) &promise, nullptr)) {
-      printf("Failed to initiate write procedure\n");
+    auto start = std::chrono::steady_clock::now();
+    {
+      MainloopLock lock;
+      if (!bt_gatt_client_write_value(gatt_, handle, value, length, write_cb, (void *) &promise, nullptr)) {
+        LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "write_failed")
+        .handle(handle).opcode(BT_ATT_OP_WRITE_REQ).length(length);
+        return false;
+      }
     }
 
     std::future<int> future = promise.get_future();
-    int rc = future.get();
+    int rc = wait(future);
     if (rc != 0) {
-      printf("write_value failed\n");
+      LOG_RECORD(LogLevel::Error, LogComponent::Bluetooth, "write_failed")
+      .handle(handle).opcode(BT_ATT_OP_WRITE_REQ).status(rc).text(bluetooth::utils::to_string(rc));
+      return false;
     }
+
+    LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "write")
+    .handle(handle).opcode(BT_ATT_OP_WRITE_REQ).length(length).latency_since(start);
   }
+
+  return true;
 }
 
 void
 LEClient::process_input()
 {
+  Realtime::apply(ThreadRole::BluetoothInput);
   mainloop_run();
 }
 
@@ -0,0 +1,461 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bluetooth/le_scanner.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+extern "C" {
+#include "hci.h"
+#include "hci_lib.h"
+}
+
+#include "util/realtime.hpp"
+
+namespace bluetooth
+{
+
+// Advertising data (AD) types, Core Specification Supplement, Part A
+static const uint8_t AD_UUID16_SOME = 0x02;
+static const uint8_t AD_UUID16_ALL = 0x03;
+static const uint8_t AD_UUID32_SOME = 0x04;
+static const uint8_t AD_UUID32_ALL = 0x05;
+static const uint8_t AD_UUID128_SOME = 0x06;
+static const uint8_t AD_UUID128_ALL = 0x07;
+static const uint8_t AD_MANUFACTURER_DATA = 0xff;
+
+std::string
+LEDevice::get_address_string() const
+{
+  char str[18];
+  ba2str(&address, str);
+  return str;
+}
+
+LEScanner::LEScanner(const Config & config)
+: config_(config)
+{
+  init_table();
+
+  int dev_id = config_.dev_id >= 0 ? config_.dev_id : hci_get_route(nullptr);
+  if ((dd_ = hci_open_dev(dev_id)) < 0) {
+    throw std::runtime_error("LEScanner: Couldn't open HCI device");
+  }
+
+  // Reports are de-duplicated here, not by the controller, so that
+  // every advertisement updates the RSSI estimate
+  if (hci_le_set_scan_parameters(dd_, config_.active ? 0x01 : 0x00, htobs(config_.interval),
+    htobs(config_.window), LE_PUBLIC_ADDRESS, 0x00, 1000) < 0)
+  {
+    hci_close_dev(dd_);
+    throw std::runtime_error("LEScanner: Couldn't set scan parameters");
+  }
+
+  if (hci_le_set_scan_enable(dd_, 0x01, 0x00, 1000) < 0) {
+    hci_close_dev(dd_);
+    throw std::runtime_error("LEScanner: Couldn't enable scan");
+  }
+
+  // Only LE meta events are delivered to this socket from now on
+  struct hci_filter filter;
+  socklen_t filter_len = sizeof(filter);
+  saved_filter_.resize(sizeof(filter));
+  getsockopt(dd_, SOL_HCI, HCI_FILTER, saved_filter_.data(), &filter_len);
+
+  hci_filter_clear(&filter);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+  hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+
+  if (setsockopt(dd_, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
+    hci_le_set_scan_enable(dd_, 0x00, 0x00, 1000);
+    hci_close_dev(dd_);
+    throw std::runtime_error("LEScanner: Couldn't set HCI filter");
+  }
+
+  scanning_ = true;
+
+  // Launch a separate thread to handle the advertising reports
+  input_thread_ = std::make_unique<std::thread>(std::bind(&LEScanner::input_thread_func, this));
+}
+
+LEScanner::LEScanner()
+: LEScanner(Config())
+{
+}
+
+LEScanner::LEScanner(int dd, const Config & config)
+: config_(config), dd_(dd)
+{
+  try {
+    init_table();
+  } catch (...) {
+    close(dd_);
+    throw;
+  }
+
+  input_thread_ = std::make_unique<std::thread>(std::bind(&LEScanner::input_thread_func, this));
+}
+
+LEScanner::~LEScanner()
+{
+  should_exit_.store(true);
+  input_thread_->join();
+
+  if (!scanning_) {
+    close(dd_);
+    return;
+  }
+
+  setsockopt(dd_, SOL_HCI, HCI_FILTER, saved_filter_.data(), saved_filter_.size());
+  hci_le_set_scan_enable(dd_, 0x00, 0x00, 1000);
+  hci_close_dev(dd_);
+}
+
+void
+LEScanner::init_table()
+{
+  size_t capacity = 1;
+  while (capacity < config_.capacity) {
+    capacity <<= 1;
+  }
+  slots_ = std::make_unique<Slot[]>(capacity);
+  mask_ = capacity - 1;
+  max_probe_ = std::min(max_probe_, capacity);
+
+  for (auto & str : config_.service_uuids) {
+    bt_uuid_t uuid;
+    if (bt_string_to_uuid(&uuid, str.c_str()) < 0) {
+      throw std::runtime_error("LEScanner: Invalid service UUID: " + str);
+    }
+
+    MatchUuid match;
+    match.length = bt_uuid_len(&uuid);
+    bt_uuid_to_le(&uuid, match.bytes);
+    match_uuids_.push_back(match);
+  }
+}
+
+void
+LEScanner::input_thread_func()
+{
+  uint8_t buf[HCI_MAX_EVENT_SIZE];
+  struct pollfd pfd = {dd_, POLLIN, 0};
+
+  jeronibot::util::Realtime::apply(jeronibot::util::ThreadRole::Scanner);
+
+  while (!should_exit_) {
+    // Wake up periodically to check for shutdown
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    // Drain everything that's queued before going back to sleep
+    for (;;) {
+      ssize_t len = recv(dd_, buf, sizeof(buf), MSG_DONTWAIT);
+      if (len < 0 && errno == EINTR) {
+        continue;
+      }
+      if (len <= 0) {
+        break;
+      }
+      process_event(buf, len);
+    }
+  }
+}
+
+void
+LEScanner::process_event(const uint8_t * buf, size_t length)
+{
+  // Packet type, hci_event_hdr, evt_le_meta_event, number of reports
+  if (length < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE + 1 ||
+    buf[0] != HCI_EVENT_PKT || buf[1] != EVT_LE_META_EVENT)
+  {
+    return;
+  }
+
+  const uint8_t * end = buf + length;
+  const evt_le_meta_event * meta = reinterpret_cast<const evt_le_meta_event *>(buf + 1 + HCI_EVENT_HDR_SIZE);
+  if (meta->subevent != EVT_LE_ADVERTISING_REPORT) {
+    return;
+  }
+
+  uint8_t num_reports = meta->data[0];
+  const uint8_t * ptr = meta->data + 1;
+
+  for (uint8_t i = 0; i < num_reports; i++) {
+    // Each report is le_advertising_info, its data, then one RSSI octet
+    if (ptr + LE_ADVERTISING_INFO_SIZE > end) {
+      return;
+    }
+
+    const le_advertising_info * info = reinterpret_cast<const le_advertising_info *>(ptr);
+    if (info->data + info->length + 1 > end) {
+      return;
+    }
+
+    int8_t rssi = static_cast<int8_t>(info->data[info->length]);
+    update(info->bdaddr, info->bdaddr_type, rssi, info->data, info->length);
+
+    ptr = info->data + info->length + 1;
+  }
+}
+
+uint64_t
+LEScanner::to_key(const bdaddr_t & address, uint8_t address_type)
+{
+  // The top byte keeps a valid key from ever being 0
+  uint64_t key = 0;
+  memcpy(&key, address.b, sizeof(address.b));
+  return key | static_cast<uint64_t>(address_type & 0xff) << 48 | 1ull << 56;
+}
+
+void
+LEScanner::update(const bdaddr_t & address, uint8_t address_type, int8_t rssi, const uint8_t * data, size_t length)
+{
+  uint64_t key = to_key(address, address_type);
+  size_t home = (key * 0x9e3779b97f4a7c15ull) >> 32;
+  int64_t now = clock::now().time_since_epoch().count();
+
+  // Find the device, else a free slot, else evict the stalest slot in the window
+  Slot * slot = nullptr;
+  Slot * free_slot = nullptr;
+  Slot * stalest = nullptr;
+
+  for (size_t i = 0; i < max_probe_; i++) {
+    Slot & s = slots_[(home + i) & mask_];
+    uint64_t k = s.key.load(std::memory_order_relaxed);
+
+    if (k == key) {
+      slot = &s;
+      break;
+    }
+    if (k == 0) {
+      if (!free_slot) {
+        free_slot = &s;
+      }
+    } else if (!stalest ||
+      s.last_seen.load(std::memory_order_relaxed) < stalest->last_seen.load(std::memory_order_relaxed))
+    {
+      stalest = &s;
+    }
+  }
+
+  bool is_new = slot == nullptr;
+  if (is_new) {
+    slot = free_slot ? free_slot : stalest;
+  }
+
+  // Advertisements and scan responses carry different fields, so a
+  // device stays matched once any of its reports has matched
+  bool matched = is_match(data, length) || (!is_new && slot->matched.load(std::memory_order_relaxed));
+  float ewma = is_new ? rssi :
+    config_.rssi_alpha * rssi + (1.0f - config_.rssi_alpha) * slot->rssi.load(std::memory_order_relaxed);
+  uint32_t reports = is_new ? 1 : slot->num_reports.load(std::memory_order_relaxed) + 1;
+
+  uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->key.store(key, std::memory_order_relaxed);
+  slot->rssi.store(ewma, std::memory_order_relaxed);
+  slot->last_rssi.store(rssi, std::memory_order_relaxed);
+  slot->num_reports.store(reports, std::memory_order_relaxed);
+  slot->matched.store(matched, std::memory_order_relaxed);
+  slot->last_seen.store(now, std::memory_order_relaxed);
+
+  slot->seq.store(seq + 2, std::memory_order_release);
+
+  num_reports_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool
+LEScanner::read_slot(const Slot & slot, LEDevice & device) const
+{
+  uint64_t key;
+  uint32_t seq;
+
+  do {
+    seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+
+    key = slot.key.load(std::memory_order_relaxed);
+    device.rssi = slot.rssi.load(std::memory_order_relaxed);
+    device.last_rssi = slot.last_rssi.load(std::memory_order_relaxed);
+    device.num_reports = slot.num_reports.load(std::memory_order_relaxed);
+    device.matched = slot.matched.load(std::memory_order_relaxed);
+    device.last_seen = clock::time_point(clock::duration(slot.last_seen.load(std::memory_order_relaxed)));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || slot.seq.load(std::memory_order_relaxed) != seq);
+
+  if (key == 0) {
+    return false;
+  }
+
+  memcpy(device.address.b, &key, sizeof(device.address.b));
+  device.address_type = (key >> 48) & 0xff;
+  return true;
+}
+
+bool
+LEScanner::find(const bdaddr_t & address, LEDevice & device) const
+{
+  for (uint8_t type : {LE_PUBLIC_ADDRESS, LE_RANDOM_ADDRESS}) {
+    uint64_t key = to_key(address, type);
+    size_t home = (key * 0x9e3779b97f4a7c15ull) >> 32;
+
+    for (size_t i = 0; i < max_probe_; i++) {
+      const Slot & slot = slots_[(home + i) & mask_];
+      if (slot.key.load(std::memory_order_relaxed) != key) {
+        continue;
+      }
+
+      // Re-check the key under the sequence counter in case the slot was just evicted
+      if (read_slot(slot, device) && !bacmp(&device.address, &address) && device.address_type == type) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+std::vector<LEDevice>
+LEScanner::get_devices(std::chrono::milliseconds max_age) const
+{
+  std::vector<LEDevice> devices;
+  auto oldest = clock::now() - max_age;
+
+  for (size_t i = 0; i <= mask_; i++) {
+    LEDevice device;
+    if (read_slot(slots_[i], device) && device.last_seen >= oldest) {
+      devices.push_back(device);
+    }
+  }
+
+  return devices;
+}
+
+bool
+LEScanner::get_best_match(LEDevice & device, std::chrono::milliseconds max_age) const
+{
+  auto oldest = clock::now() - max_age;
+  bool found = false;
+
+  for (size_t i = 0; i <= mask_; i++) {
+    LEDevice candidate;
+    if (read_slot(slots_[i], candidate) && candidate.matched && candidate.last_seen >= oldest &&
+      (!found || candidate.rssi > device.rssi))
+    {
+      device = candidate;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+bool
+LEScanner::is_match(const uint8_t * data, size_t length) const
+{
+  for (auto & uuid : match_uuids_) {
+    if (has_service_uuid(data, length, uuid.bytes, uuid.length)) {
+      return true;
+    }
+  }
+
+  for (auto company_id : config_.company_ids) {
+    if (has_company_id(data, length, company_id)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+LEScanner::has_service_uuid(const uint8_t * data, size_t length, const uint8_t * uuid_le, size_t uuid_length)
+{
+  // AD structures are length, type, payload; the length covers the type
+  for (size_t i = 0; i + 1 < length && data[i] != 0; i += data[i] + 1) {
+    size_t field_len = data[i] - 1;
+    uint8_t type = data[i + 1];
+    const uint8_t * payload = &data[i + 2];
+
+    if (i + 1 + data[i] > length) {
+      break;
+    }
+
+    size_t size;
+    switch (type) {
+      case AD_UUID16_SOME:
+      case AD_UUID16_ALL:
+        size = 2;
+        break;
+      case AD_UUID32_SOME:
+      case AD_UUID32_ALL:
+        size = 4;
+        break;
+      case AD_UUID128_SOME:
+      case AD_UUID128_ALL:
+        size = 16;
+        break;
+      default:
+        continue;
+    }
+
+    if (size != uuid_length) {
+      continue;
+    }
+
+    for (size_t j = 0; j + size <= field_len; j += size) {
+      if (!memcmp(&payload[j], uuid_le, size)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool
+LEScanner::has_company_id(const uint8_t * data, size_t length, uint16_t company_id)
+{
+  for (size_t i = 0; i + 1 < length && data[i] != 0; i += data[i] + 1) {
+    if (i + 1 + data[i] > length) {
+      break;
+    }
+
+    // Manufacturer specific data starts with the company identifier, little endian
+    if (data[i + 1] == AD_MANUFACTURER_DATA && data[i] >= 3 &&
+      bt_get_le16(&data[i + 2]) == company_id)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}  // namespace bluetooth
@@ -0,0 +1,84 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bluetooth/notification_ring.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace bluetooth
+{
+
+static const size_t cache_line_size = 64;
+
+NotificationRing::NotificationRing(size_t num_slots, size_t slot_size)
+: slot_size_(slot_size)
+{
+  if (num_slots == 0 || slot_size == 0 || slot_size > std::numeric_limits<uint16_t>::max()) {
+    throw std::runtime_error("NotificationRing: Invalid ring size");
+  }
+
+  size_t capacity = 1;
+  while (capacity < num_slots) {
+    capacity <<= 1;
+  }
+  mask_ = capacity - 1;
+
+  // Whole cache lines per slot so that neighbouring slots don't share
+  stride_ = (sizeof(Notification) + slot_size + cache_line_size - 1) & ~(cache_line_size - 1);
+
+  storage_ = std::make_unique<uint8_t[]>(capacity * stride_ + cache_line_size);
+  uintptr_t base = reinterpret_cast<uintptr_t>(storage_.get());
+  buffer_ = storage_.get() + ((cache_line_size - (base & (cache_line_size - 1))) & (cache_line_size - 1));
+}
+
+bool
+NotificationRing::push(uint16_t value_handle, const uint8_t * value, uint16_t length)
+{
+  size_t head = head_.load(std::memory_order_relaxed);
+
+  // Only reload the consumer's index when the ring looks full
+  if (head - cached_tail_ > mask_) {
+    cached_tail_ = tail_.load(std::memory_order_acquire);
+    if (head - cached_tail_ > mask_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+
+  Notification * n = slot(head);
+  n->timestamp = std::chrono::steady_clock::now();
+  n->value_handle = value_handle;
+  n->truncated = length > slot_size_;
+  n->length = n->truncated ? slot_size_ : length;
+
+  if (n->length) {
+    memcpy(n->data(), value, n->length);
+  }
+
+  if (n->truncated) {
+    truncated_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  head_.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+size_t
+NotificationRing::size() const
+{
+  return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+}
+
+}  // namespace bluetooth
@@ -0,0 +1,191 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bluetooth/rpa_resolver.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace bluetooth
+{
+
+RpaResolver::RpaResolver(std::chrono::milliseconds cache_ttl)
+: cache_ttl_(cache_ttl)
+{
+}
+
+void
+RpaResolver::add_irk(const bdaddr_t & identity, const uint8_t irk[16])
+{
+  // ah() runs AES with the most significant octet of the key first
+  uint8_t key_msb[16];
+  bt_aes_swap_buf(irk, key_msb, sizeof(key_msb));
+
+  Key key;
+  bacpy(&key.identity, &identity);
+
+  enum bt_aes_impl impl =
+    bt_aes_impl_supported(BT_AES_IMPL_AESNI) ? BT_AES_IMPL_AESNI : BT_AES_IMPL_GENERIC;
+
+  if (!bt_aes128_init(&key.aes, impl, key_msb)) {
+    throw std::runtime_error("RpaResolver: Failed to expand IRK");
+  }
+
+  keys_.push_back(key);
+}
+
+void
+RpaResolver::clear_irks()
+{
+  keys_.clear();
+  cache_.clear();
+}
+
+bool
+RpaResolver::is_rpa(const bdaddr_t & addr)
+{
+  // The two most significant bits of a resolvable private address are 0b01
+  return (addr.b[5] & 0xc0) == 0x40;
+}
+
+uint64_t
+RpaResolver::to_key(const bdaddr_t & addr)
+{
+  uint64_t key = 0;
+  memcpy(&key, addr.b, sizeof(addr.b));
+  return key;
+}
+
+size_t
+RpaResolver::resolve(const bdaddr_t * rpas, size_t count, const bdaddr_t ** identities)
+{
+  auto start = clock::now();
+  size_t resolved = 0;
+
+  pending_.clear();
+  plaintext_.clear();
+
+  // Serve what we can from the cache and queue the rest. An RPA is
+  // hash (b[0..2]) || prand (b[3..5]); ah() encrypts padding || prand
+  for (size_t i = 0; i < count; i++) {
+    identities[i] = nullptr;
+
+    if (!is_rpa(rpas[i])) {
+      continue;
+    }
+
+    auto it = cache_.find(to_key(rpas[i]));
+    if (it != cache_.end()) {
+      if (it->second.expires > start) {
+        identities[i] = &keys_[it->second.key_index].identity;
+        stats_.cache_hits++;
+        resolved++;
+        continue;
+      }
+      cache_.erase(it);
+    }
+
+    uint8_t block[16] = {0};
+    block[13] = rpas[i].b[5];
+    block[14] = rpas[i].b[4];
+    block[15] = rpas[i].b[3];
+
+    pending_.push_back(i);
+    plaintext_.insert(plaintext_.end(), block, block + sizeof(block));
+  }
+
+  ciphertext_.resize(plaintext_.size());
+
+  // Key-major: encrypt every still unresolved prand under one IRK, then
+  // drop the matches so that later keys have less to do
+  for (size_t k = 0; k < keys_.size() && !pending_.empty(); k++) {
+    size_t num_pending = pending_.size();
+
+    bt_aes128_encrypt_blocks(
+      &keys_[k].aes, plaintext_.data(), ciphertext_.data(), num_pending);
+    stats_.ah_evaluations += num_pending;
+
+    size_t kept = 0;
+    for (size_t p = 0; p < num_pending; p++) {
+      const bdaddr_t & rpa = rpas[pending_[p]];
+      const uint8_t * out = &ciphertext_[p * 16];
+
+      // ah(k, r) = e(k, r') mod 2^24, compared LSB first
+      if (out[15] == rpa.b[0] && out[14] == rpa.b[1] && out[13] == rpa.b[2]) {
+        identities[pending_[p]] = &keys_[k].identity;
+        cache_[to_key(rpa)] = {k, start + cache_ttl_};
+        resolved++;
+        continue;
+      }
+
+      if (kept != p) {
+        pending_[kept] = pending_[p];
+        memcpy(&plaintext_[kept * 16], &plaintext_[p * 16], 16);
+      }
+      kept++;
+    }
+
+    pending_.resize(kept);
+  }
+
+  stats_.addresses += count;
+  stats_.resolved += resolved;
+  stats_.busy_time += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start);
+
+  return resolved;
+}
+
+bool
+RpaResolver::resolve(const bdaddr_t & rpa, bdaddr_t & identity)
+{
+  const bdaddr_t * result = nullptr;
+
+  if (!resolve(&rpa, 1, &result)) {
+    return false;
+  }
+
+  bacpy(&identity, result);
+  return true;
+}
+
+void
+RpaResolver::expire_cache()
+{
+  auto now = clock::now();
+
+  for (auto it = cache_.begin(); it != cache_.end(); ) {
+    if (it->second.expires <= now) {
+      it = cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+double
+RpaResolver::Stats::resolutions_per_second() const
+{
+  double seconds = std::chrono::duration<double>(busy_time).count();
+  return seconds > 0 ? addresses / seconds : 0.0;
+}
+
+double
+RpaResolver::Stats::ah_per_second() const
+{
+  double seconds = std::chrono::duration<double>(busy_time).count();
+  return seconds > 0 ? ah_evaluations / seconds : 0.0;
+}
+
+}  // namespace bluetooth
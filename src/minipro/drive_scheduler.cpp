@@ -0,0 +1,108 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/drive_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+namespace jeronibot::minipro
+{
+
+DriveScheduler::DriveScheduler(const Config & config)
+: config_(config)
+{
+}
+
+DriveScheduler::DriveScheduler()
+: DriveScheduler(Config())
+{
+}
+
+bool
+DriveScheduler::update(int16_t throttle, int16_t steering, clock::time_point now)
+{
+  stats_.updates++;
+
+  if (!have_sent_) {
+    sent(throttle, steering, now);
+    return true;
+  }
+
+  // A setpoint that went back to what was last sent has nothing pending
+  bool changed = throttle != sent_throttle_ || steering != sent_steering_;
+  if (!changed) {
+    change_pending_ = false;
+  } else if (!change_pending_) {
+    change_pending_ = true;
+    change_time_ = now;
+  }
+
+  // Stopping (or starting) always goes out right away, however small
+  bool stop_changed = (throttle == 0 && steering == 0) != (sent_throttle_ == 0 && sent_steering_ == 0);
+
+  if (stop_changed ||
+    std::abs(throttle - sent_throttle_) > config_.epsilon ||
+    std::abs(steering - sent_steering_) > config_.epsilon)
+  {
+    sent(throttle, steering, now);
+    return true;
+  }
+
+  if (now - sent_time_ >= config_.keepalive) {
+    stats_.keepalives++;
+    sent(throttle, steering, now);
+    return true;
+  }
+
+  return false;
+}
+
+void
+DriveScheduler::sent(int16_t throttle, int16_t steering, clock::time_point now)
+{
+  if (change_pending_) {
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - change_time_);
+    stats_.max_latency = std::max(stats_.max_latency, latency);
+    stats_.total_latency += latency;
+    stats_.num_latencies++;
+    change_pending_ = false;
+  }
+
+  have_sent_ = true;
+  sent_throttle_ = throttle;
+  sent_steering_ = steering;
+  sent_time_ = now;
+  stats_.packets++;
+}
+
+double
+DriveScheduler::Stats::packets_per_second(clock::time_point now) const
+{
+  double seconds = std::chrono::duration<double>(now - start).count();
+  return seconds > 0 ? packets / seconds : 0.0;
+}
+
+std::chrono::nanoseconds
+DriveScheduler::Stats::mean_latency() const
+{
+  if (!num_latencies) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  return total_latency / static_cast<int64_t>(num_latencies);
+}
+
+}  // namespace jeronibot::minipro
@@ -14,110 +14,298 @@
 
 #include "minipro/minipro.hpp"
 
-#include "minipro/drive.hpp"
-#include "minipro/enter_remote_control_mode.hpp"
-#include "minipro/exit_remote_control_mode.hpp"
-#include "minipro/packet.hpp"
-
-#include <netinet/in.h>
+#include "minipro/protocol.hpp"
+#include "util/logger.hpp"
+#include "util/metrics.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <exception>
 #include <string>
 #include <vector>
 
 namespace jeronibot::minipro
 {
 
-MiniPro::MiniPro(const std::string & bt_addr)
-: LEClient(bt_addr)
+using util::LogComponent;
+using util::LogLevel;
+
+// Nordic UART service characteristics: the vehicle receives packets on RX
+// and sends them on TX, which is notified through its CCC descriptor
+static const char * nus_rx_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+static const char * nus_tx_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
+
+MiniPro::MiniPro(const std::string & bt_addr, Dispatch dispatch)
+: LEClient(bt_addr, BDADDR_LE_RANDOM, BT_SECURITY_LOW, 0, dispatch)
+{
+  find_handles();
+}
+
+MiniPro::MiniPro(int fd, Dispatch dispatch)
+: LEClient(fd, 0, dispatch)
+{
+  find_handles();
+}
+
+void
+MiniPro::find_handles()
 {
+  util::MetricsRegistry & registry = util::MetricsRegistry::get_default();
+  drive_updates_ = &registry.counter("minipro_drive_updates_total", "Setpoints given to update_drive()", metric_labels_);
+  drive_coalesced_ = &registry.counter(
+    "minipro_drive_coalesced_total", "Setpoints the drive scheduler held back", metric_labels_);
+  drive_dropped_ = &registry.counter(
+    "minipro_drive_dropped_total", "Drive packets that couldn't be queued", metric_labels_);
+  query_rtt_ = &registry.histogram(
+    "minipro_query_seconds", "From a GetSetValue query to its answer", metric_labels_);
+
+  if (uint16_t handle = find_characteristic(nus_rx_uuid)) {
+    tx_service_handle_ = handle;
+  }
+
+  if (uint16_t handle = find_characteristic(nus_tx_uuid)) {
+    notify_handle_ = handle;
+  }
+
+  LOG_RECORD(LogLevel::Info, LogComponent::MiniPro, "tx_handle")
+  .device(device_address_).handle(tx_service_handle_);
+  LOG_RECORD(LogLevel::Info, LogComponent::MiniPro, "notify_handle")
+  .device(device_address_).handle(notify_handle_);
+}
+
+bluetooth::LEScanner::Config
+MiniPro::get_scan_config()
+{
+  // The MiniPRO exposes its serial protocol through the Nordic UART service
+  bluetooth::LEScanner::Config config;
+  config.service_uuids.push_back("6e400001-b5a3-f393-e0a9-e50e24dcca9e");
+  return config;
 }
 
 units::velocity::miles_per_hour_t
 MiniPro::get_current_speed()
 {
-  // TODO(mjeronimo):
-  return 0_mph;
+  return units::velocity::kilometers_per_hour_t(get_value<protocol::Speed>() / 100.0);
 }
 
 units::current::ampere_t
 MiniPro::get_battery_level()
 {
-  // TODO(mjeronimo):
+  // TODO(mjeronimo): the vehicle reports the level in percent
+  // (protocol::BatteryLevel), not a current
   return 0_A;
 }
 
 units::voltage::volt_t
 MiniPro::get_voltage()
 {
-  // TODO(mjeronimo):
-  return 0_V;
+  return units::voltage::volt_t(get_value<protocol::Voltage>() / 100.0);
 }
 
 units::temperature::fahrenheit_t
 MiniPro::get_vehicle_temperature()
 {
-  // TODO(mjeronimo):
-  return 0_degF;
+  return units::temperature::celsius_t(get_value<protocol::Temperature>() / 10.0);
+}
+
+units::length::meter_t
+MiniPro::get_odometer()
+{
+  return units::length::meter_t(get_value<protocol::Odometer>());
 }
 
 void
 MiniPro::enable_notifications()
 {
-  write_config_value(0x0001);
+  if (telemetry_) {
+    return;
+  }
+
+  try {
+    telemetry_ = subscribe(notify_handle_, telemetry_config_.num_slots, telemetry_config_.slot_size);
+  } catch (const std::exception & e) {
+    // Nothing is pushed; only the polled values come in
+    LOG_RECORD(LogLevel::Error, LogComponent::MiniPro, "subscribe_failed")
+    .device(device_address_).handle(notify_handle_).text(e.what());
+    return;
+  }
+
+  last_telemetry_.reserve(telemetry_config_.slot_size);
+}
+
+void
+MiniPro::set_telemetry_config(const TelemetryConfig & config)
+{
+  telemetry_config_ = config;
+
+  // Reads still outstanding go to the old ring, which they keep until then
+  polled_.reset();
+  poll_pending_.assign(config.poll_handles.size(), false);
+  polled_values_.assign(config.poll_handles.size(), {});
+
+  if (config.poll_period.count() > 0 && !config.poll_handles.empty()) {
+    polled_ = std::make_shared<bluetooth::NotificationRing>(config.poll_handles.size(), config.slot_size);
+    for (auto & value : polled_values_) {
+      value.reserve(config.slot_size);
+    }
+  }
+}
+
+const std::vector<uint8_t> &
+MiniPro::get_polled_value(uint16_t handle) const
+{
+  static const std::vector<uint8_t> none;
+
+  auto & handles = telemetry_config_.poll_handles;
+  auto it = std::find(handles.begin(), handles.end(), handle);
+  return it == handles.end() ? none : polled_values_[it - handles.begin()];
 }
 
 void
 MiniPro::disable_notifications()
 {
-  write_config_value(0x0000);
+  if (!telemetry_) {
+    return;
+  }
+
+  // Take what is still in the ring before it goes
+  receive_packet();
+  unsubscribe(telemetry_);
+  telemetry_.reset();
 }
 
 void
 MiniPro::enter_remote_control_mode()
 {
-  packet::EnterRemoteControlMode packet;
-  send_packet(packet);
+  send_packet(protocol::enter_remote_control_mode);
+
+  // Start the new session with a drive packet on the first update
+  drive_scheduler_.reset();
 }
 
 void
 MiniPro::exit_remote_control_mode()
 {
-  packet::ExitRemoteControlMode packet;
-  send_packet(packet);
+  send_packet(protocol::exit_remote_control_mode);
 }
 
 void
 MiniPro::drive(int16_t throttle, int16_t steering)
 {
-  packet::Drive packet(throttle, steering);
-  send_packet(packet);
+  send_packet(protocol::Drive::encode(throttle, steering));
 }
 
-void
-MiniPro::send_packet(packet::Packet & packet)
+bool
+MiniPro::update_drive(int16_t throttle, int16_t steering, DriveScheduler::clock::time_point now)
+{
+  drive_updates_->inc();
+
+  if (!drive_scheduler_.update(throttle, steering, now)) {
+    drive_coalesced_->inc();
+    return false;
+  }
+
+  if (!send_packet(protocol::Drive::encode(throttle, steering))) {
+    drive_dropped_->inc();
+  }
+
+  return true;
+}
+
+bool
+MiniPro::send_packet(const uint8_t * bytes, size_t length)
 {
-  std::vector<uint8_t> bytes = packet.get_bytes();
-  write_value(tx_service_handle_, bytes.data(), bytes.size(), true);
+  if (util::FlightRecorder * recorder = recorder_.load(std::memory_order_acquire)) {
+    recorder->record(util::FlightRecord::Packet, tx_service_handle_, bytes, length);
+  }
+  LOG_RECORD(LogLevel::Trace, LogComponent::MiniPro, "send_packet")
+  .handle(tx_service_handle_).opcode(BT_ATT_OP_WRITE_CMD).data(bytes, length);
+  return write_value(tx_service_handle_, bytes, length, true);
 }
 
 bool
 MiniPro::receive_packet()
 {
-  read_value(tx_service_handle_);  // LEClient::read_cb() prints: "Read value (12 bytes): 55 aa 06 0a 03 7b 00 00 ac 09 bc fe"
+  size_t count = 0;
+  auto now = std::chrono::steady_clock::now();
 
-  read_value(config_service_handle_); //LEClient::read_cb() prints: "Read value (2 bytes): 00 01"
+  if (telemetry_) {
+    count = telemetry_->consume([this](const bluetooth::Notification & n) {
+          // e.g. "55aa060a037b0000ac09bcfe"
+          last_telemetry_.assign(n.data(), n.data() + n.length);
+          LOG_RECORD(LogLevel::Debug, LogComponent::MiniPro, "telemetry")
+          .handle(n.value_handle).data(n.data(), n.length);
+          decode(n);
+        });
+    num_telemetry_ += count;
+  }
 
-  //uint16_t handles[] {tx_service_handle_, config_service_handle_};
-  //read_multiple(handles, 2); // this fails:  "Read multiple request failed: 0x06"
+  // Answers come back as telemetry, so without a subscription there is
+  // no point in asking
+  if (telemetry_) {
+    for (size_t i; (i = query_scheduler_.next(now)) != QueryScheduler::npos; ) {
+      if (!send_packet(query_requests_[i])) {
+        query_scheduler_.failed(i);
+        break;
+      }
+    }
+  }
 
-  return true;
+  poll(now);
+  return count > 0;
 }
 
 void
-MiniPro::write_config_value(uint16_t value)
+MiniPro::decode(const bluetooth::Notification & n)
 {
-  uint16_t htons_value = htons(value);
-  write_value(config_service_handle_, (uint8_t *) &htons_value, sizeof(htons_value));
+  // The round trip ends when the answer arrived, not when it was consumed
+  // here
+  protocol::Incoming::dispatch(n.data(), n.length, [this, &n](auto message, const auto & values) {
+      using M = decltype(message);
+      if constexpr (M::operation == protocol::Operation::GetSetValue) {
+        values_[M::parameter] = std::get<0>(values);
+        if (query_scheduler_.answered(M::parameter, n.timestamp)) {
+          query_rtt_->observe(query_scheduler_.get_last_rtt());
+        }
+      }
+    });
+}
+
+void
+MiniPro::poll(std::chrono::steady_clock::time_point now)
+{
+  if (!polled_) {
+    return;
+  }
+
+  auto & handles = telemetry_config_.poll_handles;
+
+  // The responses, or an empty entry for a read that failed
+  polled_->consume([this, &handles](const bluetooth::Notification & n) {
+      auto it = std::find(handles.begin(), handles.end(), n.value_handle);
+      if (it == handles.end()) {
+        return;
+      }
+
+      size_t i = it - handles.begin();
+      poll_pending_[i] = false;
+      if (n.length) {
+        polled_values_[i].assign(n.data(), n.data() + n.length);
+        num_polled_++;
+        decode(n);
+      }
+    });
+
+  if (now - last_poll_ < telemetry_config_.poll_period) {
+    return;
+  }
+
+  for (size_t i = 0; i < handles.size(); i++) {
+    if (!poll_pending_[i]) {
+      poll_pending_[i] = read_value(handles[i], polled_);
+    }
+  }
+  last_poll_ = now;
 }
 
 }  // namespace jeronibot::minipro
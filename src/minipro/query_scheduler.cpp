@@ -0,0 +1,146 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/query_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace jeronibot::minipro
+{
+
+QueryScheduler::QueryScheduler(const Config & config)
+: config_(config)
+{
+}
+
+QueryScheduler::QueryScheduler()
+: QueryScheduler(Config())
+{
+}
+
+size_t
+QueryScheduler::add(uint8_t parameter, std::chrono::nanoseconds period)
+{
+  if (period.count() <= 0) {
+    throw std::runtime_error("QueryScheduler: Period must be positive");
+  }
+
+  for (const auto & query : queries_) {
+    if (query.parameter == parameter) {
+      throw std::runtime_error("QueryScheduler: Parameter already queried");
+    }
+  }
+
+  queries_.emplace_back(parameter, period);
+  return queries_.size() - 1;
+}
+
+void
+QueryScheduler::expire(clock::time_point now)
+{
+  for (auto & query : queries_) {
+    if (query.in_flight && now - query.sent >= config_.timeout) {
+      query.in_flight = false;
+      num_in_flight_--;
+      stats_.timeouts++;
+    }
+  }
+}
+
+size_t
+QueryScheduler::next(clock::time_point now)
+{
+  expire(now);
+
+  if (num_in_flight_ >= config_.max_in_flight) {
+    return npos;
+  }
+
+  size_t best = npos;
+  for (size_t i = 0; i < queries_.size(); i++) {
+    Query & query = queries_[i];
+    if (!query.started) {
+      query.started = true;
+      query.due = now;
+    }
+
+    if (!query.in_flight && query.due <= now && (best == npos || query.due < queries_[best].due)) {
+      best = i;
+    }
+  }
+
+  if (best == npos) {
+    return npos;
+  }
+
+  Query & query = queries_[best];
+  query.in_flight = true;
+  query.sent = now;
+  num_in_flight_++;
+
+  // Keep to the period, but don't make up for a stall with a burst
+  query.due += query.period;
+  if (query.due <= now) {
+    query.due = now + query.period;
+  }
+
+  stats_.requests++;
+  return best;
+}
+
+void
+QueryScheduler::failed(size_t index)
+{
+  Query & query = queries_[index];
+  if (query.in_flight) {
+    query.in_flight = false;
+    num_in_flight_--;
+    stats_.requests--;
+    query.due = query.sent;
+  }
+}
+
+bool
+QueryScheduler::answered(uint8_t parameter, clock::time_point now)
+{
+  for (auto & query : queries_) {
+    if (query.parameter == parameter && query.in_flight) {
+      query.in_flight = false;
+      num_in_flight_--;
+
+      last_rtt_ = std::chrono::duration_cast<std::chrono::nanoseconds>(now - query.sent);
+      stats_.max_rtt = std::max(stats_.max_rtt, last_rtt_);
+      stats_.total_rtt += last_rtt_;
+      stats_.responses++;
+      return true;
+    }
+  }
+
+  stats_.unsolicited++;
+  return false;
+}
+
+std::chrono::nanoseconds
+QueryScheduler::Stats::mean_rtt() const
+{
+  if (!responses) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  return total_rtt / static_cast<int64_t>(responses);
+}
+
+}  // namespace jeronibot::minipro
@@ -0,0 +1,619 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/replay.hpp"
+
+#include <fcntl.h>
+#include <linux/joystick.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bluez.h"
+#include "minipro/minipro.hpp"
+#include "minipro/teleop.hpp"
+#include "util/joystick.hpp"
+#include "util/xbox360_controller.hpp"
+
+using jeronibot::util::FlightLog;
+using jeronibot::util::FlightRecord;
+using jeronibot::util::Joystick;
+using jeronibot::util::JoystickSnapshot;
+using jeronibot::util::XBox360Controller;
+
+namespace jeronibot::minipro
+{
+
+// The fake device's database mirrors the handles the MiniPRO firmware
+// uses: the Nordic UART service with TX (notify, and its CCC) and RX
+static const char * nus_uuid = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+static const char * nus_rx_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+static const char * nus_tx_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
+
+static const uint16_t tx_decl_handle = 0x000a;
+static const uint16_t tx_value_handle = 0x000b;
+static const uint16_t tx_ccc_handle = 0x000c;
+static const uint16_t rx_decl_handle = 0x000d;
+static const uint16_t rx_value_handle = 0x000e;
+
+static const uint16_t peer_mtu = BT_ATT_DEFAULT_LE_MTU;
+
+// The replayed side of the link: a minimal ATT server on its own thread
+class ReplayPeer
+{
+public:
+  ReplayPeer(int fd, std::vector<const FlightRecord *> responses);
+  ~ReplayPeer();
+
+  void notify(uint16_t handle, const uint8_t * value, size_t length);
+
+  std::vector<std::vector<uint8_t>> get_packets();
+  uint64_t get_num_reads() const { return next_response_.load(std::memory_order_relaxed); }
+
+  // Writes to the CCC of TX and the last value written
+  uint64_t get_num_ccc_writes() const { return ccc_writes_.load(std::memory_order_acquire); }
+  uint16_t get_ccc_value() const { return ccc_value_.load(std::memory_order_relaxed); }
+
+protected:
+  struct Attribute
+  {
+    uint16_t handle;
+    uint8_t type[16];  // 128-bit, little endian
+    uint8_t type_length;
+    std::vector<uint8_t> value;
+  };
+
+  void add(uint16_t handle, const char * type, std::vector<uint8_t> value);
+  void run();
+  void handle_pdu(const uint8_t * pdu, size_t length);
+  void send(const uint8_t * pdu, size_t length);
+  void send_error(uint8_t opcode, uint16_t handle, uint8_t ecode);
+
+  void read_by_group_type(const uint8_t * pdu, size_t length);
+  void read_by_type(const uint8_t * pdu, size_t length);
+  void find_information(const uint8_t * pdu, size_t length);
+
+  static bool parse_type(const uint8_t * type, size_t length, uint8_t * type128);
+
+  int fd_;
+  std::vector<Attribute> attributes_;
+  std::vector<const FlightRecord *> responses_;
+  std::atomic<uint64_t> next_response_{0};
+
+  std::mutex mutex_;
+  std::vector<std::vector<uint8_t>> packets_;
+
+  std::atomic<uint16_t> ccc_value_{0};
+  std::atomic<uint64_t> ccc_writes_{0};
+
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+ReplayPeer::ReplayPeer(int fd, std::vector<const FlightRecord *> responses)
+: fd_(fd), responses_(std::move(responses))
+{
+  bt_uuid_t uuid;
+  uint8_t le[16];
+
+  bt_string_to_uuid(&uuid, nus_uuid);
+  bt_uuid_to_le(&uuid, le);
+  add(0x0001, "2800", std::vector<uint8_t>(le, le + 16));
+
+  auto declaration = [&](uint8_t properties, uint16_t value_handle, const char * type) {
+      std::vector<uint8_t> value(3);
+      value[0] = properties;
+      put_le16(value_handle, &value[1]);
+      bt_string_to_uuid(&uuid, type);
+      bt_uuid_to_le(&uuid, le);
+      value.insert(value.end(), le, le + 16);
+      return value;
+    };
+
+  add(tx_decl_handle, "2803", declaration(BT_GATT_CHRC_PROP_NOTIFY, tx_value_handle, nus_tx_uuid));
+  add(tx_value_handle, nus_tx_uuid, {});
+  add(tx_ccc_handle, "2902", {0x00, 0x00});
+  add(rx_decl_handle, "2803",
+    declaration(BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP, rx_value_handle, nus_rx_uuid));
+  add(rx_value_handle, nus_rx_uuid, {});
+
+  thread_ = std::thread(&ReplayPeer::run, this);
+}
+
+ReplayPeer::~ReplayPeer()
+{
+  should_exit_ = true;
+  thread_.join();
+  close(fd_);
+}
+
+void
+ReplayPeer::add(uint16_t handle, const char * type, std::vector<uint8_t> value)
+{
+  Attribute attr;
+  bt_uuid_t uuid, uuid128;
+
+  bt_string_to_uuid(&uuid, type);
+  bt_uuid_to_uuid128(&uuid, &uuid128);
+
+  attr.handle = handle;
+  bt_uuid_to_le(&uuid128, attr.type);
+  attr.type_length = bt_uuid_len(&uuid);
+  attr.value = std::move(value);
+  attributes_.push_back(std::move(attr));
+}
+
+bool
+ReplayPeer::parse_type(const uint8_t * type, size_t length, uint8_t * type128)
+{
+  bt_uuid_t uuid, uuid128;
+
+  if (length == 2) {
+    bt_uuid16_create(&uuid, get_le16(type));
+    bt_uuid_to_uuid128(&uuid, &uuid128);
+    bt_uuid_to_le(&uuid128, type128);
+    return true;
+  }
+
+  if (length == 16) {
+    memcpy(type128, type, 16);
+    return true;
+  }
+
+  return false;
+}
+
+void
+ReplayPeer::run()
+{
+  struct pollfd pfd = {fd_, POLLIN, 0};
+  uint8_t pdu[512];
+
+  while (!should_exit_) {
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    ssize_t n = recv(fd_, pdu, sizeof(pdu), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      break;  // the client went away
+    }
+
+    if (n > 0) {
+      handle_pdu(pdu, n);
+    }
+  }
+}
+
+void
+ReplayPeer::send(const uint8_t * pdu, size_t length)
+{
+  ::send(fd_, pdu, length, MSG_NOSIGNAL);
+}
+
+void
+ReplayPeer::send_error(uint8_t opcode, uint16_t handle, uint8_t ecode)
+{
+  uint8_t pdu[5] = {BT_ATT_OP_ERROR_RSP, opcode};
+  put_le16(handle, &pdu[2]);
+  pdu[4] = ecode;
+  send(pdu, sizeof(pdu));
+}
+
+void
+ReplayPeer::notify(uint16_t handle, const uint8_t * value, size_t length)
+{
+  uint8_t pdu[3 + FlightRecord::max_data];
+
+  length = std::min(length, FlightRecord::max_data);
+  pdu[0] = BT_ATT_OP_HANDLE_VAL_NOT;
+  put_le16(handle, &pdu[1]);
+  memcpy(&pdu[3], value, length);
+  send(pdu, 3 + length);
+}
+
+std::vector<std::vector<uint8_t>>
+ReplayPeer::get_packets()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return packets_;
+}
+
+void
+ReplayPeer::handle_pdu(const uint8_t * pdu, size_t length)
+{
+  uint8_t opcode = pdu[0];
+  uint8_t rsp[BT_ATT_DEFAULT_LE_MTU];
+
+  switch (opcode) {
+    case BT_ATT_OP_MTU_REQ:
+      rsp[0] = BT_ATT_OP_MTU_RSP;
+      put_le16(peer_mtu, &rsp[1]);
+      send(rsp, 3);
+      break;
+
+    case BT_ATT_OP_READ_BY_GRP_TYPE_REQ:
+      read_by_group_type(pdu, length);
+      break;
+
+    case BT_ATT_OP_READ_BY_TYPE_REQ:
+      read_by_type(pdu, length);
+      break;
+
+    case BT_ATT_OP_FIND_INFO_REQ:
+      find_information(pdu, length);
+      break;
+
+    case BT_ATT_OP_READ_REQ:
+      {
+        // Whatever the handle, the next response in the recording
+        uint64_t i = next_response_.fetch_add(1, std::memory_order_relaxed);
+        size_t n = 0;
+        rsp[0] = BT_ATT_OP_READ_RSP;
+        if (i < responses_.size()) {
+          n = std::min<size_t>({responses_[i]->length, FlightRecord::max_data, peer_mtu - 1u});
+          memcpy(&rsp[1], responses_[i]->data, n);
+        }
+        send(rsp, 1 + n);
+      }
+      break;
+
+    case BT_ATT_OP_READ_BLOB_REQ:
+      rsp[0] = BT_ATT_OP_READ_BLOB_RSP;
+      send(rsp, 1);
+      break;
+
+    case BT_ATT_OP_WRITE_REQ:
+    case BT_ATT_OP_WRITE_CMD:
+      if (length >= 3 && get_le16(&pdu[1]) == rx_value_handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        packets_.emplace_back(pdu + 3, pdu + length);
+      }
+      if (length >= 5 && get_le16(&pdu[1]) == tx_ccc_handle) {
+        ccc_value_.store(get_le16(&pdu[3]), std::memory_order_relaxed);
+        ccc_writes_.fetch_add(1, std::memory_order_release);
+      }
+      if (opcode == BT_ATT_OP_WRITE_REQ) {
+        rsp[0] = BT_ATT_OP_WRITE_RSP;
+        send(rsp, 1);
+      }
+      break;
+
+    case BT_ATT_OP_HANDLE_VAL_CONF:
+      break;
+
+    default:
+      // Commands get no response
+      if (!(opcode & 0x40)) {
+        send_error(opcode, 0x0000, BT_ATT_ERROR_REQUEST_NOT_SUPPORTED);
+      }
+      break;
+  }
+}
+
+void
+ReplayPeer::read_by_group_type(const uint8_t * pdu, size_t length)
+{
+  uint8_t type[16];
+
+  if (length != 7 && length != 21) {
+    send_error(pdu[0], 0x0000, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(&pdu[1]);
+  uint16_t end = get_le16(&pdu[3]);
+  parse_type(&pdu[5], length - 5, type);
+
+  // A single primary service covering every attribute
+  const Attribute & service = attributes_.front();
+  if (start > service.handle || end < service.handle || memcmp(type, service.type, 16)) {
+    send_error(pdu[0], start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  uint8_t rsp[2 + 4 + 16] = {BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 4 + 16};
+  put_le16(service.handle, &rsp[2]);
+  put_le16(attributes_.back().handle, &rsp[4]);
+  memcpy(&rsp[6], service.value.data(), 16);
+  send(rsp, sizeof(rsp));
+}
+
+void
+ReplayPeer::read_by_type(const uint8_t * pdu, size_t length)
+{
+  uint8_t type[16];
+
+  if (length != 7 && length != 21) {
+    send_error(pdu[0], 0x0000, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(&pdu[1]);
+  uint16_t end = get_le16(&pdu[3]);
+  parse_type(&pdu[5], length - 5, type);
+
+  // One attribute per response; the client asks again from the next handle
+  for (const Attribute & attr : attributes_) {
+    if (attr.handle < start || attr.handle > end || memcmp(type, attr.type, 16)) {
+      continue;
+    }
+
+    uint8_t rsp[BT_ATT_DEFAULT_LE_MTU] = {BT_ATT_OP_READ_BY_TYPE_RSP};
+    size_t n = std::min<size_t>(attr.value.size(), sizeof(rsp) - 4);
+    rsp[1] = static_cast<uint8_t>(2 + n);
+    put_le16(attr.handle, &rsp[2]);
+    memcpy(&rsp[4], attr.value.data(), n);
+    send(rsp, 4 + n);
+    return;
+  }
+
+  send_error(pdu[0], start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+}
+
+void
+ReplayPeer::find_information(const uint8_t * pdu, size_t length)
+{
+  if (length != 5) {
+    send_error(pdu[0], 0x0000, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(&pdu[1]);
+  uint16_t end = get_le16(&pdu[3]);
+
+  uint8_t rsp[BT_ATT_DEFAULT_LE_MTU] = {BT_ATT_OP_FIND_INFO_RSP};
+  size_t n = 2;
+  uint8_t type_length = 0;
+
+  // All the entries of a response have types of the same length
+  for (const Attribute & attr : attributes_) {
+    if (attr.handle < start || attr.handle > end) {
+      continue;
+    }
+    if (type_length && (attr.type_length != type_length || n + 2 + type_length > sizeof(rsp))) {
+      break;
+    }
+
+    type_length = attr.type_length;
+    put_le16(attr.handle, &rsp[n]);
+    if (type_length == 2) {
+      memcpy(&rsp[n + 2], &attr.type[12], 2);  // the 16-bit value within the base UUID
+    } else {
+      memcpy(&rsp[n + 2], attr.type, 16);
+    }
+    n += 2 + type_length;
+  }
+
+  if (!type_length) {
+    send_error(pdu[0], start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  rsp[1] = type_length == 2 ? 0x01 : 0x02;
+  send(rsp, n);
+}
+
+Replay::Replay(const std::string & path, const Config & config)
+: config_(config), log_(std::make_unique<FlightLog>(path))
+{
+  if (config_.tick <= std::chrono::nanoseconds(0)) {
+    throw std::runtime_error("Replay: Invalid tick period");
+  }
+}
+
+Replay::Replay(const std::string & path)
+: Replay(path, Config())
+{
+}
+
+Replay::Result
+Replay::run()
+{
+  const FlightLog & log = *log_;
+  Result result;
+
+  std::vector<const FlightRecord *> responses;
+  std::vector<const FlightRecord *> expected;
+  uint8_t num_axes = XBox360Controller::Axis_Digipad + 1;
+  bool have_axes = false;
+
+  for (size_t i = 0; i < log.size(); i++) {
+    if (log[i].type == FlightRecord::ReadResponse) {
+      responses.push_back(&log[i]);
+    } else if (log[i].type == FlightRecord::Packet) {
+      expected.push_back(&log[i]);
+    } else if (log[i].type == FlightRecord::Joystick && !have_axes && log[i].length >= 4) {
+      num_axes = std::min<size_t>((log[i].length - 4) / 4, JoystickSnapshot::max_axes);
+      have_axes = true;
+    }
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    throw std::runtime_error("Replay: Couldn't create the transport");
+  }
+
+  int js[2];
+  if (pipe2(js, O_CLOEXEC) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    throw std::runtime_error("Replay: Couldn't create the joystick source");
+  }
+
+  ReplayPeer peer(sv[1], responses);
+  Joystick joystick(js[0], num_axes, 32);
+  MiniPro minipro(sv[0]);
+
+  minipro.get_drive_scheduler().set_config(config_.scheduler);
+  minipro.enable_notifications();
+  minipro.enter_remote_control_mode();
+
+  // The stick's events are taken on this thread, between the updates
+  Teleop::Config teleop_config = config_.teleop;
+  teleop_config.sender_thread = false;
+  Teleop teleop(joystick, minipro, teleop_config);
+  joystick.stop_input_thread();
+
+  JoystickSnapshot last = {};
+  uint64_t written = 0;
+
+  auto apply_joystick = [&](const FlightRecord & r) {
+      JoystickSnapshot snapshot = {};
+      memcpy(&snapshot, r.data, std::min<size_t>(r.length, sizeof(snapshot)));
+
+      struct js_event events[JoystickSnapshot::max_axes + 32];
+      size_t n = 0;
+      uint32_t time = static_cast<uint32_t>(r.timestamp_ns / 1000000);
+
+      for (uint8_t number = 0; number < JoystickSnapshot::max_axes; number++) {
+        uint8_t axis;
+        bool is_y;
+        if (Joystick::axis_of_event(number, &axis, &is_y) && axis < num_axes &&
+          snapshot.axes[axis][is_y] != last.axes[axis][is_y])
+        {
+          events[n++] = {time, snapshot.axes[axis][is_y], JS_EVENT_AXIS, number};
+        }
+      }
+
+      uint32_t changed = snapshot.buttons ^ last.buttons;
+      for (uint8_t number = 0; number < 32; number++) {
+        if (changed & (1u << number)) {
+          events[n++] = {time, static_cast<int16_t>((snapshot.buttons >> number) & 1), JS_EVENT_BUTTON, number};
+        }
+      }
+
+      last = snapshot;
+      if (!n) {
+        return;
+      }
+
+      if (write(js[1], events, n * sizeof(events[0])) != static_cast<ssize_t>(n * sizeof(events[0]))) {
+        throw std::runtime_error("Replay: Couldn't feed the joystick");
+      }
+
+      // The update that follows has to see the new state
+      written += n;
+      while (joystick.get_num_events() < written) {
+        joystick.process_input();
+      }
+      result.joystick_events += n;
+    };
+
+  auto at = [](uint64_t t) {
+      return Teleop::clock::time_point(std::chrono::nanoseconds(t));
+    };
+
+  auto t0 = at(log.size() ? log[0].timestamp_ns : 0);
+  auto wall_start = std::chrono::steady_clock::now();
+
+  auto wait_until = [&](Teleop::clock::time_point t) {
+      if (config_.real_time) {
+        std::this_thread::sleep_until(wall_start + (t - t0));
+      }
+    };
+
+  // The loop of TeleopLoop::run(), with the records for input. It runs
+  // until the last record has gone in
+  auto now = t0;
+  auto next_tick = t0;
+  size_t next = 0;
+
+  for (;;) {
+    // Everything recorded up to now goes in before the update
+    for (; next < log.size() && at(log[next].timestamp_ns) <= now; next++) {
+      const FlightRecord & r = log[next];
+      result.records++;
+
+      if (r.type == FlightRecord::Joystick) {
+        apply_joystick(r);
+      } else if (r.type == FlightRecord::Notification) {
+        peer.notify(r.handle, r.data, r.length);
+        result.notifications++;
+      }
+    }
+
+    auto next_update = teleop.update(now);
+
+    if (now >= next_tick) {
+      minipro.receive_packet();
+      result.ticks++;
+      next_tick += config_.tick;
+    }
+
+    if (next >= log.size()) {
+      break;
+    }
+
+    now = std::min({next_update, next_tick, at(log[next].timestamp_ns)});
+    wait_until(now);
+  }
+  result.updates = teleop.get_stats().updates;
+
+  // Telemetry arrives on the client's input thread; let it catch up
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (minipro.get_num_telemetry() < result.notifications && std::chrono::steady_clock::now() < deadline) {
+    minipro.receive_packet();
+    std::this_thread::yield();
+  }
+
+  minipro.drive(0, 0);
+  minipro.exit_remote_control_mode();
+
+  // The CCC is cleared with a write request, after every packet
+  uint64_t ccc_writes = peer.get_num_ccc_writes();
+  minipro.disable_notifications();
+
+  deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (!(peer.get_num_ccc_writes() > ccc_writes && peer.get_ccc_value() == 0)) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      throw std::runtime_error("Replay: The client didn't unsubscribe");
+    }
+    std::this_thread::yield();
+  }
+
+  result.elapsed = std::chrono::steady_clock::now() - wall_start;
+  result.telemetry = minipro.get_num_telemetry();
+  result.read_responses = std::min<uint64_t>(peer.get_num_reads(), responses.size());
+
+  std::vector<std::vector<uint8_t>> sent = peer.get_packets();
+  result.sent_packets = sent.size();
+  result.expected_packets = expected.size();
+
+  for (size_t i = 0; i < std::max(sent.size(), expected.size()); i++) {
+    if (i >= sent.size() || i >= expected.size() ||
+      sent[i].size() != expected[i]->length ||
+      memcmp(sent[i].data(), expected[i]->data, std::min(sent[i].size(), FlightRecord::max_data)))
+    {
+      result.first_mismatch = i;
+      break;
+    }
+  }
+
+  close(js[1]);
+
+  return result;
+}
+
+}  // namespace jeronibot::minipro
@@ -0,0 +1,191 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/teleop.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <utility>
+
+#include "minipro/minipro.hpp"
+#include "util/realtime.hpp"
+
+namespace jeronibot::minipro
+{
+
+static inline int sign(int a) { return a > 0 ? 1 : -1; }
+
+// The part of an axis past the deadzone, shaped by the expo and scaled
+static int shape_axis(int value, const StickMapping & mapping, double scale)
+{
+  if (abs(value) < mapping.deadzone) {
+    return 0;
+  }
+
+  int range = 32767 - mapping.deadzone;
+  int magnitude = std::min(abs(value) - mapping.deadzone, range);
+
+  if (mapping.expo != 0.0 && range > 0) {
+    double n = static_cast<double>(magnitude) / range;
+    n = (1.0 - mapping.expo) * n + mapping.expo * n * n * n;
+    magnitude = static_cast<int>(std::lround(n * range));
+  }
+
+  double scaled = magnitude * sign(value) * scale;
+  return static_cast<int>(std::clamp(scaled, -32767.0, 32767.0));
+}
+
+DriveSetpoint
+teleop_setpoint(const util::AxisState & stick, const StickMapping & mapping)
+{
+  // Flip the axis values so that forward and right are positive values
+  // so that the direction of the MiniPRO matches the joysticks
+  int throttle = -stick.y;
+  int steering = -stick.x;
+
+  // Set values to zero if below the deadzone so that the MiniPRO is
+  // stable when the joysticks are released (and wouldn't otherwise go
+  // all the way back to 0). 4000 seems to work pretty well for my joystick
+  DriveSetpoint setpoint;
+  setpoint.throttle = static_cast<int16_t>(shape_axis(throttle, mapping, mapping.throttle_scale));
+  setpoint.steering = static_cast<int16_t>(shape_axis(steering, mapping, mapping.steering_scale));
+  return setpoint;
+}
+
+DriveSetpoint
+teleop_setpoint(const util::AxisState & stick)
+{
+  return teleop_setpoint(stick, StickMapping());
+}
+
+Teleop::Teleop(util::Joystick & joystick, MiniPro & minipro, const Config & config)
+: Teleop(joystick, [&minipro](int16_t throttle, int16_t steering, clock::time_point now) {
+      return minipro.update_drive(throttle, steering, now);
+    }, config)
+{
+}
+
+Teleop::Teleop(util::Joystick & joystick, DriveFunc drive, const Config & config)
+: joystick_(joystick), drive_(std::move(drive)), config_(config)
+{
+  if (config_.sender_thread) {
+    sender_thread_ = std::thread(&Teleop::sender_thread_func, this);
+  }
+
+  joystick_.set_axis_callback([this](uint8_t axis, util::AxisState state) {
+      if (axis == config_.axis) {
+        set_setpoint(teleop_setpoint(state, config_.mapping), joystick_.get_event_time());
+      }
+    });
+}
+
+Teleop::~Teleop()
+{
+  joystick_.set_axis_callback(nullptr);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    should_exit_ = true;
+  }
+  cv_.notify_one();
+  if (sender_thread_.joinable()) {
+    sender_thread_.join();
+  }
+}
+
+void
+Teleop::set_setpoint(const DriveSetpoint & setpoint, clock::time_point since)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    setpoint_ = setpoint;
+    if (!pending_) {
+      pending_ = true;
+      pending_since_ = since;
+    }
+    stats_.events++;
+  }
+  cv_.notify_one();
+}
+
+Teleop::Stats
+Teleop::get_stats()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+Teleop::clock::time_point
+Teleop::update(clock::time_point now)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (now >= next_update()) {
+    send(lock, now);
+  }
+  return next_update();
+}
+
+Teleop::clock::time_point
+Teleop::next_update() const
+{
+  // A new setpoint only has to wait out the rate limit
+  return last_update_ + (pending_ ? config_.min_interval : config_.idle_period);
+}
+
+void
+Teleop::sender_thread_func()
+{
+  util::Realtime::apply(util::ThreadRole::TeleopSender);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (!should_exit_) {
+    auto deadline = next_update();
+    if (clock::now() < deadline) {
+      if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+        util::Realtime::observe_wakeup(deadline);
+      }
+      continue;
+    }
+
+    send(lock, clock::now());
+  }
+}
+
+void
+Teleop::send(std::unique_lock<std::mutex> & lock, clock::time_point now)
+{
+  DriveSetpoint setpoint = setpoint_;
+  bool was_pending = pending_;
+  clock::time_point since = pending_since_;
+  pending_ = false;
+
+  // Not under the lock, so the input thread never waits on the link
+  lock.unlock();
+  bool sent = drive_(setpoint.throttle, setpoint.steering, now);
+  lock.lock();
+
+  last_update_ = now;
+  stats_.updates++;
+  stats_.packets += sent ? 1 : 0;
+  if (was_pending) {
+    stats_.max_latency = std::max(stats_.max_latency,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - since));
+  }
+}
+
+}  // namespace jeronibot::minipro
@@ -0,0 +1,149 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/teleop_loop.hpp"
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+#include "bluez.h"
+#include "util/realtime.hpp"
+
+namespace jeronibot::minipro
+{
+
+TeleopLoop::TeleopLoop(MiniPro & minipro, util::Joystick & joystick, Teleop & teleop, const Config & config)
+: minipro_(minipro), joystick_(joystick), teleop_(teleop), config_(config)
+{
+  if (minipro_.get_dispatch() != MiniPro::Dispatch::Caller) {
+    throw std::runtime_error("TeleopLoop: The MiniPro has to be created with Dispatch::Caller");
+  }
+
+  if (config_.tick.count() <= 0) {
+    throw std::runtime_error("TeleopLoop: Invalid tick period");
+  }
+
+  // steady_clock is CLOCK_MONOTONIC, so the timer is armed with its times
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd_ < 0) {
+    throw std::runtime_error("TeleopLoop: Couldn't create the timer");
+  }
+
+  if (mainloop_add_fd(timer_fd_, EPOLLIN, timer_cb, this, nullptr) < 0) {
+    close(timer_fd_);
+    throw std::runtime_error("TeleopLoop: Couldn't add the timer to the mainloop");
+  }
+
+  if (mainloop_add_fd(joystick_.get_fd(), EPOLLIN, joystick_cb, this, nullptr) < 0) {
+    mainloop_remove_fd(timer_fd_);
+    close(timer_fd_);
+    throw std::runtime_error("TeleopLoop: Couldn't add the joystick to the mainloop");
+  }
+}
+
+TeleopLoop::~TeleopLoop()
+{
+  mainloop_remove_fd(joystick_.get_fd());
+  mainloop_remove_fd(timer_fd_);
+  close(timer_fd_);
+}
+
+void
+TeleopLoop::joystick_cb(int fd, uint32_t events, void * user_data)
+{
+  TeleopLoop * This = (TeleopLoop *) user_data;
+
+  if (events & EPOLLIN) {
+    This->joystick_.process_input();
+    This->stats_.joystick++;
+  }
+
+  // The device went away; don't spin on it
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    mainloop_remove_fd(fd);
+  }
+}
+
+void
+TeleopLoop::timer_cb(int fd, uint32_t /*events*/, void * user_data)
+{
+  TeleopLoop * This = (TeleopLoop *) user_data;
+  uint64_t expirations;
+
+  if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    util::Realtime::observe_wakeup(This->armed_);
+    This->stats_.timer++;
+  }
+
+  // Spent; the same time has to be set again
+  This->armed_ = clock::time_point();
+}
+
+void
+TeleopLoop::arm(clock::time_point when)
+{
+  if (when == armed_) {
+    return;
+  }
+
+  // An all zero time would disarm the timer
+  int64_t ns = std::max<int64_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count(), 1);
+
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    throw std::runtime_error("TeleopLoop: Couldn't arm the timer");
+  }
+
+  armed_ = when;
+}
+
+void
+TeleopLoop::run(const std::atomic<bool> & should_exit)
+{
+  util::Realtime::apply(util::ThreadRole::Control);
+
+  auto next_tick = clock::now();
+
+  while (!should_exit) {
+    // Whatever woke the loop, the stick's setpoint is already in
+    auto now = clock::now();
+    auto next_update = teleop_.update(now);
+
+    if (now >= next_tick) {
+      minipro_.receive_packet();
+      stats_.ticks++;
+
+      // Late ticks are skipped rather than run back to back
+      next_tick += config_.tick;
+      if (next_tick <= now) {
+        next_tick = now + config_.tick;
+      }
+    }
+
+    arm(std::min(next_update, next_tick));
+    bluetooth::LEClient::run_once(-1);
+    stats_.wakeups++;
+  }
+}
+
+}  // namespace jeronibot::minipro
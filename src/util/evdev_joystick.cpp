@@ -0,0 +1,332 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/evdev_joystick.hpp"
+
+#include <fcntl.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace jeronibot::util
+{
+
+// The absolute axes paired into the joystick's axes, in the order the js
+// interface numbers them for a gamepad
+static const struct
+{
+  uint16_t x;
+  uint16_t y;
+} abs_pairs[] = {
+  {ABS_X, ABS_Y}, {ABS_RX, ABS_RY}, {ABS_Z, ABS_RZ}, {ABS_HAT0X, ABS_HAT0Y}, {ABS_HAT1X, ABS_HAT1Y},
+  {ABS_HAT2X, ABS_HAT2Y}, {ABS_HAT3X, ABS_HAT3Y}, {ABS_THROTTLE, ABS_RUDDER}, {ABS_WHEEL, ABS_GAS},
+};
+
+static bool test_bit(const uint8_t * bits, unsigned int bit)
+{
+  return bits[bit / 8] & (1u << (bit % 8));
+}
+
+int
+EvdevJoystick::open_device(const std::string & device_name)
+{
+  int fd = open(device_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("EvdevJoystick: Couldn't open " + device_name);
+  }
+  return fd;
+}
+
+EvdevJoystick::EvdevJoystick(const std::string & device_name)
+: Joystick(open_device(device_name), 0, 0, false)
+{
+  uint8_t abs_bits[(ABS_CNT + 7) / 8] = {};
+  uint8_t key_bits[(KEY_CNT + 7) / 8] = {};
+
+  if (ioctl(fd_, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) == -1) {
+    throw std::runtime_error("EvdevJoystick: ioctl (EVIOCGBIT) failed");
+  }
+  if (ioctl(fd_, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) == -1) {
+    throw std::runtime_error("EvdevJoystick: ioctl (EVIOCGBIT) failed");
+  }
+
+  // Timestamps on the clock steady_clock reads
+  int clock_id = CLOCK_MONOTONIC;
+  if (ioctl(fd_, EVIOCSCLOCKID, &clock_id) == -1) {
+    throw std::runtime_error("EvdevJoystick: ioctl (EVIOCSCLOCKID) failed");
+  }
+
+  std::vector<AbsAxis> axes;
+  for (unsigned int code = 0; code < ABS_CNT; code++) {
+    struct input_absinfo info;
+    if (test_bit(abs_bits, code) && ioctl(fd_, EVIOCGABS(code), &info) != -1) {
+      axes.push_back({static_cast<uint16_t>(code), info.minimum, info.maximum});
+    }
+  }
+
+  std::vector<uint16_t> keys;
+  for (unsigned int code = 0; code < KEY_CNT; code++) {
+    if (test_bit(key_bits, code)) {
+      keys.push_back(static_cast<uint16_t>(code));
+    }
+  }
+
+  if (axes.empty()) {
+    throw std::runtime_error("EvdevJoystick: " + device_name + " has no absolute axes");
+  }
+
+  have_device_ = true;
+  build_maps(axes, keys);
+
+  // Start from where the sticks are
+  resync();
+  start();
+}
+
+EvdevJoystick::EvdevJoystick(int fd, const std::vector<AbsAxis> & axes, const std::vector<uint16_t> & keys)
+: Joystick(fd, 0, 0, false)
+{
+  build_maps(axes, keys);
+  start();
+}
+
+EvdevJoystick::~EvdevJoystick()
+{
+  // Before the overrides the input thread calls go away
+  stop();
+}
+
+void
+EvdevJoystick::build_maps(const std::vector<AbsAxis> & axes, const std::vector<uint16_t> & keys)
+{
+  auto find = [&axes](uint16_t code) {
+      return std::find_if(axes.begin(), axes.end(), [code](const AbsAxis & a) {return a.code == code;});
+    };
+
+  uint8_t axis = 0;
+  for (const auto & pair : abs_pairs) {
+    auto x = find(pair.x);
+    auto y = find(pair.y);
+    if (x == axes.end() && y == axes.end()) {
+      continue;
+    }
+    if (x != axes.end()) {
+      abs_map_[pair.x] = {true, axis, false, x->minimum, x->maximum};
+    }
+    if (y != axes.end()) {
+      abs_map_[pair.y] = {true, axis, true, y->minimum, y->maximum};
+    }
+    if (++axis == frame_axes_.size()) {
+      break;
+    }
+  }
+  num_axes_ = axis;
+
+  // Buttons are numbered like joydev numbers them: the joystick and
+  // gamepad buttons and up, then the miscellaneous ones
+  key_map_.fill(no_button);
+  std::vector<uint16_t> ordered;
+  for (uint16_t code : keys) {
+    if (code >= BTN_JOYSTICK && code < KEY_CNT) {
+      ordered.push_back(code);
+    }
+  }
+  for (uint16_t code : keys) {
+    if (code >= BTN_MISC && code < BTN_JOYSTICK) {
+      ordered.push_back(code);
+    }
+  }
+
+  uint8_t button = 0;
+  for (uint16_t code : ordered) {
+    if (button == no_button) {
+      break;
+    }
+    key_map_[code] = button++;
+  }
+  num_buttons_ = button;
+}
+
+int16_t
+EvdevJoystick::scale(uint16_t code, int32_t value) const
+{
+  const AxisMapping & mapping = abs_map_[code];
+  if (mapping.maximum <= mapping.minimum) {
+    return 0;
+  }
+
+  int64_t v = std::clamp(value, mapping.minimum, mapping.maximum);
+  int64_t range = static_cast<int64_t>(mapping.maximum) - mapping.minimum;
+  return static_cast<int16_t>((v - mapping.minimum) * 65534 / range - 32767);
+}
+
+void
+EvdevJoystick::read_events()
+{
+  // Many events a syscall; a frame may span reads
+  struct input_event events[64];
+  ssize_t n;
+
+  while ((n = read(fd_, events, sizeof(events))) > 0) {
+    size_t count = n / sizeof(events[0]);
+    for (size_t i = 0; i < count; i++) {
+      apply_event(events[i]);
+    }
+  }
+}
+
+void
+EvdevJoystick::apply_event(const struct input_event & event)
+{
+  if (event.type == EV_SYN && event.code == SYN_DROPPED) {
+    // The frame in progress is incomplete and what follows up to the next
+    // report is stale
+    dropping_ = true;
+    frame_changed_ = 0;
+    num_frame_buttons_ = 0;
+    num_dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  if (dropping_) {
+    if (event.type == EV_SYN && event.code == SYN_REPORT) {
+      dropping_ = false;
+      resync();
+    }
+    return;
+  }
+
+  switch (event.type) {
+    case EV_SYN:
+      if (event.code == SYN_REPORT) {
+        auto since_boot = std::chrono::seconds(event.input_event_sec) +
+          std::chrono::microseconds(event.input_event_usec);
+        event_time_ = std::chrono::steady_clock::time_point(
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(since_boot));
+        apply_frame();
+      }
+      break;
+
+    case EV_ABS:
+      if (event.code < ABS_CNT && abs_map_[event.code].used) {
+        const AxisMapping & mapping = abs_map_[event.code];
+        uint32_t bit = 1u << mapping.axis;
+        if (!(frame_changed_ & bit)) {
+          frame_axes_[mapping.axis] = unpack(axis_map_[mapping.axis].load(std::memory_order_relaxed));
+          frame_changed_ |= bit;
+        }
+        if (mapping.is_y) {
+          frame_axes_[mapping.axis].y = scale(event.code, event.value);
+        } else {
+          frame_axes_[mapping.axis].x = scale(event.code, event.value);
+        }
+      }
+      break;
+
+    case EV_KEY:
+      // 2 is autorepeat
+      if (event.code < KEY_CNT && key_map_[event.code] != no_button && event.value != 2) {
+        if (num_frame_buttons_ == max_frame_buttons) {
+          apply_frame();
+        }
+        frame_buttons_[num_frame_buttons_++] = {key_map_[event.code], event.value != 0};
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void
+EvdevJoystick::apply_frame()
+{
+  for (uint8_t axis = 0; frame_changed_; axis++) {
+    if (frame_changed_ & (1u << axis)) {
+      set_axis(axis, frame_axes_[axis]);
+      frame_changed_ &= ~(1u << axis);
+    }
+  }
+
+  for (size_t i = 0; i < num_frame_buttons_; i++) {
+    set_button(frame_buttons_[i].first, frame_buttons_[i].second);
+  }
+  num_frame_buttons_ = 0;
+
+  event_applied();
+
+  int64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - event_time_).count();
+  last_latency_.store(latency, std::memory_order_relaxed);
+  if (latency > max_latency_.load(std::memory_order_relaxed)) {
+    max_latency_.store(latency, std::memory_order_relaxed);
+  }
+}
+
+void
+EvdevJoystick::resync()
+{
+  // After a drop, the device's current state replaces what was missed
+  if (!have_device_) {
+    return;
+  }
+
+  frame_changed_ = 0;
+  for (unsigned int code = 0; code < ABS_CNT; code++) {
+    struct input_absinfo info;
+    if (!abs_map_[code].used || ioctl(fd_, EVIOCGABS(code), &info) == -1) {
+      continue;
+    }
+
+    const AxisMapping & mapping = abs_map_[code];
+    uint32_t bit = 1u << mapping.axis;
+    if (!(frame_changed_ & bit)) {
+      frame_axes_[mapping.axis] = unpack(axis_map_[mapping.axis].load(std::memory_order_relaxed));
+      frame_changed_ |= bit;
+    }
+    if (mapping.is_y) {
+      frame_axes_[mapping.axis].y = scale(code, info.value);
+    } else {
+      frame_axes_[mapping.axis].x = scale(code, info.value);
+    }
+  }
+
+  uint8_t key_bits[(KEY_CNT + 7) / 8] = {};
+  if (ioctl(fd_, EVIOCGKEY(sizeof(key_bits)), key_bits) != -1) {
+    for (unsigned int code = 0; code < KEY_CNT && num_frame_buttons_ < max_frame_buttons; code++) {
+      if (key_map_[code] != no_button) {
+        uint8_t button = key_map_[code];
+        bool pressed = test_bit(key_bits, code);
+        bool was_pressed = button < 32 && (buttons_ & (1u << button));
+        if (pressed != was_pressed) {
+          frame_buttons_[num_frame_buttons_++] = {button, pressed};
+        }
+      }
+    }
+  }
+
+  event_time_ = std::chrono::steady_clock::now();
+  apply_frame();
+}
+
+}  // namespace jeronibot::util
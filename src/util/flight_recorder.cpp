@@ -0,0 +1,215 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/flight_recorder.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace jeronibot::util
+{
+
+static const size_t header_size = 4096;
+
+static_assert(sizeof(FlightRecorderHeader) <= header_size, "FlightRecorderHeader must fit in its page");
+
+static int64_t
+clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+FlightRecorder::FlightRecorder(const std::string & path, size_t num_records)
+{
+  if (num_records == 0) {
+    throw std::runtime_error("FlightRecorder: Invalid number of records");
+  }
+
+  size_t capacity = 1;
+  while (capacity < num_records) {
+    capacity <<= 1;
+  }
+  mask_ = capacity - 1;
+
+  if ((fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+    throw std::runtime_error("FlightRecorder: Couldn't open " + path);
+  }
+
+  map_size_ = header_size + capacity * sizeof(FlightRecord);
+  if (ftruncate(fd_, map_size_) == -1) {
+    close(fd_);
+    throw std::runtime_error("FlightRecorder: Couldn't size " + path);
+  }
+
+  // Populate up front so that record() doesn't take page faults
+  map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, 0);
+  if (map_ == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("FlightRecorder: Couldn't map " + path);
+  }
+
+  header_ = static_cast<FlightRecorderHeader *>(map_);
+  records_ = reinterpret_cast<FlightRecord *>(static_cast<uint8_t *>(map_) + header_size);
+
+  header_->version = FlightRecorderHeader::version_value;
+  header_->record_size = sizeof(FlightRecord);
+  header_->capacity = capacity;
+  header_->wall_clock_ns = clock_ns(CLOCK_REALTIME);
+  header_->monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+  header_->commit.store(0, std::memory_order_relaxed);
+
+  // The magic goes last: a file without it was never initialized
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header_->magic, FlightRecorderHeader::magic_value, sizeof(header_->magic));
+}
+
+FlightRecorder::~FlightRecorder()
+{
+  msync(map_, map_size_, MS_ASYNC);
+  munmap(map_, map_size_);
+  close(fd_);
+}
+
+void
+FlightRecorder::record(FlightRecord::Type type, uint16_t handle, const uint8_t * data, size_t length)
+{
+  uint64_t pos = next_.fetch_add(1, std::memory_order_relaxed);
+  FlightRecord & r = records_[pos & mask_];
+
+  // Invalidate the slot before overwriting what the ring held there
+  r.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  size_t stored = std::min(length, FlightRecord::max_data);
+  r.timestamp_ns = clock_ns(CLOCK_MONOTONIC);
+  r.type = type;
+  r.flags = length > stored ? FlightRecord::Truncated : 0;
+  r.handle = handle;
+  r.length = static_cast<uint16_t>(std::min<size_t>(length, UINT16_MAX));
+  r.reserved = 0;
+  if (stored) {
+    memcpy(r.data, data, stored);
+  }
+
+  r.seq.store(pos + 1);
+
+  // Move the commit index past this record and any later ones that are
+  // already complete. If an earlier record is still being written the CAS
+  // fails, and its writer carries the index past this one when it is done
+  uint64_t commit = pos;
+  while (header_->commit.compare_exchange_strong(commit, commit + 1)) {
+    commit++;
+    if (records_[commit & mask_].seq.load() != commit + 1) {
+      break;
+    }
+  }
+}
+
+void
+FlightRecorder::record_joystick(const JoystickSnapshot & snapshot, uint8_t num_axes)
+{
+  num_axes = std::min<uint8_t>(num_axes, JoystickSnapshot::max_axes);
+  record(FlightRecord::Joystick, 0, reinterpret_cast<const uint8_t *>(&snapshot),
+    sizeof(snapshot.buttons) + num_axes * sizeof(snapshot.axes[0]));
+}
+
+void
+FlightRecorder::sync()
+{
+  msync(map_, map_size_, MS_ASYNC);
+}
+
+FlightLog::FlightLog(const std::string & path)
+{
+  if ((fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+    throw std::runtime_error("FlightLog: Couldn't open " + path);
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) == -1 || static_cast<size_t>(st.st_size) < header_size) {
+    close(fd_);
+    throw std::runtime_error("FlightLog: Not a flight recorder file: " + path);
+  }
+
+  map_size_ = st.st_size;
+  map_ = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map_ == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("FlightLog: Couldn't map " + path);
+  }
+
+  header_ = static_cast<const FlightRecorderHeader *>(map_);
+  uint64_t capacity = header_->capacity;
+
+  if (memcmp(header_->magic, FlightRecorderHeader::magic_value, sizeof(header_->magic)) ||
+    header_->version != FlightRecorderHeader::version_value ||
+    header_->record_size != sizeof(FlightRecord) ||
+    capacity == 0 || (capacity & (capacity - 1)) ||
+    map_size_ < header_size + capacity * sizeof(FlightRecord))
+  {
+    munmap(map_, map_size_);
+    close(fd_);
+    throw std::runtime_error("FlightLog: Not a flight recorder file: " + path);
+  }
+
+  auto records = reinterpret_cast<const FlightRecord *>(static_cast<const uint8_t *>(map_) + header_size);
+  auto valid = [&](uint64_t pos) {
+      return records[pos & (capacity - 1)].seq.load(std::memory_order_acquire) == pos + 1;
+    };
+
+  // Records past the commit index were complete but not yet committed when
+  // the writer stopped; the last one written ends the log
+  uint64_t end = header_->commit.load(std::memory_order_acquire);
+  uint64_t last = end;
+  for (uint64_t pos = end; pos < end + capacity; pos++) {
+    if (valid(pos)) {
+      last = pos + 1;
+    }
+  }
+
+  uint64_t first = last > capacity ? last - capacity : 0;
+  lost_ = first;
+
+  for (uint64_t pos = first; pos < last; pos++) {
+    if (valid(pos)) {
+      records_.push_back(&records[pos & (capacity - 1)]);
+    } else {
+      lost_++;
+    }
+  }
+}
+
+FlightLog::~FlightLog()
+{
+  munmap(map_, map_size_);
+  close(fd_);
+}
+
+int64_t
+FlightLog::wall_clock_ns(const FlightRecord & record) const
+{
+  return header_->wall_clock_ns + (static_cast<int64_t>(record.timestamp_ns) - header_->monotonic_ns);
+}
+
+}  // namespace jeronibot::util
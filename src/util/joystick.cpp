@@ -16,20 +16,51 @@
 
 #include <fcntl.h>
 #include <linux/joystick.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <exception>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <utility>
 
-#include "util/loop_rate.hpp"
+#include "util/realtime.hpp"
 
 namespace jeronibot::util
 {
 
+// Axis event numbers and the axis and coordinate they update:
+//
+// 0, 1 = Axis_LeftThumbstick x,y
+// 2    = Axis_Trigger - Left
+// 3, 4 = Axis_RightThumbstick x,y
+// 5    = Axis_Trigger - Right
+// 6, 7 = Axis_Digipad x,y
+static const struct
+{
+  uint8_t axis;
+  bool is_y;
+} event_axes[] = {{0, false}, {0, true}, {2, false}, {1, false}, {1, true}, {2, true}, {3, false}, {3, true}};
+
+bool
+Joystick::axis_of_event(uint8_t number, uint8_t * axis, bool * is_y)
+{
+  if (number >= sizeof(event_axes) / sizeof(event_axes[0])) {
+    return false;
+  }
+
+  *axis = event_axes[number].axis;
+  *is_y = event_axes[number].is_y;
+  return true;
+}
+
 Joystick::Joystick(const std::string & device_name)
 {
   if ((fd_ = open(device_name.c_str(), O_RDONLY)) == -1) {
@@ -44,13 +75,36 @@ Joystick::Joystick(const std::string & device_name)
     throw std::runtime_error("Joystick: ioctl (JSIOCGBUTTONS) failed");
   }
 
+  start();
+}
+
+Joystick::Joystick(int fd, uint8_t num_axes, uint8_t num_buttons)
+: Joystick(fd, num_axes, num_buttons, true)
+{
+}
+
+Joystick::Joystick(int fd, uint8_t num_axes, uint8_t num_buttons, bool start_input)
+: fd_(fd), num_axes_(num_axes), num_buttons_(num_buttons)
+{
+  if (fd_ < 0) {
+    throw std::runtime_error("Joystick: Invalid event source");
+  }
+
+  if (start_input) {
+    start();
+  }
+}
+
+void
+Joystick::start()
+{
+  // Axes a backend has already read the state of keep it
   for (int i = 0; i < num_axes_; i++) {
-    axis_map_[i].x = 0;
-    axis_map_[i].y = 0;
+    axis_map_.try_emplace(i, 0);
   }
 
   for (int i = 0; i < num_buttons_; i++) {
-    button_map_[i] = nullptr;
+    button_map_.try_emplace(i, nullptr);
   }
 
   // Set the handle to non-blocking so that the input thread
@@ -69,11 +123,32 @@ Joystick::Joystick()
 
 Joystick::~Joystick()
 {
-  should_exit_.store(true);
-  input_thread_->join();
+  stop();
   close(fd_);
 }
 
+void
+Joystick::stop()
+{
+  if (input_thread_) {
+    should_exit_.store(true);
+    input_thread_->join();
+    input_thread_.reset();
+  }
+}
+
+uint32_t
+Joystick::pack(AxisState state)
+{
+  return static_cast<uint16_t>(state.x) | static_cast<uint32_t>(static_cast<uint16_t>(state.y)) << 16;
+}
+
+AxisState
+Joystick::unpack(uint32_t packed)
+{
+  return {static_cast<int16_t>(packed & 0xffff), static_cast<int16_t>(packed >> 16)};
+}
+
 AxisState
 Joystick::get_axis_state(uint8_t axis)
 {
@@ -81,7 +156,39 @@ Joystick::get_axis_state(uint8_t axis)
     throw std::runtime_error("Joystick: get_axis_state: axis value out of range");
   }
 
-  return {axis_map_[axis].x, axis_map_[axis].y};
+  return unpack(axis_map_[axis].load(std::memory_order_relaxed));
+}
+
+void
+Joystick::set_axis(uint8_t axis, AxisState state)
+{
+  axis_map_[axis].store(pack(state), std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(axis_callback_mutex_);
+  if (axis_callback_) {
+    axis_callback_(axis, state);
+  }
+}
+
+void
+Joystick::set_button(uint8_t button, bool pressed)
+{
+  if (button < 32) {
+    buttons_ = pressed ? buttons_ | (1u << button) : buttons_ & ~(1u << button);
+  }
+  if (button < num_buttons_ && button_map_[button] != nullptr) {
+    button_map_[button](pressed);
+  }
+}
+
+void
+Joystick::event_applied()
+{
+  if (FlightRecorder * recorder = recorder_.load(std::memory_order_acquire)) {
+    record_snapshot(recorder);
+  }
+
+  num_events_.fetch_add(1, std::memory_order_release);
 }
 
 void
@@ -94,68 +201,88 @@ Joystick::set_button_callback(uint8_t button, std::function<void(bool)> callback
   button_map_[button] = callback;
 }
 
+void
+Joystick::set_axis_callback(std::function<void(uint8_t axis, AxisState state)> callback)
+{
+  std::lock_guard<std::mutex> lock(axis_callback_mutex_);
+  axis_callback_ = std::move(callback);
+}
+
+void
+Joystick::set_recorder(FlightRecorder * recorder)
+{
+  recorder_.store(recorder, std::memory_order_release);
+}
+
+void
+Joystick::record_snapshot(FlightRecorder * recorder)
+{
+  JoystickSnapshot snapshot;
+  uint8_t num_axes = std::min<uint8_t>(num_axes_, JoystickSnapshot::max_axes);
+
+  snapshot.buttons = buttons_;
+  for (uint8_t i = 0; i < num_axes; i++) {
+    AxisState state = unpack(axis_map_[i].load(std::memory_order_relaxed));
+    snapshot.axes[i][0] = state.x;
+    snapshot.axes[i][1] = state.y;
+  }
+
+  recorder->record_joystick(snapshot, num_axes);
+}
+
 void
 Joystick::input_thread_func()
 {
-  struct ::js_event event;
-  jeronibot::util::LoopRate loop_rate(60_Hz);
+  struct pollfd pfd = {fd_, POLLIN, 0};
+
+  Realtime::apply(ThreadRole::JoystickInput);
 
   while (!should_exit_) {
-    if (read(fd_, &event, sizeof(event)) == sizeof(event)) {
-      switch (event.type) {
-        case JS_EVENT_BUTTON:
-          // printf("Button %u %s\n", event.number, event.value ? "pressed" : "released");
-          if (button_map_[event.number] != nullptr) {
-            button_map_[event.number](event.value ? true : false);
-          }
-          break;
-
-        case JS_EVENT_AXIS:
-          {
-            //printf("Event number %u\n", event.number);
-
-            // 0, 1 = Axis_LeftThumbstick x,y
-            // 2    = Axis_Trigger - Left
-            // 3, 4 = Axis_RightThumbstick x,y
-            // 5    = Axis_Trigger - Right
-            // 6, 7 = Axis_Digipad x,y
-
-            switch(event.number)
-            {
-              case 0:
-                axis_map_[0].x = event.value; // XBox360Controller::Axis_LeftThumbstick
-                break;
-              case 1:
-                axis_map_[0].y = event.value;
-                break;
-              case 2:
-                axis_map_[2].x = event.value; // Axis_Trigger
-                break;
-              case 3:
-                axis_map_[1].x = event.value; // XBox360Controller::Axis_RightThumbstick
-                break;
-              case 4:
-                axis_map_[1].y = event.value;
-                break;
-              case 5:
-                axis_map_[2].y = event.value; // Axis_Trigger
-                break;
-              case 6:
-                axis_map_[3].x = event.value; // Axis_Digipad
-                break;
-              case 7:
-                axis_map_[3].y = event.value;
-                break;
-            }
+    // Wake up for input right away, and periodically to check for exit
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    read_events();
+  }
+}
+
+void
+Joystick::read_events()
+{
+  struct ::js_event event;
+
+  while (read(fd_, &event, sizeof(event)) == sizeof(event)) {
+    uint8_t axis;
+    bool is_y;
+
+    // js_event times are in ms from an unspecified start; take our own
+    event_time_ = std::chrono::steady_clock::now();
+
+    switch (event.type) {
+      case JS_EVENT_BUTTON:
+        // printf("Button %u %s\n", event.number, event.value ? "pressed" : "released");
+        set_button(event.number, event.value ? true : false);
+        break;
+
+      case JS_EVENT_AXIS:
+        //printf("Event number %u\n", event.number);
+        if (axis_of_event(event.number, &axis, &is_y) && axis < num_axes_) {
+          AxisState state = unpack(axis_map_[axis].load(std::memory_order_relaxed));
+          if (is_y) {
+            state.y = event.value;
+          } else {
+            state.x = event.value;
           }
-          break;
+          set_axis(axis, state);
+        }
+        break;
 
-        default:
-          break;
-      }
+      default:
+        break;
     }
 
-    loop_rate.sleep();
+    event_applied();
   }
 }
 
@@ -0,0 +1,474 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/logger.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef HAVE_LOG4CXX
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/logger.h>
+#endif
+
+#include "util/realtime.hpp"
+
+using namespace std::chrono_literals;
+
+namespace jeronibot::util
+{
+
+static const size_t queue_size = 1024;  // power of two
+static const auto idle_period = 1ms;
+
+static const char * level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+static const char * component_names[] = {"bluetooth", "minipro", "util"};
+
+// Bounded multi-producer queue: a slot is free for the producer that claims
+// position pos when its seq equals pos, and holds a record for the consumer
+// when seq equals pos + 1
+struct alignas(64) Slot
+{
+  std::atomic<size_t> seq;
+  LogRecord record;
+};
+
+static Slot queue[queue_size];
+static std::atomic<size_t> queue_tail{0};
+static size_t queue_head = 0;
+static std::atomic<uint64_t> dropped{0};
+static std::atomic<uint64_t> written{0};
+
+static std::mutex control_mutex;
+static std::thread worker;
+static std::atomic<bool> running{false};
+static std::atomic<bool> stopping{false};
+static bool stopped = false;
+static FILE * output = nullptr;
+
+static LogSource source{nullptr, nullptr};
+static std::atomic<bool> source_attached{false};
+
+#ifdef HAVE_LOG4CXX
+static log4cxx::LoggerPtr loggers[3];
+
+static log4cxx::LevelPtr
+log4cxx_level(LogLevel level)
+{
+  switch (level) {
+    case LogLevel::Error: return log4cxx::Level::getError();
+    case LogLevel::Warn: return log4cxx::Level::getWarn();
+    case LogLevel::Info: return log4cxx::Level::getInfo();
+    case LogLevel::Debug: return log4cxx::Level::getDebug();
+    default: return log4cxx::Level::getTrace();
+  }
+}
+#endif
+
+// Append the fields that were set as key=value pairs
+static size_t
+format_fields(const LogRecord & r, char * buf, size_t size)
+{
+  size_t n = 0;
+
+  auto append = [&](const char * format, auto ... args) {
+      if (n < size) {
+        int written = snprintf(buf + n, size - n, format, args ...);
+        n += written > 0 ? static_cast<size_t>(written) : 0;
+      }
+    };
+
+  append("%s %s", component_names[static_cast<int>(r.component)], r.event);
+
+  if (r.device[0]) {
+    append(" device=%s", r.device);
+  }
+  if (r.handle >= 0) {
+    append(" handle=0x%04x", r.handle);
+  }
+  if (r.opcode >= 0) {
+    append(" opcode=0x%02x", r.opcode);
+  }
+  if (r.status >= 0) {
+    append(" status=0x%02x", r.status);
+  }
+  if (r.length >= 0) {
+    append(" length=%d", r.length);
+  }
+  if (r.latency_ns >= 0) {
+    append(" latency_us=%lld.%03lld", static_cast<long long>(r.latency_ns / 1000),
+      static_cast<long long>(r.latency_ns % 1000));
+  }
+  if (r.data_length) {
+    append(" data=");
+    for (uint8_t i = 0; i < r.data_length; i++) {
+      append("%02x", r.data[i]);
+    }
+    if (r.length > r.data_length) {
+      append("..");
+    }
+  }
+  if (r.text[0]) {
+    append(" text=\"%s\"", r.text);
+  }
+
+  return std::min(n, size - 1);
+}
+
+static void
+write_line(
+  std::chrono::system_clock::time_point time, LogLevel level, LogComponent component,
+  const char * text)
+{
+#ifdef HAVE_LOG4CXX
+  if (!output) {
+    loggers[static_cast<int>(component)]->log(log4cxx_level(level), text);
+    return;
+  }
+#else
+  (void)component;
+#endif
+
+  auto since_epoch = time.time_since_epoch();
+  time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+  long micros = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count() % 1000000;
+
+  struct tm tm;
+  char stamp[32];
+  localtime_r(&seconds, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+  fprintf(output, "%s.%06ld %-5s %s\n", stamp, micros, level_names[static_cast<int>(level)], text);
+}
+
+static void
+write_record(const LogRecord & r)
+{
+  char fields[256];
+  format_fields(r, fields, sizeof(fields));
+  write_line(r.time, r.level, r.component, fields);
+}
+
+// Write out every published record, and the source's; returns how many
+// there were
+static unsigned int
+drain()
+{
+  unsigned int count = 0;
+
+  if (source_attached.load(std::memory_order_acquire)) {
+    count += source.drain();
+  }
+
+  for (;;) {
+    Slot & slot = queue[queue_head & (queue_size - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != queue_head + 1) {
+      break;
+    }
+
+    write_record(slot.record);
+
+    slot.seq.store(queue_head + queue_size, std::memory_order_release);
+    queue_head++;
+    count++;
+  }
+
+  if (count && output) {
+    fflush(output);
+  }
+
+  written.fetch_add(count, std::memory_order_relaxed);
+  return count;
+}
+
+static void
+run()
+{
+  Realtime::apply(ThreadRole::Logger);
+
+  while (!stopping.load(std::memory_order_acquire)) {
+    if (!drain()) {
+      std::this_thread::sleep_for(idle_period);
+    }
+  }
+
+  drain();
+}
+
+// Called with control_mutex held
+static bool
+start_locked(FILE * stream)
+{
+  if (running.load(std::memory_order_relaxed)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < queue_size; i++) {
+    queue[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  queue_head = 0;
+  queue_tail.store(0, std::memory_order_relaxed);
+  stopping.store(false, std::memory_order_relaxed);
+
+#ifdef HAVE_LOG4CXX
+  output = stream;
+  if (!output) {
+    if (log4cxx::Logger::getRootLogger()->getAllAppenders().empty()) {
+      log4cxx::BasicConfigurator::configure();
+    }
+    for (size_t i = 0; i < sizeof(component_names) / sizeof(component_names[0]); i++) {
+      loggers[i] = log4cxx::Logger::getLogger(std::string("jeronibot.") + component_names[i]);
+    }
+  }
+#else
+  output = stream ? stream : stderr;
+#endif
+
+  worker = std::thread(run);
+  running.store(true, std::memory_order_release);
+
+  return true;
+}
+
+// Joins the thread at exit if the application did not stop it
+static struct Shutdown
+{
+  ~Shutdown() {Logger::stop();}
+} logger_shutdown;
+
+// The source follows the threshold; called with control_mutex held
+static void
+set_source_level(int level)
+{
+  if (source_attached.load(std::memory_order_relaxed)) {
+    source.set_level(level);
+  }
+}
+
+bool
+Logger::start(LogLevel level, FILE * stream)
+{
+  std::lock_guard<std::mutex> lock(control_mutex);
+
+  if (!start_locked(stream)) {
+    return false;
+  }
+
+  stopped = false;
+  level_.store(static_cast<int>(level), std::memory_order_release);
+  set_source_level(static_cast<int>(level));
+  return true;
+}
+
+void
+Logger::stop()
+{
+  std::lock_guard<std::mutex> lock(control_mutex);
+
+  stopped = true;
+  level_.store(-1, std::memory_order_release);
+  set_source_level(-1);
+  if (!running.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  stopping.store(true, std::memory_order_release);
+  worker.join();
+  running.store(false, std::memory_order_release);
+}
+
+void
+Logger::set_level(LogLevel level)
+{
+  std::lock_guard<std::mutex> lock(control_mutex);
+  level_.store(static_cast<int>(level), std::memory_order_release);
+  set_source_level(static_cast<int>(level));
+}
+
+bool
+Logger::log(const LogRecord & record)
+{
+  if (!running.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(control_mutex);
+    // A producer that passed enabled() just before stop() must not bring
+    // the thread back, least of all after logger_shutdown has run
+    if (stopped) {
+      return false;
+    }
+    start_locked(nullptr);
+  }
+
+  size_t pos = queue_tail.load(std::memory_order_relaxed);
+  Slot * slot;
+
+  for (;;) {
+    slot = &queue[pos & (queue_size - 1)];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+    if (diff == 0) {
+      if (queue_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = queue_tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->record = record;
+  slot->seq.store(pos + 1, std::memory_order_release);
+
+  return true;
+}
+
+bool
+Logger::attach(const LogSource & attached)
+{
+  std::lock_guard<std::mutex> lock(control_mutex);
+
+  if (source_attached.load(std::memory_order_relaxed) || !attached.drain || !attached.set_level) {
+    return false;
+  }
+
+  source = attached;
+  source.set_level(stopped ? -1 : level_.load(std::memory_order_relaxed));
+  source_attached.store(true, std::memory_order_release);
+
+  if (!stopped) {
+    start_locked(nullptr);
+  }
+
+  return true;
+}
+
+void
+Logger::write(
+  LogLevel level, LogComponent component, std::chrono::system_clock::time_point time,
+  const char * text)
+{
+  char line[1100];
+  snprintf(line, sizeof(line), "%s %s", component_names[static_cast<int>(component)], text);
+  write_line(time, level, component, line);
+}
+
+uint64_t
+Logger::get_dropped()
+{
+  return dropped.load(std::memory_order_relaxed);
+}
+
+uint64_t
+Logger::get_written()
+{
+  return written.load(std::memory_order_relaxed);
+}
+
+LogEntry::LogEntry(LogLevel level, LogComponent component, const char * event)
+{
+  record_.time = std::chrono::system_clock::now();
+  record_.level = level;
+  record_.component = component;
+  record_.event = event;
+}
+
+LogEntry::~LogEntry()
+{
+  Logger::log(record_);
+}
+
+LogEntry &
+LogEntry::device(const std::string & address)
+{
+  size_t n = std::min(address.size(), LogRecord::max_device - 1);
+  memcpy(record_.device, address.data(), n);
+  record_.device[n] = '\0';
+  return *this;
+}
+
+LogEntry &
+LogEntry::handle(uint16_t handle)
+{
+  record_.handle = handle;
+  return *this;
+}
+
+LogEntry &
+LogEntry::opcode(uint8_t opcode)
+{
+  record_.opcode = opcode;
+  return *this;
+}
+
+LogEntry &
+LogEntry::status(uint8_t status)
+{
+  record_.status = status;
+  return *this;
+}
+
+LogEntry &
+LogEntry::length(size_t length)
+{
+  record_.length = static_cast<int32_t>(length);
+  return *this;
+}
+
+LogEntry &
+LogEntry::latency(std::chrono::nanoseconds latency)
+{
+  record_.latency_ns = latency.count();
+  return *this;
+}
+
+LogEntry &
+LogEntry::latency_since(std::chrono::steady_clock::time_point start)
+{
+  return latency(std::chrono::steady_clock::now() - start);
+}
+
+LogEntry &
+LogEntry::text(const char * text)
+{
+  if (!text) {
+    return *this;
+  }
+  strncpy(record_.text, text, LogRecord::max_text - 1);
+  record_.text[LogRecord::max_text - 1] = '\0';
+  return *this;
+}
+
+LogEntry &
+LogEntry::data(const uint8_t * data, size_t length)
+{
+  record_.data_length = static_cast<uint8_t>(std::min(length, LogRecord::max_data));
+  memcpy(record_.data, data, record_.data_length);
+  if (record_.length < 0) {
+    record_.length = static_cast<int32_t>(length);
+  }
+  return *this;
+}
+
+}  // namespace jeronibot::util
@@ -19,6 +19,8 @@
 #include <exception>
 #include <thread>
 
+#include "util/realtime.hpp"
+
 namespace jeronibot::util
 {
 
@@ -44,8 +46,9 @@ LoopRate::sleep()
   std::chrono::duration<double, std::milli> work_time = now_ - prev_;
 
   if (work_time < period_) {
-    std::chrono::duration<double, std::milli> delta_ms(period_ - work_time);
-    std::this_thread::sleep_for(delta_ms);
+    auto deadline = prev_ + period_;
+    std::this_thread::sleep_until(deadline);
+    Realtime::observe_wakeup(deadline);
   }
 
   prev_ = std::chrono::steady_clock::now();
@@ -0,0 +1,334 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/metrics.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "util/realtime.hpp"
+
+using namespace std::chrono_literals;
+
+namespace jeronibot::util
+{
+
+std::vector<std::chrono::nanoseconds>
+Histogram::latency_buckets()
+{
+  return {100us, 250us, 500us, 1ms, 2500us, 5ms, 10ms, 25ms, 50ms, 100ms, 250ms, 500ms, 1s};
+}
+
+Histogram::Histogram(const std::vector<std::chrono::nanoseconds> & bounds)
+: num_bounds_(bounds.size())
+{
+  if (bounds.empty() || bounds.size() > max_buckets || !std::is_sorted(bounds.begin(), bounds.end())) {
+    throw std::runtime_error("Histogram: Invalid bucket bounds");
+  }
+
+  for (size_t i = 0; i < num_bounds_; i++) {
+    bounds_[i] = bounds[i].count();
+  }
+}
+
+void
+Histogram::observe(std::chrono::nanoseconds value)
+{
+  int64_t ns = value.count();
+  size_t i = std::lower_bound(bounds_, bounds_ + num_bounds_, ns) - bounds_;
+
+  counts_[i].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(ns, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MetricsRegistry &
+MetricsRegistry::get_default()
+{
+  static MetricsRegistry registry;
+  return registry;
+}
+
+static std::string
+format_labels(const MetricLabels & labels)
+{
+  std::string text;
+
+  for (const auto & label : labels) {
+    text += text.empty() ? "" : ",";
+    text += label.first + "=\"";
+    for (char c : label.second) {
+      switch (c) {
+        case '\\': text += "\\\\"; break;
+        case '"': text += "\\\""; break;
+        case '\n': text += "\\n"; break;
+        default: text += c; break;
+      }
+    }
+    text += "\"";
+  }
+
+  return text;
+}
+
+MetricsRegistry::Family &
+MetricsRegistry::family(const std::string & name, const std::string & help, Type type)
+{
+  auto it = families_.find(name);
+  if (it == families_.end()) {
+    it = families_.emplace(name, Family{type, help, {}}).first;
+  } else if (it->second.type != type) {
+    throw std::runtime_error("MetricsRegistry: " + name + " is already another type of metric");
+  }
+
+  return it->second;
+}
+
+Counter &
+MetricsRegistry::counter(const std::string & name, const std::string & help, const MetricLabels & labels)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto & metric = family(name, help, Type::Counter).metrics[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Counter>();
+  }
+
+  return *std::static_pointer_cast<Counter>(metric);
+}
+
+Gauge &
+MetricsRegistry::gauge(const std::string & name, const std::string & help, const MetricLabels & labels)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto & metric = family(name, help, Type::Gauge).metrics[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Gauge>();
+  }
+
+  return *std::static_pointer_cast<Gauge>(metric);
+}
+
+Histogram &
+MetricsRegistry::histogram(
+  const std::string & name, const std::string & help, const MetricLabels & labels,
+  const std::vector<std::chrono::nanoseconds> & bounds)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto & metric = family(name, help, Type::Histogram).metrics[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Histogram>(bounds);
+  }
+
+  return *std::static_pointer_cast<Histogram>(metric);
+}
+
+unsigned int
+MetricsRegistry::add_collector(std::function<void()> collector)
+{
+  std::lock_guard<std::mutex> lock(collectors_mutex_);
+  unsigned int id = next_collector_id_++;
+  collectors_[id] = std::move(collector);
+  return id;
+}
+
+void
+MetricsRegistry::remove_collector(unsigned int id)
+{
+  // Waits for an export that is running the collector
+  std::lock_guard<std::mutex> lock(collectors_mutex_);
+  collectors_.erase(id);
+}
+
+void
+MetricsRegistry::collect()
+{
+  // Not under mutex_, which the collectors' locks may be held around
+  std::lock_guard<std::mutex> lock(collectors_mutex_);
+  for (auto & collector : collectors_) {
+    collector.second();
+  }
+}
+
+static void
+write_sample(std::ostream & out, const std::string & name, const std::string & labels, const std::string & value)
+{
+  out << name;
+  if (!labels.empty()) {
+    out << "{" << labels << "}";
+  }
+  out << " " << value << "\n";
+}
+
+static std::string
+seconds(int64_t ns)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%.9g", ns / 1e9);
+  return text;
+}
+
+void
+MetricsRegistry::write_prometheus(std::ostream & out)
+{
+  collect();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  for (const auto & entry : families_) {
+    const std::string & name = entry.first;
+    const Family & family = entry.second;
+
+    static const char * type_names[] = {"counter", "gauge", "histogram"};
+    out << "# HELP " << name << " " << family.help << "\n";
+    out << "# TYPE " << name << " " << type_names[static_cast<int>(family.type)] << "\n";
+
+    for (const auto & metric : family.metrics) {
+      const std::string & labels = metric.first;
+
+      switch (family.type) {
+        case Type::Counter:
+          write_sample(out, name, labels, std::to_string(std::static_pointer_cast<Counter>(metric.second)->get()));
+          break;
+
+        case Type::Gauge:
+          write_sample(out, name, labels, std::to_string(std::static_pointer_cast<Gauge>(metric.second)->get()));
+          break;
+
+        case Type::Histogram:
+          {
+            auto histogram = std::static_pointer_cast<Histogram>(metric.second);
+            std::string prefix = labels.empty() ? "" : labels + ",";
+            uint64_t cumulative = 0;
+
+            for (size_t i = 0; i < histogram->get_num_buckets(); i++) {
+              cumulative += histogram->get_bucket_count(i);
+              write_sample(out, name + "_bucket", prefix + "le=\"" + seconds(histogram->get_bound(i).count()) + "\"",
+                std::to_string(cumulative));
+            }
+            cumulative += histogram->get_bucket_count(histogram->get_num_buckets());
+
+            write_sample(out, name + "_bucket", prefix + "le=\"+Inf\"", std::to_string(cumulative));
+            write_sample(out, name + "_sum", labels, seconds(histogram->get_sum().count()));
+            write_sample(out, name + "_count", labels, std::to_string(cumulative));
+          }
+          break;
+      }
+    }
+  }
+}
+
+bool
+MetricsRegistry::write_file(const std::string & path)
+{
+  // Written aside and renamed, so a reader never sees a partial file
+  std::string tmp_path = path + ".tmp";
+
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    if (!out) {
+      return false;
+    }
+
+    write_prometheus(out);
+    if (!out.flush()) {
+      return false;
+    }
+  }
+
+  return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+MetricsExporter::MetricsExporter(MetricsRegistry & registry, const std::string & socket_path)
+: registry_(registry), socket_path_(socket_path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("MetricsExporter: Socket path too long");
+  }
+  strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    throw std::runtime_error("MetricsExporter: Couldn't create socket");
+  }
+
+  // Left behind by an earlier run
+  unlink(socket_path_.c_str());
+
+  if (bind(fd_, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd_, 4) < 0) {
+    close(fd_);
+    throw std::runtime_error("MetricsExporter: Couldn't listen on " + socket_path_);
+  }
+
+  thread_ = std::thread(&MetricsExporter::serve, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+  should_exit_ = true;
+  thread_.join();
+  close(fd_);
+  unlink(socket_path_.c_str());
+}
+
+void
+MetricsExporter::serve()
+{
+  struct pollfd pfd = {fd_, POLLIN, 0};
+
+  Realtime::apply(ThreadRole::MetricsExporter);
+
+  while (!should_exit_) {
+    // Wake up periodically to check for exit
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+
+    int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      continue;
+    }
+
+    std::ostringstream out;
+    registry_.write_prometheus(out);
+    std::string text = out.str();
+
+    for (size_t sent = 0; sent < text.size(); ) {
+      ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+
+    // Before the client sees the end of the text
+    num_scrapes_.fetch_add(1, std::memory_order_relaxed);
+    close(client);
+  }
+}
+
+}  // namespace jeronibot::util
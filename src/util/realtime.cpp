@@ -0,0 +1,297 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/realtime.hpp"
+
+#include <alloca.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/logger.hpp"
+#include "util/metrics.hpp"
+
+using namespace std::chrono_literals;
+
+namespace jeronibot::util
+{
+
+// At most 15 characters, the kernel's limit
+static const char * role_names[] = {
+  "ble-input", "joystick", "teleop-sender", "le-scanner", "logger", "metrics", "control",
+};
+
+static constexpr size_t num_roles = sizeof(role_names) / sizeof(role_names[0]);
+
+static std::mutex mutex;
+static ThreadProfile profiles[num_roles];
+
+static std::atomic<bool> memory_locked{false};
+static std::atomic<size_t> stack_prefault_bytes{0};
+
+// The CPUs a thread with no CPUs in its profile goes back to, rather than
+// those of the thread that created it
+static struct InitialAffinity
+{
+  InitialAffinity()
+  {
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+      CPU_ZERO(&cpus);
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+  }
+
+  cpu_set_t cpus;
+} initial_affinity;
+
+// Threads whose schedstat is sampled into the metrics, under mutex
+struct ThreadStats
+{
+  pid_t tid;
+  uint64_t run_delay_ns;
+  uint64_t timeslices;
+  Counter * run_delay;
+  Counter * slices;
+};
+
+static std::vector<ThreadStats> threads;
+static std::once_flag collector_once;
+
+static thread_local Histogram * wakeup_latency = nullptr;
+
+// A timed wait is expected to be late by tens of microseconds
+static std::vector<std::chrono::nanoseconds> wakeup_buckets()
+{
+  return {10us, 25us, 50us, 100us, 250us, 500us, 1ms, 2500us, 5ms, 10ms, 25ms, 50ms};
+}
+
+static size_t index_of(ThreadRole role)
+{
+  size_t i = static_cast<size_t>(role);
+  return i < num_roles ? i : num_roles - 1;
+}
+
+static void report_failure(ThreadRole role, const char * what, int error)
+{
+  const char * name = role_names[index_of(role)];
+
+  MetricsRegistry::get_default().counter("thread_profile_failures_total",
+    "Thread profiles that couldn't be applied", {{"thread", name}}).inc();
+
+  std::string text = std::string(name) + ": " + strerror(error);
+  LOG_RECORD(LogLevel::Warn, LogComponent::Util, what).text(text.c_str());
+}
+
+// Touch each page of the stack below the caller's frame. The pages stay
+// resident, and with MCL_FUTURE locked, after the frame is gone
+static void __attribute__((noinline)) prefault_stack(size_t bytes)
+{
+  volatile uint8_t * stack = static_cast<volatile uint8_t *>(alloca(bytes));
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  for (size_t i = 0; i < bytes; i += page) {
+    stack[i] = 0;
+  }
+}
+
+// "<exec_runtime_ns> <run_delay_ns> <timeslices>"
+static bool read_schedstat(pid_t tid, uint64_t & run_delay_ns, uint64_t & timeslices)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+
+  FILE * file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+
+  uint64_t runtime_ns;
+  bool ok = fscanf(file, "%" SCNu64 " %" SCNu64 " %" SCNu64, &runtime_ns, &run_delay_ns, &timeslices) == 3;
+  fclose(file);
+  return ok;
+}
+
+static void collect_schedstat()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (auto it = threads.begin(); it != threads.end(); ) {
+    uint64_t run_delay_ns;
+    uint64_t timeslices;
+
+    // Exited
+    if (!read_schedstat(it->tid, run_delay_ns, timeslices)) {
+      it = threads.erase(it);
+      continue;
+    }
+
+    // Counted from zero again when the tid went to another thread
+    if (run_delay_ns < it->run_delay_ns || timeslices < it->timeslices) {
+      it->run_delay_ns = 0;
+      it->timeslices = 0;
+    }
+
+    // What's short of a microsecond is counted with the next sample
+    uint64_t delay_us = (run_delay_ns - it->run_delay_ns) / 1000;
+    it->run_delay->inc(delay_us);
+    it->slices->inc(timeslices - it->timeslices);
+    it->run_delay_ns += delay_us * 1000;
+    it->timeslices = timeslices;
+    ++it;
+  }
+}
+
+static void register_thread(ThreadRole role)
+{
+  const char * name = role_names[index_of(role)];
+  MetricsRegistry & registry = MetricsRegistry::get_default();
+
+  wakeup_latency = &registry.histogram("thread_wakeup_latency_seconds",
+      "How late a timed wait woke up past its deadline", {{"thread", name}}, wakeup_buckets());
+
+  ThreadStats stats;
+  stats.tid = static_cast<pid_t>(syscall(SYS_gettid));
+  stats.run_delay_ns = 0;
+  stats.timeslices = 0;
+  stats.run_delay = &registry.counter("thread_run_delay_microseconds_total",
+      "Time runnable but waiting for a CPU", {{"thread", name}});
+  stats.slices = &registry.counter("thread_timeslices_total",
+      "Times run on a CPU", {{"thread", name}});
+
+  std::call_once(collector_once, [&registry] {registry.add_collector(collect_schedstat);});
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto & thread : threads) {
+    if (thread.tid == stats.tid) {
+      thread = stats;
+      return;
+    }
+  }
+  threads.push_back(stats);
+}
+
+void
+Realtime::set_profile(ThreadRole role, const ThreadProfile & profile)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  profiles[index_of(role)] = profile;
+}
+
+ThreadProfile
+Realtime::get_profile(ThreadRole role)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return profiles[index_of(role)];
+}
+
+const char *
+Realtime::get_name(ThreadRole role)
+{
+  return role_names[index_of(role)];
+}
+
+bool
+Realtime::lock_memory(size_t stack_prefault)
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    int error = errno;
+    LOG_RECORD(LogLevel::Warn, LogComponent::Util, "memory_lock_failed").text(strerror(error));
+    return false;
+  }
+
+  // Freed memory is kept for reuse instead of being trimmed, and large
+  // blocks come from the locked heap instead of new mappings
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  stack_prefault_bytes.store(stack_prefault, std::memory_order_relaxed);
+  memory_locked.store(true, std::memory_order_release);
+
+  prefault_stack(stack_prefault);
+  return true;
+}
+
+bool
+Realtime::is_memory_locked()
+{
+  return memory_locked.load(std::memory_order_acquire);
+}
+
+bool
+Realtime::apply(ThreadRole role)
+{
+  ThreadProfile profile = get_profile(role);
+  bool ok = true;
+
+  // Not the main thread, whose name is the process's
+  if (syscall(SYS_gettid) != getpid()) {
+    pthread_setname_np(pthread_self(), get_name(role));
+  }
+
+  cpu_set_t cpus = initial_affinity.cpus;
+  if (!profile.cpus.empty()) {
+    CPU_ZERO(&cpus);
+    for (int cpu : profile.cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+  }
+  if (int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+    report_failure(role, "thread_affinity_failed", error);
+    ok = false;
+  }
+
+  // Set even when it's the default, since a thread inherits its creator's
+  struct sched_param param = {};
+  param.sched_priority = profile.priority;
+  if (int error = pthread_setschedparam(pthread_self(), profile.policy, &param)) {
+    report_failure(role, "thread_sched_failed", error);
+    ok = false;
+  }
+
+  if (is_memory_locked()) {
+    prefault_stack(stack_prefault_bytes.load(std::memory_order_relaxed));
+  }
+
+  register_thread(role);
+  return ok;
+}
+
+void
+Realtime::observe_wakeup(std::chrono::steady_clock::time_point deadline)
+{
+  if (!wakeup_latency) {
+    return;
+  }
+
+  auto late = std::chrono::steady_clock::now() - deadline;
+  if (late.count() >= 0) {
+    wakeup_latency->observe(late);
+  }
+}
+
+}  // namespace jeronibot::util
@@ -0,0 +1,130 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include "att.h"
+#include "mainloop.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Receive-side throughput of the ATT reader: a peer thread floods one end
+// of a SOCK_SEQPACKET socketpair with Handle Value Notifications and the
+// mainloop dispatches them from the other, for several receive batch sizes.
+// The receiver's CPU time per PDU is reported separately from wall-clock
+// throughput, which on a small machine is bounded by the sender
+//
+
+using jeronibot::test::check;
+
+static double thread_cpu_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Receiver
+{
+  uint32_t expected{0};
+  uint32_t total{0};
+  bool in_order{true};
+};
+
+static void notify_cb(uint8_t, const void * pdu, uint16_t length, void * user_data)
+{
+  Receiver * rx = static_cast<Receiver *>(user_data);
+  uint32_t seq;
+
+  // handle (2 octets), then the sequence number
+  memcpy(&seq, static_cast<const uint8_t *>(pdu) + 2, sizeof(seq));
+  if (length < 2 + sizeof(seq) || seq != rx->expected) {
+    rx->in_order = false;
+  }
+
+  if (++rx->expected == rx->total) {
+    mainloop_quit();
+  }
+}
+
+static bool run(unsigned int batch, uint32_t count)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    std::cerr << "socketpair failed" << std::endl;
+    return false;
+  }
+
+  mainloop_init();
+
+  struct bt_att * att = bt_att_new(sv[0], false);
+  Receiver rx;
+  rx.total = count;
+
+  bt_att_set_rx_batch(att, batch);
+  bt_att_register(att, BT_ATT_OP_HANDLE_VAL_NOT, notify_cb, &rx, nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  double cpu_start = thread_cpu_seconds();
+
+  // Telemetry-sized notifications: opcode, handle 0x000e, 16 byte value
+  std::thread peer([&] {
+      uint8_t pdu[19] = {BT_ATT_OP_HANDLE_VAL_NOT, 0x0e, 0x00};
+      for (uint32_t i = 0; i < count; i++) {
+        memcpy(&pdu[3], &i, sizeof(i));
+        if (write(sv[1], pdu, sizeof(pdu)) != sizeof(pdu)) {
+          break;
+        }
+      }
+    });
+
+  mainloop_run();
+  double cpu_seconds = thread_cpu_seconds() - cpu_start;
+  peer.join();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  bt_att_unref(att);
+  close(sv[0]);
+  close(sv[1]);
+
+  return check("batch " + std::to_string(batch) + ": " + std::to_string(rx.expected) + " notifications, " +
+    std::to_string(static_cast<uint64_t>(count / seconds)) + " PDUs/s, receiver " +
+    std::to_string(static_cast<uint64_t>(cpu_seconds * 1e9 / count)) + " ns CPU/PDU",
+    rx.in_order && rx.expected == count);
+}
+
+int main(int argc, char ** argv)
+{
+  const uint32_t count = argc > 1 ? atoi(argv[1]) : 500000;
+
+  for (unsigned int batch : {1, 4, 16, 64}) {
+    run(batch, count);
+  }
+
+  return jeronibot::test::result();
+}
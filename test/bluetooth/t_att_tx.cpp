@@ -0,0 +1,178 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include "att.h"
+#include "mainloop.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Write side of the ATT transport: queues bursts of Write Commands the way
+// a teleop loop does (drive, config, ...) and checks that the peer of a
+// SOCK_SEQPACKET socketpair receives every PDU intact and in order, then
+// reports how many PDUs each write wakeup carried. Then a request already
+// in flight when the metrics callback is set gets no round trip
+//
+
+using jeronibot::test::check;
+
+struct Responses
+{
+  int answered{0};
+  int observed{0};
+  uint64_t rtt_ns{0};
+};
+
+static void response_cb(uint8_t, const void *, uint16_t, void * user_data)
+{
+  static_cast<Responses *>(user_data)->answered++;
+}
+
+static void metrics_cb(int metric, uint8_t, uint64_t value, void * user_data)
+{
+  if (metric == BT_ATT_METRIC_RESPONSE) {
+    auto responses = static_cast<Responses *>(user_data);
+    responses->observed++;
+    responses->rtt_ns = value;
+  }
+}
+
+// Send a Read Request and take it at the peer; the response is up to the caller
+static bool request(struct bt_att * att, int peer, Responses * responses)
+{
+  uint8_t handle[2] = {0x03, 0x00};
+  uint8_t pdu[16];
+
+  bt_att_send(att, BT_ATT_OP_READ_REQ, handle, sizeof(handle), response_cb, responses, nullptr);
+  mainloop_iterate(100);
+  return recv(peer, pdu, sizeof(pdu), MSG_DONTWAIT) == 3 && pdu[0] == BT_ATT_OP_READ_REQ;
+}
+
+static bool respond(int peer, Responses * responses, int answered)
+{
+  uint8_t rsp[3] = {BT_ATT_OP_READ_RSP, 0x01, 0x02};
+  if (write(peer, rsp, sizeof(rsp)) != sizeof(rsp)) {
+    return false;
+  }
+  for (int i = 0; i < 10 && responses->answered < answered; i++) {
+    mainloop_iterate(100);
+  }
+  return responses->answered == answered;
+}
+
+static void test_unstamped_response()
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    check("socketpair", false);
+    return;
+  }
+
+  // mainloop_run() above closed the loop when it returned
+  mainloop_init();
+  struct bt_att * att = bt_att_new(sv[0], false);
+  Responses responses;
+
+  bool exchanged = request(att, sv[1], &responses);
+  bt_att_set_metrics_cb(att, metrics_cb, &responses, nullptr);
+  exchanged = exchanged && respond(sv[1], &responses, 1);
+  check("request in flight has no round trip", exchanged && responses.observed == 0);
+
+  exchanged = request(att, sv[1], &responses) && respond(sv[1], &responses, 2);
+  check("later request timed", exchanged && responses.observed == 1 && responses.rtt_ns < 1000000000);
+
+  bt_att_unref(att);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(int argc, char ** argv)
+{
+  const uint32_t count = argc > 1 ? atoi(argv[1]) : 100000;
+  const uint32_t burst = 3;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    std::cerr << "socketpair failed" << std::endl;
+    return -1;
+  }
+
+  mainloop_init();
+  struct bt_att * att = bt_att_new(sv[0], false);
+
+  uint32_t received = 0;
+  bool in_order = true;
+
+  // The peer checks each PDU, then stops the loop
+  std::thread peer([&] {
+      uint8_t pdu[64];
+      while (received < count) {
+        ssize_t len = read(sv[1], pdu, sizeof(pdu));
+        uint32_t seq;
+        memcpy(&seq, &pdu[3], sizeof(seq));
+        if (len != 7 || pdu[0] != BT_ATT_OP_WRITE_CMD || seq != received) {
+          in_order = false;
+        }
+        received++;
+      }
+      mainloop_quit();
+    });
+
+  auto start = std::chrono::steady_clock::now();
+
+  // Queue everything up front in bursts; the writer runs once the loop starts
+  for (uint32_t i = 0; i < count; i += burst) {
+    for (uint32_t j = i; j < i + burst && j < count; j++) {
+      uint8_t value[6] = {0x0e, 0x00};
+      memcpy(&value[2], &j, sizeof(j));
+      bt_att_send(att, BT_ATT_OP_WRITE_CMD, value, sizeof(value), nullptr, nullptr, nullptr);
+    }
+  }
+
+  mainloop_run();
+  peer.join();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  struct bt_att_io_stats stats;
+  bt_att_get_io_stats(att, &stats);
+
+  bt_att_unref(att);
+  close(sv[0]);
+  close(sv[1]);
+
+  check(std::to_string(received) + " write commands in order, " +
+    std::to_string(static_cast<uint64_t>(count / seconds)) + " PDUs/s",
+    in_order && received == count && stats.tx_pdus == count);
+  std::cout << "write wakeups: " << stats.tx_wakeups << ", " <<
+    (stats.tx_wakeups ? static_cast<double>(stats.tx_pdus) / stats.tx_wakeups : 0.0) <<
+    " PDUs/wakeup" << std::endl;
+
+  test_unstamped_response();
+
+  return jeronibot::test::result();
+}
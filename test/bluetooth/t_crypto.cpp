@@ -0,0 +1,190 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "aes.h"
+#include "crypto.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Known-answer tests for the bt_crypto backends. Vectors are written MSB
+// first, as in FIPS-197, RFC 4493 and the Bluetooth Core Specification
+// (Vol 3, Part H, Appendix D); the bt_crypto API takes them LSB first.
+//
+
+using jeronibot::test::check;
+
+static std::vector<uint8_t> from_hex(const std::string & hex)
+{
+  std::vector<uint8_t> bytes;
+  for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+    bytes.push_back(std::stoi(hex.substr(i, 2), nullptr, 16));
+  }
+  return bytes;
+}
+
+static std::vector<uint8_t> from_hex_le(const std::string & hex)
+{
+  std::vector<uint8_t> bytes = from_hex(hex);
+  return std::vector<uint8_t>(bytes.rbegin(), bytes.rend());
+}
+
+static void check(const std::string & name, const uint8_t * got, const std::vector<uint8_t> & expected)
+{
+  check(name, memcmp(got, expected.data(), expected.size()) == 0);
+}
+
+static void test_aes(enum bt_aes_impl impl, const std::string & impl_name)
+{
+  struct bt_aes128 aes;
+  uint8_t out[64];
+
+  // FIPS-197 Appendix C.1
+  bt_aes128_init(&aes, impl, from_hex("000102030405060708090a0b0c0d0e0f").data());
+  bt_aes128_encrypt(&aes, from_hex("00112233445566778899aabbccddeeff").data(), out);
+  check(impl_name + " AES-128 FIPS-197", out, from_hex("69c4e0d86a7b0430d8cdb78070b4c55a"));
+
+  // Multi-block path must match single-block encryption
+  std::vector<uint8_t> blocks(80);
+  std::vector<uint8_t> expected(80);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i] = i * 7;
+  }
+  for (size_t i = 0; i < blocks.size(); i += 16) {
+    bt_aes128_encrypt(&aes, &blocks[i], &expected[i]);
+  }
+  std::vector<uint8_t> batch(80);
+  bt_aes128_encrypt_blocks(&aes, blocks.data(), batch.data(), 5);
+  check(impl_name + " AES-128 5 blocks", batch.data(), expected);
+
+  // RFC 4493 section 4
+  const std::string msg =
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+  bt_aes128_init(&aes, impl, from_hex("2b7e151628aed2a6abf7158809cf4f3c").data());
+  std::vector<uint8_t> m = from_hex(msg);
+
+  bt_aes128_cmac(&aes, nullptr, 0, out);
+  check(impl_name + " AES-CMAC len 0", out, from_hex("bb1d6929e95937287fa37d129b756746"));
+  bt_aes128_cmac(&aes, m.data(), 16, out);
+  check(impl_name + " AES-CMAC len 16", out, from_hex("070a16b46b4d4144f79bdd9dd04a287c"));
+  bt_aes128_cmac(&aes, m.data(), 40, out);
+  check(impl_name + " AES-CMAC len 40", out, from_hex("dfa66747de9ae63030ca32611497c827"));
+  bt_aes128_cmac(&aes, m.data(), 64, out);
+  check(impl_name + " AES-CMAC len 64", out, from_hex("51f0bebf7e3b9d92fc49741779363cfe"));
+}
+
+static void test_crypto(struct bt_crypto * crypto, const std::string & name)
+{
+  uint8_t out[16];
+
+  // D.7 ah Random Address Hash function
+  std::vector<uint8_t> irk = from_hex_le("ec0234a357c8ad05341010a60a397d9b");
+  std::vector<uint8_t> prand = from_hex_le("708194");
+  if (!bt_crypto_ah(crypto, irk.data(), prand.data(), out)) {
+    out[0] = ~out[0];
+  }
+  check(name + " ah", out, from_hex_le("0dfbaa"));
+
+  // D.2 f4 LE SC Confirm Value Generation Function
+  std::vector<uint8_t> u = from_hex_le(
+    "20b003d2f297be2c5e2c83a7e9f9a5b9eff49111acf4fddbcc0301480e359de6");
+  std::vector<uint8_t> v = from_hex_le(
+    "55188b3d32f6bb9a900afcfbeed4e72a59cb9ac2f19d7cfb6b4fdd49f47fc5fd");
+  std::vector<uint8_t> x = from_hex_le("d5cb8454d177733effffb2ec712baeab");
+  if (!bt_crypto_f4(crypto, u.data(), v.data(), x.data(), 0, out)) {
+    out[0] = ~out[0];
+  }
+  check(name + " f4", out, from_hex_le("f2c916f107a9bd1cf1eda1bea974872d"));
+}
+
+// Compare every userspace backend against AF_ALG on pseudo-random input
+static void cross_check(struct bt_crypto * crypto, enum bt_crypto_backend backend, const std::string & name)
+{
+  uint8_t key[16], in[16], msg[60], ref[16], out[16];
+  bool ok = true;
+
+  srand(1);
+  for (int i = 0; i < 64 && ok; i++) {
+    for (auto & b : key) {b = rand();}
+    for (auto & b : in) {b = rand();}
+    for (auto & b : msg) {b = rand();}
+
+    bt_crypto_set_backend(crypto, BT_CRYPTO_BACKEND_AF_ALG);
+    bt_crypto_e(crypto, key, in, ref);
+    bt_crypto_set_backend(crypto, backend);
+    bt_crypto_e(crypto, key, in, out);
+    ok = memcmp(ref, out, 16) == 0;
+
+    bt_crypto_set_backend(crypto, BT_CRYPTO_BACKEND_AF_ALG);
+    bt_crypto_sign_att(crypto, key, msg, i % sizeof(msg), i, ref);
+    bt_crypto_set_backend(crypto, backend);
+    bt_crypto_sign_att(crypto, key, msg, i % sizeof(msg), i, out);
+    ok = ok && memcmp(ref, out, 12) == 0;
+  }
+
+  check(name + " matches AF_ALG", ok);
+}
+
+int main(int, char **)
+{
+  test_aes(BT_AES_IMPL_GENERIC, "generic");
+  if (bt_aes_impl_supported(BT_AES_IMPL_AESNI)) {
+    test_aes(BT_AES_IMPL_AESNI, "aesni");
+  } else {
+    std::cout << "SKIP: aesni not supported on this CPU" << std::endl;
+  }
+
+  struct bt_crypto * crypto = bt_crypto_new();
+  if (!crypto) {
+    std::cerr << "Failed to create crypto context" << std::endl;
+    return -1;
+  }
+
+  const struct {
+    enum bt_crypto_backend backend;
+    const char * name;
+  } backends[] = {
+    {BT_CRYPTO_BACKEND_GENERIC, "generic"},
+    {BT_CRYPTO_BACKEND_AESNI, "aesni"},
+    {BT_CRYPTO_BACKEND_AF_ALG, "af_alg"},
+  };
+
+  bool have_af_alg = bt_crypto_set_backend(crypto, BT_CRYPTO_BACKEND_AF_ALG);
+
+  for (auto & b : backends) {
+    if (!bt_crypto_set_backend(crypto, b.backend)) {
+      std::cout << "SKIP: " << b.name << " backend not available" << std::endl;
+      continue;
+    }
+    test_crypto(crypto, b.name);
+
+    if (have_af_alg && b.backend != BT_CRYPTO_BACKEND_AF_ALG) {
+      cross_check(crypto, b.backend, b.name);
+    }
+  }
+
+  bt_crypto_unref(crypto);
+
+  return jeronibot::test::result();
+}
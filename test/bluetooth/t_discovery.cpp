@@ -0,0 +1,443 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "att.h"
+#include "bluetooth.h"
+#include "uuid.h"
+#include "gatt-helpers.h"
+#include "mainloop.h"
+#include "util.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Discovery against a loopback peer: one end of a SOCK_SEQPACKET
+// socketpair runs the discovery procedures, the other is a minimal ATT
+// server that answers them at the default MTU, so that every result spans
+// many responses. Services, characteristics (16 and 128-bit UUIDs, which
+// can't share a response), descriptors and included services (the 128-bit
+// ones read one by one) are iterated back and counted. Then times primary
+// service discovery
+//
+
+static const int num_services = 40;
+static const int num_characteristics = 30;
+static const int num_descriptors = 20;
+
+static const uint16_t chrc_start = 0x0100;
+static const uint16_t chrc_end = 0x01ff;
+static const uint16_t desc_start = 0x0300;
+static const uint16_t desc_end = 0x031f;
+static const uint16_t incl_start = 0x0400;
+static const uint16_t incl_end = 0x04ff;
+
+using jeronibot::test::check;
+
+static uint16_t service_start(int i) {return static_cast<uint16_t>(1 + i * 16);}
+static uint16_t chrc_decl(int k) {return static_cast<uint16_t>(chrc_start + k * 3);}
+static bool chrc_is_128(int k) {return k >= 12 && k < 18;}
+static uint16_t incl_service(int k) {return static_cast<uint16_t>(0x0500 + k * 16);}
+static bool incl_is_128(int k) {return k < 2;}
+
+// A 128-bit UUID, little-endian as on the air
+static std::vector<uint8_t> uuid128_le(uint8_t tag)
+{
+  std::vector<uint8_t> uuid(16);
+  for (int i = 0; i < 16; i++) {
+    uuid[i] = static_cast<uint8_t>(tag + i * 17);
+  }
+  return uuid;
+}
+
+// The same UUID as the iterators return it, big-endian
+static std::vector<uint8_t> uuid128_be(uint8_t tag)
+{
+  auto uuid = uuid128_le(tag);
+  return std::vector<uint8_t>(uuid.rbegin(), uuid.rend());
+}
+
+static std::vector<uint8_t> uuid16_be(uint16_t value)
+{
+  bt_uuid_t uuid;
+  bt_uuid_t uuid128;
+  bt_uuid16_create(&uuid, value);
+  bt_uuid_to_uuid128(&uuid, &uuid128);
+  return std::vector<uint8_t>(uuid128.value.u128.data, uuid128.value.u128.data + 16);
+}
+
+struct Element
+{
+  uint16_t handle;
+  std::vector<uint8_t> data;  // starting with the handle
+};
+
+static Element element(uint16_t handle, std::vector<uint8_t> rest)
+{
+  Element e{handle, {static_cast<uint8_t>(handle), static_cast<uint8_t>(handle >> 8)}};
+  e.data.insert(e.data.end(), rest.begin(), rest.end());
+  return e;
+}
+
+static std::vector<uint8_t> le16(uint16_t value) {return {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)};}
+
+static std::vector<uint8_t> operator+(std::vector<uint8_t> a, const std::vector<uint8_t> & b)
+{
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
+struct Peer
+{
+  struct bt_att * att;
+  std::vector<Element> services;
+  std::vector<Element> characteristics;
+  std::vector<Element> descriptors;
+  std::vector<Element> includes;
+};
+
+// As many elements in [start, end] as fit, all of the first one's length;
+// the response starts with the length, or the format for Find Information
+static void respond(
+  Peer * peer, uint8_t opcode, uint8_t rsp_opcode, uint16_t start, uint16_t end,
+  const std::vector<Element> & elements)
+{
+  size_t mtu = bt_att_get_mtu(peer->att);
+  std::vector<uint8_t> rsp(1);
+  size_t length = 0;
+
+  for (const auto & e : elements) {
+    if (e.handle < start || e.handle > end) {
+      continue;
+    }
+    if (length && (e.data.size() != length || 1 + rsp.size() + length > mtu)) {
+      break;
+    }
+    length = e.data.size();
+    rsp.insert(rsp.end(), e.data.begin(), e.data.end());
+  }
+
+  if (!length) {
+    bt_att_send_error_rsp(peer->att, opcode, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  rsp[0] = rsp_opcode == BT_ATT_OP_FIND_INFO_RSP ? (length == 4 ? 0x01 : 0x02) : static_cast<uint8_t>(length);
+  bt_att_send(peer->att, rsp_opcode, rsp.data(), rsp.size(), nullptr, nullptr, nullptr);
+}
+
+static void group_req_cb(uint8_t opcode, const void * pdu, uint16_t length, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  const uint8_t * p = static_cast<const uint8_t *>(pdu);
+
+  if (length != 6 || get_le16(p + 4) != GATT_PRIM_SVC_UUID) {
+    bt_att_send_error_rsp(peer->att, opcode, get_le16(p), BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+  respond(peer, opcode, BT_ATT_OP_READ_BY_GRP_TYPE_RSP, get_le16(p), get_le16(p + 2), peer->services);
+}
+
+static void type_req_cb(uint8_t opcode, const void * pdu, uint16_t length, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  const uint8_t * p = static_cast<const uint8_t *>(pdu);
+  uint16_t type = length == 6 ? get_le16(p + 4) : 0;
+
+  if (type == GATT_CHARAC_UUID) {
+    respond(peer, opcode, BT_ATT_OP_READ_BY_TYPE_RSP, get_le16(p), get_le16(p + 2), peer->characteristics);
+  } else if (type == GATT_INCLUDE_UUID) {
+    respond(peer, opcode, BT_ATT_OP_READ_BY_TYPE_RSP, get_le16(p), get_le16(p + 2), peer->includes);
+  } else {
+    bt_att_send_error_rsp(peer->att, opcode, get_le16(p), BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+  }
+}
+
+static void info_req_cb(uint8_t opcode, const void * pdu, uint16_t, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  const uint8_t * p = static_cast<const uint8_t *>(pdu);
+  respond(peer, opcode, BT_ATT_OP_FIND_INFO_RSP, get_le16(p), get_le16(p + 2), peer->descriptors);
+}
+
+// The 128-bit UUIDs of included services, read from their declarations
+static void read_req_cb(uint8_t opcode, const void * pdu, uint16_t, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  uint16_t handle = get_le16(pdu);
+
+  for (int k = 0; k < 4; k++) {
+    if (incl_is_128(k) && handle == incl_service(k)) {
+      auto uuid = uuid128_le(static_cast<uint8_t>(0x80 + k));
+      bt_att_send(peer->att, BT_ATT_OP_READ_RSP, uuid.data(), uuid.size(), nullptr, nullptr, nullptr);
+      return;
+    }
+  }
+  bt_att_send_error_rsp(peer->att, opcode, handle, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+}
+
+static void build_peer(Peer & peer)
+{
+  for (int i = 0; i < num_services; i++) {
+    peer.services.push_back(element(service_start(i), le16(service_start(i) + 15) + le16(0x1800 + i)));
+  }
+
+  for (int k = 0; k < num_characteristics; k++) {
+    auto uuid = chrc_is_128(k) ? uuid128_le(static_cast<uint8_t>(k)) : le16(0x2a00 + k);
+    peer.characteristics.push_back(element(chrc_decl(k),
+      std::vector<uint8_t>{static_cast<uint8_t>(k)} + le16(chrc_decl(k) + 1) + uuid));
+  }
+
+  for (int j = 0; j < num_descriptors; j++) {
+    peer.descriptors.push_back(element(desc_start + j, le16(0x2900 + j)));
+  }
+
+  // Two with 128-bit UUIDs, which aren't in the declaration, then two with 16-bit ones
+  for (int k = 0; k < 4; k++) {
+    auto rest = le16(incl_service(k)) + le16(incl_service(k) + 15);
+    if (!incl_is_128(k)) {
+      rest = rest + le16(0x1810 + k);
+    }
+    peer.includes.push_back(element(incl_start + k, rest));
+  }
+}
+
+// The procedures run one after another from each other's callbacks, since
+// the mainloop can only be run once
+struct Discovery
+{
+  struct bt_att * att;
+  std::vector<std::function<void()>> steps;
+  size_t next{0};
+  std::vector<struct bt_gatt_request *> requests;
+
+  int repeats{0};
+  int remaining{0};
+  std::chrono::steady_clock::time_point start;
+};
+
+static void next_step(Discovery * discovery)
+{
+  if (discovery->next < discovery->steps.size()) {
+    discovery->steps[discovery->next++]();
+  } else {
+    mainloop_quit();
+  }
+}
+
+static void services_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data)
+{
+  Discovery * discovery = static_cast<Discovery *>(user_data);
+  struct bt_gatt_iter iter;
+  uint16_t start;
+  uint16_t end;
+  uint8_t uuid[16];
+  int i = 0;
+  bool ok = success && bt_gatt_result_service_count(result) == num_services && bt_gatt_iter_init(&iter, result);
+
+  while (ok && bt_gatt_iter_next_service(&iter, &start, &end, uuid)) {
+    ok = start == service_start(i) && end == service_start(i) + 15 &&
+      std::vector<uint8_t>(uuid, uuid + 16) == uuid16_be(0x1800 + i);
+    i++;
+  }
+  check("services", ok && i == num_services);
+  next_step(discovery);
+}
+
+static void characteristics_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data)
+{
+  Discovery * discovery = static_cast<Discovery *>(user_data);
+  struct bt_gatt_iter iter;
+  uint16_t start;
+  uint16_t end;
+  uint16_t value;
+  uint8_t properties;
+  uint8_t uuid[16];
+  int k = 0;
+  bool ok = success && bt_gatt_result_characteristic_count(result) == num_characteristics &&
+    bt_gatt_iter_init(&iter, result);
+
+  // Each ends where the next one starts, across responses; the last one at the end of the range
+  while (ok && bt_gatt_iter_next_characteristic(&iter, &start, &end, &value, &properties, &uuid[0])) {
+    uint16_t expected_end = k + 1 < num_characteristics ? chrc_decl(k + 1) - 1 : chrc_end;
+    auto expected_uuid = chrc_is_128(k) ? uuid128_be(static_cast<uint8_t>(k)) : uuid16_be(0x2a00 + k);
+    ok = start == chrc_decl(k) && value == chrc_decl(k) + 1 && end == expected_end && properties == k &&
+      std::vector<uint8_t>(uuid, uuid + 16) == expected_uuid;
+    k++;
+  }
+  check("characteristics", ok && k == num_characteristics);
+  next_step(discovery);
+}
+
+static void descriptors_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data)
+{
+  Discovery * discovery = static_cast<Discovery *>(user_data);
+  struct bt_gatt_iter iter;
+  uint16_t handle;
+  uint8_t uuid[16];
+  int j = 0;
+  bool ok = success && bt_gatt_result_descriptor_count(result) == num_descriptors &&
+    bt_gatt_iter_init(&iter, result);
+
+  while (ok && bt_gatt_iter_next_descriptor(&iter, &handle, uuid)) {
+    ok = handle == desc_start + j && std::vector<uint8_t>(uuid, uuid + 16) == uuid16_be(0x2900 + j);
+    j++;
+  }
+  check("descriptors", ok && j == num_descriptors);
+  next_step(discovery);
+}
+
+static void included_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data)
+{
+  Discovery * discovery = static_cast<Discovery *>(user_data);
+  struct bt_gatt_iter iter;
+  uint16_t handle;
+  uint16_t start;
+  uint16_t end;
+  uint8_t uuid[16];
+  int k = 0;
+  bool ok = success && bt_gatt_result_included_count(result) == 4 && bt_gatt_iter_init(&iter, result);
+
+  while (ok && bt_gatt_iter_next_included_service(&iter, &handle, &start, &end, uuid)) {
+    auto expected_uuid = incl_is_128(k) ? uuid128_be(static_cast<uint8_t>(0x80 + k)) : uuid16_be(0x1810 + k);
+    ok = handle == incl_start + k && start == incl_service(k) && end == incl_service(k) + 15 &&
+      std::vector<uint8_t>(uuid, uuid + 16) == expected_uuid;
+    k++;
+  }
+  check("included services", ok && k == 4);
+  next_step(discovery);
+}
+
+static void timed_services_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data);
+
+static void discover_services(Discovery * discovery, bt_gatt_request_callback_t callback)
+{
+  auto request = bt_gatt_discover_all_primary_services(discovery->att, nullptr, callback, discovery, nullptr);
+  if (!request) {
+    check("discovery started", false);
+    mainloop_quit();
+    return;
+  }
+  discovery->requests.push_back(request);
+}
+
+static void timed_services_cb(bool success, uint8_t, struct bt_gatt_result * result, void * user_data)
+{
+  Discovery * discovery = static_cast<Discovery *>(user_data);
+
+  if (!success || bt_gatt_result_service_count(result) != num_services) {
+    check("repeated discovery", false);
+    next_step(discovery);
+    return;
+  }
+
+  // Release each request as it completes so a long run doesn't hold them
+  bt_gatt_request_unref(discovery->requests.back());
+  discovery->requests.pop_back();
+
+  if (--discovery->remaining > 0) {
+    discover_services(discovery, timed_services_cb);
+    return;
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - discovery->start).count();
+  std::cout << "primary discovery: " << num_services << " services in " <<
+    (num_services + 2) / 3 + 1 << " responses, " <<
+    static_cast<uint64_t>(seconds * 1e6 / discovery->repeats) << " us/discovery" << std::endl;
+  next_step(discovery);
+}
+
+int main(int argc, char ** argv)
+{
+  const int repeats = argc > 1 ? atoi(argv[1]) : 500;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    std::cerr << "socketpair failed" << std::endl;
+    return -1;
+  }
+
+  mainloop_init();
+
+  Peer peer;
+  peer.att = bt_att_new(sv[1], false);
+  build_peer(peer);
+  bt_att_register(peer.att, BT_ATT_OP_READ_BY_GRP_TYPE_REQ, group_req_cb, &peer, nullptr);
+  bt_att_register(peer.att, BT_ATT_OP_READ_BY_TYPE_REQ, type_req_cb, &peer, nullptr);
+  bt_att_register(peer.att, BT_ATT_OP_FIND_INFO_REQ, info_req_cb, &peer, nullptr);
+  bt_att_register(peer.att, BT_ATT_OP_READ_REQ, read_req_cb, &peer, nullptr);
+
+  Discovery discovery;
+  discovery.att = bt_att_new(sv[0], false);
+  discovery.repeats = repeats;
+
+  auto add = [&](struct bt_gatt_request * request) {
+      if (!request) {
+        check("discovery started", false);
+        mainloop_quit();
+        return;
+      }
+      discovery.requests.push_back(request);
+    };
+
+  discovery.steps = {
+    [&] {discover_services(&discovery, services_cb);},
+    [&] {
+      add(bt_gatt_discover_characteristics(discovery.att, chrc_start, chrc_end, characteristics_cb,
+        &discovery, nullptr));
+    },
+    [&] {
+      add(bt_gatt_discover_descriptors(discovery.att, desc_start, desc_end, descriptors_cb, &discovery, nullptr));
+    },
+    [&] {
+      add(bt_gatt_discover_included_services(discovery.att, incl_start, incl_end, included_cb, &discovery,
+        nullptr));
+    },
+    [&] {
+      discovery.remaining = discovery.repeats;
+      discovery.start = std::chrono::steady_clock::now();
+      discover_services(&discovery, timed_services_cb);
+    },
+  };
+
+  next_step(&discovery);
+  mainloop_run();
+
+  if (discovery.next != discovery.steps.size()) {
+    check("every procedure completed", false);
+  }
+
+  for (auto request : discovery.requests) {
+    bt_gatt_request_unref(request);
+  }
+  bt_att_unref(discovery.att);
+  bt_att_unref(peer.att);
+  close(sv[0]);
+  close(sv[1]);
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,279 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "bluetooth.h"
+#include "uuid.h"
+#include "att-types.h"
+#include "gatt-db.h"
+#include "queue.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Builds a database the way discovery does, with services inserted out of
+// order, and checks handle lookup, range iteration and range removal
+// against the expected layout, lookups by UUID through the interned UUID
+// index, and values stored in the database. Then times gatt_db_get_attribute() and UUID lookups
+//
+
+using jeronibot::test::check;
+
+static void collect(struct gatt_db_attribute * attr, void * user_data)
+{
+  static_cast<std::vector<uint16_t> *>(user_data)->push_back(gatt_db_attribute_get_handle(attr));
+}
+
+static void push_handle(void * data, void * user_data)
+{
+  collect(static_cast<struct gatt_db_attribute *>(data), user_data);
+}
+
+int main(int argc, char ** argv)
+{
+  const int num_services = argc > 1 ? atoi(argv[1]) : 200;
+  const uint16_t handles_per_service = 8;
+  const uint16_t gap = 4;
+
+  struct gatt_db * db = gatt_db_new();
+
+  // Service i covers [1 + i * (8 + 4), ... + 7]; insert in shuffled order
+  std::vector<int> order(num_services);
+  for (int i = 0; i < num_services; i++) {
+    order[i] = i;
+  }
+  srand(1);
+  std::random_shuffle(order.begin(), order.end(), [](int n) {return rand() % n;});
+
+  auto start_of = [&](int i) {return static_cast<uint16_t>(1 + i * (handles_per_service + gap));};
+
+  for (int i : order) {
+    bt_uuid_t uuid;
+    bt_uuid16_create(&uuid, 0x1800 + i);
+    struct gatt_db_attribute * svc = gatt_db_insert_service(db, start_of(i), &uuid, true, handles_per_service);
+
+    bt_uuid_t chrc;
+    bt_uuid16_create(&chrc, 0x2a00 + i);
+    for (int c = 0; c < 3; c++) {
+      gatt_db_service_add_characteristic(svc, &chrc, 0, 0, nullptr, nullptr, nullptr);
+    }
+    gatt_db_service_set_active(svc, true);
+  }
+
+  // Overlapping inserts are rejected
+  bt_uuid_t other;
+  bt_uuid16_create(&other, 0x1234);
+  check("overlapping insert rejected",
+    gatt_db_insert_service(db, start_of(3) + 2, &other, true, 4) == nullptr);
+
+  // Every handle resolves to the attribute carrying it; gaps resolve to nothing
+  bool lookup_ok = true;
+  for (int i = 0; i < num_services && lookup_ok; i++) {
+    for (uint16_t h = start_of(i); h < start_of(i) + handles_per_service + gap; h++) {
+      struct gatt_db_attribute * attr = gatt_db_get_attribute(db, h);
+      bool expected = h < start_of(i) + 7;  // service + 3 x (decl, value)
+      lookup_ok = lookup_ok && (attr != nullptr) == expected &&
+        (!attr || gatt_db_attribute_get_handle(attr) == h);
+    }
+  }
+  check("gatt_db_get_attribute", lookup_ok);
+
+  // Services come back in handle order
+  std::vector<uint16_t> services;
+  gatt_db_foreach_service(db, nullptr, collect, &services);
+  bool sorted = static_cast<int>(services.size()) == num_services &&
+    std::is_sorted(services.begin(), services.end());
+  check("foreach_service in handle order", sorted);
+
+  // Range iteration only sees services that start inside the range
+  services.clear();
+  gatt_db_foreach_service_in_range(db, nullptr, collect, &services, start_of(10) + 1, start_of(20));
+  check("foreach_service_in_range", services.size() == 10 && services.front() == start_of(11));
+
+  // Find information returns every attribute in the range, in order
+  struct queue * q = queue_new();
+  gatt_db_find_information(db, start_of(5) + 3, start_of(7) + 1, q);
+  std::vector<uint16_t> found;
+  queue_foreach(q, push_handle, &found);
+  queue_destroy(q, nullptr);
+  check("find_information range", found.size() == 4 + 7 + 2 &&
+    found.front() == start_of(5) + 3 && found.back() == start_of(7) + 1 &&
+    std::is_sorted(found.begin(), found.end()));
+
+  // UUID lookups resolve to the lowest handle of that type, whatever form
+  // the UUID is given in
+  bt_uuid_t chrc7, chrc7_128;
+  bt_uuid16_create(&chrc7, 0x2a07);
+  bt_uuid_to_uuid128(&chrc7, &chrc7_128);
+  struct gatt_db_attribute * value7 = gatt_db_get_attribute_with_uuid(db, &chrc7);
+  check("get_attribute_with_uuid",
+    value7 && gatt_db_attribute_get_handle(value7) == start_of(7) + 2 &&
+    gatt_db_get_attribute_with_uuid(db, &chrc7_128) == value7);
+
+  bt_uuid_t missing;
+  bt_uuid16_create(&missing, 0x3fff);
+  check("get_attribute_with_uuid unknown", gatt_db_get_attribute_with_uuid(db, &missing) == nullptr);
+
+  bt_uuid_t svc9;
+  bt_uuid16_create(&svc9, 0x1809);
+  struct gatt_db_attribute * service9 = gatt_db_get_service_with_uuid(db, &svc9);
+  check("get_service_with_uuid",
+    service9 && gatt_db_attribute_get_handle(service9) == start_of(9));
+
+  // Find by type only sees the attributes in range
+  found.clear();
+  gatt_db_find_by_type(db, start_of(7) + 3, 0xffff, &chrc7_128, collect, &found);
+  check("find_by_type", found.size() == 2 &&
+    found[0] == start_of(7) + 4 && found[1] == start_of(7) + 6);
+
+  check("bt_uuid_cmp mixed widths",
+    !bt_uuid_cmp(&chrc7, &chrc7_128) && bt_uuid_cmp(&chrc7, &missing) < 0 &&
+    bt_uuid_cmp(&missing, &chrc7) > 0);
+
+  // Clearing a range removes exactly the overlapping services
+  gatt_db_clear_range(db, start_of(30) + 5, start_of(32));
+  services.clear();
+  gatt_db_foreach_service(db, nullptr, collect, &services);
+  check("clear_range", static_cast<int>(services.size()) == num_services - 3 &&
+    gatt_db_get_attribute(db, start_of(31)) == nullptr &&
+    gatt_db_get_attribute(db, start_of(33)) != nullptr);
+
+  bt_uuid_t chrc31;
+  bt_uuid16_create(&chrc31, 0x2a00 + 31);
+  check("UUID index follows removal", gatt_db_get_attribute_with_uuid(db, &chrc31) == nullptr);
+
+  // Values stored in the database: declarations and short values are kept
+  // in the attribute, longer ones grow out of it; reads through read_func
+  // are held until answered
+  {
+    bt_uuid_t uuid;
+    bt_uuid128_create(&uuid, {{0x6e, 0x40, 0x00, 0x01, 0xb5, 0xa3, 0xf3, 0x93, 0xe0, 0xa9, 0xe5, 0x0e, 0x24, 0xdc,
+        0xca, 0x9e}});
+    struct gatt_db_attribute * svc = gatt_db_insert_service(db, 0xff00, &uuid, true, 6);
+    struct gatt_db_attribute * value = gatt_db_service_add_characteristic(svc, &uuid, 0,
+        BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE, nullptr, nullptr, nullptr);
+
+    bt_uuid_t ccc;
+    bt_uuid16_create(&ccc, GATT_CLIENT_CHARAC_CFG_UUID);
+    gatt_db_service_add_descriptor(svc, &ccc, 0, nullptr, nullptr, nullptr);
+
+    bt_uuid_t desc;
+    bt_uuid16_create(&desc, GATT_CHARAC_USER_DESC_UUID);
+    struct gatt_db_attribute * deferred = gatt_db_service_add_descriptor(svc, &desc, 0,
+        [](struct gatt_db_attribute *, unsigned int, uint16_t, uint8_t, struct bt_att *, void *) {}, nullptr, nullptr);
+    gatt_db_service_set_active(svc, true);
+
+    uint16_t value_handle = 0;
+    bt_uuid_t chrc_uuid;
+    check("characteristic declaration", gatt_db_attribute_get_char_data(gatt_db_get_attribute(db, 0xff01),
+      nullptr, &value_handle, nullptr, &chrc_uuid) && value_handle == 0xff02 &&
+      !bt_uuid_cmp(&chrc_uuid, &uuid));
+
+    std::vector<uint16_t> descriptors;
+    gatt_db_service_foreach_desc(gatt_db_get_attribute(db, 0xff01), collect, &descriptors);
+    check("descriptors", descriptors == std::vector<uint16_t>({0xff03, 0xff04}));
+
+    std::vector<uint8_t> bytes;
+    auto read = [&]() {
+        bytes.clear();
+        gatt_db_attribute_read(value, 0, 0, nullptr,
+          [](struct gatt_db_attribute *, int err, const uint8_t * data, size_t length, void * user_data) {
+            static_cast<std::vector<uint8_t> *>(user_data)->assign(data, data + length);
+          }, &bytes);
+        return bytes;
+      };
+    auto write = [&](uint16_t offset, std::vector<uint8_t> data) {
+        gatt_db_attribute_write(value, offset, data.data(), data.size(), 0, nullptr,
+          [](struct gatt_db_attribute *, int, void *) {}, nullptr);
+      };
+
+    std::vector<uint8_t> expected = {1, 2, 3, 4};
+    write(0, expected);
+    check("short value", read() == expected);
+
+    // Past the end: the gap reads as zeros
+    write(8, {9, 9});
+    expected.insert(expected.end(), {0, 0, 0, 0, 9, 9});
+    check("value grows", read() == expected);
+
+    std::vector<uint8_t> long_value(100, 0x5a);
+    write(4, long_value);
+    expected.resize(4);
+    expected.insert(expected.end(), long_value.begin(), long_value.end());
+    check("long value", read() == expected);
+
+    gatt_db_attribute_reset(value);
+    check("reset", read().empty());
+
+    int err = -1;
+    gatt_db_attribute_read(deferred, 0, 0, nullptr,
+      [](struct gatt_db_attribute *, int err, const uint8_t *, size_t, void * user_data) {
+        *static_cast<int *>(user_data) = err;
+      }, &err);
+    bool held = err == -1;
+    check("deferred read", held && gatt_db_attribute_read_result(deferred, 1, 0, nullptr, 0) && err == 0);
+
+    gatt_db_remove_service(db, svc);
+  }
+
+  // Lookup cost
+  const int lookups = 2000000;
+  uint16_t max_handle = start_of(num_services - 1) + 6;
+  auto t0 = std::chrono::steady_clock::now();
+  uintptr_t sink = 0;
+  for (int i = 0; i < lookups; i++) {
+    sink += reinterpret_cast<uintptr_t>(gatt_db_get_attribute(db, 1 + (i * 7919u) % max_handle));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "get_attribute: " << num_services << " services, " <<
+    static_cast<uint64_t>(seconds * 1e9 / lookups) << " ns/lookup" << std::endl;
+
+  // Find by type over the whole database: the search UUID is interned once
+  // and attributes are matched by id
+  const int searches = 20000;
+  unsigned int matches = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < searches; i++) {
+    bt_uuid_t type;
+    bt_uuid16_create(&type, 0x2a00 + (i % num_services));
+    matches += gatt_db_find_by_type(db, 0x0001, 0xffff, &type, [](struct gatt_db_attribute *, void *) {}, nullptr);
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "find_by_type: " << static_cast<uint64_t>(seconds * 1e9 / searches) << " ns/search" << std::endl;
+
+  t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < lookups; i++) {
+    bt_uuid_t type;
+    bt_uuid16_create(&type, 0x2a00 + (i % num_services));
+    sink += reinterpret_cast<uintptr_t>(gatt_db_get_attribute_with_uuid(db, &type));
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "get_attribute_with_uuid: " << static_cast<uint64_t>(seconds * 1e9 / lookups) <<
+    " ns/lookup" << std::endl;
+
+  check("timed lookups found their attributes", sink && matches);
+
+  gatt_db_unref(db);
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,212 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bluetooth/le_scanner.hpp"
+
+extern "C" {
+#include "hci.h"
+}
+
+#include "support/check.hpp"
+
+using namespace std::chrono_literals;
+using bluetooth::LEDevice;
+using bluetooth::LEScanner;
+using jeronibot::test::check;
+
+//
+// LEScanner: the AD parsers find 16- and 128-bit service UUIDs and
+// manufacturer data and stop at malformed lengths. Then advertising reports
+// written to one end of a socketpair, standing in for the controller, are
+// folded into the device table: one entry per address and type, the RSSI
+// averaged, a match kept, truncated events cut short and the stalest
+// device evicted when the table is full
+//
+
+// Nordic UART service, 6e400001-b5a3-f393-e0a9-e50e24dcca9e, as advertised
+static const uint8_t uart_le[16] = {0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5,
+  0x01, 0x00, 0x40, 0x6e};
+static const uint8_t battery_le[2] = {0x0f, 0x18};
+static const uint8_t hid_le[2] = {0x12, 0x18};
+
+struct Report
+{
+  bdaddr_t address;
+  uint8_t type;
+  int8_t rssi;
+  std::vector<uint8_t> data;
+};
+
+static bdaddr_t address(uint8_t last)
+{
+  return bdaddr_t{{last, 0x00, 0x5e, 0x7a, 0x02, 0xf4}};
+}
+
+// An LE Advertising Report event carrying reports
+static std::vector<uint8_t> event(const std::vector<Report> & reports)
+{
+  std::vector<uint8_t> e = {HCI_EVENT_PKT, EVT_LE_META_EVENT, 0, EVT_LE_ADVERTISING_REPORT,
+    static_cast<uint8_t>(reports.size())};
+
+  for (auto & r : reports) {
+    e.push_back(0x00);                    // ADV_IND
+    e.push_back(r.type);
+    e.insert(e.end(), r.address.b, r.address.b + 6);
+    e.push_back(static_cast<uint8_t>(r.data.size()));
+    e.insert(e.end(), r.data.begin(), r.data.end());
+    e.push_back(static_cast<uint8_t>(r.rssi));
+  }
+
+  e[2] = static_cast<uint8_t>(e.size() - 1 - HCI_EVENT_HDR_SIZE);
+  return e;
+}
+
+// Wait for the scanner's thread to take in a total of reports
+static bool wait_for(const LEScanner & scanner, uint64_t reports)
+{
+  auto deadline = std::chrono::steady_clock::now() + 2s;
+  while (scanner.get_num_reports() < reports) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+  return true;
+}
+
+static void test_ad_parsing()
+{
+  const std::vector<uint8_t> uuid16 = {0x02, 0x01, 0x06, 0x05, 0x03, 0x0d, 0x18, 0x0f, 0x18};
+  check("16-bit UUID list", LEScanner::has_service_uuid(uuid16.data(), uuid16.size(), battery_le, 2));
+  check("16-bit UUID absent", !LEScanner::has_service_uuid(uuid16.data(), uuid16.size(), hid_le, 2));
+
+  std::vector<uint8_t> uuid128 = {0x02, 0x01, 0x06, 0x11, 0x07};
+  uuid128.insert(uuid128.end(), uart_le, uart_le + 16);
+  check("128-bit UUID list", LEScanner::has_service_uuid(uuid128.data(), uuid128.size(), uart_le, 16));
+  check("sizes are not mixed", !LEScanner::has_service_uuid(uuid128.data(), uuid128.size(), uart_le, 2));
+
+  const std::vector<uint8_t> manufacturer = {0x02, 0x01, 0x06, 0x05, 0xff, 0x4c, 0x00, 0x02, 0x15};
+  check("company ID", LEScanner::has_company_id(manufacturer.data(), manufacturer.size(), 0x004c));
+  check("other company ID", !LEScanner::has_company_id(manufacturer.data(), manufacturer.size(), 0x0059));
+
+  // The field claims more than the buffer holds
+  const std::vector<uint8_t> overrun = {0x02, 0x01, 0x06, 0x07, 0x03, 0x0f, 0x18};
+  check("UUID field past the end", !LEScanner::has_service_uuid(overrun.data(), overrun.size(), battery_le, 2));
+  const std::vector<uint8_t> short_mfr = {0x05, 0xff, 0x4c, 0x00};
+  check("manufacturer field past the end",
+    !LEScanner::has_company_id(short_mfr.data(), short_mfr.size(), 0x004c));
+
+  // Too short to hold a company ID
+  const std::vector<uint8_t> tiny_mfr = {0x02, 0xff, 0x4c, 0x00};
+  check("manufacturer field too short", !LEScanner::has_company_id(tiny_mfr.data(), tiny_mfr.size(), 0x4c));
+
+  // A zero length ends the data; a field with only a type is skipped
+  const std::vector<uint8_t> terminated = {0x00, 0x03, 0x03, 0x0f, 0x18};
+  check("zero length ends the data",
+    !LEScanner::has_service_uuid(terminated.data(), terminated.size(), battery_le, 2));
+  const std::vector<uint8_t> empty_field = {0x01, 0x03, 0x03, 0x03, 0x0f, 0x18};
+  check("empty field skipped", LEScanner::has_service_uuid(empty_field.data(), empty_field.size(), battery_le, 2));
+  const std::vector<uint8_t> odd = {0x04, 0x03, 0x0f, 0x18, 0x12};
+  check("partial UUID ignored", LEScanner::has_service_uuid(odd.data(), odd.size(), battery_le, 2) &&
+    !LEScanner::has_service_uuid(odd.data(), odd.size(), hid_le, 2));
+}
+
+// Reports written to controller are read by a scanner on dd
+static void fold_reports(int dd, int controller)
+{
+  LEScanner::Config config;
+  config.capacity = 16;
+  config.service_uuids = {"6e400001-b5a3-f393-e0a9-e50e24dcca9e"};
+  config.company_ids = {0x004c};
+  LEScanner scanner(dd, config);
+
+  std::vector<uint8_t> uart_ad = {0x11, 0x07};
+  uart_ad.insert(uart_ad.end(), uart_le, uart_le + 16);
+  const std::vector<uint8_t> flags = {0x02, 0x01, 0x06};
+  const std::vector<uint8_t> apple = {0x05, 0xff, 0x4c, 0x00, 0x02, 0x15};
+
+  auto send = [&](const std::vector<uint8_t> & e) {
+      return write(controller, e.data(), e.size()) == static_cast<ssize_t>(e.size());
+    };
+
+  send(event({{address(1), LE_PUBLIC_ADDRESS, -60, flags}, {address(2), LE_RANDOM_ADDRESS, -70, apple}}));
+  send(event({{address(1), LE_PUBLIC_ADDRESS, -40, uart_ad}}));
+  send(event({{address(1), LE_PUBLIC_ADDRESS, -40, flags}, {address(1), LE_RANDOM_ADDRESS, -80, flags}}));
+  check("reports taken in", wait_for(scanner, 5));
+
+  LEDevice device;
+  check("one entry per address and type", scanner.get_devices().size() == 3);
+  check("found", scanner.find(address(1), device) && device.address_type == LE_PUBLIC_ADDRESS);
+  check("reports counted", device.num_reports == 3 && device.last_rssi == -40);
+  check("RSSI averaged", std::fabs(device.rssi - (0.25f * -40 + 0.75f * (0.25f * -40 + 0.75f * -60))) < 0.01f);
+  check("match kept", device.matched);
+  check("matched by company ID", scanner.find(address(2), device) && device.matched);
+  bdaddr_t first = address(1);
+  check("best match", scanner.get_best_match(device) && !bacmp(&device.address, &first));
+  check("unknown device", !scanner.find(address(9), device));
+
+  // Two reports promised, one present; then a truncated event and another subevent
+  std::vector<uint8_t> cut = event({{address(3), LE_PUBLIC_ADDRESS, -50, flags}});
+  cut[4] = 2;
+  send(cut);
+  std::vector<uint8_t> truncated = event({{address(4), LE_PUBLIC_ADDRESS, -50, flags}});
+  truncated.resize(truncated.size() - 2);
+  send(truncated);
+  std::vector<uint8_t> other = event({{address(5), LE_PUBLIC_ADDRESS, -50, flags}});
+  other[3] = 0x01;                        // LE Connection Complete
+  send(other);
+  send(event({{address(6), LE_PUBLIC_ADDRESS, -50, flags}}));
+  check("malformed events cut short", wait_for(scanner, 7) && scanner.find(address(3), device) &&
+    !scanner.find(address(4), device) && !scanner.find(address(5), device) && scanner.find(address(6), device));
+
+  // A full table evicts its stalest device
+  for (uint8_t i = 10; i < 30; i++) {
+    send(event({{address(i), LE_PUBLIC_ADDRESS, -50, flags}}));
+    wait_for(scanner, 7 + i - 9);
+  }
+  check("table bounded", scanner.get_devices().size() == 16);
+  check("stalest evicted", !scanner.find(address(1), device) && !scanner.find(address(2), device));
+  check("newest kept", scanner.find(address(29), device));
+}
+
+static void test_device_table()
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    check("socketpair", false);
+    return;
+  }
+
+  // The scanner closes its end
+  fold_reports(sv[0], sv[1]);
+  close(sv[1]);
+}
+
+int main(int, char **)
+{
+  test_ad_parsing();
+  test_device_table();
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,151 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <time.h>
+
+extern "C" {
+#include "log.h"
+}
+
+#include "support/check.hpp"
+
+//
+// bt_log: records taken on the caller's side are formatted by the
+// background thread exactly as printf would have; disabled call sites do
+// not evaluate their arguments; without the thread, bt_log_drain() hands
+// the same text to the caller. Then times a disabled call site and the
+// producer side of an enabled one
+//
+
+using jeronibot::test::check;
+
+static int evaluated = 0;
+
+static unsigned int side_effect()
+{
+  return ++evaluated;
+}
+
+static void append_line(int level, uint64_t, const char * line, void * user_data)
+{
+  auto lines = static_cast<std::string *>(user_data);
+  *lines += std::to_string(level) + " " + line + "\n";
+}
+
+static std::string read_all(FILE * f)
+{
+  std::string contents;
+  char buf[512];
+  size_t n;
+
+  rewind(f);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents.append(buf, n);
+  }
+
+  return contents;
+}
+
+int main(int argc, char ** argv)
+{
+  const int iterations = argc > 1 ? atoi(argv[1]) : 10000000;
+
+  FILE * f = tmpfile();
+  if (!f) {
+    std::cerr << "tmpfile failed" << std::endl;
+    return -1;
+  }
+
+  // Nothing is taken before the thread is started
+  bt_log(BT_LOG_ERROR, "too early %u", side_effect());
+  check("disabled before start", evaluated == 0);
+
+  check("start", bt_log_start(BT_LOG_DEBUG, f));
+
+  int neg = -42;
+  long long big = 1234567890123LL;
+  size_t size = 77;
+  const uint8_t pdu[] = {0x1b, 0x0e, 0x00, 0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0xac,
+    0x09, 0xbc, 0xfe, 0x01, 0x02, 0x03};
+
+  bt_log(BT_LOG_INFO, "ATT op 0x%02x handle 0x%04x len %u", 0x1b, 0x000e, 12u);
+  bt_log(BT_LOG_WARN, "%s: %d %lld %zu %5.3x|%-4c| 100%%", "mixed", neg, big, size, 0xab, 'z');
+  bt_log_hexdump(BT_LOG_DEBUG, '<', pdu, sizeof(pdu));
+  bt_log(BT_LOG_TRACE, "above the runtime level %u", side_effect());
+
+  bt_log_stop();
+
+  std::string out = read_all(f);
+  check("integer conversions", out.find("I ATT op 0x1b handle 0x000e len 12\n") != std::string::npos);
+  check("mixed conversions",
+    out.find("W mixed: -42 1234567890123 77   0ab|z   | 100%\n") != std::string::npos);
+  check("hexdump", out.find("D 18 bytes\n< 1b 0e 00 55 aa 06 0a 03 7b 00 00 ac 09 bc fe 01") != std::string::npos &&
+    out.find("\n  02 03 ") != std::string::npos);
+  check("arguments of disabled sites are not evaluated",
+    evaluated == 0 && out.find("above the runtime level") == std::string::npos);
+
+  // Drained by the caller instead of a thread
+  std::string lines;
+  bt_log_set_level(BT_LOG_INFO);
+  bt_log(BT_LOG_INFO, "notify_cb: opcode 0x%02x, %u bytes", 0x1b, 12u);
+  bt_log_hexdump(BT_LOG_INFO, '<', pdu, 3);
+  bt_log(BT_LOG_DEBUG, "above the drain level %u", side_effect());
+  check("drained", bt_log_drain(append_line, &lines) == 2);
+  check("drained text", lines.find("2 notify_cb: opcode 0x1b, 12 bytes\n2 3 bytes\n< 1b 0e 00 ") == 0 &&
+    lines.find("above the drain level") == std::string::npos);
+  check("nothing more to drain", bt_log_drain(append_line, &lines) == 0);
+  bt_log_set_level(-1);
+  check("drain threshold respected", evaluated == 0);
+
+  // Cost of a call site that is disabled at runtime
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    bt_log(BT_LOG_DEBUG, "disabled %u %u", side_effect(), static_cast<unsigned int>(i));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "disabled call site: " << seconds * 1e9 / iterations << " ns" << std::endl;
+  check("disabled loop evaluated nothing", evaluated == 0);
+
+  // Producer cost of an enabled one; bursts stay within the queue
+  FILE * null = fopen("/dev/null", "w");
+  bt_log_start(BT_LOG_DEBUG, null);
+  const int records = 500;
+  const int bursts = 200;
+  double producer = 0;
+  for (int b = 0; b < bursts; b++) {
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < records; i++) {
+      bt_log(BT_LOG_DEBUG, "ATT op 0x%02x handle 0x%04x len %u", 0x1b, i, 12u);
+    }
+    producer += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    // Let the thread catch up between bursts
+    struct timespec ts = {0, 5000000};
+    nanosleep(&ts, nullptr);
+  }
+  bt_log_stop();
+  fclose(null);
+  std::cout << "enabled call site: " << producer * 1e9 / (records * bursts) << " ns/record, " <<
+    bt_log_get_dropped() << " dropped" << std::endl;
+
+  fclose(f);
+
+  return jeronibot::test::result();
+}
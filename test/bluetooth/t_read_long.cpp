@@ -0,0 +1,257 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "att.h"
+#include "bluetooth.h"
+#include "uuid.h"
+#include "gatt-db.h"
+#include "gatt-client.h"
+#include "mainloop.h"
+#include "util.h"
+}
+
+#include "support/check.hpp"
+
+//
+// Long reads against a loopback peer: one end of a SOCK_SEQPACKET
+// socketpair is a gatt client, the other a minimal ATT server with a single
+// empty service that answers Read Blob requests from a 512-byte value. Checks
+// that the value comes back intact, with a growing buffer and into a
+// caller-supplied one (including one too small for it), then times reads
+//
+
+static const uint16_t value_handle = 0x0010;
+static uint8_t value[BT_ATT_MAX_VALUE_LEN];
+
+struct Peer
+{
+  struct bt_att * att;
+};
+
+static void blob_req_cb(uint8_t opcode, const void * pdu, uint16_t length, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  uint16_t handle = get_le16(pdu);
+  uint16_t offset = get_le16(static_cast<const uint8_t *>(pdu) + 2);
+
+  if (length != 4 || handle != value_handle || offset > sizeof(value)) {
+    bt_att_send_error_rsp(peer->att, opcode, handle, BT_ATT_ERROR_INVALID_OFFSET);
+    return;
+  }
+
+  uint16_t len = std::min<size_t>(bt_att_get_mtu(peer->att) - 1, sizeof(value) - offset);
+  bt_att_send(peer->att, BT_ATT_OP_READ_BLOB_RSP, value + offset, len, nullptr, nullptr, nullptr);
+}
+
+static void mtu_req_cb(uint8_t, const void *, uint16_t, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  uint8_t rsp[2];
+
+  put_le16(BT_ATT_DEFAULT_LE_MTU, rsp);
+  bt_att_send(peer->att, BT_ATT_OP_MTU_RSP, rsp, sizeof(rsp), nullptr, nullptr, nullptr);
+}
+
+// The client needs at least one primary service to become ready
+static void group_req_cb(uint8_t opcode, const void * pdu, uint16_t length, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  uint16_t start = get_le16(pdu);
+  uint16_t type = get_le16(static_cast<const uint8_t *>(pdu) + 4);
+
+  if (length != 6 || start > 0x0001 || type != GATT_PRIM_SVC_UUID) {
+    bt_att_send_error_rsp(peer->att, opcode, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  uint8_t rsp[7] = {6};
+  put_le16(0x0001, &rsp[1]);
+  put_le16(value_handle, &rsp[3]);
+  put_le16(0x1800, &rsp[5]);
+  bt_att_send(peer->att, BT_ATT_OP_READ_BY_GRP_TYPE_RSP, rsp, sizeof(rsp), nullptr, nullptr, nullptr);
+}
+
+static void not_found_cb(uint8_t opcode, const void * pdu, uint16_t, void * user_data)
+{
+  Peer * peer = static_cast<Peer *>(user_data);
+  bt_att_send_error_rsp(peer->att, opcode, get_le16(pdu), BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+}
+
+// One timed run of reads; the runs are chained from the client's ready
+// callback since the mainloop can only be run once
+struct Run
+{
+  const char * name;
+  uint8_t * buf;            // nullptr: let the client allocate
+  size_t size;
+  size_t expected_length;
+  int remaining;
+  bool ok;
+  std::chrono::steady_clock::time_point start;
+};
+
+struct Reader
+{
+  struct bt_gatt_client * client;
+  std::vector<Run> runs;
+  size_t current{0};
+  int count{0};
+  bool ready{false};
+};
+
+using jeronibot::test::check;
+
+static void start_run(Reader * reader);
+static void start_read(Reader * reader);
+
+static void finish_run(Reader * reader)
+{
+  Run & run = reader->runs[reader->current];
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run.start).count();
+
+  run.ok = run.ok && run.remaining == 0;
+  check(std::string(run.name) + ": " + std::to_string(reader->count) + " reads of " +
+    std::to_string(run.expected_length) + " bytes, " +
+    std::to_string(static_cast<uint64_t>(seconds * 1e6 / reader->count)) + " us/read", run.ok);
+
+  if (++reader->current < reader->runs.size()) {
+    start_run(reader);
+  } else {
+    mainloop_quit();
+  }
+}
+
+static void read_cb(bool success, uint8_t, const uint8_t * data, uint16_t length, void * user_data)
+{
+  Reader * reader = static_cast<Reader *>(user_data);
+  Run & run = reader->runs[reader->current];
+
+  if (!success || length != run.expected_length || memcmp(data, value, length) ||
+    (run.buf && data != run.buf))
+  {
+    run.ok = false;
+  }
+
+  if (--run.remaining > 0 && run.ok) {
+    start_read(reader);
+  } else {
+    finish_run(reader);
+  }
+}
+
+static void start_read(Reader * reader)
+{
+  Run & run = reader->runs[reader->current];
+
+  unsigned int id = run.buf ?
+    bt_gatt_client_read_long_value_into(reader->client, value_handle, 0, run.buf, run.size,
+      read_cb, reader, nullptr) :
+    bt_gatt_client_read_long_value(reader->client, value_handle, 0, read_cb, reader, nullptr);
+
+  if (!id) {
+    run.ok = false;
+    finish_run(reader);
+  }
+}
+
+static void start_run(Reader * reader)
+{
+  Run & run = reader->runs[reader->current];
+  run.remaining = reader->count;
+  run.ok = true;
+  run.start = std::chrono::steady_clock::now();
+  start_read(reader);
+}
+
+static void ready_cb(bool success, uint8_t, void * user_data)
+{
+  Reader * reader = static_cast<Reader *>(user_data);
+
+  reader->ready = success;
+  if (!success) {
+    mainloop_quit();
+    return;
+  }
+
+  start_run(reader);
+}
+
+int main(int argc, char ** argv)
+{
+  const int count = argc > 1 ? atoi(argv[1]) : 2000;
+
+  for (size_t i = 0; i < sizeof(value); i++) {
+    value[i] = static_cast<uint8_t>(i * 31 + 7);
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    std::cerr << "socketpair failed" << std::endl;
+    return -1;
+  }
+
+  mainloop_init();
+
+  Peer peer;
+  peer.att = bt_att_new(sv[1], false);
+  bt_att_register(peer.att, BT_ATT_OP_READ_BLOB_REQ, blob_req_cb, &peer, nullptr);
+  bt_att_register(peer.att, BT_ATT_OP_MTU_REQ, mtu_req_cb, &peer, nullptr);
+  bt_att_register(peer.att, BT_ATT_OP_READ_BY_GRP_TYPE_REQ, group_req_cb, &peer, nullptr);
+  for (uint8_t opcode : {BT_ATT_OP_READ_BY_TYPE_REQ, BT_ATT_OP_FIND_INFO_REQ, BT_ATT_OP_FIND_BY_TYPE_VAL_REQ}) {
+    bt_att_register(peer.att, opcode, not_found_cb, &peer, nullptr);
+  }
+
+  struct bt_att * att = bt_att_new(sv[0], false);
+  struct gatt_db * db = gatt_db_new();
+  struct bt_gatt_client * client = bt_gatt_client_new(db, att, 0);
+
+  uint8_t buf[BT_ATT_MAX_VALUE_LEN];
+  uint8_t small[100];
+
+  Reader reader;
+  reader.client = client;
+  reader.count = count;
+  reader.runs = {
+    {"growing buffer", nullptr, 0, sizeof(value)},
+    {"caller buffer", buf, sizeof(buf), sizeof(value)},
+    {"short caller buffer", small, sizeof(small), sizeof(small)},
+  };
+
+  bt_gatt_client_set_ready_handler(client, ready_cb, &reader, nullptr);
+  mainloop_run();
+
+  check("client became ready", reader.ready);
+
+  bt_gatt_client_unref(client);
+  gatt_db_unref(db);
+  bt_att_unref(att);
+  bt_att_unref(peer.att);
+  close(sv[0]);
+  close(sv[1]);
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "bluetooth/rpa_resolver.hpp"
+
+extern "C" {
+#include "crypto.h"
+}
+
+#include "support/check.hpp"
+
+using bluetooth::RpaResolver;
+using jeronibot::test::check;
+
+//
+// Resolves a scan's worth of addresses against a set of IRKs, checks the
+// results against bt_crypto_ah() and reports throughput for the batched
+// resolver and for the one-pair-at-a-time path
+//
+
+int main(int argc, char ** argv)
+{
+  const size_t num_irks = argc > 1 ? atoi(argv[1]) : 64;
+  const size_t num_addrs = argc > 2 ? atoi(argv[2]) : 4096;
+
+  struct bt_crypto * crypto = bt_crypto_new();
+  if (!crypto) {
+    std::cerr << "Failed to create crypto context" << std::endl;
+    return -1;
+  }
+
+  srand(1);
+
+  std::vector<std::vector<uint8_t>> irks(num_irks, std::vector<uint8_t>(16));
+  std::vector<bdaddr_t> identities(num_irks);
+  RpaResolver resolver;
+
+  for (size_t k = 0; k < num_irks; k++) {
+    for (auto & b : irks[k]) {b = rand();}
+    for (auto & b : identities[k].b) {b = rand();}
+    resolver.add_irk(identities[k], irks[k].data());
+  }
+
+  // Every other address belongs to a known device, the rest are strangers
+  std::vector<bdaddr_t> rpas(num_addrs);
+  std::vector<int> owner(num_addrs, -1);
+
+  for (size_t i = 0; i < num_addrs; i++) {
+    for (auto & b : rpas[i].b) {b = rand();}
+    rpas[i].b[5] = (rpas[i].b[5] & 0x3f) | 0x40;
+
+    if (i % 2 == 0) {
+      owner[i] = rand() % num_irks;
+      bt_crypto_ah(crypto, irks[owner[i]].data(), &rpas[i].b[3], &rpas[i].b[0]);
+    }
+  }
+
+  std::vector<const bdaddr_t *> result(num_addrs);
+  resolver.resolve(rpas.data(), rpas.size(), result.data());
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < num_addrs; i++) {
+    const bdaddr_t * expected = owner[i] < 0 ? nullptr : &identities[owner[i]];
+    if ((result[i] == nullptr) != (expected == nullptr) ||
+      (result[i] && bacmp(result[i], expected)))
+    {
+      mismatches++;
+    }
+  }
+
+  check("batched resolution matches bt_crypto_ah", mismatches == 0);
+
+  auto & stats = resolver.get_stats();
+  std::cout << "batched:  " << num_addrs << " addresses x " << num_irks << " IRKs, " <<
+    stats.ah_evaluations << " ah(), " << static_cast<uint64_t>(stats.resolutions_per_second()) <<
+    " resolutions/s, " << static_cast<uint64_t>(stats.ah_per_second()) << " ah/s" << std::endl;
+
+  // Second pass is served from the cache
+  resolver.reset_stats();
+  resolver.resolve(rpas.data(), rpas.size(), result.data());
+  std::cout << "cached:   " << stats.cache_hits << " hits, " <<
+    static_cast<uint64_t>(stats.resolutions_per_second()) << " resolutions/s" << std::endl;
+
+  // Baseline: every (address, IRK) pair through bt_crypto_ah
+  auto start = std::chrono::steady_clock::now();
+  uint64_t evaluations = 0;
+  for (size_t i = 0; i < num_addrs; i++) {
+    for (size_t k = 0; k < num_irks; k++) {
+      uint8_t hash[3];
+      evaluations++;
+      bt_crypto_ah(crypto, irks[k].data(), &rpas[i].b[3], hash);
+      if (!memcmp(hash, rpas[i].b, sizeof(hash))) {
+        break;
+      }
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "pairwise: " << evaluations << " ah(), " <<
+    static_cast<uint64_t>(num_addrs / seconds) << " resolutions/s" << std::endl;
+
+  bt_crypto_unref(crypto);
+
+  return jeronibot::test::result();
+}
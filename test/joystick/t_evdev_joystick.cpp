@@ -0,0 +1,215 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <linux/input.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/check.hpp"
+#include "util/evdev_joystick.hpp"
+#include "util/xbox360_controller.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::util::AxisState;
+using jeronibot::util::EvdevJoystick;
+using jeronibot::util::XBox360Controller;
+
+//
+// EvdevJoystick: a gamepad's axes and buttons are numbered like the js
+// interface numbers them and scaled to its range, both coordinates of a
+// stick change in one frame, frames carry the kernel's timestamps, a
+// dropped frame is discarded, and a backlog of frames is read in bulk.
+// Events come through a pipe standing in for the device
+//
+
+using jeronibot::test::check;
+
+static struct timeval monotonic_now(std::chrono::microseconds offset = 0us)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + offset.count();
+  return {static_cast<time_t>(us / 1000000), static_cast<suseconds_t>(us % 1000000)};
+}
+
+struct Frame
+{
+  std::vector<struct input_event> events;
+
+  Frame & add(uint16_t type, uint16_t code, int32_t value)
+  {
+    struct input_event event = {};
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    events.push_back(event);
+    return *this;
+  }
+
+  // Stamp every event and end the frame
+  Frame & report(struct timeval time = monotonic_now())
+  {
+    add(EV_SYN, SYN_REPORT, 0);
+    for (auto & event : events) {
+      event.input_event_sec = time.tv_sec;
+      event.input_event_usec = time.tv_usec;
+    }
+    return *this;
+  }
+};
+
+int main(int argc, char ** argv)
+{
+  int fds[2];
+  if (pipe(fds) < 0) {
+    std::cerr << "pipe failed" << std::endl;
+    return -1;
+  }
+
+  auto send = [&](const Frame & frame) {
+      size_t length = frame.events.size() * sizeof(frame.events[0]);
+      return write(fds[1], frame.events.data(), length) == static_cast<ssize_t>(length);
+    };
+
+  // What xpad reports for an XBox 360 controller
+  EvdevJoystick joystick(fds[0], {
+      {ABS_X, -32768, 32767}, {ABS_Y, -32768, 32767}, {ABS_Z, 0, 255},
+      {ABS_RX, -32768, 32767}, {ABS_RY, -32768, 32767}, {ABS_RZ, 0, 255},
+      {ABS_HAT0X, -1, 1}, {ABS_HAT0Y, -1, 1}},
+    {BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_TL, BTN_TR, BTN_SELECT, BTN_START, BTN_MODE,
+      BTN_THUMBL, BTN_THUMBR});
+
+  std::mutex mutex;
+  std::vector<std::pair<uint8_t, AxisState>> moves;
+  std::vector<std::chrono::steady_clock::time_point> times;
+  joystick.set_axis_callback([&](uint8_t axis, AxisState state) {
+      std::lock_guard<std::mutex> lock(mutex);
+      moves.emplace_back(axis, state);
+      times.push_back(joystick.get_event_time());
+    });
+
+  bool x_pressed = false;
+  joystick.set_button_callback(XBox360Controller::Button_X, [&](bool pressed) {x_pressed = pressed;});
+
+  auto wait_for = [&](uint64_t frames) {
+      auto start = std::chrono::steady_clock::now();
+      while (joystick.get_num_events() < frames && std::chrono::steady_clock::now() - start < 2s) {
+        std::this_thread::yield();
+      }
+      return joystick.get_num_events() >= frames;
+    };
+
+  check("numbered like js", joystick.get_num_axes() == 4 && joystick.get_num_buttons() == 11);
+
+  {
+    send(Frame().add(EV_ABS, ABS_X, 1000).add(EV_ABS, ABS_Y, -2000).report());
+    bool applied = wait_for(1);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    check("atomic frame", applied && moves.size() == 1 && moves[0].first == XBox360Controller::Axis_LeftThumbstick &&
+      moves[0].second.x == 1000 && moves[0].second.y == -2000);
+    moves.clear();
+    times.clear();
+  }
+
+  {
+    send(Frame().add(EV_ABS, ABS_Z, 255).add(EV_ABS, ABS_RZ, 0).add(EV_ABS, ABS_HAT0X, -1).report());
+    bool applied = wait_for(2);
+
+    AxisState triggers = joystick.get_axis_state(XBox360Controller::Axis_Triggers);
+    AxisState digipad = joystick.get_axis_state(XBox360Controller::Axis_Digipad);
+    check("scaled", applied && triggers.x == 32767 && triggers.y == -32767 && digipad.x == -32767 && digipad.y == 0);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    moves.clear();
+    times.clear();
+  }
+
+  {
+    send(Frame().add(EV_KEY, BTN_NORTH, 1).report());
+    check("buttons", wait_for(3) && x_pressed);
+  }
+
+  {
+    auto stamp = monotonic_now(-5000us);
+    send(Frame().add(EV_ABS, ABS_RX, 500).report(stamp));
+    bool applied = wait_for(4);
+
+    auto expected = std::chrono::steady_clock::time_point(std::chrono::seconds(stamp.tv_sec) +
+      std::chrono::microseconds(stamp.tv_usec));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    check("kernel timestamp", applied && times.size() == 1 && times[0] == expected);
+    check("latency", joystick.get_last_latency() >= 5ms && joystick.get_last_latency() < 1s);
+    std::cout << "latency: " << std::chrono::duration<double, std::micro>(joystick.get_last_latency()).count() <<
+      " us (5000 us of it made up)" << std::endl;
+    moves.clear();
+    times.clear();
+  }
+
+  {
+    // The kernel lost events mid frame: up to the next report is stale
+    Frame dropped;
+    dropped.add(EV_ABS, ABS_X, 111).add(EV_SYN, SYN_DROPPED, 0).add(EV_ABS, ABS_Y, 222).report();
+    send(dropped);
+    send(Frame().add(EV_ABS, ABS_X, 333).report());
+    bool applied = wait_for(5);
+
+    AxisState left = joystick.get_axis_state(XBox360Controller::Axis_LeftThumbstick);
+    check("dropped frame discarded", applied && joystick.get_num_dropped() == 1 && left.x == 333 && left.y == -2000);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    moves.clear();
+    times.clear();
+  }
+
+  {
+    const int frames = 10000;
+    uint64_t before = joystick.get_num_events();
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer([&] {
+        for (int i = 0; i < frames; i++) {
+          send(Frame().add(EV_ABS, ABS_X, i).add(EV_ABS, ABS_Y, -i).report());
+        }
+      });
+    bool applied = wait_for(before + frames);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    writer.join();
+
+    bool paired = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto & move : moves) {
+        paired = paired && move.second.x == -move.second.y;
+      }
+      paired = paired && moves.size() == frames;
+    }
+
+    std::cout << "frames: " << frames / seconds << "/s" << std::endl;
+    check("backlog", applied && paired);
+  }
+
+  joystick.set_axis_callback(nullptr);
+  close(fds[1]);
+  return jeronibot::test::result();
+}
@@ -0,0 +1,328 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "bluez.h"
+#include "minipro/minipro.hpp"
+#include "minipro/protocol.hpp"
+#include "support/check.hpp"
+#include "util/logger.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::MiniPro;
+using jeronibot::util::Logger;
+
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// Steady state: once a session is warmed up, driving, taking the pushed
+// telemetry and sending queries allocate nothing, on any thread, with the
+// client's mainloop on its own thread or on the caller's. The logger runs
+// at its default level, draining bt_log too, and the drive path gives it
+// nothing to write. malloc is replaced with one that counts, so an
+// allocation anywhere after the warmup fails the test. The vehicle is a
+// minimal ATT peer on a socketpair that pushes telemetry at 100 Hz
+//
+
+static std::atomic<bool> counting{false};
+static std::atomic<uint64_t> allocations{0};
+
+#ifndef __SANITIZE_ADDRESS__
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+void __libc_free(void * ptr);
+
+// operator new comes here too
+void * malloc(size_t size) noexcept
+{
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) noexcept
+{
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) noexcept
+{
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr) noexcept
+{
+  __libc_free(ptr);
+}
+
+}  // extern "C"
+#endif
+
+using jeronibot::test::check;
+
+using clock_type = std::chrono::steady_clock;
+
+static const uint16_t rx_value_handle = 0x000e;  // where MiniPro writes without discovery
+static const uint16_t tx_value_handle = 0x000b;
+static const uint16_t ccc_handle = 0x000c;
+
+// A vehicle with TX and its CCC, so that the client subscribes; MiniPro
+// writes RX at the handle the firmware has been seen to use. Counts the
+// drive packets and allocates nothing once running
+class Peer
+{
+public:
+  explicit Peer(int fd)
+  : fd_(fd), thread_(&Peer::run, this) {}
+
+  ~Peer()
+  {
+    should_exit_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+  uint64_t get_drives() const { return drives_.load(std::memory_order_relaxed); }
+
+protected:
+  void run()
+  {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    uint8_t pdu[512];
+    auto next_notify = clock_type::now();
+
+    while (!should_exit_) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_notify - clock_type::now());
+      if (poll(&pfd, 1, std::max<int>(wait.count(), 0)) > 0) {
+        ssize_t n = recv(fd_, pdu, sizeof(pdu), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          break;
+        }
+        if (n > 0) {
+          handle_pdu(pdu, n);
+        }
+      }
+
+      if (clock_type::now() >= next_notify) {
+        auto telemetry = protocol::Speed::encode(0);
+        uint8_t notification[3 + telemetry.size()] = {BT_ATT_OP_HANDLE_VAL_NOT};
+        put_le16(tx_value_handle, &notification[1]);
+        std::copy(telemetry.begin(), telemetry.end(), notification + 3);
+        send(fd_, notification, sizeof(notification), MSG_NOSIGNAL);
+        next_notify += 10ms;
+      }
+    }
+  }
+
+  void handle_pdu(const uint8_t * pdu, size_t length)
+  {
+    uint8_t opcode = pdu[0];
+
+    if (opcode == BT_ATT_OP_WRITE_CMD && length > 3 && get_le16(&pdu[1]) == rx_value_handle) {
+      protocol::Schema<protocol::Drive>::dispatch(pdu + 3, length - 3, [this](auto, const auto &) {
+          drives_.fetch_add(1, std::memory_order_relaxed);
+        });
+      return;
+    }
+
+    // Commands and confirmations get no response
+    if ((opcode & 0x40) || opcode == BT_ATT_OP_HANDLE_VAL_CONF) {
+      return;
+    }
+
+    // One primary service over every handle, with TX and its CCC
+    if (opcode == BT_ATT_OP_READ_BY_GRP_TYPE_REQ && length == 7 && get_le16(&pdu[1]) <= 0x0001 &&
+      get_le16(&pdu[5]) == 0x2800)
+    {
+      uint8_t rsp[8] = {BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 6};
+      put_le16(0x0001, &rsp[2]);
+      put_le16(0xffff, &rsp[4]);
+      put_le16(0xffe0, &rsp[6]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    if (opcode == BT_ATT_OP_READ_BY_TYPE_REQ && length == 7 && get_le16(&pdu[1]) < tx_value_handle &&
+      get_le16(&pdu[5]) == 0x2803)
+    {
+      uint8_t rsp[9] = {BT_ATT_OP_READ_BY_TYPE_RSP, 7};
+      put_le16(tx_value_handle - 1, &rsp[2]);
+      rsp[4] = BT_GATT_CHRC_PROP_NOTIFY;
+      put_le16(tx_value_handle, &rsp[5]);
+      put_le16(0xffe4, &rsp[7]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    if (opcode == BT_ATT_OP_FIND_INFO_REQ && length == 5 && get_le16(&pdu[1]) <= ccc_handle) {
+      uint8_t rsp[6] = {BT_ATT_OP_FIND_INFO_RSP, 0x01};
+      put_le16(ccc_handle, &rsp[2]);
+      put_le16(GATT_CLIENT_CHARAC_CFG_UUID, &rsp[4]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    if (opcode == BT_ATT_OP_WRITE_REQ && length >= 3 && get_le16(&pdu[1]) == ccc_handle) {
+      uint8_t rsp[1] = {BT_ATT_OP_WRITE_RSP};
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    uint8_t ecode = opcode == BT_ATT_OP_MTU_REQ ? BT_ATT_ERROR_REQUEST_NOT_SUPPORTED : BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+    uint8_t rsp[5] = {BT_ATT_OP_ERROR_RSP, opcode, 0, 0, ecode};
+    if (length >= 3 && opcode != BT_ATT_OP_MTU_REQ) {
+      rsp[2] = pdu[1];
+      rsp[3] = pdu[2];
+    }
+    send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+  }
+
+  int fd_;
+  std::atomic<uint64_t> drives_{0};
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+struct Result
+{
+  uint64_t allocations{0};
+  uint64_t drives{0};
+  uint64_t telemetry{0};
+  uint64_t log_lines{0};
+};
+
+// The control loop at 100 Hz: the stick moves every time, so a drive
+// packet goes out whenever the scheduler lets it
+static void drive_for(MiniPro & minipro, std::chrono::milliseconds duration, int & step)
+{
+  bool caller = minipro.get_dispatch() == MiniPro::Dispatch::Caller;
+  auto next = clock_type::now();
+
+  for (auto end = next + duration; next < end; step++) {
+    int16_t throttle = static_cast<int16_t>(1000 + (step % 50) * 100);
+    minipro.update_drive(throttle, 0, clock_type::now());
+    minipro.receive_packet();
+
+    next += 10ms;
+    if (caller) {
+      for (auto now = clock_type::now(); now < next; now = clock_type::now()) {
+        MiniPro::run_once(static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(next - now).count()));
+      }
+    } else {
+      std::this_thread::sleep_until(next);
+    }
+  }
+}
+
+static Result run(MiniPro::Dispatch dispatch)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    throw std::runtime_error("Couldn't create the transport");
+  }
+
+  Result result;
+  Peer peer(sv[1]);
+  MiniPro minipro(sv[0], dispatch);
+  minipro.query<protocol::Voltage>(50ms);
+  minipro.enable_notifications();
+  minipro.enter_remote_control_mode();
+
+  int step = 0;
+  drive_for(minipro, 200ms, step);
+
+  uint64_t drives = peer.get_drives();
+  uint64_t telemetry = minipro.get_num_telemetry();
+  uint64_t log_lines = Logger::get_written();
+  allocations = 0;
+  counting = true;
+
+  drive_for(minipro, 500ms, step);
+
+  counting = false;
+  result.allocations = allocations;
+
+  // What was logged meanwhile has been written out by now
+  std::this_thread::sleep_for(20ms);
+  result.log_lines = Logger::get_written() - log_lines;
+  result.drives = peer.get_drives() - drives;
+  result.telemetry = minipro.get_num_telemetry() - telemetry;
+
+  minipro.exit_remote_control_mode();
+  minipro.disable_notifications();
+  minipro.flush();
+  return result;
+}
+
+int main(int argc, char ** argv)
+{
+  // As an application starts it; the formatting thread is measured too
+  Logger::start();
+
+  // The hook is in: one allocation here is counted
+  allocations = 0;
+  counting = true;
+  auto counted = std::make_unique<int>(1);
+  counting = false;
+#ifdef __SANITIZE_ADDRESS__
+  // AddressSanitizer has its own malloc; nothing is counted
+  bool hooked = false;
+  std::cout << "allocations aren't counted under AddressSanitizer" << std::endl;
+#else
+  bool hooked = allocations.load() == 1;
+  check("counting hook", hooked);
+#endif
+
+  Result threaded = run(MiniPro::Dispatch::Thread);
+  std::cout << "mainloop thread: " << threaded.allocations << " allocations, " << threaded.drives << " drives, " <<
+    threaded.telemetry << " notifications" << std::endl;
+
+  Result caller = run(MiniPro::Dispatch::Caller);
+  std::cout << "caller's thread: " << caller.allocations << " allocations, " << caller.drives << " drives, " <<
+    caller.telemetry << " notifications" << std::endl;
+
+  check("drive and telemetry flow", threaded.drives >= 10 && threaded.telemetry >= 25 &&
+    caller.drives >= 10 && caller.telemetry >= 25);
+  check("nothing logged", threaded.log_lines == 0 && caller.log_lines == 0);
+
+  if (hooked) {
+    check("no allocations on the mainloop thread", threaded.allocations == 0);
+    check("no allocations on the caller's thread", caller.allocations == 0);
+  }
+
+  Logger::stop();
+  return jeronibot::test::result();
+}
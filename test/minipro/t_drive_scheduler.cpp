@@ -0,0 +1,114 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+#include "minipro/drive_scheduler.hpp"
+#include "support/check.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::DriveScheduler;
+
+//
+// DriveScheduler: changes within epsilon wait for the keepalive, larger
+// ones and stopping go out right away, an unchanged setpoint is repeated
+// at the keepalive floor, and the latency from a change to the packet
+// carrying it is measured. Then a stick held mostly still at the old 30 Hz
+// tick. Runs on a virtual clock
+//
+
+using jeronibot::test::check;
+
+static const DriveScheduler::clock::time_point t0{std::chrono::seconds(1)};
+
+int main(int, char **)
+{
+  {
+    DriveScheduler scheduler;
+    check("first update sends", scheduler.update(1000, 0, t0));
+    check("within epsilon", !scheduler.update(1256, -256, t0 + 10ms));
+    check("beyond epsilon", scheduler.update(1257, 0, t0 + 20ms));
+    scheduler.reset();
+    check("sends after reset", scheduler.update(1257, 0, t0 + 30ms));
+    check("packets", scheduler.get_stats().updates == 4 && scheduler.get_stats().packets == 3);
+  }
+
+  {
+    DriveScheduler scheduler;
+    scheduler.update(100, 0, t0);
+    check("stop goes out at once", scheduler.update(0, 0, t0 + 10ms));
+    check("stop is not repeated early", !scheduler.update(0, 0, t0 + 20ms));
+    check("start goes out at once", scheduler.update(0, 50, t0 + 30ms));
+  }
+
+  {
+    DriveScheduler scheduler({256, 100ms});
+    scheduler.update(500, 500, t0);
+    check("no keepalive early", !scheduler.update(500, 500, t0 + 99ms));
+    check("keepalive", scheduler.update(500, 500, t0 + 100ms));
+    check("keepalive counted", scheduler.get_stats().keepalives == 1);
+    check("keepalive restarts", !scheduler.update(500, 500, t0 + 199ms) && scheduler.update(500, 500, t0 + 200ms));
+  }
+
+  {
+    // A small change rides on the keepalive
+    DriveScheduler scheduler({256, 100ms});
+    scheduler.update(1000, 0, t0);
+    scheduler.update(1100, 0, t0 + 10ms);
+    scheduler.update(1150, 0, t0 + 50ms);
+    scheduler.update(1150, 0, t0 + 100ms);
+    auto & stats = scheduler.get_stats();
+    check("latency from the first change", stats.num_latencies == 1 && stats.max_latency == 90ms);
+    check("mean latency", stats.mean_latency() == 90ms);
+
+    // A change that went back before it was sent has no latency
+    scheduler.update(1200, 0, t0 + 110ms);
+    scheduler.update(1150, 0, t0 + 120ms);
+    scheduler.update(1150, 0, t0 + 200ms);
+    check("undone change", stats.num_latencies == 1 && stats.packets == 3);
+
+    scheduler.reset_stats();
+    check("stats reset", scheduler.get_stats().packets == 0 && scheduler.get_stats().mean_latency() == 0ns);
+  }
+
+  {
+    // 10 s of the old 30 Hz tick: a ramp, a slow drift, a hold and a stop
+    DriveScheduler scheduler({256, 100ms});
+    const int ticks = 300;
+    for (int i = 0; i < ticks; i++) {
+      int16_t throttle;
+      if (i < 30) {
+        throttle = static_cast<int16_t>(i * 300);
+      } else if (i < 150) {
+        throttle = static_cast<int16_t>(9000 + 200 * std::sin(i / 10.0));
+      } else if (i < 270) {
+        throttle = 9000;
+      } else {
+        throttle = 0;
+      }
+      scheduler.update(throttle, 0, t0 + i * 33ms);
+    }
+
+    auto & stats = scheduler.get_stats();
+    std::cout << stats.packets << " of " << stats.updates << " updates sent, max latency " <<
+      std::chrono::duration<double, std::milli>(stats.max_latency).count() << " ms" << std::endl;
+    check("fewer packets", stats.packets < ticks / 2);
+    check("latency bounded by the keepalive", stats.max_latency <= 100ms);
+  }
+
+  return jeronibot::test::result();
+}
@@ -13,16 +13,34 @@
 // limitations under the License.
 
 #include <atomic>
+#include <chrono>
 #include <csignal>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <thread>
 
+#include "bluetooth/le_scanner.hpp"
 #include "minipro/minipro.hpp"
+#include "minipro/teleop.hpp"
+#include "minipro/teleop_loop.hpp"
+#include "util/flight_recorder.hpp"
 #include "util/xbox360_controller.hpp"
 #include "util/loop_rate.hpp"
+#include "util/realtime.hpp"
 
+using bluetooth::LEDevice;
+using bluetooth::LEScanner;
 using jeronibot::minipro::MiniPro;
+using jeronibot::minipro::Teleop;
+using jeronibot::minipro::TeleopLoop;
+using jeronibot::util::FlightRecorder;
 using jeronibot::util::LoopRate;
+using jeronibot::util::Realtime;
+using jeronibot::util::ThreadProfile;
+using jeronibot::util::ThreadRole;
 using jeronibot::util::XBox360Controller;
 using units::frequency::hertz;
 
@@ -33,63 +51,111 @@ void signal_handler(int signum)
   should_exit = true;
 }
 
-inline int sign(int a) { return a > 0 ? 1 : -1; }
-
 //
 // See https://github.com/slgrobotics/robots_bringup/tree/main/Docs/miniPRO
 //
 
-int main(int, char **)
+// Scan for a few seconds and return the strongest MiniPRO in range
+static std::string find_minipro()
+{
+  LEScanner scanner(MiniPro::get_scan_config());
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+
+  LEDevice device;
+  if (!scanner.get_best_match(device)) {
+    throw std::runtime_error("No MiniPro found");
+  }
+
+  std::cout << "OK: MiniPro: found " << device.get_address_string() << " (" << device.rssi << " dBm)" << std::endl;
+  return device.get_address_string();
+}
+
+// The threads between the stick and the link ahead of everything else;
+// needs root or CAP_SYS_NICE and CAP_IPC_LOCK
+static void use_realtime_profile()
+{
+  Realtime::set_profile(ThreadRole::JoystickInput, ThreadProfile{SCHED_FIFO, 80, {}});
+  Realtime::set_profile(ThreadRole::TeleopSender, ThreadProfile{SCHED_FIFO, 80, {}});
+  Realtime::set_profile(ThreadRole::BluetoothInput, ThreadProfile{SCHED_FIFO, 75, {}});
+  Realtime::set_profile(ThreadRole::Control, ThreadProfile{SCHED_FIFO, 70, {}});
+
+  if (!Realtime::lock_memory()) {
+    std::cout << "WARN: couldn't lock memory" << std::endl;
+  }
+}
+
+int main(int argc, char ** argv)
 {
-  // put your miniPRO address here (use "bt-device -l"):
-  const char* bt_addr = "F4:02:07:C6:C7:B4";
+  // put your miniPRO address here (use "bt-device -l"), pass one on the
+  // command line or use "--scan" to pick the closest one. With
+  // "--single-thread", the joystick, the link and the loop all run on the
+  // main thread; "--realtime" puts the control threads under SCHED_FIFO
+  // and "--record <file>" keeps a flight recording of the session that
+  // minipro::Replay can run back
+  std::string bt_addr = "F4:02:07:C6:C7:B4";
+  bool single_thread = false;
+  std::string record_path;
 
   try {
     signal(SIGINT, signal_handler);
 
+    for (int i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "--single-thread")) {
+        single_thread = true;
+      } else if (!strcmp(argv[i], "--realtime")) {
+        use_realtime_profile();
+      } else if (!strcmp(argv[i], "--record")) {
+        if (++i == argc) {
+          throw std::runtime_error("--record needs a file");
+        }
+        record_path = argv[i];
+      } else {
+        bt_addr = strcmp(argv[i], "--scan") ? argv[i] : find_minipro();
+      }
+    }
+
+    // Outlives the vehicle and the joystick that record into it
+    std::unique_ptr<FlightRecorder> recorder;
+    if (!record_path.empty()) {
+      recorder = std::make_unique<FlightRecorder>(record_path);
+    }
+
     std::cout << "IP: MiniPro: " << bt_addr << " trying to connect..." << std::endl;
 
-    MiniPro minipro(bt_addr); // <- connection happens here
+    // <- connection happens here
+    MiniPro minipro(bt_addr, single_thread ? MiniPro::Dispatch::Caller : MiniPro::Dispatch::Thread);
+    minipro.set_recorder(recorder.get());
     minipro.enable_notifications();
     minipro.enter_remote_control_mode();
 
     std::cout << "OK: MiniPro: connected" << std::endl;
 
     XBox360Controller joystick;
+    joystick.set_recorder(recorder.get());
     LoopRate loop_rate(30_Hz);
 
-    while (!should_exit) {
-      // Flip the axis values so that forward and right are positive values
-      // so that the direction of the MiniPRO matches the joysticks
-      auto throttle = -joystick.get_axis_state(XBox360Controller::Axis_LeftThumbstick).y;
-      auto steering = -joystick.get_axis_state(XBox360Controller::Axis_LeftThumbstick).x;
-
-      // Set values to zero if below a specified threshold so that the MiniPRO
-      // is stable when the joysticks are released (and wouldn't otherwise go
-      // all the way back to 0). 4000 seems to work pretty well for my joystick
-      const int zero_threshold_x = 8000;
-      const int zero_threshold_y = 8000;
-      if (abs(throttle) < zero_threshold_x) 
-      {
-        throttle = 0;
-      } else {
-        throttle = (abs(throttle) - zero_threshold_x) * sign(throttle);
-      }
-
-      if (abs(steering) < zero_threshold_y)
-      {
-        steering = 0;
-      } else {
-        steering = (abs(steering) - zero_threshold_y) * sign(steering);
-        steering /= 10.0;  // less aggressive on turns
-      }
-
-      //std::cout << "throttle: " << throttle << "   steering: " << steering << std::endl;
-
-      // Keep the MiniPRO fed with drive commands, throttling to achieve a
-      // consistent rate. I need to empirically determine the minimum rate
-      minipro.drive(throttle, steering);
+    // Drive commands go out as the stick moves, and at the scheduler's
+    // keepalive rate otherwise to keep the MiniPRO in remote control mode;
+    // this loop only takes the telemetry
+    Teleop::Config teleop_config;
+    teleop_config.axis = XBox360Controller::Axis_LeftThumbstick;
+    teleop_config.sender_thread = !single_thread;
+    auto teleop = std::make_unique<Teleop>(joystick, minipro, teleop_config);
+
+    if (single_thread) {
+      joystick.stop_input_thread();
+
+      TeleopLoop loop(minipro, joystick, *teleop, TeleopLoop::Config());
+      loop.run(should_exit);
+
+      auto & loop_stats = loop.get_stats();
+      std::cout << "loop: " << loop_stats.wakeups << " wakeups, " << loop_stats.joystick << " joystick, " <<
+        loop_stats.timer << " timer, " << loop_stats.ticks << " ticks" << std::endl;
+    } else if (!Realtime::apply(ThreadRole::Control)) {
+      std::cout << "WARN: couldn't apply the control thread's profile" << std::endl;
+    }
 
+    while (!should_exit) {
       //std::cout << "IP: reading..." << std::endl;
       minipro.receive_packet();
       //std::cout << "OK: read" << std::endl;
@@ -97,10 +163,32 @@ int main(int, char **)
       loop_rate.sleep();
     }
 
+    auto teleop_stats = teleop->get_stats();
+    teleop.reset();
+
     // When exiting, make sure to stop the miniPRO and return to normal mode
     minipro.drive(0, 0);
     minipro.exit_remote_control_mode();
+
+    // A replay ends with the last packet too
+    if (recorder) {
+      minipro.set_recorder(nullptr);
+      joystick.set_recorder(nullptr);
+      recorder->sync();
+      std::cout << "OK: recorded " << recorder->get_count() << " records to " << record_path << std::endl;
+    }
+
     minipro.disable_notifications();
+    minipro.flush();
+
+    auto & stats = minipro.get_drive_scheduler().get_stats();
+    std::cout << "drive: " << stats.packets << "/" << stats.updates << " updates sent, " <<
+      stats.packets_per_second() << " packets/s, latency mean " <<
+      std::chrono::duration<double, std::milli>(stats.mean_latency()).count() << " ms, max " <<
+      std::chrono::duration<double, std::milli>(stats.max_latency).count() << " ms" << std::endl;
+    std::cout << "teleop: " << teleop_stats.events << " stick events, " << teleop_stats.updates <<
+      " updates, max latency " << std::chrono::duration<double, std::milli>(teleop_stats.max_latency).count() <<
+      " ms" << std::endl;
 
   } catch (std::exception & ex) {
     std::cerr << "Exception: " << ex.what() << std::endl;
@@ -0,0 +1,225 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bluez.h"
+#include "minipro/minipro.hpp"
+#include "minipro/protocol.hpp"
+#include "support/check.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::MiniPro;
+
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// MiniPro polling: the values read from the poll handles reach the getters
+// through the telemetry decoder and get_polled_value(), a failed read keeps
+// the last value and is tried again, and a handle is not read again while
+// its last read is outstanding, so a vehicle slower than the poll period
+// doesn't get a queue of reads. The vehicle is a minimal ATT peer on a
+// socketpair that takes 40 ms to answer each read
+//
+
+using jeronibot::test::check;
+
+using clock_type = std::chrono::steady_clock;
+
+static const uint16_t voltage_handle = 0x0020;
+static const uint16_t locked_handle = 0x0021;
+static const auto answer_delay = 40ms;
+
+// A vehicle with an empty service that answers reads of voltage_handle
+// with a voltage packet and of locked_handle with an error
+class Peer
+{
+public:
+  explicit Peer(int fd)
+  : fd_(fd), thread_(&Peer::run, this) {}
+
+  ~Peer()
+  {
+    should_exit_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+  std::map<uint16_t, int> get_reads()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reads_;
+  }
+
+  int get_num_reads()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int n = 0;
+    for (auto & reads : reads_) {
+      n += reads.second;
+    }
+    return n;
+  }
+
+protected:
+  void run()
+  {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    uint8_t pdu[512];
+
+    while (!should_exit_) {
+      int timeout = 10;
+      if (!answers_.empty()) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(answers_.front().first - clock_type::now());
+        timeout = std::min<int>(std::max<int>(wait.count(), 0), timeout);
+      }
+
+      if (poll(&pfd, 1, timeout) > 0) {
+        ssize_t n = recv(fd_, pdu, sizeof(pdu), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          break;
+        }
+        if (n > 0) {
+          handle_pdu(pdu, n);
+        }
+      }
+
+      while (!answers_.empty() && answers_.front().first <= clock_type::now()) {
+        auto & answer = answers_.front().second;
+        send(fd_, answer.data(), answer.size(), MSG_NOSIGNAL);
+        answers_.pop_front();
+      }
+    }
+  }
+
+  void handle_pdu(const uint8_t * pdu, size_t length)
+  {
+    uint8_t opcode = pdu[0];
+
+    if (opcode == BT_ATT_OP_READ_REQ && length == 3) {
+      uint16_t handle = get_le16(&pdu[1]);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reads_[handle]++;
+      }
+
+      std::vector<uint8_t> answer;
+      if (handle == voltage_handle) {
+        auto voltage = protocol::Voltage::encode(5430);
+        answer.push_back(BT_ATT_OP_READ_RSP);
+        answer.insert(answer.end(), voltage.begin(), voltage.end());
+      } else {
+        answer = {BT_ATT_OP_ERROR_RSP, opcode, pdu[1], pdu[2], BT_ATT_ERROR_READ_NOT_PERMITTED};
+      }
+      answers_.emplace_back(clock_type::now() + answer_delay, answer);
+      return;
+    }
+
+    // Commands and confirmations get no response
+    if ((opcode & 0x40) || opcode == BT_ATT_OP_HANDLE_VAL_CONF) {
+      return;
+    }
+
+    // One empty primary service over every handle; nothing else is found
+    if (opcode == BT_ATT_OP_READ_BY_GRP_TYPE_REQ && length == 7 && get_le16(&pdu[1]) <= 0x0001 &&
+      get_le16(&pdu[5]) == 0x2800)
+    {
+      uint8_t rsp[8] = {BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 6};
+      put_le16(0x0001, &rsp[2]);
+      put_le16(0xffff, &rsp[4]);
+      put_le16(0x1800, &rsp[6]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    uint8_t ecode = opcode == BT_ATT_OP_MTU_REQ ? BT_ATT_ERROR_REQUEST_NOT_SUPPORTED : BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+    uint8_t rsp[5] = {BT_ATT_OP_ERROR_RSP, opcode, 0, 0, ecode};
+    if (length >= 3 && opcode != BT_ATT_OP_MTU_REQ) {
+      rsp[2] = pdu[1];
+      rsp[3] = pdu[2];
+    }
+    send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+  }
+
+  int fd_;
+  std::mutex mutex_;
+  std::map<uint16_t, int> reads_;
+  std::deque<std::pair<clock_type::time_point, std::vector<uint8_t>>> answers_;
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+int main(int, char **)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    check("socketpair", false);
+    return jeronibot::test::result();
+  }
+
+  Peer peer(sv[1]);
+  MiniPro minipro(sv[0]);
+
+  MiniPro::TelemetryConfig config;
+  config.poll_period = 10ms;
+  config.poll_handles = {voltage_handle, locked_handle};
+  minipro.set_telemetry_config(config);
+
+  // Polled four times as often as the vehicle answers
+  auto start = clock_type::now();
+  while (clock_type::now() - start < 1s) {
+    minipro.receive_packet();
+    std::this_thread::sleep_for(2ms);
+  }
+
+  // Whatever the client still has queued goes out now
+  int reads = peer.get_num_reads();
+  std::this_thread::sleep_for(300ms);
+  int late = peer.get_num_reads() - reads;
+  minipro.receive_packet();
+
+  auto by_handle = peer.get_reads();
+  std::cout << by_handle[voltage_handle] << " voltage reads, " << by_handle[locked_handle] << " failed reads, " <<
+    late << " after polling stopped" << std::endl;
+
+  auto voltage = protocol::Voltage::encode(5430);
+  check("decoded", minipro.get_value<protocol::Voltage>() == 5430);
+  check("raw value", minipro.get_polled_value(voltage_handle) ==
+    std::vector<uint8_t>(voltage.begin(), voltage.end()));
+  check("counted", minipro.get_num_polled() >= 5 && minipro.get_num_polled() <= static_cast<uint64_t>(
+      by_handle[voltage_handle]));
+  check("failed read has no value", minipro.get_polled_value(locked_handle).empty());
+  check("failed read is tried again", by_handle[locked_handle] >= 5);
+  check("unknown handle", minipro.get_polled_value(0x0030).empty());
+
+  // Reads are serialized over the bearer, so each takes 40 ms and at most
+  // one per handle may still be on its way
+  check("no reads queued up", late <= 2);
+  check("read at the vehicle's pace", reads <= 1s / answer_delay + 2);
+
+  return jeronibot::test::result();
+}
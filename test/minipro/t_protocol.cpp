@@ -0,0 +1,161 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "minipro/protocol.hpp"
+#include "support/check.hpp"
+
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// Protocol: the fixed commands are the bytes the vehicle has been sent all
+// along, the generated encoder agrees with a byte-by-byte one, every
+// incoming message decodes to its own type and values through the perfect
+// hash, and malformed packets are turned away. Then times encode and
+// dispatch
+//
+
+// std::array's operator== isn't constexpr before C++20
+template<size_t N>
+constexpr bool same(const std::array<uint8_t, N> & a, const std::array<uint8_t, N> & b)
+{
+  for (size_t i = 0; i < N; i++) {
+    if (a[i] != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The fixed commands are encoded at compile time
+static_assert(same(protocol::enter_remote_control_mode, {0x55, 0xaa, 0x04, 0x0a, 0x03, 0x7a, 0x01, 0x00, 0x73, 0xff}));
+static_assert(same(protocol::exit_remote_control_mode, {0x55, 0xaa, 0x04, 0x0a, 0x03, 0x7a, 0x00, 0x00, 0x74, 0xff}));
+static_assert(same(protocol::stop, {0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0x00, 0x00, 0x71, 0xff}));
+static_assert(protocol::Incoming::contains(protocol::Voltage::key));
+static_assert(!protocol::Incoming::contains(protocol::Drive::key));
+
+using jeronibot::test::check;
+
+// The packet layout spelled out a byte at a time
+static std::vector<uint8_t> reference_packet(
+  uint8_t type, uint8_t operation, uint8_t parameter, const std::vector<uint8_t> & payload)
+{
+  std::vector<uint8_t> bytes = {0x55, 0xaa, static_cast<uint8_t>(payload.size() + 2), type, operation, parameter};
+  bytes.insert(bytes.end(), payload.begin(), payload.end());
+
+  uint16_t sum = 0;
+  for (size_t i = 2; i < bytes.size(); i++) {
+    sum += bytes[i];
+  }
+  sum ^= 0xffff;
+
+  bytes.push_back(sum & 0xff);
+  bytes.push_back(sum >> 8);
+  return bytes;
+}
+
+template<typename M, typename T>
+static bool round_trip(T value)
+{
+  auto bytes = M::encode(value);
+  bool seen = false;
+
+  bool ok = protocol::Incoming::dispatch(bytes.data(), bytes.size(), [&](auto message, const auto & values) {
+        using Seen = decltype(message);
+        if constexpr (std::is_same_v<Seen, M>) {
+          seen = std::get<0>(values) == value;
+        }
+      });
+
+  return ok && seen;
+}
+
+int main(int argc, char ** argv)
+{
+  const int count = argc > 1 ? atoi(argv[1]) : 10000000;
+
+  {
+    bool matched = true;
+    for (int throttle = -32768; throttle < 32768; throttle += 257) {
+      for (int steering = -32768; steering < 32768; steering += 1031) {
+        auto bytes = protocol::Drive::encode(throttle, steering);
+        auto expected = reference_packet(0x0a, 0x03, 0x7b, {
+            static_cast<uint8_t>(throttle), static_cast<uint8_t>(throttle >> 8),
+            static_cast<uint8_t>(steering), static_cast<uint8_t>(steering >> 8)});
+        matched = matched && std::vector<uint8_t>(bytes.begin(), bytes.end()) == expected;
+      }
+    }
+    check("drive encoder", matched);
+
+    auto request = protocol::get_value_request<protocol::Odometer>;
+    check("get value request", std::vector<uint8_t>(request.begin(), request.end()) ==
+      reference_packet(0x0a, 0x01, 0x29, {0x04}));
+  }
+
+  {
+    check("battery level", round_trip<protocol::BatteryLevel>(uint16_t{87}));
+    check("speed", round_trip<protocol::Speed>(int16_t{-1234}));
+    check("odometer", round_trip<protocol::Odometer>(uint32_t{0x01020304}));
+    check("temperature", round_trip<protocol::Temperature>(int16_t{-50}));
+    check("voltage", round_trip<protocol::Voltage>(uint16_t{5430}));
+  }
+
+  {
+    auto ignore = [](auto, const auto &) {};
+    auto good = protocol::Voltage::encode(5430);
+
+    auto bad_checksum = good;
+    bad_checksum.back() ^= 0x01;
+    auto bad_header = good;
+    bad_header[0] = 0xaa;
+    auto unknown = protocol::Value<0x99, uint16_t>::encode(1);
+    auto wrong_size = protocol::Value<protocol::Voltage::parameter, uint32_t>::encode(1);
+
+    check("bad checksum", !protocol::Incoming::dispatch(bad_checksum.data(), bad_checksum.size(), ignore));
+    check("bad header", !protocol::Incoming::dispatch(bad_header.data(), bad_header.size(), ignore));
+    check("truncated", !protocol::Incoming::dispatch(good.data(), good.size() - 1, ignore));
+    check("not in the schema", !protocol::Incoming::dispatch(unknown.data(), unknown.size(), ignore));
+    check("wrong payload size", !protocol::Incoming::dispatch(wrong_size.data(), wrong_size.size(), ignore));
+    check("outgoing isn't incoming", !protocol::Incoming::dispatch(protocol::stop.data(), protocol::stop.size(), ignore));
+  }
+
+  {
+    const protocol::Speed::Bytes speed = protocol::Speed::encode(100);
+    uint64_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      auto bytes = protocol::Drive::encode(static_cast<int16_t>(i), static_cast<int16_t>(-i));
+      sum += bytes[10];
+      protocol::Incoming::dispatch(speed.data(), speed.size(), [&](auto, const auto & values) {
+          sum += std::get<0>(values);
+        });
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "encode + dispatch: " << seconds * 1e9 / count << " ns (" << sum << ")" << std::endl;
+    check("cheap enough for the drive path", seconds * 1e9 / count < 1000);
+  }
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,138 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include "minipro/protocol.hpp"
+#include "minipro/query_scheduler.hpp"
+#include "support/check.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::QueryScheduler;
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// QueryScheduler: each parameter is queried at its own rate, no more than
+// max_in_flight are outstanding, lost answers time out and are asked for
+// again, and over a link with a long round trip keeping several queries in
+// flight multiplies the throughput. Runs on a virtual clock
+//
+
+using jeronibot::test::check;
+
+static const QueryScheduler::clock::time_point t0{std::chrono::seconds(1)};
+
+// Answers per second for five parameters at 50 Hz each, over a link that
+// answers each query rtt after it is sent
+static double throughput(size_t max_in_flight, std::chrono::milliseconds rtt)
+{
+  QueryScheduler scheduler({max_in_flight, 1s});
+  for (uint8_t parameter = 1; parameter <= 5; parameter++) {
+    scheduler.add(parameter, 20ms);
+  }
+
+  std::deque<std::pair<QueryScheduler::clock::time_point, uint8_t>> link;
+  const auto length = 10s;
+
+  for (auto now = t0; now < t0 + length; now += 1ms) {
+    while (!link.empty() && link.front().first <= now) {
+      scheduler.answered(link.front().second, now);
+      link.pop_front();
+    }
+    for (size_t i; (i = scheduler.next(now)) != QueryScheduler::npos; ) {
+      link.emplace_back(now + rtt, scheduler.get_parameter(i));
+    }
+  }
+
+  return scheduler.get_stats().responses / std::chrono::duration<double>(length).count();
+}
+
+int main(int argc, char ** argv)
+{
+  {
+    // Answered right away: each runs at its own rate
+    QueryScheduler scheduler;
+    size_t voltage = scheduler.add(protocol::Voltage::parameter, 1s);
+    size_t speed = scheduler.add(protocol::Speed::parameter, 50ms);
+    uint64_t sent[2] = {0, 0};
+
+    for (auto now = t0; now < t0 + 10s; now += 1ms) {
+      for (size_t i; (i = scheduler.next(now)) != QueryScheduler::npos; ) {
+        sent[i == voltage ? 0 : 1]++;
+        scheduler.answered(scheduler.get_parameter(i), now + 1ms);
+      }
+    }
+
+    check("voltage at 1 Hz", sent[0] == 10);
+    check("speed at 20 Hz", sent[1] == 200 && speed == 1);
+    check("all answered", scheduler.get_stats().responses == 210 && scheduler.get_num_in_flight() == 0);
+  }
+
+  {
+    // Never answered: no more than max_in_flight out, retried after the timeout
+    QueryScheduler scheduler({2, 100ms});
+    for (uint8_t parameter = 1; parameter <= 4; parameter++) {
+      scheduler.add(parameter, 10ms);
+    }
+
+    size_t max_in_flight = 0;
+    for (auto now = t0; now < t0 + 1s; now += 1ms) {
+      while (scheduler.next(now) != QueryScheduler::npos) {
+      }
+      max_in_flight = std::max(max_in_flight, scheduler.get_num_in_flight());
+    }
+
+    auto & stats = scheduler.get_stats();
+    check("in flight limit", max_in_flight == 2);
+    check("timeouts", stats.timeouts >= 18 && stats.requests == stats.timeouts + 2 && stats.responses == 0);
+  }
+
+  {
+    QueryScheduler scheduler;
+    size_t i = scheduler.add(protocol::Odometer::parameter, 1s);
+    check("first query", scheduler.next(t0) == i);
+    scheduler.failed(i);
+    check("failed query is due again", scheduler.next(t0) == i && scheduler.get_stats().requests == 1);
+
+    check("unsolicited", !scheduler.answered(protocol::Temperature::parameter, t0) &&
+      scheduler.get_stats().unsolicited == 1);
+    check("answer", scheduler.answered(protocol::Odometer::parameter, t0 + 30ms) &&
+      scheduler.get_stats().max_rtt == 30ms);
+    check("one answer per query", !scheduler.answered(protocol::Odometer::parameter, t0 + 40ms));
+
+    bool threw = false;
+    try {
+      scheduler.add(protocol::Odometer::parameter, 2s);
+    } catch (const std::exception &) {
+      threw = true;
+    }
+    check("one query per parameter", threw);
+  }
+
+  {
+    double one = throughput(1, 100ms);
+    double four = throughput(4, 100ms);
+    std::cout << "100 ms round trip: " << one << " answers/s with 1 in flight, " << four << " with 4" << std::endl;
+    check("pipelined", one <= 10.0 && four >= 3.9 * one);
+  }
+
+  return jeronibot::test::result();
+}
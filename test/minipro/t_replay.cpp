@@ -0,0 +1,450 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <linux/joystick.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bluez.h"
+#include "minipro/drive_scheduler.hpp"
+#include "minipro/minipro.hpp"
+#include "minipro/protocol.hpp"
+#include "minipro/replay.hpp"
+#include "minipro/teleop.hpp"
+#include "support/check.hpp"
+#include "util/flight_recorder.hpp"
+#include "util/joystick.hpp"
+#include "util/logger.hpp"
+#include "util/metrics.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::DriveScheduler;
+using jeronibot::minipro::MiniPro;
+using jeronibot::minipro::Replay;
+using jeronibot::minipro::Teleop;
+using jeronibot::util::FlightLog;
+using jeronibot::util::FlightRecord;
+using jeronibot::util::FlightRecorder;
+using jeronibot::util::Joystick;
+using jeronibot::util::JoystickSnapshot;
+using jeronibot::util::Logger;
+using jeronibot::util::LogLevel;
+using jeronibot::util::MetricsRegistry;
+
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// Replay: a synthesized teleop session (joystick snapshots and telemetry
+// notifications, with the drive packets Teleop sends for them)
+// replays to the same packets, a corrupted packet is caught, a real time
+// replay takes as long as the session, and an as fast as possible one is
+// timed. The client's metrics agree with what the replay saw. Then a
+// session driven live against a fake vehicle, recorded by the hooks of
+// MiniPro, LEClient and Joystick, replays to the packets it sent
+//
+
+using jeronibot::test::check;
+
+// Records at chosen timestamps instead of the current time
+class SessionRecorder : public FlightRecorder
+{
+public:
+  using FlightRecorder::FlightRecorder;
+
+  void record_at(uint64_t timestamp_ns, FlightRecord::Type type, uint16_t handle, std::vector<uint8_t> bytes)
+  {
+    record(type, handle, bytes.data(), bytes.size());
+    stamp(timestamp_ns);
+  }
+
+  void record_joystick_at(uint64_t timestamp_ns, const JoystickSnapshot & snapshot)
+  {
+    record_joystick(snapshot, 4);
+    stamp(timestamp_ns);
+  }
+
+protected:
+  void stamp(uint64_t timestamp_ns)
+  {
+    records_[(next_.load() - 1) & mask_].timestamp_ns = timestamp_ns;
+  }
+};
+
+// Write a session of the given length. The packets come from a Teleop
+// run without its sender thread on the same virtual clock as the replay's,
+// given the same joystick events through a pipe, with a DriveScheduler
+// standing in for the MiniPro. Returns the number of packets
+static size_t write_session(
+  const std::string & path, std::chrono::milliseconds length,
+  const Replay::Config & config, int corrupt_packet = -1)
+{
+  const uint64_t t0 = 1000000000;
+  const uint64_t t_end = t0 + std::chrono::nanoseconds(length).count();
+  const uint64_t joystick_period = std::chrono::nanoseconds(std::chrono::milliseconds(10)).count();
+  const uint64_t notify_period = std::chrono::nanoseconds(std::chrono::milliseconds(50)).count();
+
+  int js[2];
+  if (pipe(js) < 0) {
+    throw std::runtime_error("Couldn't create the joystick source");
+  }
+
+  SessionRecorder recorder(path, 1 << 20);
+  DriveScheduler scheduler(config.scheduler);
+  JoystickSnapshot snapshot = {};
+  size_t packets = 0;
+
+  auto send = [&](uint64_t t, auto packet) {
+      std::vector<uint8_t> bytes(packet.begin(), packet.end());
+      if (static_cast<int>(packets++) == corrupt_packet) {
+        bytes.back() ^= 0xff;
+      }
+      recorder.record_at(t, FlightRecord::Packet, 0x000e, bytes);
+    };
+
+  auto ns = [](Teleop::clock::time_point t) {
+      return static_cast<uint64_t>(std::chrono::nanoseconds(t.time_since_epoch()).count());
+    };
+
+  Joystick joystick(js[0], 4, 11);
+  joystick.stop_input_thread();
+
+  Teleop::Config teleop_config = config.teleop;
+  teleop_config.sender_thread = false;
+  Teleop teleop(joystick, [&](int16_t throttle, int16_t steering, Teleop::clock::time_point now) {
+      if (!scheduler.update(throttle, steering, now)) {
+        return false;
+      }
+      send(ns(now), protocol::Drive::encode(throttle, steering));
+      return true;
+    }, teleop_config);
+
+  // The events the replay derives from a snapshot, for the axis that drives
+  auto move = [&](const JoystickSnapshot & last) {
+      for (uint8_t number = 0; number < JoystickSnapshot::max_axes; number++) {
+        uint8_t axis;
+        bool is_y;
+        if (Joystick::axis_of_event(number, &axis, &is_y) && axis == teleop_config.axis &&
+          snapshot.axes[axis][is_y] != last.axes[axis][is_y])
+        {
+          struct js_event event = {0, snapshot.axes[axis][is_y], JS_EVENT_AXIS, number};
+          if (write(js[1], &event, sizeof(event)) != sizeof(event)) {
+            throw std::runtime_error("Couldn't feed the joystick");
+          }
+          joystick.process_input();
+        }
+      }
+    };
+
+  send(t0, protocol::enter_remote_control_mode);
+
+  uint64_t next_joystick = t0;
+  uint64_t next_notify = t0;
+  uint64_t now = t0;
+
+  for (;;) {
+    // The stick sweeps around, with the button 0 toggling now and then
+    for (; next_joystick <= now && next_joystick < t_end; next_joystick += joystick_period) {
+      JoystickSnapshot last = snapshot;
+      double phase = (next_joystick - t0) / 1e9;
+      snapshot.axes[0][0] = static_cast<int16_t>(30000 * sin(phase * 2.0));
+      snapshot.axes[0][1] = static_cast<int16_t>(-30000 * cos(phase * 0.7));
+      snapshot.axes[1][0] = static_cast<int16_t>(1000 * phase);
+      snapshot.buttons = ((next_joystick - t0) / (25 * joystick_period)) & 1;
+      recorder.record_joystick_at(next_joystick, snapshot);
+      move(last);
+    }
+
+    for (; next_notify <= now && next_notify < t_end; next_notify += notify_period) {
+      recorder.record_at(next_notify, FlightRecord::Notification, 0x000b,
+        {0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0xac, 0x09, 0xbc, 0xfe});
+    }
+
+    uint64_t next_update = ns(teleop.update(Teleop::clock::time_point(std::chrono::nanoseconds(now))));
+
+    if (next_joystick >= t_end && next_notify >= t_end) {
+      break;
+    }
+    now = std::min({next_update, next_joystick, next_notify});
+  }
+
+  send(now, protocol::stop);
+  send(now, protocol::exit_remote_control_mode);
+
+  close(js[1]);
+  return packets;
+}
+
+// A vehicle with an empty service, so that MiniPro writes to the handles
+// the firmware has been seen to use. It pushes telemetry every 50 ms and
+// answers reads with a voltage packet
+class Vehicle
+{
+public:
+  explicit Vehicle(int fd)
+  : fd_(fd), thread_(&Vehicle::run, this) {}
+
+  ~Vehicle()
+  {
+    should_exit_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+protected:
+  void run()
+  {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    uint8_t pdu[512];
+    auto next_notify = std::chrono::steady_clock::now();
+
+    while (!should_exit_) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next_notify - std::chrono::steady_clock::now());
+      if (poll(&pfd, 1, std::max<int>(wait.count(), 0)) > 0) {
+        ssize_t n = recv(fd_, pdu, sizeof(pdu), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          break;
+        }
+        if (n > 0) {
+          handle_pdu(pdu, n);
+        }
+      }
+
+      if (std::chrono::steady_clock::now() >= next_notify) {
+        auto telemetry = protocol::Speed::encode(120);
+        reply(BT_ATT_OP_HANDLE_VAL_NOT, 0x000b, telemetry);
+        next_notify += 50ms;
+      }
+    }
+  }
+
+  template<typename Bytes>
+  void reply(uint8_t opcode, uint16_t handle, const Bytes & value)
+  {
+    std::vector<uint8_t> pdu = {opcode};
+    if (handle) {
+      pdu.resize(3);
+      put_le16(handle, &pdu[1]);
+    }
+    pdu.insert(pdu.end(), value.begin(), value.end());
+    send(fd_, pdu.data(), pdu.size(), MSG_NOSIGNAL);
+  }
+
+  void handle_pdu(const uint8_t * pdu, size_t length)
+  {
+    uint8_t opcode = pdu[0];
+
+    if (opcode == BT_ATT_OP_READ_REQ && length == 3) {
+      reply(BT_ATT_OP_READ_RSP, 0, protocol::Voltage::encode(5430));
+      return;
+    }
+
+    // Commands and confirmations get no response
+    if ((opcode & 0x40) || opcode == BT_ATT_OP_HANDLE_VAL_CONF) {
+      return;
+    }
+
+    // One empty primary service over every handle; nothing else is found
+    if (opcode == BT_ATT_OP_READ_BY_GRP_TYPE_REQ && length == 7 && get_le16(&pdu[1]) <= 0x0001 &&
+      get_le16(&pdu[5]) == 0x2800)
+    {
+      uint8_t rsp[8] = {BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 6};
+      put_le16(0x0001, &rsp[2]);
+      put_le16(0xffff, &rsp[4]);
+      put_le16(0x1800, &rsp[6]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    uint8_t ecode = opcode == BT_ATT_OP_MTU_REQ ? BT_ATT_ERROR_REQUEST_NOT_SUPPORTED : BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+    uint8_t rsp[5] = {BT_ATT_OP_ERROR_RSP, opcode, 0, 0, ecode};
+    if (length >= 3 && opcode != BT_ATT_OP_MTU_REQ) {
+      rsp[2] = pdu[1];
+      rsp[3] = pdu[2];
+    }
+    send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+  }
+
+  int fd_;
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+// Drive a vehicle from a joystick on a pipe for about a second, the way
+// TeleopLoop does on the real clock, with the recorder set on MiniPro and
+// the joystick. The stick moves every 60 ms, by more than the epsilon, and
+// the keepalive is longer than the session, so which packets go out
+// doesn't depend on how late the loop wakes up
+static void record_session(const std::string & path, const Replay::Config & config)
+{
+  int sv[2];
+  int js[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0 || pipe(js) < 0) {
+    throw std::runtime_error("Couldn't create the transport");
+  }
+
+  FlightRecorder recorder(path, 1 << 16);
+  Vehicle vehicle(sv[1]);
+  MiniPro minipro(sv[0]);
+  Joystick joystick(js[0], 4, 11);
+
+  minipro.get_drive_scheduler().set_config(config.scheduler);
+  MiniPro::TelemetryConfig telemetry;
+  telemetry.poll_period = 200ms;
+  telemetry.poll_handles = {0x0020};
+  minipro.set_telemetry_config(telemetry);
+
+  Teleop::Config teleop_config = config.teleop;
+  teleop_config.sender_thread = false;
+  Teleop teleop(joystick, minipro, teleop_config);
+  joystick.stop_input_thread();
+
+  minipro.set_recorder(&recorder);
+  joystick.set_recorder(&recorder);
+  minipro.enter_remote_control_mode();
+
+  const int num_moves = 16;
+  auto start = Teleop::clock::now();
+  auto end = start + num_moves * 60ms + 100ms;
+  auto next_move = start + 30ms;
+  auto next_update = teleop.update(start);
+
+  for (int moves = 0; Teleop::clock::now() < end; ) {
+    std::this_thread::sleep_until(moves < num_moves ? std::min(next_update, next_move) : next_update);
+
+    if (moves < num_moves && Teleop::clock::now() >= next_move) {
+      struct js_event event = {0, static_cast<int16_t>(-10000 - (moves % 5) * 3000), JS_EVENT_AXIS, 1};
+      if (write(js[1], &event, sizeof(event)) != sizeof(event)) {
+        throw std::runtime_error("Couldn't feed the joystick");
+      }
+      joystick.process_input();
+      moves++;
+      next_move += 60ms;
+    }
+
+    next_update = teleop.update(Teleop::clock::now());
+    minipro.receive_packet();
+  }
+
+  minipro.drive(0, 0);
+  minipro.exit_remote_control_mode();
+
+  // Nothing after the last packet, as at the end of the replay
+  minipro.set_recorder(nullptr);
+  joystick.set_recorder(nullptr);
+  close(js[1]);
+}
+
+int main(int argc, char ** argv)
+{
+  const int seconds = argc > 1 ? atoi(argv[1]) : 60;
+  const std::string path = "/tmp/t_replay." + std::to_string(getpid());
+
+  Logger::start(LogLevel::Warn);
+
+  Replay::Config config;
+
+  {
+    MetricsRegistry & registry = MetricsRegistry::get_default();
+    auto & writes = registry.counter("ble_att_pdus_sent_total", "", {{"device", "fd"}, {"opcode", "0x52"}});
+    auto & notifications = registry.counter("ble_att_pdus_received_total", "", {{"device", "fd"}, {"opcode", "0x1b"}});
+    auto & coalesced = registry.counter("minipro_drive_coalesced_total", "", {{"device", "fd"}});
+
+    size_t packets = write_session(path, std::chrono::seconds(2), config);
+    Replay::Result result = Replay(path, config).run();
+
+    check("metrics", writes.get() == packets && notifications.get() == result.notifications &&
+      coalesced.get() == result.updates - (packets - 3));
+
+    check("packets match", result.ok() && result.sent_packets == packets);
+    check("drive packets coalesced", packets > 3 && packets < result.updates);
+    check("all records replayed", result.notifications == 40 && result.joystick_events > 0);
+    check("telemetry pushed, not polled", result.telemetry == result.notifications && result.read_responses == 0);
+
+    // Identical the second time around
+    Replay::Result again = Replay(path, config).run();
+    check("deterministic", again.ok() && again.sent_packets == result.sent_packets);
+  }
+
+  {
+    write_session(path, std::chrono::seconds(2), config, 5);
+    Replay::Result result = Replay(path, config).run();
+    check("corrupted packet detected", !result.ok() && result.first_mismatch == 5);
+  }
+
+  {
+    Replay::Config real_time = config;
+    real_time.real_time = true;
+
+    write_session(path, std::chrono::milliseconds(500), real_time);
+    Replay::Result result = Replay(path, real_time).run();
+
+    double elapsed = std::chrono::duration<double>(result.elapsed).count();
+    check("real time", result.ok() && elapsed >= 0.49 && elapsed < 1.0);
+  }
+
+  {
+    write_session(path, std::chrono::seconds(seconds), config);
+    Replay::Result result = Replay(path, config).run();
+
+    double elapsed = std::chrono::duration<double>(result.elapsed).count();
+    std::cout << "replay: " << result.records << " records, " << result.updates << " updates in " <<
+      elapsed << " s, " << result.records / elapsed << " records/s, " <<
+      seconds / elapsed << "x real time" << std::endl;
+    check("as fast as possible", result.ok() && elapsed < seconds);
+  }
+
+  {
+    Replay::Config live = config;
+    live.scheduler.keepalive = 5s;
+    record_session(path, live);
+
+    size_t packets = 0;
+    size_t notifications = 0;
+    bool read = false;
+    bool joystick = false;
+    {
+      FlightLog log(path);
+      for (size_t i = 0; i < log.size(); i++) {
+        packets += log[i].type == FlightRecord::Packet;
+        notifications += log[i].type == FlightRecord::Notification;
+        read |= log[i].type == FlightRecord::ReadResponse && log[i].handle == 0x0020;
+        joystick |= log[i].type == FlightRecord::Joystick;
+      }
+    }
+    check("recorded through the hooks", packets > 16 && notifications > 10 && read && joystick);
+
+    Replay::Result result = Replay(path, live).run();
+    check("live session replays", result.ok() && result.sent_packets == packets &&
+      result.notifications == notifications);
+  }
+
+  unlink(path.c_str());
+  Logger::stop();
+
+  return jeronibot::test::result();
+}
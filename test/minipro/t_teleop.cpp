@@ -0,0 +1,187 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <linux/joystick.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "minipro/teleop.hpp"
+#include "support/check.hpp"
+#include "util/joystick.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::DriveSetpoint;
+using jeronibot::minipro::StickMapping;
+using jeronibot::minipro::Teleop;
+using jeronibot::minipro::teleop_setpoint;
+using jeronibot::util::AxisState;
+using jeronibot::util::Joystick;
+
+//
+// Teleop: the stick mapping keeps the old deadzone and steering behavior
+// and shapes with the expo, a stick move reaches the drive function
+// without waiting for a tick, a burst of moves is rate limited down to
+// its last setpoint, a still stick is updated at the idle period and
+// other sticks are ignored. Joystick events come through a pipe
+//
+
+using jeronibot::test::check;
+
+// What teleop_setpoint() did before the mapping could be configured
+static DriveSetpoint fixed_setpoint(const AxisState & stick)
+{
+  int throttle = -stick.y;
+  int steering = -stick.x;
+
+  throttle = abs(throttle) < 8000 ? 0 : (abs(throttle) - 8000) * (throttle > 0 ? 1 : -1);
+  steering = abs(steering) < 8000 ? 0 : (abs(steering) - 8000) * (steering > 0 ? 1 : -1);
+  steering /= 10.0;
+
+  return {static_cast<int16_t>(throttle), static_cast<int16_t>(steering)};
+}
+
+struct Update
+{
+  Teleop::clock::time_point time;
+  DriveSetpoint setpoint;
+};
+
+int main(int argc, char ** argv)
+{
+  {
+    bool same = true;
+    for (int x = -32767; x <= 32767; x += 97) {
+      for (int y = -32767; y <= 32767; y += 1009) {
+        AxisState stick = {static_cast<int16_t>(x), static_cast<int16_t>(y)};
+        DriveSetpoint a = teleop_setpoint(stick);
+        DriveSetpoint b = fixed_setpoint(stick);
+        same = same && a.throttle == b.throttle && abs(a.steering - b.steering) <= 1;
+      }
+    }
+    check("default mapping", same);
+
+    StickMapping cubic;
+    cubic.expo = 1.0;
+    cubic.deadzone = 0;
+    DriveSetpoint half = teleop_setpoint({0, -16384}, cubic);
+    DriveSetpoint full = teleop_setpoint({0, -32767}, cubic);
+    check("expo", abs(half.throttle - 32767 / 8) < 16 && full.throttle == 32767);
+  }
+
+  int fds[2];
+  if (pipe(fds) < 0) {
+    std::cerr << "pipe failed" << std::endl;
+    return -1;
+  }
+
+  Joystick joystick(fds[0], 4, 11);
+  auto move = [&](uint8_t number, int16_t value) {
+      struct js_event event = {0, value, JS_EVENT_AXIS, number};
+      return write(fds[1], &event, sizeof(event)) == sizeof(event);
+    };
+
+  std::mutex mutex;
+  std::vector<Update> updates;
+  auto updates_since = [&](size_t from) {
+      std::lock_guard<std::mutex> lock(mutex);
+      return std::vector<Update>(updates.begin() + std::min(from, updates.size()), updates.end());
+    };
+  auto num_updates = [&]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return updates.size();
+    };
+
+  {
+    Teleop::Config config;
+    config.min_interval = 20ms;
+    config.idle_period = 50ms;
+
+    Teleop teleop(joystick, [&](int16_t throttle, int16_t steering, Teleop::clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        updates.push_back({now, {throttle, steering}});
+        return true;
+      }, config);
+
+    // Settle into idle updates
+    std::this_thread::sleep_for(100ms);
+
+    // An idle update just before the move holds it back by up to
+    // min_interval, but never by a tick
+    size_t from = num_updates();
+    auto moved = Teleop::clock::now();
+    move(1, -20000);
+    auto is_moved = [](const Update & update) {return update.setpoint.throttle == 12000;};
+    std::vector<Update> after_move;
+    while (Teleop::clock::now() - moved < 1s) {
+      after_move = updates_since(from);
+      if (std::find_if(after_move.begin(), after_move.end(), is_moved) != after_move.end()) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+    auto it = std::find_if(after_move.begin(), after_move.end(), is_moved);
+    auto latency = it == after_move.end() ? Teleop::clock::duration(1s) : it->time - moved;
+    std::cout << "stick to drive: " << std::chrono::duration<double, std::micro>(latency).count() << " us" << std::endl;
+    check("event driven", latency <= config.min_interval + 2ms);
+
+    // A burst of moves, 10 ms long, right after an update
+    std::this_thread::sleep_for(5ms);
+    from = num_updates();
+    for (int i = 0; i < 100; i++) {
+      move(1, static_cast<int16_t>(-10000 - i * 100));
+      std::this_thread::sleep_for(100us);
+    }
+    std::this_thread::sleep_for(3 * config.min_interval);
+    auto after_burst = updates_since(from);
+    bool spaced = true;
+    for (size_t i = 1; i < after_burst.size(); i++) {
+      spaced = spaced && after_burst[i].time - after_burst[i - 1].time >= config.min_interval;
+    }
+    check("rate limited", after_burst.size() >= 1 && after_burst.size() <= 4 && spaced);
+    check("last setpoint sent", !after_burst.empty() && after_burst.back().setpoint.throttle == 11900);
+
+    // Still: only the idle updates
+    from = num_updates();
+    std::this_thread::sleep_for(520ms);
+    size_t idle = num_updates() - from;
+    check("idle period", idle >= 8 && idle <= 11);
+
+    // The right stick doesn't drive
+    from = num_updates();
+    move(3, 30000);
+    std::this_thread::sleep_for(30ms);
+    auto after_other = updates_since(from);
+    bool unchanged = true;
+    for (auto & update : after_other) {
+      unchanged = unchanged && update.setpoint.throttle == 11900 && update.setpoint.steering == 0;
+    }
+    check("other stick ignored", unchanged && teleop.get_stats().events == 101);
+  }
+
+  size_t from = num_updates();
+  move(1, 0);
+  std::this_thread::sleep_for(100ms);
+  check("stopped", num_updates() == from);
+
+  close(fds[1]);
+  return jeronibot::test::result();
+}
@@ -0,0 +1,331 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <dirent.h>
+#include <linux/joystick.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "bluez.h"
+#include "minipro/minipro.hpp"
+#include "minipro/protocol.hpp"
+#include "minipro/teleop.hpp"
+#include "minipro/teleop_loop.hpp"
+#include "support/check.hpp"
+#include "util/joystick.hpp"
+#include "util/logger.hpp"
+#include "util/loop_rate.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::minipro::MiniPro;
+using jeronibot::minipro::Teleop;
+using jeronibot::minipro::TeleopLoop;
+using jeronibot::util::Joystick;
+using jeronibot::util::Logger;
+using jeronibot::util::LoopRate;
+using units::frequency::hertz;
+
+namespace protocol = jeronibot::minipro::protocol;
+
+//
+// TeleopLoop: the same stick moves are driven through the three-thread
+// setup of t_minipro (joystick input thread, client mainloop thread and
+// Teleop's sender, with the app loop taking the telemetry) and through the
+// single-threaded loop. The single-threaded one runs no other thread, gets
+// every move to the link without waiting for a tick, and wakes up less.
+// The vehicle is a minimal ATT peer on a socketpair that pushes telemetry
+// at 100 Hz; the joystick is a pipe
+//
+
+using jeronibot::test::check;
+
+using clock_type = std::chrono::steady_clock;
+
+static const uint16_t rx_value_handle = 0x000e;  // where MiniPro writes without discovery
+static const uint16_t tx_value_handle = 0x000b;
+
+static const int num_moves = 80;
+static const auto move_period = 25ms;
+
+static int16_t throttle_of_move(int i) { return static_cast<int16_t>(2000 + (i % 20) * 1000); }
+
+static long voluntary_switches(int who)
+{
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_nvcsw;
+}
+
+static size_t num_threads()
+{
+  size_t n = 0;
+  if (DIR * dir = opendir("/proc/self/task")) {
+    while (struct dirent * entry = readdir(dir)) {
+      n += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+  }
+  return n;
+}
+
+// A vehicle with an empty service: discovery finds no characteristics, so
+// MiniPro writes to the handles the firmware has been seen to use
+class Peer
+{
+public:
+  explicit Peer(int fd)
+  : fd_(fd), thread_(&Peer::run, this) {}
+
+  ~Peer()
+  {
+    should_exit_ = true;
+    thread_.join();
+    close(fd_);
+  }
+
+  std::vector<std::pair<clock_type::time_point, int16_t>> get_drives()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return drives_;
+  }
+
+  long get_switches() const { return switches_.load(std::memory_order_relaxed); }
+
+protected:
+  void run()
+  {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    uint8_t pdu[512];
+    auto next_notify = clock_type::now();
+
+    while (!should_exit_) {
+      switches_.store(voluntary_switches(RUSAGE_THREAD), std::memory_order_relaxed);
+
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_notify - clock_type::now());
+      if (poll(&pfd, 1, std::max<int>(wait.count(), 0)) > 0) {
+        ssize_t n = recv(fd_, pdu, sizeof(pdu), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          break;
+        }
+        if (n > 0) {
+          handle_pdu(pdu, n);
+        }
+      }
+
+      if (clock_type::now() >= next_notify) {
+        auto telemetry = protocol::Speed::encode(0);
+        uint8_t notification[3 + telemetry.size()] = {BT_ATT_OP_HANDLE_VAL_NOT};
+        put_le16(tx_value_handle, &notification[1]);
+        std::copy(telemetry.begin(), telemetry.end(), notification + 3);
+        send(fd_, notification, sizeof(notification), MSG_NOSIGNAL);
+        next_notify += 10ms;
+      }
+    }
+  }
+
+  void handle_pdu(const uint8_t * pdu, size_t length)
+  {
+    auto now = clock_type::now();
+    uint8_t opcode = pdu[0];
+
+    if (opcode == BT_ATT_OP_WRITE_CMD && length > 3 && get_le16(&pdu[1]) == rx_value_handle) {
+      protocol::Schema<protocol::Drive>::dispatch(pdu + 3, length - 3, [&](auto, const auto & values) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          drives_.emplace_back(now, std::get<0>(values));
+        });
+      return;
+    }
+
+    // Commands and confirmations get no response
+    if ((opcode & 0x40) || opcode == BT_ATT_OP_HANDLE_VAL_CONF) {
+      return;
+    }
+
+    // One empty primary service over every handle; nothing else is found
+    if (opcode == BT_ATT_OP_READ_BY_GRP_TYPE_REQ && length == 7 && get_le16(&pdu[1]) <= 0x0001 &&
+      get_le16(&pdu[5]) == 0x2800)
+    {
+      uint8_t rsp[8] = {BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 6};
+      put_le16(0x0001, &rsp[2]);
+      put_le16(0xffff, &rsp[4]);
+      put_le16(0x1800, &rsp[6]);
+      send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+      return;
+    }
+
+    uint8_t ecode = opcode == BT_ATT_OP_MTU_REQ ? BT_ATT_ERROR_REQUEST_NOT_SUPPORTED : BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+    uint8_t rsp[5] = {BT_ATT_OP_ERROR_RSP, opcode, 0, 0, ecode};
+    if (length >= 3 && opcode != BT_ATT_OP_MTU_REQ) {
+      rsp[2] = pdu[1];
+      rsp[3] = pdu[2];
+    }
+    send(fd_, rsp, sizeof(rsp), MSG_NOSIGNAL);
+  }
+
+  int fd_;
+  std::mutex mutex_;
+  std::vector<std::pair<clock_type::time_point, int16_t>> drives_;
+  std::atomic<long> switches_{0};
+  std::atomic<bool> should_exit_{false};
+  std::thread thread_;
+};
+
+struct Result
+{
+  double wakeups_per_second{0};
+  size_t threads{0};
+  int delivered{0};
+  std::chrono::nanoseconds mean_latency{0};
+  std::chrono::nanoseconds max_latency{0};
+  TeleopLoop::Stats loop;
+};
+
+static Result run(bool single_thread)
+{
+  int sv[2];
+  int js[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0 || pipe(js) < 0) {
+    throw std::runtime_error("Couldn't create the transport");
+  }
+
+  Result result;
+  Peer peer(sv[1]);
+  MiniPro minipro(sv[0], single_thread ? MiniPro::Dispatch::Caller : MiniPro::Dispatch::Thread);
+  Joystick joystick(js[0], 4, 11);
+  minipro.enter_remote_control_mode();
+
+  Teleop::Config config;
+  config.sender_thread = !single_thread;
+  Teleop teleop(joystick, minipro, config);
+  if (single_thread) {
+    joystick.stop_input_thread();
+  }
+
+  // The stick moves through a pipe written by another thread, which also
+  // takes the measurements around the moves
+  std::atomic<bool> done{false};
+  std::vector<clock_type::time_point> moved(num_moves);
+  std::thread writer([&] {
+      std::this_thread::sleep_for(100ms);
+
+      long self = voluntary_switches(RUSAGE_SELF);
+      long own = voluntary_switches(RUSAGE_THREAD);
+      long peer_switches = peer.get_switches();
+      auto start = clock_type::now();
+
+      for (int i = 0; i < num_moves; i++) {
+        std::this_thread::sleep_until(start + i * move_period);
+        if (i == num_moves / 2) {
+          result.threads = num_threads();
+        }
+
+        int16_t y = static_cast<int16_t>(-(8000 + throttle_of_move(i)));
+        struct js_event event = {0, y, JS_EVENT_AXIS, 1};
+        moved[i] = clock_type::now();
+        if (write(js[1], &event, sizeof(event)) != sizeof(event)) {
+          break;
+        }
+      }
+      std::this_thread::sleep_until(start + num_moves * move_period);
+
+      double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+      long others = (voluntary_switches(RUSAGE_THREAD) - own) + (peer.get_switches() - peer_switches);
+      result.wakeups_per_second = (voluntary_switches(RUSAGE_SELF) - self - others) / seconds;
+      done = true;
+    });
+
+  if (single_thread) {
+    TeleopLoop loop(minipro, joystick, teleop, TeleopLoop::Config());
+    loop.run(done);
+    result.loop = loop.get_stats();
+  } else {
+    LoopRate loop_rate(30_Hz);
+    while (!done) {
+      minipro.receive_packet();
+      loop_rate.sleep();
+    }
+  }
+  writer.join();
+
+  // The first packet carrying each move
+  auto drives = peer.get_drives();
+  std::chrono::nanoseconds total{0};
+  for (int i = 0; i < num_moves; i++) {
+    auto it = std::find_if(drives.begin(), drives.end(), [&](const auto & drive) {
+          return drive.first >= moved[i] && drive.second == throttle_of_move(i);
+        });
+    if (it == drives.end() || (i + 1 < num_moves && it->first >= moved[i + 1])) {
+      continue;
+    }
+
+    auto latency = it->first - moved[i];
+    result.delivered++;
+    total += latency;
+    result.max_latency = std::max<std::chrono::nanoseconds>(result.max_latency, latency);
+  }
+  if (result.delivered) {
+    result.mean_latency = total / result.delivered;
+  }
+
+  close(js[1]);
+  return result;
+}
+
+static void print(const std::string & name, const Result & result)
+{
+  std::cout << name << ": " << result.threads << " threads, " << result.wakeups_per_second << " wakeups/s, " <<
+    result.delivered << "/" << num_moves << " moves, latency mean " <<
+    std::chrono::duration<double, std::micro>(result.mean_latency).count() << " us, max " <<
+    std::chrono::duration<double, std::micro>(result.max_latency).count() << " us" << std::endl;
+}
+
+int main(int argc, char ** argv)
+{
+  // Its worker polls every millisecond and would swamp the wakeups
+  Logger::stop();
+
+  Result threaded = run(false);
+  print("three threads", threaded);
+
+  Result single = run(true);
+  print("single thread", single);
+  std::cout << "loop: " << single.loop.wakeups << " wakeups, " << single.loop.joystick << " joystick, " <<
+    single.loop.timer << " timer, " << single.loop.ticks << " ticks" << std::endl;
+
+  // Besides the peer and the stick's writer
+  check("no other threads", single.threads == 3 && threaded.threads == 6);
+  check("every move driven", single.delivered >= num_moves * 9 / 10 && threaded.delivered >= num_moves * 9 / 10);
+  check("joystick on the loop", single.loop.joystick >= static_cast<uint64_t>(num_moves));
+
+  // A move waits out min_interval at most, when it comes right after an
+  // idle update, never a tick
+  check("latency", single.max_latency <= Teleop::Config().min_interval + 5ms &&
+    threaded.max_latency <= Teleop::Config().min_interval + 5ms);
+  check("fewer wakeups", single.wakeups_per_second < threaded.wakeups_per_second);
+
+  return jeronibot::test::result();
+}
@@ -12,24 +12,34 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#ifndef MINIPRO__MINIPRO_DRIVE_HPP_
-#define MINIPRO__MINIPRO_DRIVE_HPP_
+#ifndef SUPPORT__CHECK_HPP_
+#define SUPPORT__CHECK_HPP_
 
-#include <cstdint>
+#include <iostream>
+#include <string>
 
-#include "minipro/packet.hpp"
-
-namespace jeronibot::minipro::packet
+namespace jeronibot::test
 {
 
-class Drive : public Packet
-{
-public:
-  Drive(uint16_t throttle, uint16_t steering);
-  Drive() = delete;
-};
+// The checks that have failed so far in this test
+inline int failures = 0;
 
-}  // namespace jeronibot::minipro::packet
+// Print a named check as PASS or FAIL, and count it if it failed
+inline bool check(const std::string & name, bool ok)
+{
+  std::cout << (ok ? "PASS: " : "FAIL: ") << name << std::endl;
+  if (!ok) {
+    failures++;
+  }
+  return ok;
+}
+
+// What main() returns: non-zero, for ctest, if any check failed
+inline int result()
+{
+  return failures ? -1 : 0;
+}
 
-#endif  // MINIPRO__MINIPRO_DRIVE_HPP_
+}  // namespace jeronibot::test
 
+#endif  // SUPPORT__CHECK_HPP_
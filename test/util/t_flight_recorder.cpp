@@ -0,0 +1,177 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/check.hpp"
+#include "util/flight_recorder.hpp"
+
+using jeronibot::util::FlightLog;
+using jeronibot::util::FlightRecord;
+using jeronibot::util::FlightRecorder;
+using jeronibot::util::JoystickSnapshot;
+
+//
+// FlightRecorder: records read back through FlightLog with their fields,
+// truncation and order; concurrent writers lose nothing; the ring keeps the
+// newest records; a process that dies mid-record leaves a file whose other
+// records, including the ones after the torn one, are still readable. Then
+// times record()
+//
+
+using jeronibot::test::check;
+
+// Leaves a record claimed but never completed, as a crash in record() would
+class TornRecorder : public FlightRecorder
+{
+public:
+  using FlightRecorder::FlightRecorder;
+
+  void tear()
+  {
+    uint64_t pos = next_.fetch_add(1);
+    records_[pos & mask_].seq.store(0);
+  }
+};
+
+int main(int argc, char ** argv)
+{
+  const int count = argc > 1 ? atoi(argv[1]) : 1000000;
+  const std::string path = "/tmp/t_flight_recorder." + std::to_string(getpid());
+
+  const uint8_t packet[] = {0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0xac, 0x09, 0xbc, 0xfe};
+  uint8_t long_value[100];
+  for (size_t i = 0; i < sizeof(long_value); i++) {
+    long_value[i] = static_cast<uint8_t>(i);
+  }
+
+  {
+    FlightRecorder recorder(path, 1000);
+    check("capacity rounded up", recorder.get_capacity() == 1024);
+
+    JoystickSnapshot snapshot = {0x5, {{100, -100}, {0, 32767}, {-32768, 0}}};
+    recorder.record(FlightRecord::Packet, 0x000c, packet, sizeof(packet));
+    recorder.record(FlightRecord::Notification, 0x000e, long_value, sizeof(long_value));
+    recorder.record(FlightRecord::ReadResponse, 0, nullptr, 0);
+    recorder.record_joystick(snapshot, 3);
+
+    FlightLog log(path);
+    check("live file readable", log.size() == 4 && log.get_lost() == 0);
+    check("packet", log[0].type == FlightRecord::Packet && log[0].handle == 0x000c &&
+      log[0].length == sizeof(packet) && !memcmp(log[0].data, packet, sizeof(packet)) && !log[0].flags);
+    check("truncated", log[1].length == sizeof(long_value) && (log[1].flags & FlightRecord::Truncated) &&
+      !memcmp(log[1].data, long_value, FlightRecord::max_data));
+    check("empty", log[2].type == FlightRecord::ReadResponse && log[2].length == 0);
+
+    JoystickSnapshot read;
+    memcpy(&read, log[3].data, log[3].length);
+    check("joystick", log[3].length == 16 && read.buttons == 0x5 && read.axes[1][1] == 32767 &&
+      read.axes[2][0] == -32768);
+    check("timestamps", log[0].timestamp_ns <= log[3].timestamp_ns &&
+      log.wall_clock_ns(log[0]) > log.header().wall_clock_ns - 1000000000LL);
+  }
+
+  // Concurrent writers: every record lands, each writer's in order
+  {
+    const int threads = 4;
+    const int per_thread = 20000;
+    FlightRecorder recorder(path, threads * per_thread);
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; t++) {
+      writers.emplace_back([&recorder, t]() {
+          for (uint32_t i = 0; i < per_thread; i++) {
+            recorder.record(FlightRecord::Packet, t, reinterpret_cast<uint8_t *>(&i), sizeof(i));
+          }
+        });
+    }
+    for (auto & writer : writers) {
+      writer.join();
+    }
+
+    FlightLog log(path);
+    bool ordered = true;
+    std::vector<uint32_t> next(threads, 0);
+    for (size_t i = 0; i < log.size(); i++) {
+      uint32_t value;
+      memcpy(&value, log[i].data, sizeof(value));
+      ordered = ordered && value == next[log[i].handle]++;
+    }
+    check("concurrent writers", log.size() == threads * per_thread && ordered &&
+      log.header().commit == threads * per_thread);
+  }
+
+  // The ring keeps the newest records
+  {
+    FlightRecorder recorder(path, 64);
+    for (uint32_t i = 0; i < 1000; i++) {
+      recorder.record(FlightRecord::Packet, 0, reinterpret_cast<uint8_t *>(&i), sizeof(i));
+    }
+
+    FlightLog log(path);
+    uint32_t first;
+    memcpy(&first, log[0].data, sizeof(first));
+    check("wrap", log.size() == 64 && log.get_lost() == 1000 - 64 && first == 1000 - 64);
+  }
+
+  // A child dies in the middle of a record; its other records survive
+  pid_t pid = fork();
+  if (pid == 0) {
+    TornRecorder recorder(path, 1024);
+    for (uint32_t i = 0; i < 500; i++) {
+      if (i == 300) {
+        recorder.tear();
+      }
+      recorder.record(FlightRecord::Packet, 0, reinterpret_cast<uint8_t *>(&i), sizeof(i));
+    }
+    abort();
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  {
+    FlightLog log(path);
+    uint32_t last;
+    memcpy(&last, log[log.size() - 1].data, sizeof(last));
+    check("crash", WIFSIGNALED(status) && log.size() == 500 && log.get_lost() == 1 &&
+      log.header().commit == 300 && last == 499);
+  }
+
+  // Cost of a record
+  {
+    FlightRecorder recorder(path, 65536);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      recorder.record(FlightRecord::Notification, 0x000e, packet, sizeof(packet));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "record: " << seconds * 1e9 / count << " ns, " <<
+      static_cast<uint64_t>(count / seconds) << " records/s" << std::endl;
+    check("sustains 10k records/s", count / seconds > 10000);
+  }
+
+  unlink(path.c_str());
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,208 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/check.hpp"
+#include "util/logger.hpp"
+
+using jeronibot::util::LogComponent;
+using jeronibot::util::LogLevel;
+using jeronibot::util::LogRecord;
+using jeronibot::util::LogSource;
+using jeronibot::util::Logger;
+using namespace std::chrono_literals;
+
+//
+// Logger: records are formatted by the background thread as key=value
+// lines with only the fields that were set; records above the threshold
+// are not built; several threads can log at once without losing records
+// while the queue has room; once stopped, records are dropped instead of
+// restarting the thread; an attached source follows the threshold and
+// shares the sink. Then times the producer side of a record
+//
+
+using jeronibot::test::check;
+
+static int evaluated = 0;
+
+static uint16_t side_effect()
+{
+  return static_cast<uint16_t>(++evaluated);
+}
+
+static std::string read_all(FILE * f)
+{
+  std::string contents;
+  char buf[512];
+  size_t n;
+
+  rewind(f);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents.append(buf, n);
+  }
+
+  return contents;
+}
+
+// Stands in for bt_log: one queued line, written when enabled
+static int source_level = -2;
+static bool source_pending = true;
+
+static unsigned int drain_source()
+{
+  if (!source_pending || source_level < static_cast<int>(LogLevel::Debug)) {
+    return 0;
+  }
+  Logger::write(LogLevel::Debug, LogComponent::Bluetooth, std::chrono::system_clock::now(),
+    "notify_cb: opcode 0x1b, 12 bytes");
+  source_pending = false;
+  return 1;
+}
+
+static void set_source_level(int level)
+{
+  source_level = level;
+}
+
+static size_t count(const std::string & s, const std::string & what)
+{
+  size_t n = 0;
+  for (size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1)) {
+    n++;
+  }
+  return n;
+}
+
+int main(int argc, char ** argv)
+{
+  const int records = argc > 1 ? atoi(argv[1]) : 100000;
+
+  FILE * f = tmpfile();
+  if (!f) {
+    std::cerr << "tmpfile failed" << std::endl;
+    return -1;
+  }
+
+  check("start", Logger::start(LogLevel::Debug, f));
+  check("second start refused", !Logger::start(LogLevel::Debug, f));
+
+  const uint8_t packet[] = {0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0xac, 0x09, 0xbc, 0xfe,
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+
+  LOG_RECORD(LogLevel::Info, LogComponent::Bluetooth, "write")
+  .device("F4:02:07:C6:C7:B4").handle(0x000c).opcode(0x12).length(12).latency(1234567ns);
+  LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "notify").handle(0x000e).data(packet, sizeof(packet));
+  LOG_RECORD(LogLevel::Error, LogComponent::MiniPro, "read_failed").status(0x0a).text("Attribute Not Found");
+  LOG_RECORD(LogLevel::Warn, LogComponent::Util, "bare");
+  LOG_RECORD(LogLevel::Trace, LogComponent::Util, "above threshold").handle(side_effect());
+
+  // Producers on several threads
+  const int threads = 4;
+  const int per_thread = 200;
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; t++) {
+    producers.emplace_back([t]() {
+        for (int i = 0; i < per_thread; i++) {
+          LOG_RECORD(LogLevel::Debug, LogComponent::Util, "burst").handle(t).length(i);
+          if (i % 50 == 49) {
+            std::this_thread::sleep_for(2ms);
+          }
+        }
+      });
+  }
+  for (auto & producer : producers) {
+    producer.join();
+  }
+
+  Logger::stop();
+
+  std::string out = read_all(f);
+  check("all fields",
+    out.find(" INFO  bluetooth write device=F4:02:07:C6:C7:B4 handle=0x000c opcode=0x12 length=12 "
+    "latency_us=1234.567\n") != std::string::npos);
+  check("data is truncated to the record",
+    out.find(" DEBUG bluetooth notify handle=0x000e length=20 data=55aa060a037b0000ac09bcfe01020304..\n") !=
+    std::string::npos);
+  check("status and text",
+    out.find(" ERROR minipro read_failed status=0x0a text=\"Attribute Not Found\"\n") != std::string::npos);
+  check("no fields", out.find(" WARN  util bare\n") != std::string::npos);
+  check("records above the threshold are not built",
+    evaluated == 0 && out.find("above threshold") == std::string::npos);
+  check("concurrent producers", count(out, "util burst") == threads * per_thread);
+  check("nothing dropped", Logger::get_dropped() == 0);
+  check("disabled after stop", !Logger::enabled(LogLevel::Error));
+
+  // A producer that passed enabled() before stop() and logs after it
+  LogRecord late{};
+  late.level = LogLevel::Error;
+  late.component = LogComponent::Util;
+  late.event = "after_stop";
+  check("log after stop is refused", !Logger::log(late));
+  check("log after stop does not restart", Logger::start(LogLevel::Debug, f));
+
+  // A source is drained by the same thread into the same sink
+  Logger::stop();
+  check("attach", Logger::attach(LogSource{drain_source, set_source_level}));
+  check("source disabled while stopped", source_level == -1);
+  check("second source refused", !Logger::attach(LogSource{drain_source, set_source_level}));
+  Logger::start(LogLevel::Debug, f);
+  check("source follows the threshold", source_level == static_cast<int>(LogLevel::Debug));
+  std::this_thread::sleep_for(20ms);
+  Logger::stop();
+  check("source disabled by stop", source_level == -1);
+  out = read_all(f);
+  check("source lines", !source_pending && out.find(" DEBUG bluetooth notify_cb: opcode 0x1b, 12 bytes\n") !=
+    std::string::npos);
+  check("late record dropped", out.find("after_stop") == std::string::npos);
+
+  // Producer cost; bursts stay within the queue
+  FILE * null = fopen("/dev/null", "w");
+  Logger::start(LogLevel::Debug, null);
+  const int burst = 500;
+  double producer = 0;
+  for (int done = 0; done < records; done += burst) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < burst; i++) {
+      LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "notify").handle(0x000e).data(packet, 12);
+    }
+    producer += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    // Let the thread catch up between bursts
+    std::this_thread::sleep_for(5ms);
+  }
+  Logger::stop();
+  fclose(null);
+  std::cout << "record: " << producer * 1e9 / records << " ns, " << Logger::get_dropped() << " dropped" <<
+    std::endl;
+
+  // A disabled site
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < records * 100; i++) {
+    LOG_RECORD(LogLevel::Debug, LogComponent::Bluetooth, "notify").handle(side_effect());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "disabled: " << seconds * 1e9 / (records * 100) << " ns" << std::endl;
+  check("disabled sites evaluate nothing", evaluated == 0);
+
+  fclose(f);
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/check.hpp"
+#include "util/metrics.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::util::Counter;
+using jeronibot::util::Gauge;
+using jeronibot::util::Histogram;
+using jeronibot::util::MetricsExporter;
+using jeronibot::util::MetricsRegistry;
+
+//
+// Metrics: counters and histograms lose nothing to concurrent updates,
+// the same name and labels give the same metric, collectors run before an
+// export, and the Prometheus text comes out the same from write_prometheus,
+// a file and the exporter's socket. Then times updates
+//
+
+using jeronibot::test::check;
+
+static bool contains(const std::string & text, const std::string & line)
+{
+  return text.find(line + "\n") != std::string::npos;
+}
+
+static std::string scrape(const std::string & path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return "";
+  }
+
+  std::string text;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    text.append(buf, n);
+  }
+
+  close(fd);
+  return text;
+}
+
+int main(int argc, char ** argv)
+{
+  const int count = argc > 1 ? atoi(argv[1]) : 10000000;
+  const std::string path = "/tmp/t_metrics." + std::to_string(getpid());
+
+  MetricsRegistry registry;
+
+  {
+    Counter & a = registry.counter("t_events_total", "Events", {{"device", "a"}});
+    Counter & b = registry.counter("t_events_total", "Events", {{"device", "b"}});
+    check("same labels, same metric", &a == &registry.counter("t_events_total", "Events", {{"device", "a"}}));
+    check("other labels, other metric", &a != &b);
+
+    bool threw = false;
+    try {
+      registry.gauge("t_events_total", "Events");
+    } catch (const std::exception &) {
+      threw = true;
+    }
+    check("one type per name", threw);
+  }
+
+  {
+    const int threads = 4;
+    const int per_thread = 100000;
+    Counter & counter = registry.counter("t_concurrent_total", "Concurrent");
+    Histogram & histogram = registry.histogram("t_concurrent_seconds", "Concurrent");
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; t++) {
+      writers.emplace_back([&, t] {
+          for (int i = 0; i < per_thread; i++) {
+            counter.inc();
+            histogram.observe(std::chrono::microseconds(t * 1000 + i % 1000));
+          }
+        });
+    }
+    for (auto & writer : writers) {
+      writer.join();
+    }
+
+    uint64_t buckets = 0;
+    for (size_t i = 0; i <= histogram.get_num_buckets(); i++) {
+      buckets += histogram.get_bucket_count(i);
+    }
+
+    check("concurrent counter", counter.get() == threads * per_thread);
+    check("concurrent histogram", histogram.get_count() == threads * per_thread && buckets == histogram.get_count());
+  }
+
+  {
+    Histogram histogram({1ms, 10ms});
+    histogram.observe(500us);
+    histogram.observe(1ms);   // on the bound: in the bucket
+    histogram.observe(2ms);
+    histogram.observe(1s);
+    check("buckets", histogram.get_bucket_count(0) == 2 && histogram.get_bucket_count(1) == 1 &&
+      histogram.get_bucket_count(2) == 1 && histogram.get_sum() == 1003500us);
+  }
+
+  {
+    MetricsRegistry text_registry;
+    text_registry.counter("t_pdus_total", "PDUs", {{"device", "AA:BB"}, {"opcode", "0x1b"}}).inc(3);
+    Gauge & depth = text_registry.gauge("t_queue_depth", "Depth", {{"queue", "req"}});
+    Histogram & rtt = text_registry.histogram("t_rtt_seconds", "RTT", {}, {1ms, 10ms});
+    rtt.observe(2ms);
+    rtt.observe(20ms);
+
+    int collected = 0;
+    unsigned int id = text_registry.add_collector([&] {depth.set(7); collected++;});
+
+    std::ostringstream out;
+    text_registry.write_prometheus(out);
+    std::string text = out.str();
+
+    check("collector ran", collected == 1);
+    check("counter text", contains(text, "# TYPE t_pdus_total counter") &&
+      contains(text, "t_pdus_total{device=\"AA:BB\",opcode=\"0x1b\"} 3"));
+    check("gauge text", contains(text, "t_queue_depth{queue=\"req\"} 7"));
+    check("histogram text", contains(text, "# TYPE t_rtt_seconds histogram") &&
+      contains(text, "t_rtt_seconds_bucket{le=\"0.001\"} 0") &&
+      contains(text, "t_rtt_seconds_bucket{le=\"0.01\"} 1") &&
+      contains(text, "t_rtt_seconds_bucket{le=\"+Inf\"} 2") &&
+      contains(text, "t_rtt_seconds_sum 0.022") &&
+      contains(text, "t_rtt_seconds_count 2"));
+
+    text_registry.remove_collector(id);
+    std::ostringstream again;
+    text_registry.write_prometheus(again);
+    check("collector removed", collected == 1);
+
+    check("file", text_registry.write_file(path) &&
+      std::string(std::istreambuf_iterator<char>(std::ifstream(path).rdbuf()), {}) == again.str());
+    unlink(path.c_str());
+
+    {
+      MetricsExporter exporter(text_registry, path + ".sock");
+      std::string scraped = scrape(path + ".sock");
+      std::string scraped_again = scrape(path + ".sock");
+      check("socket", scraped == again.str() && scraped_again == scraped && exporter.get_num_scrapes() == 2);
+    }
+    check("socket removed", access((path + ".sock").c_str(), F_OK) != 0);
+  }
+
+  {
+    Counter & counter = registry.counter("t_timed_total", "Timed");
+    Histogram & histogram = registry.histogram("t_timed_seconds", "Timed");
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      counter.inc();
+      histogram.observe(std::chrono::microseconds(i & 0xffff));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "counter + histogram: " << seconds * 1e9 / count << " ns" << std::endl;
+    check("cheap enough for the PDU path", seconds * 1e9 / count < 1000);
+  }
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,226 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/check.hpp"
+#include "util/joystick.hpp"
+#include "util/loop_rate.hpp"
+#include "util/metrics.hpp"
+#include "util/realtime.hpp"
+
+using namespace std::chrono_literals;
+using jeronibot::util::Joystick;
+using jeronibot::util::LoopRate;
+using jeronibot::util::MetricsRegistry;
+using jeronibot::util::Realtime;
+using jeronibot::util::ThreadProfile;
+using jeronibot::util::ThreadRole;
+using units::frequency::hertz;
+
+//
+// Realtime: the library's threads are named after their roles and take
+// their profiles' CPUs and policies, or go back to the process's CPUs; a
+// policy that isn't permitted leaves the thread as it was and is counted;
+// timed waits and schedstat are reported per thread; and memory can be
+// locked. Runs with or without the privileges for SCHED_FIFO and mlockall
+//
+
+using jeronibot::test::check;
+
+static std::vector<std::string> thread_names()
+{
+  std::vector<std::string> names;
+  if (DIR * dir = opendir("/proc/self/task")) {
+    while (struct dirent * entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        std::string name;
+        std::getline(std::ifstream(std::string("/proc/self/task/") + entry->d_name + "/comm"), name);
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+  }
+  return names;
+}
+
+static bool has_thread(const std::string & name)
+{
+  for (const auto & thread : thread_names()) {
+    if (thread == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::string process_name()
+{
+  std::string name;
+  std::getline(std::ifstream("/proc/self/comm"), name);
+  return name;
+}
+
+// The value of a sample in the default registry's export, or -1
+static double sample(const std::string & name)
+{
+  std::ostringstream out;
+  MetricsRegistry::get_default().write_prometheus(out);
+
+  std::istringstream in(out.str());
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, name.size() + 1, name + " ") == 0) {
+      return std::stod(line.substr(name.size() + 1));
+    }
+  }
+  return -1;
+}
+
+static int num_cpus(const cpu_set_t & cpus)
+{
+  return CPU_COUNT(&cpus);
+}
+
+int main(int argc, char ** argv)
+{
+  cpu_set_t process_cpus;
+  sched_getaffinity(0, sizeof(process_cpus), &process_cpus);
+
+  {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      std::cerr << "pipe failed" << std::endl;
+      return -1;
+    }
+
+    Joystick joystick(fds[0], 4, 11);
+    std::this_thread::sleep_for(50ms);
+    check("named after the role", has_thread(Realtime::get_name(ThreadRole::JoystickInput)));
+    close(fds[1]);
+  }
+
+  {
+    int first_cpu = 0;
+    while (first_cpu < CPU_SETSIZE && !CPU_ISSET(first_cpu, &process_cpus)) {
+      first_cpu++;
+    }
+    Realtime::set_profile(ThreadRole::Control, ThreadProfile{SCHED_OTHER, 0, {first_cpu}});
+
+    cpu_set_t pinned;
+    cpu_set_t unpinned;
+    std::string name;
+    std::thread control([&] {
+        Realtime::apply(ThreadRole::Control);
+        sched_getaffinity(0, sizeof(pinned), &pinned);
+        char text[16] = {};
+        pthread_getname_np(pthread_self(), text, sizeof(text));
+        name = text;
+
+        // A thread it creates doesn't stay on its CPU
+        std::thread scanner([&] {
+            Realtime::apply(ThreadRole::Scanner);
+            sched_getaffinity(0, sizeof(unpinned), &unpinned);
+          });
+        scanner.join();
+      });
+    control.join();
+
+    check("pinned", num_cpus(pinned) == 1 && CPU_ISSET(first_cpu, &pinned) && name == "control");
+    check("back to the process's CPUs", CPU_EQUAL(&unpinned, &process_cpus));
+    Realtime::set_profile(ThreadRole::Control, ThreadProfile());
+  }
+
+  {
+    Realtime::apply(ThreadRole::Control);
+    check("main thread keeps the process's name", process_name() == "t_realtime");
+  }
+
+  {
+    Realtime::set_profile(ThreadRole::TeleopSender, ThreadProfile{SCHED_FIFO, 10, {}});
+
+    bool applied = false;
+    int policy = -1;
+    std::thread sender([&] {
+        applied = Realtime::apply(ThreadRole::TeleopSender);
+        policy = sched_getscheduler(0);
+      });
+    sender.join();
+
+    double failed = sample("thread_profile_failures_total{thread=\"teleop-sender\"}");
+    std::cout << "SCHED_FIFO: " << (applied ? "applied" : "not permitted") << std::endl;
+    check("real-time policy", applied ? policy == SCHED_FIFO && failed < 0 : policy == SCHED_OTHER && failed == 1);
+    Realtime::set_profile(ThreadRole::TeleopSender, ThreadProfile());
+  }
+
+  {
+    // schedstat is sampled at the export, while the thread is there
+    double wakeups;
+    double slices;
+    double run_delay;
+    std::thread control([&] {
+        Realtime::apply(ThreadRole::Control);
+        LoopRate loop_rate(100_Hz);
+        for (int i = 0; i < 10; i++) {
+          loop_rate.sleep();
+        }
+        wakeups = sample("thread_wakeup_latency_seconds_count{thread=\"control\"}");
+        slices = sample("thread_timeslices_total{thread=\"control\"}");
+        run_delay = sample("thread_run_delay_microseconds_total{thread=\"control\"}");
+      });
+    control.join();
+
+    std::cout << "control: " << wakeups << " wakeups, " << slices << " timeslices, " << run_delay <<
+      " us run delay" << std::endl;
+    check("wakeup latency", wakeups >= 9);
+    check("schedstat", slices >= 10);
+  }
+
+  {
+    bool locked = Realtime::lock_memory(64 * 1024);
+    std::cout << "mlockall: " << (locked ? "locked" : "not permitted") << std::endl;
+
+    std::string status;
+    long locked_kb = 0;
+    std::ifstream in("/proc/self/status");
+    while (std::getline(in, status)) {
+      if (status.compare(0, 6, "VmLck:") == 0) {
+        locked_kb = std::stol(status.substr(6));
+      }
+    }
+
+    bool applied = false;
+    std::thread logger([&] {applied = Realtime::apply(ThreadRole::Logger);});
+    logger.join();
+
+#ifdef __SANITIZE_ADDRESS__
+    // AddressSanitizer makes mlockall a no-op
+    locked_kb = 1;
+#endif
+    check("memory locked", locked == Realtime::is_memory_locked() && (!locked || locked_kb > 0) && applied);
+  }
+
+  return jeronibot::test::result();
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "util/flight_recorder.hpp"
+
+using jeronibot::util::FlightLog;
+using jeronibot::util::FlightRecord;
+using jeronibot::util::JoystickSnapshot;
+
+//
+// Dump a flight recorder file as text, or convert it to CSV:
+//
+//   flight_dump [--csv] <file>
+//
+
+static const char * type_name(uint8_t type)
+{
+  switch (type) {
+    case FlightRecord::Packet: return "packet";
+    case FlightRecord::Notification: return "notify";
+    case FlightRecord::ReadResponse: return "read";
+    case FlightRecord::Joystick: return "joystick";
+    default: return "unknown";
+  }
+}
+
+static void print_hex(const FlightRecord & r, const char * separator)
+{
+  size_t n = std::min<size_t>(r.length, FlightRecord::max_data);
+  for (size_t i = 0; i < n; i++) {
+    printf("%s%02x", i ? separator : "", r.data[i]);
+  }
+}
+
+static void print_joystick(const FlightRecord & r)
+{
+  JoystickSnapshot snapshot;
+  size_t n = std::min<size_t>(r.length, sizeof(snapshot));
+
+  memset(&snapshot, 0, sizeof(snapshot));
+  memcpy(&snapshot, r.data, n);
+
+  printf("buttons=0x%08x axes=", snapshot.buttons);
+  size_t num_axes = n > sizeof(snapshot.buttons) ? (n - sizeof(snapshot.buttons)) / sizeof(snapshot.axes[0]) : 0;
+  for (size_t i = 0; i < num_axes; i++) {
+    printf("%s(%d,%d)", i ? " " : "", snapshot.axes[i][0], snapshot.axes[i][1]);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  bool csv = argc == 3 && !strcmp(argv[1], "--csv");
+
+  if (argc != 2 && !csv) {
+    std::cerr << "usage: " << argv[0] << " [--csv] <file>" << std::endl;
+    return -1;
+  }
+
+  try {
+    FlightLog log(argv[argc - 1]);
+
+    if (csv) {
+      printf("timestamp_ns,wall_clock_ns,type,handle,length,truncated,data\n");
+    } else {
+      printf("# %zu records, %" PRIu64 " lost, capacity %" PRIu64 "\n", log.size(), log.get_lost(),
+        log.header().capacity);
+    }
+
+    uint64_t start = log.size() ? log[0].timestamp_ns : 0;
+
+    for (size_t i = 0; i < log.size(); i++) {
+      const FlightRecord & r = log[i];
+
+      if (csv) {
+        printf("%" PRIu64 ",%" PRId64 ",%s,%u,%u,%d,", r.timestamp_ns, log.wall_clock_ns(r),
+          type_name(r.type), r.handle, r.length, (r.flags & FlightRecord::Truncated) ? 1 : 0);
+        print_hex(r, "");
+      } else {
+        printf("%12.6f %-8s handle=0x%04x length=%-3u ", (r.timestamp_ns - start) / 1e9, type_name(r.type),
+          r.handle, r.length);
+        if (r.type == FlightRecord::Joystick) {
+          print_joystick(r);
+        } else {
+          print_hex(r, " ");
+          if (r.flags & FlightRecord::Truncated) {
+            printf(" ..");
+          }
+        }
+      }
+      printf("\n");
+    }
+  } catch (const std::exception & e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+
+  return 0;
+}